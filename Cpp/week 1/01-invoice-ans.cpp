@@ -6,76 +6,537 @@
 #include <map>
 #include <stdexcept>
 #include <memory>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <atomic>
+#include <deque>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+#include <charconv>
+#include <cctype>
+#include <cmath>
+#include <array>
+#include <limits>
+#include <functional>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
 
 using namespace std;
 
+// =========================
+// Currencies and FX
+// =========================
+enum class Currency : uint8_t {
+    USD, EUR, GBP, INR, JPY, CNY, AUD, CAD, CHF, SEK,
+    NOK, DKK, NZD, SGD, HKD, KRW, BRL, MXN, ZAR, AED,
+    SAR, PLN, CZK, HUF, TRY, THB, IDR, MYR, PHP, ILS,
+    Count
+};
+constexpr size_t kCurrencyCount = static_cast<size_t>(Currency::Count);
+
+inline const char* currencyCode(Currency c) {
+    static const char* const codes[kCurrencyCount] = {
+        "USD", "EUR", "GBP", "INR", "JPY", "CNY", "AUD", "CAD", "CHF", "SEK",
+        "NOK", "DKK", "NZD", "SGD", "HKD", "KRW", "BRL", "MXN", "ZAR", "AED",
+        "SAR", "PLN", "CZK", "HUF", "TRY", "THB", "IDR", "MYR", "PHP", "ILS"};
+    return c < Currency::Count ? codes[static_cast<size_t>(c)] : "???";
+}
+
 struct LineItem {
     string sku;
     int quantity{0};
     double unitPrice{0.0};
+    Currency currency{Currency::USD};
 };
 
-// OCP: Discount Strategy
-class IDiscount {
-public:
-    virtual ~IDiscount() = default;
-    virtual double apply(double subtotal) const = 0;
+// OCP: Discount rules are plain data. New behaviour is a new DiscountKind handled by
+// the compiler/evaluator below; Invoice and InvoiceService never change.
+enum class DiscountKind : uint8_t {
+    SkuPercent,   // percent off every line of one SKU
+    SkuFlat,      // fixed amount off one SKU (capped at that SKU's amount)
+    BuyXGetY,     // for every (x + y) units of one SKU, y are free
+    Percent,      // percent off the running order balance
+    Tiered,       // percent off the running balance, picked by balance threshold
+    Flat          // fixed amount off the running balance
 };
+constexpr size_t kDiscountKindCount = 6;
+using DiscountBreakdown = array<double, kDiscountKindCount>;
 
-class PercentDiscount : public IDiscount {
-private:
-    double percentage;
-public:
-    PercentDiscount(double p) : percentage(p) {}
-    double apply(double subtotal) const override {
-        return subtotal * (percentage / 100.0);
+inline const char* discountKindName(DiscountKind k) {
+    static const char* const names[kDiscountKindCount] = {"sku-percent", "sku-flat", "buy-x-get-y", "percent", "tiered", "flat"};
+    return names[static_cast<size_t>(k)];
+}
+
+struct DiscountRule {
+    DiscountKind kind{DiscountKind::Flat};
+    double value{0.0};                  // percent or amount, depending on kind
+    string sku;                         // SKU-scoped and buy-X-get-Y rules
+    int buyQty{0};
+    int freeQty{0};
+    vector<pair<double, double>> tiers; // (threshold, percent) for Tiered
+    bool exclusive{false};              // never combined with any other rule
+    Currency currency{Currency::USD};   // of the amount (Flat, SkuFlat) or thresholds (Tiered)
+
+    // Absolute amounts take their currency explicitly: "20 off" means nothing without one.
+    static DiscountRule percent(double p, bool excl = false) { return {DiscountKind::Percent, p, "", 0, 0, {}, excl}; }
+    static DiscountRule flat(double a, Currency c, bool excl = false) { return {DiscountKind::Flat, a, "", 0, 0, {}, excl, c}; }
+    static DiscountRule skuPercent(string s, double p, bool excl = false) { return {DiscountKind::SkuPercent, p, move(s), 0, 0, {}, excl}; }
+    static DiscountRule skuFlat(string s, double a, Currency c, bool excl = false) { return {DiscountKind::SkuFlat, a, move(s), 0, 0, {}, excl, c}; }
+    static DiscountRule buyXGetY(string s, int x, int y, bool excl = false) { return {DiscountKind::BuyXGetY, 0.0, move(s), x, y, {}, excl}; }
+    static DiscountRule tiered(vector<pair<double, double>> t, Currency c, bool excl = false) {
+        return {DiscountKind::Tiered, 0.0, "", 0, 0, move(t), excl, c};
     }
 };
 
-class FlatDiscount : public IDiscount {
+/**
+ * @brief Immutable, flattened form of a set of DiscountRules.
+ *
+ * Compiled once and shared (read-only) by every invoice in a batch. Evaluation
+ * order is fixed by stage, not by the order rules were written in:
+ *   1. SKU-scoped rules (SkuPercent, SkuFlat, BuyXGetY) on that SKU's line amount,
+ *   2. Percent and Tiered on the running balance,
+ *   3. Flat on the running balance.
+ * Stackable rules are applied in sequence, each clamped to what is left. Each
+ * exclusive rule is evaluated alone against the full subtotal, and the invoice
+ * gets whichever single outcome (the stack, or one exclusive rule) is largest.
+ *
+ * Absolute amounts and thresholds in one program share a currency, and the
+ * program refuses invoices in any other; compile one program per currency.
+ */
+class DiscountProgram {
+public:
+    // Per-SKU aggregates the SKU-scoped rules read; one slot per distinct SKU.
+    struct SkuTotals {
+        int quantity{0};
+        double amount{0.0};
+    };
+
 private:
-    double amount;
+    struct Op {
+        DiscountKind kind;
+        bool exclusive;
+        uint32_t slot;       // SkuTotals index for SKU-scoped ops
+        double a;            // percent / amount / buy quantity
+        double b;            // free quantity
+        uint32_t tierBegin;  // [tierBegin, tierEnd) into tiers, sorted by threshold
+        uint32_t tierEnd;
+    };
+
+    vector<Op> ops;
+    vector<pair<double, double>> tiers;
+    vector<string> slotSkus;
+    unordered_map<string, uint32_t> slotBySku;
+    Currency amounts{Currency::Count};  // Count: no absolute rules, any currency will do
+
+    static int stage(DiscountKind k) {
+        switch (k) {
+            case DiscountKind::SkuPercent:
+            case DiscountKind::SkuFlat:
+            case DiscountKind::BuyXGetY: return 0;
+            case DiscountKind::Percent:
+            case DiscountKind::Tiered: return 1;
+            case DiscountKind::Flat: return 2;
+        }
+        return 2;
+    }
+
+    double evalOp(const Op& op, double balance, const SkuTotals* slots) const {
+        switch (op.kind) {
+            case DiscountKind::SkuPercent:
+                return slots[op.slot].amount * (op.a / 100.0);
+            case DiscountKind::SkuFlat:
+                return min(op.a, slots[op.slot].amount);
+            case DiscountKind::BuyXGetY: {
+                const SkuTotals& t = slots[op.slot];
+                if (t.quantity <= 0) return 0.0;
+                int groups = t.quantity / static_cast<int>(op.a + op.b);
+                return groups * op.b * (t.amount / t.quantity);
+            }
+            case DiscountKind::Percent:
+                return balance * (op.a / 100.0);
+            case DiscountKind::Tiered: {
+                double pct = 0.0;
+                for (uint32_t i = op.tierBegin; i < op.tierEnd && tiers[i].first <= balance; ++i) pct = tiers[i].second;
+                return balance * (pct / 100.0);
+            }
+            case DiscountKind::Flat:
+                return op.a;
+        }
+        return 0.0;
+    }
+
 public:
-    FlatDiscount(double a) : amount(a) {}
-    double apply(double subtotal) const override {
-        return amount;
+    static shared_ptr<const DiscountProgram> compile(const vector<DiscountRule>& rules) {
+        auto prog = make_shared<DiscountProgram>();
+        for (const auto& r : rules) {
+            Op op{r.kind, r.exclusive, 0, r.value, 0.0, 0, 0};
+            switch (r.kind) {
+                case DiscountKind::BuyXGetY:
+                    if (r.buyQty <= 0 || r.freeQty <= 0) throw invalid_argument("buy-X-get-Y needs positive quantities");
+                    op.a = r.buyQty;
+                    op.b = r.freeQty;
+                    [[fallthrough]];
+                case DiscountKind::SkuPercent:
+                case DiscountKind::SkuFlat: {
+                    if (r.sku.empty()) throw invalid_argument("SKU-scoped discount without SKU");
+                    auto ins = prog->slotBySku.emplace(r.sku, static_cast<uint32_t>(prog->slotSkus.size()));
+                    if (ins.second) prog->slotSkus.push_back(r.sku);
+                    op.slot = ins.first->second;
+                    break;
+                }
+                case DiscountKind::Tiered: {
+                    auto t = r.tiers;
+                    sort(t.begin(), t.end());
+                    op.tierBegin = static_cast<uint32_t>(prog->tiers.size());
+                    prog->tiers.insert(prog->tiers.end(), t.begin(), t.end());
+                    op.tierEnd = static_cast<uint32_t>(prog->tiers.size());
+                    break;
+                }
+                case DiscountKind::Percent:
+                case DiscountKind::Flat:
+                    break;
+            }
+            if (r.kind == DiscountKind::Flat || r.kind == DiscountKind::SkuFlat || r.kind == DiscountKind::Tiered) {
+                if (prog->amounts != Currency::Count && prog->amounts != r.currency) {
+                    throw invalid_argument(string("Discount amounts in ") + currencyCode(r.currency) + " and " +
+                                           currencyCode(prog->amounts) + " in one program");
+                }
+                prog->amounts = r.currency;
+            }
+            prog->ops.push_back(op);
+        }
+        stable_sort(prog->ops.begin(), prog->ops.end(),
+                    [](const Op& x, const Op& y) { return stage(x.kind) < stage(y.kind); });
+        return prog;
+    }
+
+    size_t slotCount() const { return slotSkus.size(); }
+    bool empty() const { return ops.empty(); }
+
+    // Throws unless this program's amounts can be applied to an order priced in `c`.
+    void requireCurrency(Currency c) const {
+        if (amounts != Currency::Count && amounts != c) {
+            throw invalid_argument(string("Discount amounts are in ") + currencyCode(amounts) + ", order is in " + currencyCode(c));
+        }
+    }
+
+    // Slot of a SKU, or -1 when no rule in this program looks at it.
+    int slotOf(const string& sku) const {
+        if (slotBySku.empty()) return -1;
+        auto it = slotBySku.find(sku);
+        return it == slotBySku.end() ? -1 : static_cast<int>(it->second);
+    }
+
+    void collect(const vector<LineItem>& items, SkuTotals* slots) const {
+        fill(slots, slots + slotCount(), SkuTotals{});
+        if (slotSkus.empty()) return;
+        for (const auto& it : items) {
+            int s = slotOf(it.sku);
+            if (s < 0) continue;
+            slots[s].quantity += it.quantity;
+            slots[s].amount += it.unitPrice * it.quantity;
+        }
+    }
+
+    // Total discount for an order with the given subtotal and per-slot SKU totals.
+    // When byKind is given, it receives the winning outcome's discount per rule kind.
+    double evaluate(double subtotal, const SkuTotals* slots, DiscountBreakdown* byKind = nullptr) const {
+        double balance = subtotal;
+        double stacked = 0.0;
+        DiscountBreakdown stackedByKind{};
+        for (const auto& op : ops) {
+            if (op.exclusive) continue;
+            double d = min(max(evalOp(op, balance, slots), 0.0), balance);
+            balance -= d;
+            stacked += d;
+            stackedByKind[static_cast<size_t>(op.kind)] += d;
+        }
+        double best = stacked;
+        const Op* winner = nullptr;
+        for (const auto& op : ops) {
+            if (!op.exclusive) continue;
+            double d = min(max(evalOp(op, subtotal, slots), 0.0), subtotal);
+            if (d > best) {
+                best = d;
+                winner = &op;
+            }
+        }
+        if (byKind) {
+            if (winner) {
+                byKind->fill(0.0);
+                (*byKind)[static_cast<size_t>(winner->kind)] = best;
+            } else {
+                *byKind = stackedByKind;
+            }
+        }
+        return best;
+    }
+
+    double apply(const vector<LineItem>& items, double subtotal, DiscountBreakdown* byKind = nullptr) const {
+        thread_local vector<SkuTotals> scratch;
+        scratch.resize(slotCount());
+        collect(items, scratch.data());
+        return evaluate(subtotal, scratch.data(), byKind);
     }
 };
 
 class Invoice{
 private:
     const vector<LineItem> items;
-    const vector<shared_ptr<IDiscount>> discounts;
+    const shared_ptr<const DiscountProgram> discounts;
     const string email;
+    const string region;
+    const Currency currency;
 
 public:
-    // Constructor for an immutable Invoice object
-    Invoice(vector<LineItem> i, vector<shared_ptr<IDiscount>> d, string e)
-        : items(move(i)), discounts(move(d)), email(move(e)) {}
+    // Constructor for an immutable Invoice object; the program may be shared by many invoices
+    Invoice(vector<LineItem> i, shared_ptr<const DiscountProgram> d, string e, string r = "", Currency c = Currency::USD)
+        : items(move(i)), discounts(move(d)), email(move(e)), region(move(r)), currency(c) {}
 
     // Getters
     const vector<LineItem>& getItems() const { return items; }
-    const vector<shared_ptr<IDiscount>>& getDiscounts() const { return discounts; }
+    const shared_ptr<const DiscountProgram>& getDiscounts() const { return discounts; }
     const string& getEmail() const { return email; }
+    const string& getRegion() const { return region; }
+    Currency getCurrency() const { return currency; }
+
+    // True when no line needs FX conversion into the billing currency.
+    bool isSingleCurrency() const {
+        for (const auto& it : items) {
+            if (it.currency != currency) return false;
+        }
+        return true;
+    }
 };
 
+// =========================
+// Structured log records
+// =========================
+enum class LogLevel : uint8_t { Debug = 0, Info = 1, Warn = 2, Error = 3 };
+
+// Records below this level are compiled out entirely (-DINVOICE_MIN_LOG_LEVEL=2 keeps Warn and up).
+#ifndef INVOICE_MIN_LOG_LEVEL
+#define INVOICE_MIN_LOG_LEVEL 1
+#endif
+constexpr LogLevel kMinLogLevel = static_cast<LogLevel>(INVOICE_MIN_LOG_LEVEL);
+
+inline const char* levelName(LogLevel level) {
+    switch (level) {
+        case LogLevel::Debug: return "DEBUG";
+        case LogLevel::Info: return "INFO";
+        case LogLevel::Warn: return "WARN";
+        case LogLevel::Error: return "ERROR";
+    }
+    return "?";
+}
+
+// A captured key/value; keys and messages must be string literals, text values are copied inline.
+// Text longer than kMaxText keeps its first kMaxText bytes and is rendered with a trailing "…".
+struct LogField {
+    enum class Type : uint8_t { Int, Double, Text };
+    static constexpr size_t kMaxText = 47;
+
+    const char* key{nullptr};
+    Type type{Type::Int};
+    uint8_t textLen{0};
+    bool truncated{false};
+    union {
+        int64_t i;
+        double d;
+    } num{0};
+    char text[kMaxText];
+};
+
+// Fixed-size, trivially copyable event: nothing is formatted until a writer needs the text.
+struct LogRecord {
+    static constexpr size_t kMaxFields = 4;
+
+    LogLevel level{LogLevel::Info};
+    uint8_t fieldCount{0};
+    const char* message{""};
+    int64_t timestampNs{0};
+    LogField fields[kMaxFields];
+};
+
+inline void captureField(LogField& f, const char* key, double v) { f.key = key; f.type = LogField::Type::Double; f.num.d = v; }
+inline void captureField(LogField& f, const char* key, float v) { captureField(f, key, static_cast<double>(v)); }
+inline void captureField(LogField& f, const char* key, string_view v) {
+    f.key = key;
+    f.type = LogField::Type::Text;
+    f.textLen = static_cast<uint8_t>(min(v.size(), LogField::kMaxText));
+    f.truncated = v.size() > LogField::kMaxText;
+    memcpy(f.text, v.data(), f.textLen);
+}
+inline void captureField(LogField& f, const char* key, const string& v) { captureField(f, key, string_view(v)); }
+inline void captureField(LogField& f, const char* key, const char* v) { captureField(f, key, string_view(v)); }
+template <class T, class = enable_if_t<is_integral<T>::value>>
+inline void captureField(LogField& f, const char* key, T v) { f.key = key; f.type = LogField::Type::Int; f.num.i = static_cast<int64_t>(v); }
+
+inline void captureFields(LogRecord&) {}
+template <class V, class... Rest>
+inline void captureFields(LogRecord& r, const char* key, const V& value, const Rest&... rest) {
+    captureField(r.fields[r.fieldCount++], key, value);
+    captureFields(r, rest...);
+}
+
+// Writes a logfmt value. Values that are empty or contain a space, '=', '"', '\\' or a control
+// character are quoted and escaped, so a value can never end the line or pose as another field.
+inline void writeLogfmtValue(ostream& os, string_view v, bool alwaysQuote = false) {
+    auto control = [](char c) { return static_cast<unsigned char>(c) < 0x20 || c == 0x7F; };
+    bool quote = alwaysQuote || v.empty();
+    for (char c : v) quote = quote || c == ' ' || c == '=' || c == '"' || c == '\\' || control(c);
+    if (!quote) {
+        os << v;
+        return;
+    }
+    os << '"';
+    for (char c : v) {
+        switch (c) {
+            case '"': os << "\\\""; break;
+            case '\\': os << "\\\\"; break;
+            case '\n': os << "\\n"; break;
+            case '\r': os << "\\r"; break;
+            case '\t': os << "\\t"; break;
+            default:
+                if (control(c)) {
+                    char hex[7];
+                    snprintf(hex, sizeof hex, "\\u%04x", static_cast<unsigned char>(c));
+                    os << hex;
+                } else {
+                    os << c;
+                }
+        }
+    }
+    os << '"';
+}
+
+// logfmt rendering: msg="..." key=value ...
+inline string formatRecord(const LogRecord& r) {
+    ostringstream os;
+    os << "level=" << levelName(r.level) << " msg=";
+    writeLogfmtValue(os, r.message, true);
+    for (uint8_t i = 0; i < r.fieldCount; ++i) {
+        const LogField& f = r.fields[i];
+        os << " " << f.key << "=";
+        switch (f.type) {
+            case LogField::Type::Int: os << f.num.i; break;
+            case LogField::Type::Double: os << f.num.d; break;
+            case LogField::Type::Text:
+                if (f.truncated) writeLogfmtValue(os, string(f.text, f.textLen) + "\u2026");
+                else writeLogfmtValue(os, string_view(f.text, f.textLen));
+                break;
+        }
+    }
+    return os.str();
+}
+
 // SRP / DIP: Abstractions
 class ILogger {
 public:
     virtual ~ILogger() = default;
     virtual void log(const string& message) = 0;
+    // Structured entry point used by logEvent(); the default formats eagerly and forwards to log().
+    virtual void logRecord(const LogRecord& record) { log(formatRecord(record)); }
+    virtual bool enabled(LogLevel level) const { return level >= kMinLogLevel; }
 };
 
+/**
+ * @brief Lazily formatted logging entry point.
+ *
+ * Arguments are captured by value into a LogRecord as alternating key/value
+ * pairs; no string is built on the calling thread. Levels below kMinLogLevel
+ * compile to nothing, and the logger's runtime filter is checked before any
+ * capture happens.
+ */
+template <LogLevel Level, class Logger, class... KeyValues>
+inline void logEvent(Logger& logger, const char* message, const KeyValues&... kv) {
+    static_assert(sizeof...(KeyValues) % 2 == 0, "logEvent takes key/value pairs");
+    static_assert(sizeof...(KeyValues) / 2 <= LogRecord::kMaxFields, "too many log fields");
+    if constexpr (static_cast<uint8_t>(Level) >= static_cast<uint8_t>(kMinLogLevel)) {
+        if (!logger.enabled(Level)) return;
+        LogRecord r;
+        r.level = Level;
+        r.message = message;
+        captureFields(r, kv...);
+        logger.logRecord(r);
+    } else {
+        (void)logger;
+        (void)message;
+    }
+}
+
 class IEmailSender {
 public:
     virtual ~IEmailSender() = default;
     virtual void send(const string& to, const string& content) = 0;
 };
 
+// Tax split by rate for reporting. The first kInline rates live inline, so the usual
+// invoice stays allocation-free; further distinct rates spill into a vector, each under its own rate.
+struct TaxBuckets {
+    static constexpr size_t kInline = 4;
+    struct Bucket {
+        double rate{0.0};
+        double tax{0.0};
+    };
+    array<Bucket, kInline> buckets{};
+    uint8_t count{0};
+    vector<Bucket> spill;
+
+    void add(double rate, double tax) {
+        for (uint8_t i = 0; i < count; ++i) {
+            if (buckets[i].rate == rate) {
+                buckets[i].tax += tax;
+                return;
+            }
+        }
+        if (count < kInline) {
+            buckets[count++] = {rate, tax};
+            return;
+        }
+        for (auto& b : spill) {
+            if (b.rate == rate) {
+                b.tax += tax;
+                return;
+            }
+        }
+        spill.push_back({rate, tax});
+    }
+
+    size_t size() const { return count + spill.size(); }
+    const Bucket& operator[](size_t i) const { return i < count ? buckets[i] : spill[i - count]; }
+};
+
 class ITaxCalculator {
 public:
     virtual ~ITaxCalculator() = default;
     virtual double calculate(double taxableAmount) = 0;
+    // Per-line variant; calculators that do not care about SKUs or regions keep the flat rule.
+    // When buckets is given it also receives the tax split by rate.
+    virtual double calculateFor(const Invoice& invoice, double subtotal, double taxableAmount, TaxBuckets* buckets) {
+        (void)invoice;
+        (void)subtotal;
+        double tax = calculate(taxableAmount);
+        if (buckets) buckets->add(taxableAmount != 0.0 ? tax / taxableAmount : 0.0, tax);
+        return tax;
+    }
 };
 
 /**
@@ -109,6 +570,226 @@ public:
     }
 };
 
+/**
+ * @brief Asynchronous ILogger: per-thread lock-free rings drained by one writer.
+ *
+ * Each logging thread gets its own single-producer/single-consumer ring of
+ * LogRecords on first use, so the hot path is a timestamp, a struct copy and a
+ * release store. The background writer formats and writes records. When a
+ * ring is full the record is dropped and counted rather than blocking the
+ * caller. Plain log(string) calls go through a mutex-protected side queue.
+ * When a thread exits its rings are marked retired, and the writer frees each
+ * one once it is drained. A thread's ring cache holds only weak references,
+ * and entries for destroyed loggers are pruned on the next cache miss.
+ */
+class StructuredLogger : public ILogger {
+private:
+    static constexpr size_t kRingSize = 4096;  // power of two
+
+    struct Ring {
+        LogRecord slots[kRingSize];
+        alignas(64) atomic<size_t> head{0};  // next slot the writer reads
+        alignas(64) atomic<size_t> tail{0};  // next slot the producer writes
+        atomic<uint64_t> dropped{0};
+        atomic<bool> retired{false};  // the producing thread has exited
+
+        Ring() { liveRings().fetch_add(1, memory_order_relaxed); }
+        ~Ring() { liveRings().fetch_sub(1, memory_order_relaxed); }
+    };
+
+    static atomic<int64_t>& liveRings() {
+        static atomic<int64_t> count{0};
+        return count;
+    }
+
+    // Per-thread ring lookup. The raw pointer serves the hot path; it is only followed for a
+    // logger that is still being called, and the weak reference is used for everything else.
+    struct RingCache {
+        struct Entry {
+            uint64_t logger;
+            Ring* ring;
+            weak_ptr<Ring> owner;
+        };
+        vector<Entry> entries;
+
+        ~RingCache() {
+            for (auto& e : entries) {
+                if (auto ring = e.owner.lock()) ring->retired.store(true, memory_order_release);
+            }
+        }
+    };
+
+    static atomic<uint64_t>& instanceCounter() {
+        static atomic<uint64_t> counter{0};
+        return counter;
+    }
+
+    const uint64_t instanceId;
+    ostream& out;
+    atomic<uint8_t> minLevel;
+    mutex ringsMtx;
+    vector<shared_ptr<Ring>> rings;
+    atomic<uint64_t> ringsVersion{0};    // bumped whenever rings changes
+    atomic<uint64_t> retiredDropped{0};  // drops counted by rings already freed
+    mutex textMtx;
+    deque<string> textQueue;
+    uint64_t textQueued{0};  // guarded by textMtx
+    atomic<uint64_t> textWritten{0};
+    mutex outMtx;
+    atomic<bool> running{true};
+    thread writer;
+
+    Ring& localRing() {
+        thread_local RingCache cache;
+        for (auto& e : cache.entries) {
+            if (e.logger == instanceId) return *e.ring;
+        }
+        auto& entries = cache.entries;
+        entries.erase(remove_if(entries.begin(), entries.end(), [](const RingCache::Entry& e) { return e.owner.expired(); }),
+                      entries.end());
+        auto ring = make_shared<Ring>();
+        {
+            lock_guard<mutex> lock(ringsMtx);
+            rings.push_back(ring);
+            ringsVersion.fetch_add(1, memory_order_release);
+        }
+        entries.push_back({instanceId, ring.get(), ring});
+        return *ring;
+    }
+
+    static int64_t nowNs() {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // Drains every ring once and frees the retired ones it emptied; returns how many entries were written.
+    size_t drainOnce(vector<shared_ptr<Ring>>& snapshot, uint64_t& version) {
+        if (version != ringsVersion.load(memory_order_acquire)) {
+            lock_guard<mutex> lock(ringsMtx);
+            snapshot = rings;
+            version = ringsVersion.load(memory_order_relaxed);
+        }
+        deque<string> texts;
+        {
+            lock_guard<mutex> lock(textMtx);
+            texts.swap(textQueue);
+        }
+        size_t written = 0;
+        lock_guard<mutex> lock(outMtx);
+        for (auto& text : texts) {
+            out << "ts=" << nowNs() << " level=INFO msg=";
+            writeLogfmtValue(out, text, true);
+            out << "\n";
+            ++written;
+        }
+        textWritten.fetch_add(texts.size(), memory_order_release);
+        vector<Ring*> drained;
+        for (auto& ring : snapshot) {
+            // Read before tail: a ring seen retired has had its last record published already.
+            bool retired = ring->retired.load(memory_order_acquire);
+            size_t head = ring->head.load(memory_order_relaxed);
+            size_t tail = ring->tail.load(memory_order_acquire);
+            for (; head != tail; ++head, ++written) {
+                const LogRecord& r = ring->slots[head & (kRingSize - 1)];
+                out << "ts=" << r.timestampNs << " " << formatRecord(r) << "\n";
+            }
+            ring->head.store(head, memory_order_release);
+            if (retired) drained.push_back(ring.get());
+        }
+        if (written) out.flush();
+        if (!drained.empty()) {
+            lock_guard<mutex> lock(ringsMtx);
+            for (Ring* ring : drained) {
+                auto it = find_if(rings.begin(), rings.end(), [&](const shared_ptr<Ring>& r) { return r.get() == ring; });
+                retiredDropped.fetch_add(ring->dropped.load(memory_order_relaxed), memory_order_relaxed);
+                rings.erase(it);
+            }
+            ringsVersion.fetch_add(1, memory_order_release);
+        }
+        return written;
+    }
+
+    void writerLoop() {
+        vector<shared_ptr<Ring>> snapshot;
+        uint64_t version = 0;
+        while (running.load(memory_order_acquire)) {
+            if (drainOnce(snapshot, version) == 0) this_thread::sleep_for(chrono::microseconds(500));
+        }
+        drainOnce(snapshot, version);
+    }
+
+public:
+    explicit StructuredLogger(ostream& os, LogLevel level = kMinLogLevel)
+        : instanceId(++instanceCounter()), out(os), minLevel(static_cast<uint8_t>(level)),
+          writer([this] { writerLoop(); }) {}
+
+    ~StructuredLogger() override {
+        running.store(false, memory_order_release);
+        writer.join();
+    }
+
+    void setLevel(LogLevel level) { minLevel = static_cast<uint8_t>(level); }
+
+    bool enabled(LogLevel level) const override {
+        return static_cast<uint8_t>(level) >= minLevel.load(memory_order_relaxed);
+    }
+
+    void logRecord(const LogRecord& record) override {
+        Ring& ring = localRing();
+        size_t tail = ring.tail.load(memory_order_relaxed);
+        if (tail - ring.head.load(memory_order_acquire) == kRingSize) {
+            ring.dropped.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        LogRecord& slot = ring.slots[tail & (kRingSize - 1)];
+        slot = record;
+        slot.timestampNs = nowNs();
+        ring.tail.store(tail + 1, memory_order_release);
+    }
+
+    void log(const string& message) override {
+        lock_guard<mutex> lock(textMtx);
+        textQueue.push_back(message);
+        ++textQueued;
+    }
+
+    // Blocks until everything logged before the call has been written out.
+    void flush() {
+        vector<pair<shared_ptr<Ring>, size_t>> targets;
+        {
+            lock_guard<mutex> lock(ringsMtx);
+            for (auto& ring : rings) targets.emplace_back(ring, ring->tail.load(memory_order_acquire));
+        }
+        for (auto& t : targets) {
+            while (t.first->head.load(memory_order_acquire) < t.second) this_thread::yield();
+        }
+        uint64_t texts;
+        {
+            lock_guard<mutex> lock(textMtx);
+            texts = textQueued;
+        }
+        // Counted once written, not once dequeued: the writer holds a swapped-out batch before it takes outMtx.
+        while (textWritten.load(memory_order_acquire) < texts) this_thread::yield();
+        lock_guard<mutex> lock(outMtx);
+        out.flush();
+    }
+
+    uint64_t getDropped() {
+        lock_guard<mutex> lock(ringsMtx);
+        uint64_t total = retiredDropped.load(memory_order_relaxed);
+        for (auto& ring : rings) total += ring->dropped.load(memory_order_relaxed);
+        return total;
+    }
+
+    // Rings this logger holds: one per live logging thread, plus retired ones not yet drained.
+    size_t getRings() {
+        lock_guard<mutex> lock(ringsMtx);
+        return rings.size();
+    }
+
+    // Rings allocated across every logger in the process, including ones kept only by thread caches.
+    static int64_t ringsInProcess() { return liveRings().load(memory_order_relaxed); }
+};
+
 class SmtpEmailSender : public IEmailSender {
 public:
     void send(const string& to, const string& content) override {
@@ -118,120 +799,2410 @@ public:
     }
 };
 
-class FixedRateTaxCalculator : public ITaxCalculator {
-private:
-    double rate;
+// Discards mail; used where delivery would distort measurements.
+class NullEmailSender final : public IEmailSender {
 public:
-    FixedRateTaxCalculator(double r) : rate(r) {}
-    double calculate(double taxableAmount) override {
-        return taxableAmount * rate;
+    void send(const string& to, const string& content) override {
+        (void)to;
+        (void)content;
     }
 };
 
-class InvoiceService {
-private:
-    shared_ptr<IInvoiceRenderer> renderer;
-    shared_ptr<IEmailSender> emailer;
-    shared_ptr<ILogger> logger;
-    shared_ptr<ITaxCalculator> tax_calculator;
-
+// Discards everything; used where logging would distort measurements.
+class NullLogger final : public ILogger {
 public:
-    // DIP: Depend on abstractions, inject dependencies
-    InvoiceService(shared_ptr<IInvoiceRenderer> renderer, shared_ptr<IEmailSender> emailer, shared_ptr<ILogger> logger, shared_ptr<ITaxCalculator> tax_calc)
-        : renderer(renderer), emailer(emailer), logger(logger), tax_calculator(tax_calc) {}
+    void log(const string& message) override { (void)message; }
+    bool enabled(LogLevel level) const override { (void)level; return false; }
+};
 
-    string process(Invoice &invoice) {
-        const vector<LineItem>& items = invoice.getItems();
-        const vector<shared_ptr<IDiscount>>& discounts = invoice.getDiscounts();
-        const string& email = invoice.getEmail();
-        // pricing
-        double subtotal = 0.0;
-        for (auto& it : items) subtotal += it.unitPrice * it.quantity;
+// =========================
+// Outbound mail queue
+// =========================
+struct MailJob {
+    uint64_t id{0};
+    string to;
+    string content;
+};
 
-        // OCP: Apply discount strategies
-        double discount_total = 0.0;
-        for (const auto& discount_strategy : discounts) {
-            if (discount_strategy) {
-                discount_total += discount_strategy->apply(subtotal);
-            }
-        }
+// Bounded multi-producer / multi-consumer queue; producers block while full.
+template <class T>
+class BoundedQueue {
+private:
+    deque<T> items;
+    const size_t capacity;
+    bool closed{false};
+    mutex mtx;
+    condition_variable notFull, notEmpty;
 
-        // SRP: Delegate tax calculation
-        double taxable_amount = subtotal - discount_total;
-        double tax = tax_calculator->calculate(taxable_amount);
-        double grand = subtotal - discount_total + tax;
+public:
+    explicit BoundedQueue(size_t cap) : capacity(cap) {}
 
-        // SRP: Delegate rendering
-        string rendered_invoice = renderer->render(invoice, subtotal, discount_total, tax, grand);
+    bool push(T item) {
+        unique_lock<mutex> lock(mtx);
+        notFull.wait(lock, [&] { return closed || items.size() < capacity; });
+        if (closed) return false;
+        items.push_back(move(item));
+        notEmpty.notify_one();
+        return true;
+    }
 
-        // SRP: Delegate emailing
-        if (!email.empty()) {
-            emailer->send(email, rendered_invoice);
+    // Blocks until at least one item is available; returns false once closed and drained.
+    bool popBatch(vector<T>& out, size_t maxItems) {
+        unique_lock<mutex> lock(mtx);
+        notEmpty.wait(lock, [&] { return closed || !items.empty(); });
+        if (items.empty()) return false;
+        while (!items.empty() && out.size() < maxItems) {
+            out.push_back(move(items.front()));
+            items.pop_front();
         }
+        notFull.notify_all();
+        return true;
+    }
 
-        // SRP: Delegate logging
-        logger->log("Invoice processed for " + email + " total=" + to_string(grand));
+    void close() {
+        lock_guard<mutex> lock(mtx);
+        closed = true;
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+};
 
-        return rendered_invoice;
+// One call = one SMTP connection delivering the whole batch. Throws on failure.
+class ISmtpTransport {
+public:
+    virtual ~ISmtpTransport() = default;
+    virtual void sendBatch(const vector<MailJob>& batch) = 0;
+};
+
+// Adapts a synchronous IEmailSender (e.g. SmtpEmailSender) into a transport.
+class EmailSenderTransport : public ISmtpTransport {
+private:
+    shared_ptr<IEmailSender> sender;
+public:
+    explicit EmailSenderTransport(shared_ptr<IEmailSender> s) : sender(move(s)) {}
+    void sendBatch(const vector<MailJob>& batch) override {
+        for (const auto& job : batch) sender->send(job.to, job.content);
     }
 };
 
-// SRP: Concrete renderer implementation
-class TextInvoiceRenderer : public IInvoiceRenderer {
+// Local SMTP stand-in with injected connection/message latency and failures.
+class FakeSmtpServer : public ISmtpTransport {
+private:
+    chrono::microseconds connectLatency;
+    chrono::microseconds perMessageLatency;
+    double failureRate;
+    atomic<uint64_t> delivered{0};
+    atomic<uint64_t> connections{0};
+
 public:
-    string render(const Invoice& invoice, double subtotal, double discount, double tax, double grandTotal) override {
-        ostringstream pdf;
-        pdf << "INVOICE\n";
-        for (const auto& it : invoice.getItems()) {
-            pdf << it.sku << " x" << it.quantity << " @ " << it.unitPrice << "\n";
+    FakeSmtpServer(chrono::microseconds connect, chrono::microseconds perMessage, double failRate = 0.0)
+        : connectLatency(connect), perMessageLatency(perMessage), failureRate(failRate) {}
+
+    void sendBatch(const vector<MailJob>& batch) override {
+        thread_local mt19937 rng(random_device{}());
+        connections++;
+        this_thread::sleep_for(connectLatency + perMessageLatency * batch.size());
+        if (failureRate > 0.0 && uniform_real_distribution<double>(0.0, 1.0)(rng) < failureRate) {
+            throw runtime_error("SMTP 421 service not available");
         }
-        pdf << "Subtotal: " << subtotal << "\n"
-            << "Discounts: " << discount << "\n"
-            << "Tax: " << tax << "\n"
-            << "Total: " << grandTotal << "\n";
-        return pdf.str();
+        delivered += batch.size();
     }
+
+    uint64_t getDelivered() const { return delivered; }
+    uint64_t getConnections() const { return connections; }
 };
 
-// LSP Fix: Use composition, not inheritance
-class InvoiceComputer {
+/**
+ * @brief Append-only on-disk log of queued mail so it survives restarts.
+ *
+ * Records are "M <id> <toLen> <contentLen>\n<to><content>\n" for a queued
+ * message and "A <id>\n" once it is delivered. append() returns only after
+ * the record is fdatasync'd, so mail that send() accepted survives a crash.
+ * Acks are written but not synced: losing one to a crash only means that mail
+ * goes out again. A failed write is cut back off the file and thrown, so a
+ * torn record cannot hide the records after it. Opening a spool returns every
+ * message without an ack and compacts the file down to just those; a running
+ * spool compacts again every `compactEvery` acks, so it stays proportional to
+ * the mail still outstanding rather than to everything ever sent.
+ */
+class MailSpool {
 private:
-    InvoiceService& service;
+    string path;
+    size_t compactEvery;
+    size_t acksSinceCompact{0};
+    int fd{-1};
+    mutex mtx;
+
+    [[noreturn]] void fail(const string& what) const {
+        throw runtime_error("Cannot " + what + " mail spool " + path + ": " + strerror(errno));
+    }
+
+    vector<MailJob> readPending() {
+        map<uint64_t, MailJob> pending;
+        ifstream in(path, ios::binary);
+        char kind;
+        while (in >> kind) {
+            uint64_t id;
+            if (kind == 'A') {
+                in >> id;
+                pending.erase(id);
+                continue;
+            }
+            size_t toLen, contentLen;
+            if (kind != 'M' || !(in >> id >> toLen >> contentLen) || in.get() != '\n') break;
+            MailJob job{id, string(toLen, '\0'), string(contentLen, '\0')};
+            if (!in.read(&job.to[0], toLen) || !in.read(&job.content[0], contentLen)) break;  // torn tail write
+            pending[id] = move(job);
+        }
+        vector<MailJob> jobs;
+        for (auto& kv : pending) jobs.push_back(move(kv.second));
+        return jobs;
+    }
+
+    static void writeAll(int to, const string& bytes) {
+        const char* p = bytes.data();
+        size_t left = bytes.size();
+        while (left > 0) {
+            ssize_t n = ::write(to, p, left);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                if (n == 0) errno = EIO;
+                throw runtime_error(strerror(errno));
+            }
+            p += n;
+            left -= static_cast<size_t>(n);
+        }
+    }
+
+    // Caller holds mtx. Appends bytes, optionally syncs, and on failure truncates them away again.
+    void appendBytes(const string& bytes, bool sync) {
+        off_t end = ::lseek(fd, 0, SEEK_END);
+        if (end < 0) fail("seek");
+        try {
+            writeAll(fd, bytes);
+            if (sync && ::fdatasync(fd) != 0) throw runtime_error(strerror(errno));
+        } catch (const runtime_error& e) {
+            int rc = ::ftruncate(fd, end);  // best effort; replay also stops at a torn record
+            (void)rc;
+            throw runtime_error("Cannot write mail spool " + path + ": " + e.what());
+        }
+    }
+
+    // Caller holds mtx. Writes the pending records beside the spool and renames over it, so a crash keeps one or the other.
+    void rewrite(const vector<MailJob>& jobs) {
+        const string tmp = path + ".compact";
+        int next = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (next < 0) fail("open");
+        try {
+            string chunk;
+            for (const auto& job : jobs) {
+                encodeRecord(chunk, job);
+                if (chunk.size() >= (1u << 20)) {
+                    writeAll(next, chunk);
+                    chunk.clear();
+                }
+            }
+            writeAll(next, chunk);
+            if (::fdatasync(next) != 0) throw runtime_error(strerror(errno));
+        } catch (const runtime_error& e) {
+            ::close(next);
+            throw runtime_error("Cannot compact mail spool " + path + ": " + e.what());
+        }
+        ::close(next);
+        if (rename(tmp.c_str(), path.c_str()) != 0) fail("compact");
+        size_t slash = path.find_last_of('/');
+        string dir = slash == string::npos ? "." : path.substr(0, slash + 1);
+        int dfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dfd >= 0) {
+            ::fsync(dfd);
+            ::close(dfd);
+        }
+        if (fd >= 0) ::close(fd);
+        fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd < 0) fail("open");
+        acksSinceCompact = 0;
+    }
+
+    static void encodeRecord(string& out, const MailJob& job) {
+        out += "M " + to_string(job.id) + " " + to_string(job.to.size()) + " " + to_string(job.content.size()) + "\n";
+        out += job.to;
+        out += job.content;
+        out += '\n';
+    }
+
 public:
-    // Helper used by ad-hoc tests; also messy on purpose
-    explicit InvoiceComputer(InvoiceService& svc) : service(svc) {}
+    explicit MailSpool(string p, size_t compactAfterAcks = 10000) : path(move(p)), compactEvery(max<size_t>(compactAfterAcks, 1)) {}
 
-    double computeTotal(Invoice &invoice) {
-        // Create a new invoice with a dummy email; avoids mutating the original.
-        Invoice test_invoice(invoice.getItems(), invoice.getDiscounts(), "noreply@example.com");
-        auto rendered = service.process(test_invoice);
+    ~MailSpool() {
+        if (fd >= 0) ::close(fd);
+    }
 
-        auto pos = rendered.rfind("Total:");
-        if (pos == string::npos) throw runtime_error("No total");
-        string line = rendered.substr(pos + 6);
-        return stod(line);
+    MailSpool(const MailSpool&) = delete;
+    MailSpool& operator=(const MailSpool&) = delete;
+
+    vector<MailJob> recover() {
+        vector<MailJob> jobs = readPending();
+        lock_guard<mutex> lock(mtx);
+        rewrite(jobs);
+        return jobs;
+    }
+
+    // Returns once the record is on disk.
+    void append(const MailJob& job) {
+        string record;
+        encodeRecord(record, job);
+        lock_guard<mutex> lock(mtx);
+        appendBytes(record, true);
+    }
+
+    void ack(const vector<MailJob>& batch) {
+        string record;
+        for (const auto& job : batch) record += "A " + to_string(job.id) + "\n";
+        lock_guard<mutex> lock(mtx);
+        appendBytes(record, false);
+        acksSinceCompact += batch.size();
+        if (acksSinceCompact >= compactEvery) rewrite(readPending());  // appends wait; amortised over compactEvery acks
     }
 };
 
-int main() {
-    // DIP: Create concrete dependencies
-    auto renderer = make_shared<TextInvoiceRenderer>();
-    auto emailer = make_shared<SmtpEmailSender>();
-    auto logger = make_shared<ConsoleLogger>();
-    auto tax_calc = make_shared<FixedRateTaxCalculator>(0.18);
+/**
+ * @brief IEmailSender that only enqueues; a worker pool delivers in batches.
+ *
+ * send() spools the message and pushes it onto a bounded queue (blocking when
+ * full, which is the backpressure). Each worker drains up to batchSize messages
+ * per transport connection and retries failed batches with exponential backoff.
+ * Batches still failing after maxAttempts stay un-acked in the spool and are
+ * redelivered on the next start. A batch that was sent but whose ack could not
+ * be written is not retried; it is counted and goes out again on the next start.
+ */
+class OutboundMailQueue : public IEmailSender {
+public:
+    struct Options {
+        size_t workers{4};
+        size_t capacity{4096};
+        size_t batchSize{32};
+        int maxAttempts{5};
+        chrono::milliseconds baseBackoff{50};
+        chrono::milliseconds maxBackoff{5000};
+        size_t compactEvery{10000};  // acks between spool compactions
+    };
 
-    // DIP: Inject dependencies into the high-level service
-    InvoiceService svc(renderer, emailer, logger, tax_calc);
+private:
+    shared_ptr<ISmtpTransport> transport;
+    MailSpool spool;
+    Options opts;
+    BoundedQueue<MailJob> queue;
+    vector<thread> workers;
+    atomic<uint64_t> nextId{1};
+    atomic<uint64_t> inFlight{0};
+    atomic<uint64_t> retries{0};
+    atomic<uint64_t> failed{0};
+    atomic<uint64_t> unacked{0};
+    mutex idleMtx;
+    condition_variable idle;
 
-    vector<LineItem> items = { {"ITEM-001", 3, 100.0}, {"ITEM-002", 1, 250.0} };
-    
-    // Create discount strategy objects directly
-    vector<shared_ptr<IDiscount>> discounts;
-    discounts.push_back(make_shared<PercentDiscount>(10.0));
+    void workerLoop() {
+        vector<MailJob> batch;
+        while (queue.popBatch(batch, opts.batchSize)) {
+            deliver(batch);
+            {
+                lock_guard<mutex> lock(idleMtx);
+                inFlight -= batch.size();
+            }
+            idle.notify_all();
+            batch.clear();
+        }
+    }
 
-    string email = "customer@example.com";
+    // Already spooled, so a refused job is delivered on the next start rather than lost.
+    void enqueue(MailJob job) {
+        inFlight++;
+        if (queue.push(move(job))) return;
+        {
+            lock_guard<mutex> lock(idleMtx);
+            inFlight--;
+        }
+        idle.notify_all();
+        throw runtime_error("Outbound mail queue is closed");
+    }
+
+    void deliver(const vector<MailJob>& batch) {
+        auto backoff = opts.baseBackoff;
+        for (int attempt = 1;; ++attempt) {
+            try {
+                transport->sendBatch(batch);
+                break;
+            } catch (const exception&) {
+                if (attempt >= opts.maxAttempts) {
+                    failed += batch.size();
+                    return;
+                }
+                retries++;
+                this_thread::sleep_for(backoff);
+                backoff = min(backoff * 2, opts.maxBackoff);
+            }
+        }
+        try {
+            spool.ack(batch);
+        } catch (const exception&) {
+            unacked += batch.size();
+        }
+    }
 
-    Invoice invoice(move(items), move(discounts), move(email));
-    cout << svc.process(invoice) << endl;
+public:
+    OutboundMailQueue(shared_ptr<ISmtpTransport> t, string spoolPath, Options o)
+        : transport(move(t)), spool(move(spoolPath), o.compactEvery), opts(o), queue(o.capacity) {
+        vector<MailJob> recovered = spool.recover();
+        for (const auto& job : recovered) nextId = max<uint64_t>(nextId, job.id + 1);
+        for (size_t i = 0; i < opts.workers; ++i) workers.emplace_back([this] { workerLoop(); });
+        try {
+            for (auto& job : recovered) enqueue(move(job));
+        } catch (...) {
+            queue.close();
+            for (auto& w : workers) w.join();
+            throw;
+        }
+    }
+
+    OutboundMailQueue(shared_ptr<ISmtpTransport> t, string spoolPath)
+        : OutboundMailQueue(move(t), move(spoolPath), Options{}) {}
+
+    ~OutboundMailQueue() override {
+        queue.close();
+        for (auto& w : workers) w.join();
+    }
+
+    void send(const string& to, const string& content) override {
+        MailJob job{nextId++, to, content};
+        spool.append(job);
+        enqueue(move(job));
+    }
+
+    // Blocks until everything enqueued so far has been delivered or given up on.
+    void flush() {
+        unique_lock<mutex> lock(idleMtx);
+        idle.wait(lock, [&] { return inFlight == 0; });
+    }
+
+    uint64_t getRetries() const { return retries; }
+    uint64_t getFailed() const { return failed; }
+    uint64_t getUnacked() const { return unacked; }
+};
+
+class FixedRateTaxCalculator final : public ITaxCalculator {
+private:
+    double rate;
+public:
+    FixedRateTaxCalculator(double r) : rate(r) {}
+    double calculate(double taxableAmount) override {
+        return taxableAmount * rate;
+    }
+};
+
+/**
+ * @brief Immutable tax rate index: (region, category) -> rate, and SKU -> category.
+ *
+ * Regions and categories are kept in sorted arrays and looked up by binary
+ * search; rates are a dense region-major matrix so one region's rates are a
+ * single contiguous row. Each SKU's category column is interned once, when the
+ * table is built, into a hash map, since that lookup runs once per invoice line. Unknown regions, uncategorised SKUs and missing
+ * (region, category) pairs fall back to the table's default rate.
+ */
+class TaxTable {
+private:
+    vector<string> regions;                      // sorted
+    vector<string> categories;                   // sorted
+    unordered_map<string, uint32_t> skuCategory;  // SKU -> rates column
+    vector<double> rates;                        // regions.size() rows, one column per category + 1
+    vector<double> defaultRow;                   // used for unknown regions
+    double defaultRate{0.0};
+
+    static int indexOf(const vector<string>& sorted, const string& key) {
+        auto it = lower_bound(sorted.begin(), sorted.end(), key);
+        return (it != sorted.end() && *it == key) ? static_cast<int>(it - sorted.begin()) : -1;
+    }
+
+public:
+    struct RateRow { string region; string category; double rate; };
+    struct SkuRow { string sku; string category; };
+
+    static shared_ptr<const TaxTable> build(const vector<RateRow>& rateRows, const vector<SkuRow>& skuRows, double defaultRate) {
+        auto t = make_shared<TaxTable>();
+        t->defaultRate = defaultRate;
+        for (const auto& r : rateRows) {
+            t->regions.push_back(r.region);
+            t->categories.push_back(r.category);
+        }
+        for (const auto& r : skuRows) t->categories.push_back(r.category);
+        for (auto* v : {&t->regions, &t->categories}) {
+            sort(v->begin(), v->end());
+            v->erase(unique(v->begin(), v->end()), v->end());
+        }
+        // Column 0 is "uncategorised"; category i lives in column i + 1.
+        const size_t cols = t->categories.size() + 1;
+        t->rates.assign(t->regions.size() * cols, defaultRate);
+        t->defaultRow.assign(cols, defaultRate);
+        for (const auto& r : rateRows) {
+            size_t row = static_cast<size_t>(indexOf(t->regions, r.region));
+            t->rates[row * cols + indexOf(t->categories, r.category) + 1] = r.rate;
+        }
+        t->skuCategory.reserve(skuRows.size());
+        for (const auto& r : skuRows) {
+            t->skuCategory.emplace(r.sku, static_cast<uint32_t>(indexOf(t->categories, r.category) + 1));  // first row wins
+        }
+        return t;
+    }
+
+    // Text format, one entry per line:
+    //   default <rate>
+    //   rate <region> <category> <rate>
+    //   sku <sku> <category>
+    static shared_ptr<const TaxTable> parse(istream& in) {
+        vector<RateRow> rateRows;
+        vector<SkuRow> skuRows;
+        double def = 0.0;
+        string kind;
+        while (in >> kind) {
+            if (kind == "default") {
+                in >> def;
+            } else if (kind == "rate") {
+                RateRow r;
+                in >> r.region >> r.category >> r.rate;
+                rateRows.push_back(r);
+            } else if (kind == "sku") {
+                SkuRow r;
+                in >> r.sku >> r.category;
+                skuRows.push_back(r);
+            } else {
+                throw runtime_error("Unknown tax table entry: " + kind);
+            }
+            if (!in) throw runtime_error("Malformed tax table entry: " + kind);
+        }
+        return build(rateRows, skuRows, def);
+    }
+
+    // Contiguous rates for a region, indexed by categoryOf().
+    const double* ratesFor(const string& region) const {
+        int r = indexOf(regions, region);
+        return r < 0 ? defaultRow.data() : rates.data() + static_cast<size_t>(r) * defaultRow.size();
+    }
+
+    uint32_t categoryOf(const string& sku) const {
+        auto it = skuCategory.find(sku);
+        return it != skuCategory.end() ? it->second : 0;
+    }
+
+    double getDefaultRate() const { return defaultRate; }
+};
+
+/**
+ * @brief Jurisdiction-aware calculator backed by a hot-swappable TaxTable.
+ *
+ * Each calculation pins the current table once, so reload() never affects an
+ * invoice that is already being computed. Discounts are allocated to lines in
+ * proportion to their amount before rates are applied.
+ */
+class TaxEngine : public ITaxCalculator {
+private:
+    shared_ptr<const TaxTable> table;
+
+public:
+    explicit TaxEngine(shared_ptr<const TaxTable> t) : table(move(t)) {}
+
+    // Publishes a new table; readers holding the old one finish with it.
+    void reload(shared_ptr<const TaxTable> t) { atomic_store(&table, move(t)); }
+    shared_ptr<const TaxTable> snapshot() const { return atomic_load(&table); }
+
+    double calculate(double taxableAmount) override {
+        return taxableAmount * snapshot()->getDefaultRate();
+    }
+
+    double calculateFor(const Invoice& invoice, double subtotal, double taxableAmount, TaxBuckets* buckets) override {
+        shared_ptr<const TaxTable> t = snapshot();
+        const vector<LineItem>& items = invoice.getItems();
+        if (subtotal <= 0.0 || items.empty()) {
+            double tax = taxableAmount * t->getDefaultRate();
+            if (buckets) buckets->add(t->getDefaultRate(), tax);
+            return tax;
+        }
+
+        // Gather pass: resolve each line to (amount, rate) in flat arrays...
+        thread_local vector<double> amounts, lineRates;
+        const size_t n = items.size();
+        amounts.resize(n);
+        lineRates.resize(n);
+        const double* regionRates = t->ratesFor(invoice.getRegion());
+        for (size_t i = 0; i < n; ++i) {
+            amounts[i] = items[i].unitPrice * items[i].quantity;
+            lineRates[i] = regionRates[t->categoryOf(items[i].sku)];
+        }
+        // ...then the dot product in four independent lanes. One running sum would have to keep source
+        // order (no -ffast-math), a chain of dependent adds; the lanes reassociate explicitly instead.
+        const double* a = amounts.data();
+        const double* r = lineRates.data();
+        double lane[4] = {0.0, 0.0, 0.0, 0.0};
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            for (size_t k = 0; k < 4; ++k) lane[k] += a[i + k] * r[i + k];
+        }
+        double tax = (lane[0] + lane[1]) + (lane[2] + lane[3]);
+        for (; i < n; ++i) tax += a[i] * r[i];
+        const double scale = taxableAmount / subtotal;
+        if (buckets) {
+            for (size_t j = 0; j < n; ++j) buckets->add(r[j], a[j] * r[j] * scale);
+        }
+        return tax * scale;
+    }
+};
+
+/**
+ * @brief Immutable, versioned set of FX rates.
+ *
+ * Built from "units per USD" quotes into a full conversion matrix stored
+ * target-major, so converting a batch into one currency reads one contiguous
+ * row. A currency without a quote converts to NaN and is rejected.
+ */
+class FxSnapshot {
+private:
+    uint64_t version;
+    vector<double> factors;  // factors[to * kCurrencyCount + from]
+
+public:
+    FxSnapshot(uint64_t v, const array<double, kCurrencyCount>& unitsPerUsd)
+        : version(v), factors(kCurrencyCount * kCurrencyCount) {
+        const double nan = numeric_limits<double>::quiet_NaN();
+        for (size_t to = 0; to < kCurrencyCount; ++to) {
+            for (size_t from = 0; from < kCurrencyCount; ++from) {
+                bool known = unitsPerUsd[from] > 0.0 && unitsPerUsd[to] > 0.0;
+                factors[to * kCurrencyCount + from] = from == to ? 1.0 : known ? unitsPerUsd[to] / unitsPerUsd[from] : nan;
+            }
+        }
+    }
+
+    uint64_t getVersion() const { return version; }
+    double factor(Currency from, Currency to) const {
+        return factors[static_cast<size_t>(to) * kCurrencyCount + static_cast<size_t>(from)];
+    }
+
+    // out[i] = amounts[i] converted from from[i] into to[i]: a gather pass, then a plain multiply loop.
+    void convert(const Currency* from, const Currency* to, const double* amounts, double* out, size_t n) const {
+        for (size_t i = 0; i < n; ++i) out[i] = factor(from[i], to[i]);
+        for (size_t i = 0; i < n; ++i) out[i] *= amounts[i];
+        for (size_t i = 0; i < n; ++i) {
+            if (std::isnan(out[i])) {
+                throw runtime_error(string("No FX rate for ") + currencyCode(from[i]) + "->" + currencyCode(to[i]));
+            }
+        }
+    }
+
+    // Re-prices every line of the given invoices into its invoice's billing currency in one pass.
+    vector<Invoice> toBillingCurrency(const vector<const Invoice*>& invoices) const {
+        vector<Currency> from, to;
+        vector<double> amounts;
+        for (const Invoice* inv : invoices) {
+            for (const auto& it : inv->getItems()) {
+                from.push_back(it.currency);
+                to.push_back(inv->getCurrency());
+                amounts.push_back(it.unitPrice);
+            }
+        }
+        vector<double> converted(amounts.size());
+        convert(from.data(), to.data(), amounts.data(), converted.data(), amounts.size());
+
+        vector<Invoice> out;
+        out.reserve(invoices.size());
+        size_t k = 0;
+        for (const Invoice* inv : invoices) {
+            vector<LineItem> items = inv->getItems();
+            for (auto& it : items) {
+                it.unitPrice = converted[k++];
+                it.currency = inv->getCurrency();
+            }
+            out.emplace_back(move(items), inv->getDiscounts(), inv->getEmail(), inv->getRegion(), inv->getCurrency());
+        }
+        return out;
+    }
+};
+
+// Publishes FX snapshots; readers pin one with snapshot() and never block a publisher.
+class FxRateProvider {
+private:
+    shared_ptr<const FxSnapshot> current;
+    atomic<uint64_t> nextVersion{1};
+
+public:
+    explicit FxRateProvider(const array<double, kCurrencyCount>& unitsPerUsd) { publish(unitsPerUsd); }
+
+    void publish(const array<double, kCurrencyCount>& unitsPerUsd) {
+        atomic_store(&current, shared_ptr<const FxSnapshot>(make_shared<FxSnapshot>(nextVersion++, unitsPerUsd)));
+    }
+    shared_ptr<const FxSnapshot> snapshot() const { return atomic_load(&current); }
+};
+
+// Structured outcome of pricing one invoice; amounts are in `currency`.
+struct InvoiceResult {
+    Currency currency{Currency::USD};
+    uint64_t fxVersion{0};  // snapshot used to convert lines, 0 if none was needed
+    double subtotal{0.0};
+    double discount{0.0};
+    double tax{0.0};
+    double grandTotal{0.0};
+    DiscountBreakdown discountByKind{};
+    TaxBuckets taxBuckets;
+};
+
+// How InvoiceService holds a collaborator: interfaces (and types that cannot be moved)
+// through shared_ptr, plain concrete types by value.
+template <class T>
+using ServiceSlot = conditional_t<is_abstract<T>::value || !is_move_constructible<T>::value, shared_ptr<T>, T>;
+
+template <class T>
+T& slotRef(T& held) { return held; }
+template <class T>
+T& slotRef(shared_ptr<T>& held) { return *held; }
+
+/**
+ * @brief Invoice pipeline, composed either at run time or at compile time.
+ *
+ * InvoiceService<> (the default) depends on the abstract interfaces and takes
+ * shared_ptr plug-ins. InvoiceService<TextInvoiceRenderer, SomeEmailer,
+ * NullLogger, FixedRateTaxCalculator> names concrete (ideally final) types:
+ * movable ones are stored by value, and every stage call binds statically,
+ * so the compiler can inline the whole pipeline for batch runs.
+ */
+template <class Renderer = IInvoiceRenderer, class Emailer = IEmailSender, class Logger = ILogger, class Tax = ITaxCalculator>
+class InvoiceService {
+private:
+    ServiceSlot<Renderer> renderer;
+    ServiceSlot<Emailer> emailer;
+    ServiceSlot<Logger> logger;
+    ServiceSlot<Tax> tax_calculator;
+    shared_ptr<FxRateProvider> fx_rates;
+
+    shared_ptr<const FxSnapshot> pinFx() const {
+        if (!fx_rates) throw runtime_error("Invoice has foreign-currency lines but no FX rates are configured");
+        return fx_rates->snapshot();
+    }
+
+    string deliver(const Invoice& invoice, const InvoiceResult& result) {
+        const string& email = invoice.getEmail();
+
+        // SRP: Delegate rendering
+        string rendered_invoice = slotRef(renderer).render(invoice, result.subtotal, result.discount, result.tax, result.grandTotal);
+
+        // SRP: Delegate emailing
+        if (!email.empty()) {
+            slotRef(emailer).send(email, rendered_invoice);
+        }
+
+        // SRP: Delegate logging
+        logEvent<LogLevel::Info>(slotRef(logger), "Invoice processed", "email", email, "total", result.grandTotal,
+                                 "currency", currencyCode(result.currency));
+
+        return rendered_invoice;
+    }
+
+public:
+    // DIP: Depend on abstractions, inject dependencies
+    InvoiceService(ServiceSlot<Renderer> renderer, ServiceSlot<Emailer> emailer, ServiceSlot<Logger> logger, ServiceSlot<Tax> tax_calc)
+        : renderer(move(renderer)), emailer(move(emailer)), logger(move(logger)), tax_calculator(move(tax_calc)) {}
+
+    // Needed only when line items may be priced in a currency other than the invoice's.
+    void setFxRates(shared_ptr<FxRateProvider> fx) { fx_rates = move(fx); }
+
+    // Prices an invoice whose lines are all in its billing currency.
+    InvoiceResult compute(const Invoice& invoice) {
+        const vector<LineItem>& items = invoice.getItems();
+        const DiscountProgram* discounts = invoice.getDiscounts().get();
+        InvoiceResult result;
+        result.currency = invoice.getCurrency();
+
+        // pricing
+        for (auto& it : items) result.subtotal += it.unitPrice * it.quantity;
+
+        // OCP: Run the compiled discount program
+        if (discounts) discounts->requireCurrency(result.currency);
+        result.discount = discounts ? discounts->apply(items, result.subtotal, &result.discountByKind) : 0.0;
+
+        // SRP: Delegate tax calculation
+        double taxable_amount = result.subtotal - result.discount;
+        result.tax = slotRef(tax_calculator).calculateFor(invoice, result.subtotal, taxable_amount, &result.taxBuckets);
+        result.grandTotal = taxable_amount + result.tax;
+        return result;
+    }
+
+    string process(Invoice &invoice) {
+        if (invoice.isSingleCurrency()) return deliver(invoice, compute(invoice));
+
+        shared_ptr<const FxSnapshot> fx = pinFx();
+        Invoice converted = move(fx->toBillingCurrency({&invoice}).front());
+        InvoiceResult result = compute(converted);
+        result.fxVersion = fx->getVersion();
+        return deliver(converted, result);
+    }
+
+    vector<InvoiceResult> processBatch(const vector<Invoice>& invoices) {
+        return processBatch(invoices, [](const Invoice&, const InvoiceResult&) {});
+    }
+
+    // Every invoice in the batch is converted with the same FX snapshot, in one pass.
+    // onPriced (e.g. a ReportAggregator shard) sees each invoice as priced, with its result.
+    template <class OnPriced>
+    vector<InvoiceResult> processBatch(const vector<Invoice>& invoices, OnPriced&& onPriced) {
+        vector<const Invoice*> foreign;
+        for (const auto& inv : invoices) {
+            if (!inv.isSingleCurrency()) foreign.push_back(&inv);
+        }
+        shared_ptr<const FxSnapshot> fx = foreign.empty() ? nullptr : pinFx();
+        vector<Invoice> converted = fx ? fx->toBillingCurrency(foreign) : vector<Invoice>{};
+
+        vector<InvoiceResult> results;
+        results.reserve(invoices.size());
+        size_t next = 0;
+        for (const auto& inv : invoices) {
+            const Invoice& priced = inv.isSingleCurrency() ? inv : converted[next++];
+            InvoiceResult result = compute(priced);
+            if (&priced != &inv) result.fxVersion = fx->getVersion();
+            deliver(priced, result);
+            onPriced(priced, result);
+            results.push_back(result);
+        }
+        return results;
+    }
+};
+
+// SRP: Concrete renderer implementation
+class TextInvoiceRenderer final : public IInvoiceRenderer {
+public:
+    string render(const Invoice& invoice, double subtotal, double discount, double tax, double grandTotal) override {
+        ostringstream pdf;
+        pdf << "INVOICE\n";
+        for (const auto& it : invoice.getItems()) {
+            pdf << it.sku << " x" << it.quantity << " @ " << it.unitPrice << "\n";
+        }
+        pdf << "Subtotal: " << subtotal << "\n"
+            << "Discounts: " << discount << "\n"
+            << "Tax: " << tax << "\n"
+            << "Total: " << grandTotal << "\n";
+        return pdf.str();
+    }
+};
+
+/**
+ * @brief TextInvoiceRenderer output, with the line-item block memoised.
+ *
+ * Subscription runs render the same items over and over. The "INVOICE" header
+ * plus line block is cached under a content hash of the items (checked against
+ * the stored items, so a collision just misses). A hit costs one copy of the
+ * cached block plus four formatted totals. Output is byte-for-byte identical to
+ * TextInvoiceRenderer. The cache is split into mutex-guarded shards with FIFO
+ * eviction, so batch workers can share one renderer.
+ */
+class CachingInvoiceRenderer final : public IInvoiceRenderer {
+private:
+    struct Entry {
+        vector<LineItem> items;
+        shared_ptr<const string> block;
+    };
+    struct alignas(64) Shard {
+        mutex mtx;
+        unordered_map<uint64_t, Entry> entries;
+        deque<uint64_t> order;  // insertion order, for eviction
+    };
+    static constexpr size_t kShards = 16;
+
+    array<Shard, kShards> shards;
+    size_t entriesPerShard;
+    atomic<uint64_t> hits{0};
+    atomic<uint64_t> misses{0};
+
+    static uint64_t contentHash(const vector<LineItem>& items) {
+        uint64_t h = 1469598103934665603ull;
+        auto mix = [&h](const void* p, size_t n) {
+            const unsigned char* b = static_cast<const unsigned char*>(p);
+            for (size_t i = 0; i < n; ++i) h = (h ^ b[i]) * 1099511628211ull;
+        };
+        for (const auto& it : items) {
+            mix(it.sku.data(), it.sku.size());
+            mix(&it.quantity, sizeof it.quantity);
+            mix(&it.unitPrice, sizeof it.unitPrice);
+        }
+        return h ^ (h >> 32);
+    }
+
+    static bool sameItems(const vector<LineItem>& a, const vector<LineItem>& b) {
+        return a.size() == b.size() && equal(a.begin(), a.end(), b.begin(), [](const LineItem& x, const LineItem& y) {
+                   return x.quantity == y.quantity && x.unitPrice == y.unitPrice && x.sku == y.sku;
+               });
+    }
+
+    // Same text as "os << value" with default stream formatting.
+    static void appendNumber(string& out, double v) {
+        char buf[32];
+        int n = snprintf(buf, sizeof buf, "%g", v);
+        out.append(buf, static_cast<size_t>(n));
+    }
+
+    static shared_ptr<const string> renderBlock(const vector<LineItem>& items) {
+        auto block = make_shared<string>("INVOICE\n");
+        char buf[16];
+        for (const auto& it : items) {
+            *block += it.sku;
+            *block += " x";
+            block->append(buf, static_cast<size_t>(to_chars(buf, buf + sizeof buf, it.quantity).ptr - buf));
+            *block += " @ ";
+            appendNumber(*block, it.unitPrice);
+            *block += '\n';
+        }
+        return block;
+    }
+
+    shared_ptr<const string> lineBlock(const vector<LineItem>& items) {
+        const uint64_t h = contentHash(items);
+        Shard& shard = shards[h % kShards];
+        {
+            lock_guard<mutex> lock(shard.mtx);
+            auto it = shard.entries.find(h);
+            if (it != shard.entries.end() && sameItems(it->second.items, items)) {
+                hits.fetch_add(1, memory_order_relaxed);
+                return it->second.block;
+            }
+        }
+        misses.fetch_add(1, memory_order_relaxed);
+        shared_ptr<const string> block = renderBlock(items);  // formatted outside the lock
+        lock_guard<mutex> lock(shard.mtx);
+        if (shard.entries.find(h) == shard.entries.end()) {
+            if (shard.order.size() >= entriesPerShard) {
+                shard.entries.erase(shard.order.front());
+                shard.order.pop_front();
+            }
+            shard.order.push_back(h);
+        }
+        shard.entries[h] = Entry{items, block};
+        return block;
+    }
+
+public:
+    explicit CachingInvoiceRenderer(size_t maxEntries = 4096) : entriesPerShard(max<size_t>(1, maxEntries / kShards)) {}
+
+    string render(const Invoice& invoice, double subtotal, double discount, double tax, double grandTotal) override {
+        shared_ptr<const string> block = lineBlock(invoice.getItems());
+        string out;
+        out.reserve(block->size() + 96);
+        out += *block;
+        out += "Subtotal: ";
+        appendNumber(out, subtotal);
+        out += "\nDiscounts: ";
+        appendNumber(out, discount);
+        out += "\nTax: ";
+        appendNumber(out, tax);
+        out += "\nTotal: ";
+        appendNumber(out, grandTotal);
+        out += '\n';
+        return out;
+    }
+
+    uint64_t getHits() const { return hits; }
+    uint64_t getMisses() const { return misses; }
+};
+
+/**
+ * @brief Editable cart whose totals stay current as lines change.
+ *
+ * Keeps the running subtotal, the per-SKU totals the discount program reads,
+ * and the rate-weighted tax base. Each edit is an O(1) delta; totals() is
+ * O(discount rules) and render() only runs when the cart changed since the
+ * last render. Tax matches TaxEngine: rates come from the table pinned at
+ * construction, scaled by taxable / subtotal.
+ */
+class IncrementalInvoice {
+public:
+    struct Totals {
+        double subtotal{0.0};
+        double discount{0.0};
+        double tax{0.0};
+        double grandTotal{0.0};
+    };
+
+private:
+    struct Line {
+        LineItem item;
+        double amount{0.0};
+        double rate{0.0};
+        int slot{-1};     // DiscountProgram slot, -1 if no rule reads this SKU
+        bool live{false};
+    };
+
+    // Running float sums are rebuilt from the lines after this many edits to bound drift.
+    static constexpr size_t kResyncEvery = 4096;
+
+    shared_ptr<const DiscountProgram> discounts;
+    shared_ptr<const TaxTable> taxTable;
+    string region;
+    Currency currency;
+    const double* regionRates;
+    vector<Line> lines;  // insertion order; removed lines are tombstones until compaction
+    unordered_map<string, size_t> bySku;
+    size_t liveCount{0};
+    vector<DiscountProgram::SkuTotals> slots;
+    double subtotal{0.0};
+    double weightedTax{0.0};
+    size_t editsSinceResync{0};
+    mutable bool totalsDirty{true};
+    mutable Totals cachedTotals;
+    bool renderDirty{true};
+    string cachedRender;
+
+    void account(const Line& line, int sign) {
+        subtotal += sign * line.amount;
+        weightedTax += sign * line.amount * line.rate;
+        if (line.slot >= 0) {
+            slots[line.slot].quantity += sign * line.item.quantity;
+            slots[line.slot].amount += sign * line.amount;
+        }
+    }
+
+    void resync() {
+        subtotal = weightedTax = 0.0;
+        fill(slots.begin(), slots.end(), DiscountProgram::SkuTotals{});
+        for (const auto& line : lines) {
+            if (line.live) account(line, +1);
+        }
+        editsSinceResync = 0;
+    }
+
+    void compact() {
+        vector<Line> kept;
+        kept.reserve(liveCount);
+        bySku.clear();
+        for (auto& line : lines) {
+            if (!line.live) continue;
+            bySku[line.item.sku] = kept.size();
+            kept.push_back(move(line));
+        }
+        lines.swap(kept);
+    }
+
+    void edited() {
+        totalsDirty = renderDirty = true;
+        if (++editsSinceResync >= kResyncEvery) resync();
+    }
+
+public:
+    // All cart lines are priced in the cart's currency.
+    IncrementalInvoice(shared_ptr<const DiscountProgram> d, shared_ptr<const TaxTable> t, string r, Currency c = Currency::USD)
+        : discounts(move(d)), taxTable(move(t)), region(move(r)), currency(c), regionRates(taxTable->ratesFor(region)),
+          slots(discounts ? discounts->slotCount() : 0) {
+        if (discounts) discounts->requireCurrency(currency);
+    }
+
+    // Adds a line, or replaces quantity and price of the existing line for this SKU.
+    void setLine(const string& sku, int quantity, double unitPrice) {
+        if (quantity <= 0) {
+            removeLine(sku);
+            return;
+        }
+        auto it = bySku.find(sku);
+        Line* line;
+        if (it == bySku.end()) {
+            bySku.emplace(sku, lines.size());
+            lines.push_back({{sku, 0, 0.0, currency}, 0.0, regionRates[taxTable->categoryOf(sku)],
+                             discounts ? discounts->slotOf(sku) : -1, true});
+            ++liveCount;
+            line = &lines.back();
+        } else {
+            line = &lines[it->second];
+            account(*line, -1);
+        }
+        line->item.quantity = quantity;
+        line->item.unitPrice = unitPrice;
+        line->amount = unitPrice * quantity;
+        account(*line, +1);
+        edited();
+    }
+
+    void setQuantity(const string& sku, int quantity) {
+        auto it = bySku.find(sku);
+        if (it == bySku.end()) throw invalid_argument("No cart line for " + sku);
+        setLine(sku, quantity, lines[it->second].item.unitPrice);
+    }
+
+    void removeLine(const string& sku) {
+        auto it = bySku.find(sku);
+        if (it == bySku.end()) return;
+        Line& line = lines[it->second];
+        account(line, -1);
+        line.live = false;
+        bySku.erase(it);
+        --liveCount;
+        if (lines.size() > 16 && liveCount * 2 < lines.size()) compact();
+        edited();
+    }
+
+    const Totals& totals() const {
+        if (totalsDirty) {
+            Totals t;
+            t.subtotal = subtotal;
+            t.discount = discounts ? discounts->evaluate(subtotal, slots.data()) : 0.0;
+            double taxable = subtotal - t.discount;
+            t.tax = subtotal > 0.0 ? weightedTax * (taxable / subtotal) : 0.0;
+            t.grandTotal = taxable + t.tax;
+            cachedTotals = t;
+            totalsDirty = false;
+        }
+        return cachedTotals;
+    }
+
+    // Snapshot of the cart as an immutable Invoice, e.g. to hand to InvoiceService at checkout.
+    Invoice toInvoice(string email) const {
+        vector<LineItem> items;
+        items.reserve(liveCount);
+        for (const auto& line : lines) {
+            if (line.live) items.push_back(line.item);
+        }
+        return Invoice(move(items), discounts, move(email), region, currency);
+    }
+
+    const string& render(IInvoiceRenderer& renderer) {
+        if (renderDirty) {
+            const Totals& t = totals();
+            cachedRender = renderer.render(toInvoice(""), t.subtotal, t.discount, t.tax, t.grandTotal);
+            renderDirty = false;
+        }
+        return cachedRender;
+    }
+
+    size_t lineCount() const { return liveCount; }
+};
+
+// LSP Fix: Use composition, not inheritance
+class InvoiceComputer {
+private:
+    InvoiceService<>& service;
+public:
+    // Helper used by ad-hoc tests; also messy on purpose
+    explicit InvoiceComputer(InvoiceService<>& svc) : service(svc) {}
+
+    double computeTotal(Invoice &invoice) {
+        // Create a new invoice with a dummy email; avoids mutating the original.
+        Invoice test_invoice(invoice.getItems(), invoice.getDiscounts(), "noreply@example.com", invoice.getRegion(), invoice.getCurrency());
+        auto rendered = service.process(test_invoice);
+
+        auto pos = rendered.rfind("Total:");
+        if (pos == string::npos) throw runtime_error("No total");
+        string line = rendered.substr(pos + 6);
+        return stod(line);
+    }
+};
+
+// =========================
+// Bulk line-item ingestion
+// =========================
+// Interns SKUs to dense ids. Open addressing over a power-of-two table of
+// (hash, id) slots; names live in a deque so their addresses never move.
+class SkuDictionary {
+private:
+    struct Slot {
+        uint64_t hash{0};
+        uint32_t id{UINT32_MAX};
+    };
+    deque<string> names;
+    vector<Slot> slots = vector<Slot>(64);
+
+    static uint64_t hashOf(string_view s) {
+        uint64_t h = 1469598103934665603ull;  // FNV-1a
+        for (unsigned char c : s) h = (h ^ c) * 1099511628211ull;
+        h ^= h >> 33;  // fmix64 finaliser: FNV alone leaves the low bits poorly mixed
+        h *= 0xff51afd7ed558ccdull;
+        return h ^ (h >> 33);
+    }
+
+    void grow() {
+        vector<Slot> bigger(slots.size() * 2);
+        const size_t mask = bigger.size() - 1;
+        for (const Slot& s : slots) {
+            if (s.id == UINT32_MAX) continue;
+            size_t i = s.hash & mask;
+            while (bigger[i].id != UINT32_MAX) i = (i + 1) & mask;
+            bigger[i] = s;
+        }
+        slots.swap(bigger);
+    }
+
+public:
+    uint32_t intern(string_view sku) {
+        const uint64_t h = hashOf(sku);
+        const size_t mask = slots.size() - 1;
+        size_t i = h & mask;
+        for (; slots[i].id != UINT32_MAX; i = (i + 1) & mask) {
+            if (slots[i].hash == h && names[slots[i].id] == sku) return slots[i].id;
+        }
+        uint32_t id = static_cast<uint32_t>(names.size());
+        names.emplace_back(sku);
+        slots[i] = {h, id};
+        if (names.size() * 2 > slots.size()) grow();
+        return id;
+    }
+    const string& name(uint32_t id) const { return names[id]; }
+    size_t size() const { return names.size(); }
+};
+
+/**
+ * @brief Columnar line items grouped by invoice.
+ *
+ * Invoice i owns rows [invoiceBegin[i], invoiceBegin[i + 1]); SKUs are stored
+ * as ids into the dictionary, so there is no per-row allocation.
+ */
+struct LineItemColumns {
+    vector<uint64_t> invoiceIds;
+    vector<uint32_t> invoiceBegin;  // invoiceIds.size() + 1 entries
+    vector<uint32_t> skuIds;
+    vector<int32_t> quantities;
+    vector<double> unitPrices;
+    SkuDictionary skus;
+
+    size_t invoiceCount() const { return invoiceIds.size(); }
+    size_t lineCount() const { return skuIds.size(); }
+
+    // Bridge to the object model for code that still wants an Invoice.
+    vector<LineItem> materialize(size_t invoice) const {
+        vector<LineItem> items;
+        for (uint32_t r = invoiceBegin[invoice]; r < invoiceBegin[invoice + 1]; ++r) {
+            items.push_back({skus.name(skuIds[r]), quantities[r], unitPrices[r]});
+        }
+        return items;
+    }
+};
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+private:
+    const char* base{nullptr};
+    size_t length{0};
+
+public:
+    explicit MappedFile(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw runtime_error("Cannot open " + path);
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw runtime_error("Cannot stat " + path);
+        }
+        length = static_cast<size_t>(st.st_size);
+        if (length > 0) {
+            void* p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                throw runtime_error("Cannot map " + path);
+            }
+            madvise(p, length, MADV_SEQUENTIAL);
+            base = static_cast<const char*>(p);
+        }
+        ::close(fd);
+    }
+    ~MappedFile() {
+        if (base) munmap(const_cast<char*>(base), length);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return base; }
+    size_t size() const { return length; }
+};
+
+/**
+ * @brief Parses "invoice_id,sku,quantity,unit_price" CSV into LineItemColumns.
+ *
+ * The mapped file is cut into one chunk per thread, each boundary moved to the
+ * next record start. Chunks are parsed in parallel with a chunk-local SKU
+ * dictionary, then merged in file order. Rows
+ * are regrouped by invoice id only if the input is not already grouped. An
+ * optional header line is skipped.
+ */
+class LineItemIngestor {
+private:
+    struct Chunk {
+        vector<uint64_t> invoiceIds;
+        vector<uint32_t> skuIds;  // chunk-local until merged
+        vector<int32_t> quantities;
+        vector<double> unitPrices;
+        SkuDictionary skus;  // owns its keys so lookups stay in cache, not scattered over the mapping
+    };
+
+    static const char* field(const char* p, const char* end, char delim, string_view& out) {
+        const char* q = static_cast<const char*>(memchr(p, delim, static_cast<size_t>(end - p)));
+        if (!q) q = end;
+        out = string_view(p, static_cast<size_t>(q - p));
+        return q == end ? end : q + 1;
+    }
+
+    template <class T>
+    static T number(string_view s, size_t lineStart) {
+        T v{};
+        if (!s.empty() && s.back() == '\r') s.remove_suffix(1);
+        auto res = from_chars(s.data(), s.data() + s.size(), v);
+        if (res.ec != errc() || res.ptr != s.data() + s.size()) {
+            throw runtime_error("Bad number near byte " + to_string(lineStart) + ": '" + string(s) + "'");
+        }
+        return v;
+    }
+
+    static void parseChunk(const char* base, size_t begin, size_t end, Chunk& c) {
+        const char* p = base + begin;
+        const char* stop = base + end;
+        while (p < stop) {
+            const char* eol = static_cast<const char*>(memchr(p, '\n', static_cast<size_t>(stop - p)));
+            if (!eol) eol = stop;
+            if (eol > p) {
+                string_view id, sku, qty, price;
+                const char* q = field(p, eol, ',', id);
+                q = field(q, eol, ',', sku);
+                q = field(q, eol, ',', qty);
+                field(q, eol, ',', price);
+                size_t at = static_cast<size_t>(p - base);
+                c.invoiceIds.push_back(number<uint64_t>(id, at));
+                c.skuIds.push_back(c.skus.intern(sku));
+                c.quantities.push_back(number<int32_t>(qty, at));
+                c.unitPrices.push_back(number<double>(price, at));
+            }
+            p = eol + 1;
+        }
+    }
+
+public:
+    static LineItemColumns ingestCsv(const string& path, unsigned threads) {
+        MappedFile file(path);
+        const char* base = file.data();
+        const size_t size = file.size();
+        LineItemColumns cols;
+        if (size == 0) {
+            cols.invoiceBegin.push_back(0);
+            return cols;
+        }
+
+        size_t start = 0;
+        if (!isdigit(static_cast<unsigned char>(base[0]))) {
+            const char* nl = static_cast<const char*>(memchr(base, '\n', size));
+            start = nl ? static_cast<size_t>(nl - base) + 1 : size;
+        }
+        threads = max(1u, threads);
+        vector<size_t> cuts{start};
+        for (unsigned t = 1; t < threads; ++t) {
+            size_t cut = max(cuts.back(), start + (size - start) * t / threads);
+            const char* nl = cut < size ? static_cast<const char*>(memchr(base + cut, '\n', size - cut)) : nullptr;
+            cuts.push_back(nl ? static_cast<size_t>(nl - base) + 1 : size);
+        }
+        cuts.push_back(size);
+
+        vector<Chunk> chunks(threads);
+        vector<thread> pool;
+        vector<exception_ptr> errors(threads);
+        for (unsigned t = 0; t < threads; ++t) {
+            pool.emplace_back([&, t] {
+                try {
+                    parseChunk(base, cuts[t], cuts[t + 1], chunks[t]);
+                } catch (...) {
+                    errors[t] = current_exception();
+                }
+            });
+        }
+        for (auto& th : pool) th.join();
+        for (auto& e : errors) {
+            if (e) rethrow_exception(e);
+        }
+
+        // Merge in file order, remapping chunk-local SKU ids to global ones.
+        size_t rows = 0;
+        for (auto& c : chunks) rows += c.invoiceIds.size();
+        vector<uint64_t> ids;
+        ids.reserve(rows);
+        cols.skuIds.reserve(rows);
+        cols.quantities.reserve(rows);
+        cols.unitPrices.reserve(rows);
+        for (auto& c : chunks) {
+            vector<uint32_t> remap(c.skus.size());
+            for (uint32_t i = 0; i < c.skus.size(); ++i) remap[i] = cols.skus.intern(c.skus.name(i));
+            ids.insert(ids.end(), c.invoiceIds.begin(), c.invoiceIds.end());
+            for (uint32_t s : c.skuIds) cols.skuIds.push_back(remap[s]);
+            cols.quantities.insert(cols.quantities.end(), c.quantities.begin(), c.quantities.end());
+            cols.unitPrices.insert(cols.unitPrices.end(), c.unitPrices.begin(), c.unitPrices.end());
+            c = Chunk{};  // release chunk memory as we go
+        }
+
+        if (!is_sorted(ids.begin(), ids.end())) {
+            vector<uint32_t> order(rows);
+            for (uint32_t i = 0; i < rows; ++i) order[i] = i;
+            stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return ids[a] < ids[b]; });
+            auto permute = [&](auto& column) {
+                auto copy = column;
+                for (size_t i = 0; i < rows; ++i) column[i] = copy[order[i]];
+            };
+            permute(ids);
+            permute(cols.skuIds);
+            permute(cols.quantities);
+            permute(cols.unitPrices);
+        }
+        for (size_t r = 0; r < rows; ++r) {
+            if (r == 0 || ids[r] != ids[r - 1]) {
+                cols.invoiceIds.push_back(ids[r]);
+                cols.invoiceBegin.push_back(static_cast<uint32_t>(r));
+            }
+        }
+        cols.invoiceBegin.push_back(static_cast<uint32_t>(rows));
+        return cols;
+    }
+};
+
+// =========================
+// Invoice archive
+// =========================
+inline void putVarint(string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back(static_cast<char>(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+}
+
+inline uint64_t getVarint(const uint8_t*& p, const uint8_t* end) {
+    uint64_t v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+        v |= static_cast<uint64_t>(b & 0x7f) << shift;
+        if (!(b & 0x80)) return v;
+    }
+    throw runtime_error("Corrupt varint in invoice archive");
+}
+
+inline uint64_t zigzag(int64_t v) { return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63); }
+inline int64_t unzigzag(uint64_t v) { return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1); }
+
+inline void putDouble(string& out, double d) { out.append(reinterpret_cast<const char*>(&d), sizeof d); }
+inline double getDouble(const uint8_t*& p, const uint8_t* end) {
+    if (end - p < static_cast<ptrdiff_t>(sizeof(double))) throw runtime_error("Truncated invoice archive block");
+    double d;
+    memcpy(&d, p, sizeof d);
+    p += sizeof d;
+    return d;
+}
+
+// One invoice as stored in, and read back from, an archive.
+struct ArchivedInvoice {
+    uint64_t id{0};
+    string email;
+    vector<LineItem> items;
+    InvoiceResult result;
+
+    Invoice toInvoice() const { return Invoice(items, nullptr, email, "", result.currency); }
+    string render(IInvoiceRenderer& renderer) const {
+        return renderer.render(toInvoice(), result.subtotal, result.discount, result.tax, result.grandTotal);
+    }
+};
+
+/**
+ * @brief Append-only columnar archive of computed invoices.
+ *
+ * File layout:
+ *   "INVARC1\0" | block* | footer | u64 footer offset | "INVARC1\0"
+ * A block holds up to invoicesPerBlock invoices (ids must be appended in
+ * ascending order) laid out column by column: delta-coded ids, currencies, FX
+ * versions, line counts, emails, totals, then SKU ids, quantities and prices
+ * for every line. Integers are varints; prices are stored as cents when the
+ * whole block is cent-exact. The footer holds the SKU dictionary and a
+ * (first id, last id, offset, size) entry per block, so a lookup decodes one
+ * small block. Blocks are encoded, not run through a general-purpose codec;
+ * the tree has no compression dependency.
+ */
+class InvoiceArchiveWriter {
+private:
+    static constexpr char kMagic[8] = {'I', 'N', 'V', 'A', 'R', 'C', '1', '\0'};
+    friend class InvoiceArchiveReader;
+
+    struct BlockRef {
+        uint64_t firstId, lastId, offset, size;
+    };
+
+    ofstream out;
+    uint64_t offset{0};
+    size_t invoicesPerBlock;
+    vector<ArchivedInvoice> pending;
+    vector<BlockRef> blocks;
+    SkuDictionary skus;
+    bool closed{false};
+
+    void write(const string& bytes) {
+        out.write(bytes.data(), static_cast<streamsize>(bytes.size()));
+        offset += bytes.size();
+    }
+
+    void flushBlock() {
+        if (pending.empty()) return;
+        string b;
+        putVarint(b, pending.size());
+        uint64_t prev = pending.front().id;
+        putVarint(b, prev);
+        for (size_t i = 1; i < pending.size(); ++i) {
+            putVarint(b, pending[i].id - prev);
+            prev = pending[i].id;
+        }
+        for (const auto& inv : pending) b.push_back(static_cast<char>(inv.result.currency));
+        for (const auto& inv : pending) putVarint(b, inv.result.fxVersion);
+        for (const auto& inv : pending) putVarint(b, inv.items.size());
+        for (const auto& inv : pending) {
+            putVarint(b, inv.email.size());
+            b += inv.email;
+        }
+        for (const auto& inv : pending) {
+            for (double d : {inv.result.subtotal, inv.result.discount, inv.result.tax, inv.result.grandTotal}) putDouble(b, d);
+        }
+        bool cents = true;
+        for (const auto& inv : pending) {
+            for (const auto& it : inv.items) {
+                putVarint(b, skus.intern(it.sku));
+                putVarint(b, zigzag(it.quantity));
+                cents = cents && fabs(it.unitPrice) < 1e15 && round(it.unitPrice * 100.0) / 100.0 == it.unitPrice;
+            }
+        }
+        b.push_back(cents ? 1 : 0);
+        for (const auto& inv : pending) {
+            for (const auto& it : inv.items) {
+                if (cents) putVarint(b, zigzag(llround(it.unitPrice * 100.0)));
+                else putDouble(b, it.unitPrice);
+            }
+        }
+        blocks.push_back({pending.front().id, pending.back().id, offset, b.size()});
+        write(b);
+        pending.clear();
+    }
+
+public:
+    explicit InvoiceArchiveWriter(const string& path, size_t perBlock = 64)
+        : out(path, ios::binary | ios::trunc), invoicesPerBlock(max<size_t>(1, perBlock)) {
+        if (!out) throw runtime_error("Cannot create invoice archive " + path);
+        write(string(kMagic, sizeof kMagic));
+    }
+
+    ~InvoiceArchiveWriter() {
+        try {
+            close();
+        } catch (...) {
+        }
+    }
+
+    void append(uint64_t id, const Invoice& invoice, const InvoiceResult& result) {
+        uint64_t last = !pending.empty() ? pending.back().id : !blocks.empty() ? blocks.back().lastId : 0;
+        if ((!pending.empty() || !blocks.empty()) && id <= last) throw invalid_argument("Archive ids must be ascending");
+        if (!invoice.isSingleCurrency()) throw invalid_argument("Archive the invoice as priced, in its billing currency");
+        pending.push_back({id, invoice.getEmail(), invoice.getItems(), result});
+        if (pending.size() >= invoicesPerBlock) flushBlock();
+    }
+
+    void close() {
+        if (closed) return;
+        flushBlock();
+        string footer;
+        putVarint(footer, skus.size());
+        for (uint32_t i = 0; i < skus.size(); ++i) {
+            putVarint(footer, skus.name(i).size());
+            footer += skus.name(i);
+        }
+        putVarint(footer, blocks.size());
+        for (const auto& blk : blocks) {
+            putVarint(footer, blk.firstId);
+            putVarint(footer, blk.lastId - blk.firstId);
+            putVarint(footer, blk.offset);
+            putVarint(footer, blk.size);
+        }
+        uint64_t footerOffset = offset;
+        write(footer);
+        write(string(reinterpret_cast<const char*>(&footerOffset), sizeof footerOffset));
+        write(string(kMagic, sizeof kMagic));
+        out.flush();
+        closed = true;
+        if (!out) throw runtime_error("Failed writing invoice archive");
+    }
+};
+
+// Random-access reader over a memory-mapped archive.
+class InvoiceArchiveReader {
+private:
+    using BlockRef = InvoiceArchiveWriter::BlockRef;
+    MappedFile file;
+    vector<string> skus;
+    vector<BlockRef> blocks;
+
+    const uint8_t* bytes() const { return reinterpret_cast<const uint8_t*>(file.data()); }
+
+    vector<ArchivedInvoice> decodeBlock(const BlockRef& blk) const {
+        const uint8_t* p = bytes() + blk.offset;
+        const uint8_t* end = p + blk.size;
+        size_t n = getVarint(p, end);
+        vector<ArchivedInvoice> invs(n);
+        uint64_t id = 0;
+        for (auto& inv : invs) inv.id = id += getVarint(p, end);  // first id, then deltas
+        for (auto& inv : invs) {
+            if (p >= end || *p >= kCurrencyCount) throw runtime_error("Corrupt currency in invoice archive");
+            inv.result.currency = static_cast<Currency>(*p++);
+        }
+        for (auto& inv : invs) inv.result.fxVersion = getVarint(p, end);
+        for (auto& inv : invs) inv.items.resize(getVarint(p, end));
+        for (auto& inv : invs) {
+            size_t len = getVarint(p, end);
+            if (static_cast<size_t>(end - p) < len) throw runtime_error("Truncated invoice archive block");
+            inv.email.assign(reinterpret_cast<const char*>(p), len);
+            p += len;
+        }
+        for (auto& inv : invs) {
+            inv.result.subtotal = getDouble(p, end);
+            inv.result.discount = getDouble(p, end);
+            inv.result.tax = getDouble(p, end);
+            inv.result.grandTotal = getDouble(p, end);
+        }
+        for (auto& inv : invs) {
+            for (auto& it : inv.items) {
+                uint64_t sku = getVarint(p, end);
+                if (sku >= skus.size()) throw runtime_error("Corrupt SKU id in invoice archive");
+                it.sku = skus[sku];
+                it.quantity = static_cast<int>(unzigzag(getVarint(p, end)));
+                it.currency = inv.result.currency;
+            }
+        }
+        if (p >= end) throw runtime_error("Truncated invoice archive block");
+        bool cents = *p++ != 0;
+        for (auto& inv : invs) {
+            for (auto& it : inv.items) {
+                it.unitPrice = cents ? static_cast<double>(unzigzag(getVarint(p, end))) / 100.0 : getDouble(p, end);
+            }
+        }
+        return invs;
+    }
+
+public:
+    explicit InvoiceArchiveReader(const string& path) : file(path) {
+        const size_t trailer = sizeof(uint64_t) + sizeof InvoiceArchiveWriter::kMagic;
+        if (file.size() < sizeof InvoiceArchiveWriter::kMagic + trailer ||
+            memcmp(file.data(), InvoiceArchiveWriter::kMagic, sizeof InvoiceArchiveWriter::kMagic) != 0 ||
+            memcmp(file.data() + file.size() - sizeof InvoiceArchiveWriter::kMagic, InvoiceArchiveWriter::kMagic,
+                   sizeof InvoiceArchiveWriter::kMagic) != 0) {
+            throw runtime_error("Not a complete invoice archive: " + path);
+        }
+        uint64_t footerOffset;
+        memcpy(&footerOffset, file.data() + file.size() - trailer, sizeof footerOffset);
+        if (footerOffset > file.size() - trailer) throw runtime_error("Corrupt invoice archive footer");
+        const uint8_t* p = bytes() + footerOffset;
+        const uint8_t* end = bytes() + file.size() - trailer;
+        skus.resize(getVarint(p, end));
+        for (auto& s : skus) {
+            size_t len = getVarint(p, end);
+            if (static_cast<size_t>(end - p) < len) throw runtime_error("Corrupt invoice archive footer");
+            s.assign(reinterpret_cast<const char*>(p), len);
+            p += len;
+        }
+        blocks.resize(getVarint(p, end));
+        for (auto& blk : blocks) {
+            blk.firstId = getVarint(p, end);
+            blk.lastId = blk.firstId + getVarint(p, end);
+            blk.offset = getVarint(p, end);
+            blk.size = getVarint(p, end);
+            if (blk.offset + blk.size > footerOffset) throw runtime_error("Corrupt invoice archive block index");
+        }
+    }
+
+    size_t blockCount() const { return blocks.size(); }
+    size_t fileSize() const { return file.size(); }
+
+    // Decodes only the block whose id range covers `id`.
+    bool find(uint64_t id, ArchivedInvoice& out) const {
+        auto it = upper_bound(blocks.begin(), blocks.end(), id, [](uint64_t v, const BlockRef& b) { return v < b.firstId; });
+        if (it == blocks.begin() || id > prev(it)->lastId) return false;
+        for (auto& inv : decodeBlock(*prev(it))) {
+            if (inv.id == id) {
+                out = move(inv);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Visits every archived invoice in id order, one decoded block at a time.
+    template <class Visitor>
+    void forEach(Visitor&& visit) const {
+        for (const auto& blk : blocks) {
+            for (const auto& inv : decodeBlock(blk)) visit(inv);
+        }
+    }
+};
+
+// =========================
+// Revenue reports
+// =========================
+struct RevenueReport {
+    struct SkuRevenue {
+        string sku;
+        int64_t quantity{0};
+        double revenue{0.0};
+    };
+
+    Currency currency{Currency::USD};
+    uint64_t invoices{0};
+    double subtotal{0.0};
+    double discount{0.0};
+    double tax{0.0};
+    double grandTotal{0.0};
+    vector<SkuRevenue> bySku;               // highest revenue first
+    DiscountBreakdown discountByKind{};
+    vector<TaxBuckets::Bucket> taxByRate;   // ascending rate
+
+    void print(ostream& os, size_t topSkus = 10) const {
+        const char* ccy = currencyCode(currency);
+        os << "invoices=" << invoices << " subtotal=" << subtotal << " discount=" << discount << " tax=" << tax
+           << " total=" << grandTotal << " " << ccy << "\n";
+        for (size_t i = 0; i < min(topSkus, bySku.size()); ++i) {
+            os << "  sku " << bySku[i].sku << " qty=" << bySku[i].quantity << " revenue=" << bySku[i].revenue << "\n";
+        }
+        for (size_t k = 0; k < kDiscountKindCount; ++k) {
+            if (discountByKind[k] != 0.0) os << "  discount " << discountKindName(static_cast<DiscountKind>(k)) << "=" << discountByKind[k] << "\n";
+        }
+        for (const auto& b : taxByRate) os << "  tax @" << b.rate * 100.0 << "%=" << b.tax << "\n";
+    }
+};
+
+/**
+ * @brief Builds revenue reports while invoices are priced, without a second pass.
+ *
+ * Each worker thread owns one Shard and feeds it (priced invoice, result)
+ * pairs, e.g. from InvoiceService::processBatch. Shards share nothing, so the
+ * hot path takes no locks; merge() combines them once the batch is done.
+ * Amounts are converted into the report currency with the pinned FX snapshot.
+ */
+class ReportAggregator {
+public:
+    class alignas(64) Shard {
+    private:
+        friend class ReportAggregator;
+        Currency currency;
+        const FxSnapshot* fx;
+        SkuDictionary skus;
+        vector<RevenueReport::SkuRevenue> bySku;  // indexed by local SKU id; sku name filled at merge
+        RevenueReport totals;
+        vector<TaxBuckets::Bucket> taxByRate;
+
+        Shard(Currency c, const FxSnapshot* f) : currency(c), fx(f) {}
+
+    public:
+        void add(const Invoice& priced, const InvoiceResult& r) {
+            double f = 1.0;
+            if (r.currency != currency) {
+                if (!fx) throw runtime_error(string("Report needs FX rates for ") + currencyCode(r.currency));
+                f = fx->factor(r.currency, currency);
+            }
+            ++totals.invoices;
+            totals.subtotal += r.subtotal * f;
+            totals.discount += r.discount * f;
+            totals.tax += r.tax * f;
+            totals.grandTotal += r.grandTotal * f;
+            for (size_t k = 0; k < kDiscountKindCount; ++k) totals.discountByKind[k] += r.discountByKind[k] * f;
+            for (size_t i = 0; i < r.taxBuckets.size(); ++i) {
+                const auto& b = r.taxBuckets[i];
+                auto it = find_if(taxByRate.begin(), taxByRate.end(), [&](const TaxBuckets::Bucket& x) { return x.rate == b.rate; });
+                if (it == taxByRate.end()) taxByRate.push_back({b.rate, b.tax * f});
+                else it->tax += b.tax * f;
+            }
+            for (const auto& it : priced.getItems()) {
+                uint32_t id = skus.intern(it.sku);
+                if (id == bySku.size()) bySku.emplace_back();
+                bySku[id].quantity += it.quantity;
+                bySku[id].revenue += it.unitPrice * it.quantity * f;
+            }
+        }
+    };
+
+private:
+    Currency currency;
+    shared_ptr<const FxSnapshot> fx;
+    deque<Shard> shards;  // stable addresses; one per worker
+
+public:
+    ReportAggregator(size_t workers, Currency reportCurrency, shared_ptr<const FxSnapshot> rates = nullptr)
+        : currency(reportCurrency), fx(move(rates)) {
+        for (size_t i = 0; i < max<size_t>(1, workers); ++i) shards.push_back(Shard(currency, fx.get()));
+    }
+
+    Shard& shard(size_t worker) { return shards.at(worker); }
+
+    RevenueReport merge() const {
+        RevenueReport out;
+        out.currency = currency;
+        SkuDictionary names;
+        for (const auto& s : shards) {
+            out.invoices += s.totals.invoices;
+            out.subtotal += s.totals.subtotal;
+            out.discount += s.totals.discount;
+            out.tax += s.totals.tax;
+            out.grandTotal += s.totals.grandTotal;
+            for (size_t k = 0; k < kDiscountKindCount; ++k) out.discountByKind[k] += s.totals.discountByKind[k];
+            for (const auto& b : s.taxByRate) {
+                auto it = find_if(out.taxByRate.begin(), out.taxByRate.end(), [&](const TaxBuckets::Bucket& x) { return x.rate == b.rate; });
+                if (it == out.taxByRate.end()) out.taxByRate.push_back(b);
+                else it->tax += b.tax;
+            }
+            for (uint32_t local = 0; local < s.bySku.size(); ++local) {
+                uint32_t id = names.intern(s.skus.name(local));
+                if (id == out.bySku.size()) out.bySku.push_back({s.skus.name(local), 0, 0.0});
+                out.bySku[id].quantity += s.bySku[local].quantity;
+                out.bySku[id].revenue += s.bySku[local].revenue;
+            }
+        }
+        sort(out.bySku.begin(), out.bySku.end(), [](const auto& a, const auto& b) { return a.revenue > b.revenue; });
+        sort(out.taxByRate.begin(), out.taxByRate.end(), [](const auto& a, const auto& b) { return a.rate < b.rate; });
+        return out;
+    }
+};
+
+// =========================
+// Profiling support
+// =========================
+// Allocation counts for bench-pipeline need a replaced global operator new, which would then sit
+// under every mode of the program. So it is a profiling build only: -DINVOICE_COUNT_ALLOCATIONS.
+#ifdef INVOICE_COUNT_ALLOCATIONS
+constexpr bool kCountsAllocations = true;
+static thread_local uint64_t tl_allocations = 0;
+
+// Kept out of line so the compiler does not pair the inlined free() with operator new.
+[[gnu::noinline]] void* operator new(size_t size) {
+    ++tl_allocations;
+    if (void* p = malloc(size ? size : 1)) return p;
+    throw bad_alloc();
+}
+[[gnu::noinline]] void* operator new[](size_t size) { return operator new(size); }
+[[gnu::noinline]] void operator delete(void* p) noexcept { free(p); }
+[[gnu::noinline]] void operator delete[](void* p) noexcept { free(p); }
+[[gnu::noinline]] void operator delete(void* p, size_t) noexcept { free(p); }
+[[gnu::noinline]] void operator delete[](void* p, size_t) noexcept { free(p); }
+
+inline uint64_t allocationCount() { return tl_allocations; }
+#else
+constexpr bool kCountsAllocations = false;
+inline uint64_t allocationCount() { return 0; }
+#endif
+
+/**
+ * @brief Optional hardware counters (cycles, instructions, cache and branch misses).
+ *
+ * Uses perf_event_open on Linux for the calling thread. Where the syscall is
+ * unavailable or not permitted (containers, perf_event_paranoid) available()
+ * is false and readings are zero.
+ */
+class PerfCounters {
+public:
+    static constexpr size_t kCount = 4;
+    static constexpr const char* kNames[kCount] = {"cycles", "instructions", "cache-misses", "branch-misses"};
+    using Reading = array<uint64_t, kCount>;
+
+private:
+    array<int, kCount> fds;
+
+public:
+    PerfCounters() {
+        fds.fill(-1);
+#ifdef __linux__
+        const uint64_t configs[kCount] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                          PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+        for (size_t i = 0; i < kCount; ++i) {
+            perf_event_attr attr{};
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.size = sizeof attr;
+            attr.config = configs[i];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fds[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+#endif
+    }
+    ~PerfCounters() {
+        for (int fd : fds) {
+            if (fd >= 0) ::close(fd);
+        }
+    }
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool available() const { return fds[0] >= 0; }
+
+    Reading read() const {
+        Reading r{};
+        for (size_t i = 0; i < kCount; ++i) {
+            uint64_t v = 0;
+            if (fds[i] >= 0 && ::read(fds[i], &v, sizeof v) == static_cast<ssize_t>(sizeof v)) r[i] = v;
+        }
+        return r;
+    }
+};
+
+// =========================
+// Benchmarks
+// =========================
+static double secondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Inline delivery versus OutboundMailQueue against a fake SMTP server with injected latency.
+int benchMail(int invoices) {
+    const auto connect = chrono::microseconds(1000);
+    const auto perMessage = chrono::microseconds(100);
+    auto program = DiscountProgram::compile({ DiscountRule::percent(10.0) });
+    auto makeService = [](shared_ptr<IEmailSender> emailer) {
+        return InvoiceService<>(make_shared<TextInvoiceRenderer>(), emailer, make_shared<NullLogger>(),
+                              make_shared<FixedRateTaxCalculator>(0.18));
+    };
+    auto runBatch = [&](InvoiceService<>& svc) {
+        for (int i = 0; i < invoices; ++i) {
+            Invoice inv({ {"ITEM-001", 3, 100.0}, {"ITEM-002", 1, 250.0} }, program,
+                        "customer" + to_string(i) + "@example.com");
+            svc.process(inv);
+        }
+    };
+
+    // Baseline: one connection per invoice, on the caller's thread.
+    struct InlineSender : IEmailSender {
+        shared_ptr<ISmtpTransport> transport;
+        explicit InlineSender(shared_ptr<ISmtpTransport> t) : transport(move(t)) {}
+        void send(const string& to, const string& content) override { transport->sendBatch({ MailJob{0, to, content} }); }
+    };
+    auto inlineServer = make_shared<FakeSmtpServer>(connect, perMessage);
+    InvoiceService<> inlineSvc = makeService(make_shared<InlineSender>(inlineServer));
+    auto start = chrono::steady_clock::now();
+    runBatch(inlineSvc);
+    double inlineSecs = secondsSince(start);
+
+    const string spoolPath = "bench-mail.spool";
+    remove(spoolPath.c_str());
+    auto queuedServer = make_shared<FakeSmtpServer>(connect, perMessage);
+    double enqueueSecs, drainSecs;
+    {
+        auto queue = make_shared<OutboundMailQueue>(queuedServer, spoolPath);
+        InvoiceService<> queuedSvc = makeService(queue);
+        start = chrono::steady_clock::now();
+        runBatch(queuedSvc);
+        enqueueSecs = secondsSince(start);
+        queue->flush();
+        drainSecs = secondsSince(start);
+    }
+    remove(spoolPath.c_str());
+
+    cout << "invoices=" << invoices << " smtp connect=" << connect.count() << "us per-message=" << perMessage.count() << "us\n"
+         << "inline:  " << invoices / inlineSecs << " invoices/s, " << inlineServer->getConnections() << " connections\n"
+         << "queued:  process() " << invoices / enqueueSecs << " invoices/s, delivered all in " << drainSecs * 1000.0
+         << " ms (" << invoices / drainSecs << " invoices/s), " << queuedServer->getConnections() << " connections\n";
+    return 0;
+}
+
+// Per-call cost of the old eager string building versus logEvent() on the async logger.
+int benchLog(int calls, int threads) {
+    const string email = "customer@example.com";
+    const double grand = 584.1;
+    // Times bursts that fit in one ring and settles between them, so the figure is
+    // the caller-side cost of a call rather than the cost of dropping it.
+    const int burst = 1024;
+    auto perCall = [&](auto&& body, auto&& settle) {
+        atomic<int64_t> busyNs{0};
+        vector<thread> pool;
+        for (int t = 0; t < threads; ++t) {
+            pool.emplace_back([&] {
+                for (int i = 0; i < calls; i += burst) {
+                    auto start = chrono::steady_clock::now();
+                    for (int j = i; j < min(calls, i + burst); ++j) body(j);
+                    busyNs += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+                    settle();
+                }
+            });
+        }
+        for (auto& th : pool) th.join();
+        return static_cast<double>(busyNs) / (static_cast<double>(calls) * threads);
+    };
+    auto noSettle = [] {};
+
+    NullLogger sink;
+    double eager = perCall([&](int) { sink.log("Invoice processed for " + email + " total=" + to_string(grand)); }, noSettle);
+
+    ofstream devnull("/dev/null");
+    uint64_t dropped;
+    double async;
+    {
+        StructuredLogger logger(devnull);
+        async = perCall([&](int i) { logEvent<LogLevel::Info>(logger, "Invoice processed", "email", email, "total", grand + i); },
+                        [&] { logger.flush(); });
+        dropped = logger.getDropped();
+    }
+    double runtimeOff;
+    {
+        StructuredLogger logger(devnull, LogLevel::Error);
+        runtimeOff = perCall([&](int i) { logEvent<LogLevel::Info>(logger, "Invoice processed", "email", email, "total", grand + i); }, noSettle);
+    }
+    double compiledOut;
+    {
+        StructuredLogger logger(devnull);
+        compiledOut = perCall([&](int i) { logEvent<LogLevel::Debug>(logger, "Invoice processed", "email", email, "total", grand + i); }, noSettle);
+    }
+
+    // Churn: short-lived threads and short-lived loggers must not leave ~1 MB rings behind.
+    const int churn = 64;
+    int64_t ringsBefore = StructuredLogger::ringsInProcess();
+    size_t threadRings;
+    {
+        StructuredLogger logger(devnull);
+        for (int round = 0; round < churn; ++round) {
+            thread([&] { logEvent<LogLevel::Info>(logger, "churn", "round", round); }).join();
+            StructuredLogger shortLived(devnull);
+            logEvent<LogLevel::Info>(shortLived, "churn", "round", round);
+        }
+        auto deadline = chrono::steady_clock::now() + chrono::seconds(2);
+        while (logger.getRings() > 0 && chrono::steady_clock::now() < deadline) this_thread::sleep_for(chrono::milliseconds(1));
+        threadRings = logger.getRings();
+    }
+    // Thread caches hold rings weakly, so a destroyed logger's rings are freed with it.
+    int64_t ringsLeft = StructuredLogger::ringsInProcess() - ringsBefore;
+
+    // Values that need quoting: spaces, '=', quotes, and a newline that must not start a forged line.
+    ostringstream captured;
+    {
+        StructuredLogger logger(captured);
+        logEvent<LogLevel::Warn>(logger, "Invoice rejected", "email", string("a b=c \"q\"\nlevel=ERROR msg=forged"), "note", string());
+        logger.log("plain \"text\"\nsecond line");
+        logger.flush();
+    }
+    const string logged = captured.str();
+    const bool escaped = count(logged.begin(), logged.end(), '\n') == 2 &&
+                         logged.find(R"(email="a b=c \"q\"\nlevel=ERROR msg=forged" note="")") != string::npos &&
+                         logged.find(R"(msg="plain \"text\"\nsecond line")") != string::npos;
+
+    cout << "threads=" << threads << " calls/thread=" << calls << " (ns per call on the calling thread)\n"
+         << "eager string + to_string:   " << eager << "\n"
+         << "logEvent -> StructuredLogger: " << async << " (dropped " << dropped << " on full rings)\n"
+         << "logEvent, runtime-disabled:   " << runtimeOff << "\n"
+         << "logEvent, compiled out:       " << compiledOut << "\n"
+         << "churn: " << churn << " exited threads leave " << threadRings << " rings, " << churn
+         << " destroyed loggers leave " << ringsLeft << "\n"
+         << "escaping: " << (escaped ? "2 lines, values quoted" : "MISMATCH") << "\n" << logged;
+    return escaped && threadRings == 0 && ringsLeft == 0 ? 0 : 1;
+}
+
+// Generates a synthetic CSV of roughly the requested size and reports parse throughput.
+int benchIngest(size_t megabytes) {
+    const string path = "bench-line-items.csv";
+    {
+        ofstream out(path, ios::binary);
+        out << "invoice_id,sku,quantity,unit_price\n";
+        mt19937 rng(42);
+        const size_t target = megabytes << 20;
+        size_t written = 0;
+        char line[96];
+        for (uint64_t invoice = 1; written < target; ++invoice) {
+            int lines = 1 + static_cast<int>(rng() % 8);
+            for (int l = 0; l < lines; ++l) {
+                int n = snprintf(line, sizeof line, "%llu,SKU-%05u,%u,%u.%02u\n", static_cast<unsigned long long>(invoice),
+                                 static_cast<unsigned>(rng() % 20000), 1 + static_cast<unsigned>(rng() % 9),
+                                 static_cast<unsigned>(rng() % 500), static_cast<unsigned>(rng() % 100));
+                out.write(line, n);
+                written += static_cast<size_t>(n);
+            }
+        }
+    }
+    MappedFile probe(path);
+    const double gigabytes = static_cast<double>(probe.size()) / 1e9;
+    cout << "file=" << path << " size=" << probe.size() / (1 << 20) << " MiB\n";
+    for (unsigned threads : {1u, 2u, 4u, max(1u, thread::hardware_concurrency())}) {
+        auto start = chrono::steady_clock::now();
+        LineItemColumns cols = LineItemIngestor::ingestCsv(path, threads);
+        double secs = secondsSince(start);
+        cout << "threads=" << threads << " lines=" << cols.lineCount() << " invoices=" << cols.invoiceCount()
+             << " skus=" << cols.skus.size() << " " << gigabytes / secs << " GB/s\n";
+    }
+    remove(path.c_str());
+    return 0;
+}
+
+// Prices a synthetic month of invoices on every core and aggregates them on the fly.
+int benchReport(uint64_t invoices, unsigned threads) {
+    auto program = DiscountProgram::compile({ DiscountRule::buyXGetY("SKU-00007", 2, 1), DiscountRule::skuPercent("SKU-00042", 15.0),
+                                              DiscountRule::tiered({ {200.0, 5.0}, {1000.0, 10.0} }, Currency::USD), DiscountRule::flat(20.0, Currency::USD, true) });
+    // Five rates, so larger invoices carry more distinct rates than TaxBuckets holds inline.
+    vector<TaxTable::SkuRow> categories;
+    for (int i = 0; i < 5000; ++i) {
+        const char* category = i % 3 == 0 ? "essential" : i % 5 == 0 ? "luxury" : i % 7 == 0 ? "reduced" : i % 11 == 0 ? "exempt" : nullptr;
+        if (category) categories.push_back({ "SKU-" + string(5 - to_string(i).size(), '0') + to_string(i), category });
+    }
+    auto tax = make_shared<TaxEngine>(TaxTable::build({ {"IN", "standard", 0.18}, {"IN", "essential", 0.05}, {"IN", "luxury", 0.28},
+                                                        {"IN", "reduced", 0.12}, {"IN", "exempt", 0.0} }, categories, 0.18));
+    InvoiceService svc(make_shared<TextInvoiceRenderer>(), make_shared<SmtpEmailSender>(), make_shared<NullLogger>(), tax);
+
+    // A pool of distinct invoices, cycled, so generation cost stays out of the timing.
+    mt19937 rng(7);
+    vector<Invoice> pool;
+    char sku[16];
+    for (int i = 0; i < 4096; ++i) {
+        vector<LineItem> items;
+        for (int l = 0, n = 1 + static_cast<int>(rng() % 8); l < n; ++l) {
+            snprintf(sku, sizeof sku, "SKU-%05u", static_cast<unsigned>(rng() % 5000));
+            items.push_back({ sku, 1 + static_cast<int>(rng() % 5), 1.0 + (rng() % 20000) / 100.0 });
+        }
+        pool.emplace_back(move(items), program, "", "IN");
+    }
+
+    threads = max(1u, threads);
+    ReportAggregator report(threads, Currency::USD);
+    auto start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            ReportAggregator::Shard& shard = report.shard(t);
+            for (uint64_t i = t; i < invoices; i += threads) {
+                const Invoice& inv = pool[i % pool.size()];
+                shard.add(inv, svc.compute(inv));
+            }
+        });
+    }
+    for (auto& w : workers) w.join();
+    double priceSecs = secondsSince(start);
+    start = chrono::steady_clock::now();
+    RevenueReport month = report.merge();
+    double mergeSecs = secondsSince(start);
+
+    cout << "invoices=" << invoices << " threads=" << threads << " price+aggregate=" << priceSecs << " s ("
+         << invoices / priceSecs << " invoices/s) merge=" << mergeSecs * 1000.0 << " ms\n";
+    month.print(cout, 5);
+    double byRate = 0.0;
+    for (const auto& b : month.taxByRate) byRate += b.tax;
+    cout << "tax by rate sums to " << byRate << " of " << month.tax << " across " << month.taxByRate.size() << " rates\n";
+    return 0;
+}
+
+// Archives priced invoices, checks every one reads back and re-renders identically, then times size, lookup and scan.
+int benchArchive(size_t invoices, size_t perBlock) {
+    auto program = DiscountProgram::compile({ DiscountRule::skuPercent("SKU-00042", 15.0), DiscountRule::percent(5.0) });
+    auto tax = make_shared<TaxEngine>(TaxTable::build({ {"IN", "standard", 0.18}, {"IN", "essential", 0.05} },
+                                                      { {"SKU-00001", "essential"}, {"SKU-00002", "essential"} }, 0.18));
+    InvoiceService svc(make_shared<TextInvoiceRenderer>(), make_shared<NullEmailSender>(), make_shared<NullLogger>(), tax);
+    TextInvoiceRenderer renderer;
+
+    mt19937 rng(11);
+    vector<Invoice> batch;
+    vector<InvoiceResult> results;
+    char sku[16];
+    size_t csvBytes = 0;
+    for (size_t i = 0; i < invoices; ++i) {
+        vector<LineItem> items;
+        for (int l = 0, n = 1 + static_cast<int>(rng() % 8); l < n; ++l) {
+            snprintf(sku, sizeof sku, "SKU-%05u", static_cast<unsigned>(rng() % 5000));
+            items.push_back({ sku, 1 + static_cast<int>(rng() % 5), 1.0 + (rng() % 20000) / 100.0 });
+            char line[96];
+            csvBytes += static_cast<size_t>(snprintf(line, sizeof line, "%zu,%s,%d,%.2f\n", i + 1, sku, items.back().quantity,
+                                                     items.back().unitPrice));
+        }
+        batch.emplace_back(move(items), program, "customer" + to_string(i % 1000) + "@example.com", "IN");
+        results.push_back(svc.compute(batch.back()));
+    }
+
+    const string path = "bench-invoices.arc";
+    auto start = chrono::steady_clock::now();
+    {
+        InvoiceArchiveWriter writer(path, perBlock);
+        for (size_t i = 0; i < invoices; ++i) writer.append(i + 1, batch[i], results[i]);
+    }
+    const double writeSecs = secondsSince(start);
+    InvoiceArchiveReader reader(path);
+    const size_t archiveBytes = reader.fileSize();
+
+    // Round trip: every id found, items and totals exact, and the re-render matches the original render.
+    size_t mismatched = 0;
+    ArchivedInvoice found;
+    for (size_t i = 0; i < invoices; ++i) {
+        const InvoiceResult& r = results[i];
+        const bool same = reader.find(i + 1, found) && found.email == batch[i].getEmail() && found.items.size() == batch[i].getItems().size() &&
+                          equal(found.items.begin(), found.items.end(), batch[i].getItems().begin(), [](const LineItem& a, const LineItem& b) {
+                              return a.sku == b.sku && a.quantity == b.quantity && a.unitPrice == b.unitPrice && a.currency == b.currency;
+                          }) &&
+                          found.result.subtotal == r.subtotal && found.result.discount == r.discount && found.result.tax == r.tax &&
+                          found.result.grandTotal == r.grandTotal &&
+                          found.render(renderer) == renderer.render(batch[i], r.subtotal, r.discount, r.tax, r.grandTotal);
+        if (!same) ++mismatched;
+    }
+    if (reader.find(invoices + 1, found)) ++mismatched;
+
+    vector<double> lookupUs;
+    const size_t probes = min<size_t>(invoices, 20000);
+    for (size_t i = 0; i < probes; ++i) {
+        const uint64_t id = 1 + rng() % invoices;
+        auto t0 = chrono::steady_clock::now();
+        if (!reader.find(id, found)) ++mismatched;
+        lookupUs.push_back(secondsSince(t0) * 1e6);
+    }
+    sort(lookupUs.begin(), lookupUs.end());
+    start = chrono::steady_clock::now();
+    size_t scanned = 0;
+    reader.forEach([&](const ArchivedInvoice&) { ++scanned; });
+    const double scanSecs = secondsSince(start);
+
+    cout << "invoices=" << invoices << " per block=" << perBlock << " blocks=" << reader.blockCount() << " write=" << writeSecs * 1e3 << " ms\n"
+         << "size: " << archiveBytes << " bytes (" << static_cast<double>(archiveBytes) / invoices << " B/invoice), line items as CSV "
+         << csvBytes << " bytes\n"
+         << "lookup by id: p50 " << lookupUs[lookupUs.size() / 2] << " us  p99 " << lookupUs[lookupUs.size() * 99 / 100] << " us\n"
+         << "full scan: " << scanned / scanSecs << " invoices/s\n"
+         << "round trip: " << invoices - min(mismatched, invoices) << "/" << invoices << " identical\n";
+    remove(path.c_str());
+    return mismatched == 0 && scanned == invoices ? 0 : 1;
+}
+
+// Times each InvoiceService stage on its own across invoice sizes and discount counts.
+int benchPipeline(size_t maxLines) {
+    auto tax = make_shared<TaxEngine>(TaxTable::build({ {"IN", "standard", 0.18}, {"IN", "essential", 0.05} },
+                                                      { {"SKU-00001", "essential"}, {"SKU-00002", "essential"} }, 0.18));
+    TextInvoiceRenderer renderer;
+    const string spoolPath = "bench-pipeline.spool";
+    remove(spoolPath.c_str());
+    OutboundMailQueue::Options mailOpts;
+    mailOpts.capacity = 1 << 16;
+    auto mail = make_shared<OutboundMailQueue>(make_shared<FakeSmtpServer>(chrono::microseconds(0), chrono::microseconds(0)), spoolPath, mailOpts);
+    ofstream devnull("/dev/null");
+    auto logger = make_shared<StructuredLogger>(devnull);
+    InvoiceService svc(make_shared<TextInvoiceRenderer>(), mail, logger, tax);
+    PerfCounters perf;
+
+    auto makeProgram = [](int rules) {
+        vector<DiscountRule> r;
+        for (int i = 0; i < rules; ++i) {
+            string sku = "SKU-0000" + to_string(i % 10);
+            switch (i % 4) {
+                case 0: r.push_back(DiscountRule::percent(5.0)); break;
+                case 1: r.push_back(DiscountRule::buyXGetY(sku, 2, 1)); break;
+                case 2: r.push_back(DiscountRule::skuPercent(sku, 10.0)); break;
+                default: r.push_back(DiscountRule::tiered({ {100.0, 2.0}, {1000.0, 4.0} }, Currency::USD)); break;
+            }
+        }
+        return rules ? DiscountProgram::compile(r) : nullptr;
+    };
+
+    cout << "stage     lines   rules   ns/line      p50(us)     p90(us)     p99(us)  allocs/inv";
+    if (perf.available()) {
+        for (auto* name : PerfCounters::kNames) cout << "  " << name << "/line";
+    }
+    cout << "\n";
+    if (!perf.available()) cout << "(hardware counters unavailable: perf_event_open not permitted here)\n";
+    if (!kCountsAllocations) cout << "(allocation counts off: build with -DINVOICE_COUNT_ALLOCATIONS)\n";
+
+    mt19937 rng(11);
+    char sku[16];
+    for (size_t lines = 1; lines <= maxLines; lines *= 10) {
+        vector<LineItem> items;
+        for (size_t l = 0; l < lines; ++l) {
+            snprintf(sku, sizeof sku, "SKU-%05u", static_cast<unsigned>(rng() % 5000));
+            items.push_back({ sku, 1 + static_cast<int>(rng() % 5), 1.0 + (rng() % 20000) / 100.0 });
+        }
+        // At least 100 samples, so p99 is an observed sample rather than the maximum of a handful.
+        const int iterations = static_cast<int>(max<size_t>(100, min<size_t>(2000, 2000000 / lines)));
+        for (int rules : {0, 1, 4, 16}) {
+            if (rules && lines != 100 && lines != maxLines) continue;  // discount sweep only on two sizes
+            Invoice invoice(items, makeProgram(rules), "customer@example.com", "IN");
+            InvoiceResult result = svc.compute(invoice);
+            string rendered = renderer.render(invoice, result.subtotal, result.discount, result.tax, result.grandTotal);
+
+            auto measure = [&](const char* stage, auto&& body) {
+                vector<double> samples(iterations);
+                uint64_t allocs = allocationCount();
+                PerfCounters::Reading before = perf.read();
+                for (int i = 0; i < iterations; ++i) {
+                    auto start = chrono::steady_clock::now();
+                    body();
+                    samples[i] = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+                }
+                PerfCounters::Reading after = perf.read();
+                allocs = allocationCount() - allocs;
+                sort(samples.begin(), samples.end());
+                auto pct = [&](double q) { return samples[min(samples.size() - 1, static_cast<size_t>(q * samples.size()))]; };
+                const double perLine = 1.0 / (static_cast<double>(iterations) * lines);
+                printf("%-8s %7zu %6d %9.1f %11.2f %11.2f %11.2f", stage, lines, rules, pct(0.5) * 1000.0 / lines, pct(0.5), pct(0.9),
+                       pct(0.99));
+                if (kCountsAllocations) printf(" %10.1f", static_cast<double>(allocs) / iterations);
+                else printf(" %10s", "-");
+                if (perf.available()) {
+                    for (size_t c = 0; c < PerfCounters::kCount; ++c) printf(" %14.2f", (after[c] - before[c]) * perLine);
+                }
+                printf("\n");
+            };
+            measure("compute", [&] { result = svc.compute(invoice); });
+            if (rules == 0) {
+                measure("render", [&] { rendered = renderer.render(invoice, result.subtotal, result.discount, result.tax, result.grandTotal); });
+                measure("email", [&] { mail->send(invoice.getEmail(), rendered); });
+                measure("log", [&] { logEvent<LogLevel::Info>(*logger, "Invoice processed", "email", invoice.getEmail(), "total", result.grandTotal); });
+                mail->flush();
+                logger->flush();
+            }
+            fflush(stdout);
+        }
+    }
+    mail.reset();
+    remove(spoolPath.c_str());
+    return 0;
+}
+
+// Dynamic InvoiceService<> versus the statically composed variant on the batch path.
+int benchCompose(size_t invoices, unsigned threads, int rounds) {
+    auto program = DiscountProgram::compile({ DiscountRule::percent(10.0) });
+    vector<Invoice> batch;
+    for (size_t i = 0; i < invoices; ++i) {
+        batch.emplace_back(vector<LineItem>{ {"ITEM-001", 3, 100.0}, {"ITEM-002", 1, 250.0 + i % 7}, {"ITEM-003", 2, 9.5} },
+                           program, "customer@example.com");
+    }
+    InvoiceService<> dynamicSvc(make_shared<TextInvoiceRenderer>(), make_shared<NullEmailSender>(), make_shared<NullLogger>(),
+                                make_shared<FixedRateTaxCalculator>(0.18));
+    InvoiceService<TextInvoiceRenderer, NullEmailSender, NullLogger, FixedRateTaxCalculator> staticSvc(
+        TextInvoiceRenderer{}, NullEmailSender{}, NullLogger{}, FixedRateTaxCalculator(0.18));
+
+    threads = max(1u, threads);
+    // Per-thread sums, added up after join into `total`; both variants must arrive at the same one.
+    auto run = [&](auto& svc, bool fullPipeline, double& total) {
+        auto start = chrono::steady_clock::now();
+        vector<thread> pool;
+        vector<double> sinks(threads);
+        for (unsigned t = 0; t < threads; ++t) {
+            pool.emplace_back([&, t] {
+                double local = 0.0;
+                for (int r = 0; r < rounds; ++r) {
+                    if (fullPipeline) {
+                        for (const auto& res : svc.processBatch(batch)) local += res.grandTotal;
+                    } else {
+                        for (const auto& inv : batch) local += svc.compute(inv).grandTotal;
+                    }
+                }
+                sinks[t] = local;
+            });
+        }
+        for (auto& th : pool) th.join();
+        const double elapsed = secondsSince(start);
+        total = 0.0;
+        for (double s : sinks) total += s;
+        return elapsed * 1e9 / (static_cast<double>(invoices) * rounds * threads);
+    };
+
+    // Best of three interleaved runs, so ordering and warm-up do not favour either variant.
+    double dynCompute = 1e300, stCompute = 1e300, dynFull = 1e300, stFull = 1e300;
+    double sums[4];
+    for (int trial = 0; trial < 3; ++trial) {
+        dynCompute = min(dynCompute, run(dynamicSvc, false, sums[0]));
+        stCompute = min(stCompute, run(staticSvc, false, sums[1]));
+        dynFull = min(dynFull, run(dynamicSvc, true, sums[2]));
+        stFull = min(stFull, run(staticSvc, true, sums[3]));
+    }
+    cout << "invoices=" << invoices << " rounds=" << rounds << " threads=" << threads << " (ns per invoice)\n"
+         << "compute:      dynamic " << dynCompute << "  static " << stCompute << "  speedup " << dynCompute / stCompute << "x\n"
+         << "processBatch: dynamic " << dynFull << "  static " << stFull << "  speedup " << dynFull / stFull << "x\n";
+    if (sums[0] != sums[1] || sums[2] != sums[3] || sums[0] != sums[2]) {
+        cout << "MISMATCH: grand totals " << sums[0] << " / " << sums[1] << " / " << sums[2] << " / " << sums[3] << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+// Subscription-style rendering: many invoices drawn from a few templates.
+int benchRender(size_t invoices, size_t templates, size_t linesPerInvoice) {
+    mt19937 rng(5);
+    vector<vector<LineItem>> shapes(max<size_t>(1, templates));
+    char sku[16];
+    for (auto& items : shapes) {
+        for (size_t l = 0; l < linesPerInvoice; ++l) {
+            snprintf(sku, sizeof sku, "PLAN-%04u", static_cast<unsigned>(rng() % 1000));
+            items.push_back({ sku, 1 + static_cast<int>(rng() % 3), (rng() % 10000) / 100.0 });
+        }
+    }
+    vector<Invoice> batch;
+    for (size_t i = 0; i < invoices; ++i) batch.emplace_back(shapes[i % shapes.size()], nullptr, "user" + to_string(i) + "@example.com");
+
+    TextInvoiceRenderer plain;
+    CachingInvoiceRenderer cached;
+    auto time = [&](IInvoiceRenderer& r) {
+        size_t bytes = 0;
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < batch.size(); ++i) bytes += r.render(batch[i], 100.0 + i, 10.0, 16.2 + i * 0.01, 106.2 + i).size();
+        return make_pair(secondsSince(start) * 1e9 / batch.size(), bytes);
+    };
+    for (size_t i = 0; i < min<size_t>(batch.size(), 1000); ++i) {
+        if (plain.render(batch[i], 1.5 * i, 0.1, 1e6 + i, 123456789.0) != cached.render(batch[i], 1.5 * i, 0.1, 1e6 + i, 123456789.0)) {
+            cerr << "CachingInvoiceRenderer output differs for invoice " << i << "\n";
+            return 1;
+        }
+    }
+    auto p = time(plain);
+    auto c = time(cached);
+    cout << "invoices=" << invoices << " templates=" << templates << " lines=" << linesPerInvoice << "\n"
+         << "TextInvoiceRenderer:    " << p.first << " ns/invoice\n"
+         << "CachingInvoiceRenderer: " << c.first << " ns/invoice (hits " << cached.getHits() << ", misses " << cached.getMisses()
+         << ")  speedup " << p.first / c.first << "x\n";
+    return p.second == c.second ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && string(argv[1]) == "bench-pipeline") return benchPipeline(argc > 2 ? stoul(argv[2]) : 100000);
+    if (argc > 1 && string(argv[1]) == "bench-compose") return benchCompose(argc > 2 ? stoul(argv[2]) : 10000, argc > 3 ? stoul(argv[3]) : 1, 20);
+    if (argc > 1 && string(argv[1]) == "bench-render") return benchRender(argc > 2 ? stoul(argv[2]) : 200000, argc > 3 ? stoul(argv[3]) : 50, argc > 4 ? stoul(argv[4]) : 10);
+    if (argc > 1 && string(argv[1]) == "bench-mail") return benchMail(argc > 2 ? stoi(argv[2]) : 500);
+    if (argc > 1 && string(argv[1]) == "bench-ingest") return benchIngest(argc > 2 ? stoul(argv[2]) : 256);
+    if (argc > 1 && string(argv[1]) == "bench-archive") return benchArchive(argc > 2 ? stoul(argv[2]) : 100000, argc > 3 ? stoul(argv[3]) : 64);
+    if (argc > 1 && string(argv[1]) == "bench-report") return benchReport(argc > 2 ? stoull(argv[2]) : 10000000, argc > 3 ? stoul(argv[3]) : thread::hardware_concurrency());
+    if (argc > 1 && string(argv[1]) == "bench-log") return benchLog(argc > 2 ? stoi(argv[2]) : 1000000, argc > 3 ? stoi(argv[3]) : 1);
+
+    // DIP: Create concrete dependencies; the caching renderer prints exactly what TextInvoiceRenderer does
+    auto renderer = make_shared<CachingInvoiceRenderer>();
+    // process() only enqueues; delivery happens on the queue's workers
+    char spoolDir[] = "/tmp/invoice-demo-XXXXXX";
+    if (!mkdtemp(spoolDir)) throw runtime_error("Cannot create a directory for the mail spool");
+    const string spoolPath = string(spoolDir) + "/outbound-mail.spool";
+    auto emailer = make_shared<OutboundMailQueue>(
+        make_shared<EmailSenderTransport>(make_shared<SmtpEmailSender>()), spoolPath);
+    auto logger = make_shared<StructuredLogger>(cout);
+    auto tax_calc = make_shared<TaxEngine>(TaxTable::build(
+        { {"IN", "standard", 0.18}, {"IN", "essential", 0.05}, {"US-CA", "standard", 0.0725} },
+        { {"ITEM-001", "standard"}, {"ITEM-002", "standard"} },
+        0.18));
+
+    // DIP: Inject dependencies into the high-level service
+    InvoiceService svc(renderer, emailer, logger, tax_calc);
+
+    // FX quotes as units per USD; unquoted currencies are rejected if an invoice needs them
+    array<double, kCurrencyCount> quotes{};
+    quotes[static_cast<size_t>(Currency::USD)] = 1.0;
+    quotes[static_cast<size_t>(Currency::EUR)] = 0.92;
+    quotes[static_cast<size_t>(Currency::GBP)] = 0.79;
+    quotes[static_cast<size_t>(Currency::INR)] = 83.1;
+    svc.setFxRates(make_shared<FxRateProvider>(quotes));
+
+    vector<LineItem> items = { {"ITEM-001", 3, 100.0}, {"ITEM-002", 1, 250.0} };
+    
+    // Compile the discount rules once; the program can be shared by every invoice in a batch
+    auto discounts = DiscountProgram::compile({ DiscountRule::percent(10.0) });
+
+    string email = "customer@example.com";
+
+    Invoice invoice(move(items), move(discounts), move(email), "IN");
+    string rendered = svc.process(invoice);
+    emailer->flush();
+    logger->flush();
+    cout << rendered << endl;
+
+    // Cart editing: each change adjusts running totals instead of re-running process()
+    IncrementalInvoice cart(invoice.getDiscounts(), tax_calc->snapshot(), invoice.getRegion());
+    for (const auto& it : invoice.getItems()) cart.setLine(it.sku, it.quantity, it.unitPrice);
+    cart.setQuantity("ITEM-002", 2);
+    cout << "Cart total after ITEM-002 x2: " << cart.totals().grandTotal << endl;
+
+    // Flat amounts carry a currency: a USD "20 off" is refused for a EUR order rather than taken as 20 EUR
+    try {
+        IncrementalInvoice eurCart(DiscountProgram::compile({ DiscountRule::flat(20.0, Currency::USD) }), tax_calc->snapshot(),
+                                   invoice.getRegion(), Currency::EUR);
+    } catch (const invalid_argument& e) {
+        cout << "EUR cart rejected: " << e.what() << endl;
+    }
+    remove(spoolPath.c_str());
+    rmdir(spoolDir);
     return 0;
 }
@@ -2,9 +2,57 @@
 // Refactored to follow ISP and LSP.
 
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <stdexcept>
 #include <memory>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <deque>
+#include <map>
+#include <set>
+#include <cmath>
+#include <numeric>
+#include <limits>
+#include <array>
+#include <queue>
+#include <utility>
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <cstdio>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MEDIA_HAVE_X86_SIMD 1
+#else
+#define MEDIA_HAVE_X86_SIMD 0
+#endif
 
 using namespace std;
 
@@ -28,48 +76,4082 @@ public:
     virtual void record(const string& destination) = 0;
 };
 
+class ISeekable {
+public:
+    virtual ~ISeekable() = default;
+    virtual chrono::nanoseconds seek(chrono::nanoseconds position) = 0;
+};
+
 class ILiveStreamable {
 public:
-    virtual ~ILiveStreamable() = default;
-    virtual void startStreaming(const string& streamUrl) = 0;
-    virtual void stopStreaming() = 0;
+    virtual ~ILiveStreamable() = default;
+    virtual void startStreaming(const string& streamUrl) = 0;
+    virtual void stopStreaming() = 0;
+};
+
+// =========================
+// Local HTTP stand-in
+// =========================
+// Throws with errno text, the way every POSIX failure below is reported.
+[[noreturn]] inline void throwErrno(const string& what) {
+    throw runtime_error(what + ": " + strerror(errno));
+}
+
+// Closes a file descriptor on scope exit.
+class FileDescriptor {
+    int fd{-1};
+public:
+    FileDescriptor() = default;
+    explicit FileDescriptor(int f) : fd(f) {}
+    ~FileDescriptor() { reset(); }
+    FileDescriptor(FileDescriptor&& o) noexcept : fd(exchange(o.fd, -1)) {}
+    FileDescriptor& operator=(FileDescriptor&& o) noexcept {
+        if (this != &o) {
+            reset();
+            fd = exchange(o.fd, -1);
+        }
+        return *this;
+    }
+    void reset() {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+    }
+    int get() const { return fd; }
+    explicit operator bool() const { return fd >= 0; }
+};
+
+inline void writeAll(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) throwErrno("write");
+        data += n;
+        len -= static_cast<size_t>(n);
+    }
+}
+
+/**
+ * @brief Minimal HTTP/1.1 file server on 127.0.0.1, standing in for a CDN.
+ *
+ * Serves files under a root directory for GET and HEAD, honours single
+ * "Range: bytes=a-b" requests with 206 responses, and sends bodies with
+ * sendfile(). One thread per connection, one request per connection.
+ * bytesPerSecond > 0 throttles every response body to that rate. The
+ * destructor shuts down every open client socket before it waits for the
+ * connection threads, so a slow or idle client cannot hold up shutdown.
+ */
+class LocalHttpServer {
+private:
+    string root;
+    FileDescriptor listener;
+    uint16_t port{0};
+    atomic<bool> running{true};
+    atomic<uint64_t> throttleBytesPerSecond{0};
+    thread acceptor;
+    mutex connMtx;
+    condition_variable connDone;
+    size_t activeConnections{0};  // guarded by connMtx; connection threads are detached and counted
+    set<int> clients;             // guarded by connMtx; open client sockets
+
+    static bool readHeaders(int fd, string& headers) {
+        char buf[1024];
+        while (headers.find("\r\n\r\n") == string::npos) {
+            ssize_t n = ::recv(fd, buf, sizeof buf, 0);
+            if (n <= 0) return false;
+            headers.append(buf, static_cast<size_t>(n));
+            if (headers.size() > 16384) return false;
+        }
+        return true;
+    }
+
+    void respond(int fd, int status, const char* reason, const string& extra = "") {
+        string head = "HTTP/1.1 " + to_string(status) + " " + reason + "\r\nContent-Length: 0\r\nConnection: close\r\n" + extra + "\r\n";
+        writeAll(fd, head.data(), head.size());
+    }
+
+    // The throttle is re-read every ~20 ms of sending, so a bandwidth change applies to responses already in flight.
+    void sendBody(int sock, int file, off_t offset, size_t length) {
+        auto due = chrono::steady_clock::now();
+        size_t sent = 0;
+        while (sent < length && running) {
+            const uint64_t rate = throttleBytesPerSecond.load();
+            size_t want = length - sent;
+            if (rate) want = min<size_t>(want, max<uint64_t>(rate / 50, 1));
+            ssize_t n = ::sendfile(sock, file, &offset, want);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return;  // client went away
+            sent += static_cast<size_t>(n);
+            if (rate) {
+                due = max(due, chrono::steady_clock::now() - chrono::milliseconds(20)) +  // no catching up after a slow stretch
+                      chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(static_cast<double>(n) / rate));
+                this_thread::sleep_until(due);
+            }
+        }
+    }
+
+    void serve(const FileDescriptor& client) {
+        try {
+            string headers;
+            if (!readHeaders(client.get(), headers)) return;
+            istringstream req(headers);
+            string method, target, version;
+            req >> method >> target >> version;
+            if (method != "GET" && method != "HEAD") return respond(client.get(), 405, "Method Not Allowed");
+            if (target.find("..") != string::npos || target.empty() || target[0] != '/') return respond(client.get(), 400, "Bad Request");
+
+            FileDescriptor file(::open((root + target).c_str(), O_RDONLY));
+            struct stat st;
+            if (!file || fstat(file.get(), &st) != 0 || !S_ISREG(st.st_mode)) return respond(client.get(), 404, "Not Found");
+            const uint64_t size = static_cast<uint64_t>(st.st_size);
+            // Validators a resuming client checks its partial file against.
+            const string etag = "\"" + to_string(size) + "-" + to_string(st.st_mtim.tv_sec) + "." + to_string(st.st_mtim.tv_nsec) + "\"";
+            char modified[64];
+            tm gmt;
+            strftime(modified, sizeof modified, "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&st.st_mtim.tv_sec, &gmt));
+
+            uint64_t first = 0, last = size ? size - 1 : 0;
+            bool partial = false;
+            size_t r = headers.find("\r\nRange: bytes=");
+            size_t ifRange = headers.find("\r\nIf-Range: ");
+            if (ifRange != string::npos && headers.compare(ifRange + 12, etag.size() + 2, etag + "\r\n") != 0) {
+                r = string::npos;  // changed since the client's partial copy: send all of it
+            }
+            if (r != string::npos) {
+                unsigned long long a = 0, b = 0;
+                int got = sscanf(headers.c_str() + r + 15, "%llu-%llu", &a, &b);
+                if (got >= 1) {
+                    if (a >= size || (got == 2 && b < a)) {
+                        return respond(client.get(), 416, "Range Not Satisfiable", "Content-Range: bytes */" + to_string(size) + "\r\n");
+                    }
+                    first = a;
+                    last = got == 2 ? min<uint64_t>(b, size - 1) : size - 1;
+                    partial = true;
+                }
+            }
+            const uint64_t length = size ? last - first + 1 : 0;
+            string head = string("HTTP/1.1 ") + (partial ? "206 Partial Content" : "200 OK") + "\r\nContent-Length: " + to_string(length) +
+                          "\r\nAccept-Ranges: bytes\r\nConnection: close\r\nETag: " + etag + "\r\nLast-Modified: " + modified + "\r\n";
+            if (partial) head += "Content-Range: bytes " + to_string(first) + "-" + to_string(last) + "/" + to_string(size) + "\r\n";
+            head += "\r\n";
+            writeAll(client.get(), head.data(), head.size());
+            if (method == "GET") sendBody(client.get(), file.get(), static_cast<off_t>(first), length);
+        } catch (const exception&) {
+            // A failed connection only affects that client.
+        }
+    }
+
+    void acceptLoop() {
+        while (running) {
+            int c = ::accept(listener.get(), nullptr, nullptr);
+            if (c < 0) {
+                if (errno == EINTR) continue;
+                break;  // listener shut down
+            }
+            lock_guard<mutex> lock(connMtx);
+            ++activeConnections;
+            clients.insert(c);
+            thread([this, c] {
+                {
+                    FileDescriptor client(c);
+                    serve(client);
+                    lock_guard<mutex> lock(connMtx);
+                    clients.erase(c);  // before the close, so the destructor never shuts down a reused descriptor
+                }
+                lock_guard<mutex> done(connMtx);
+                if (--activeConnections == 0) connDone.notify_all();  // under the lock: the destructor may run right after
+            }).detach();
+        }
+    }
+
+public:
+    explicit LocalHttpServer(string rootDir) : root(move(rootDir)) {
+        listener = FileDescriptor(::socket(AF_INET, SOCK_STREAM, 0));
+        if (!listener) throwErrno("socket");
+        int one = 1;
+        setsockopt(listener.get(), SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (::bind(listener.get(), reinterpret_cast<sockaddr*>(&addr), sizeof addr) != 0) throwErrno("bind");
+        if (::listen(listener.get(), 128) != 0) throwErrno("listen");
+        socklen_t len = sizeof addr;
+        getsockname(listener.get(), reinterpret_cast<sockaddr*>(&addr), &len);
+        port = ntohs(addr.sin_port);
+        acceptor = thread([this] { acceptLoop(); });
+    }
+
+    ~LocalHttpServer() {
+        running = false;
+        ::shutdown(listener.get(), SHUT_RDWR);
+        acceptor.join();
+        unique_lock<mutex> lock(connMtx);
+        for (int c : clients) ::shutdown(c, SHUT_RDWR);  // wakes handlers blocked in recv() or sendfile()
+        connDone.wait(lock, [&] { return activeConnections == 0; });
+    }
+
+    void setThrottle(uint64_t bytesPerSecond) { throttleBytesPerSecond = bytesPerSecond; }
+    uint16_t getPort() const { return port; }
+    string url(const string& path) const { return "http://127.0.0.1:" + to_string(port) + "/" + path; }
+};
+
+// =========================
+// Media metrics
+// =========================
+/**
+ * @brief HDR-style latency histogram: 32 linear sub-buckets per power of two.
+ *
+ * Any value from 1 ns to about 9 hours lands in a bucket no wider than 1/32
+ * of its value, so percentiles are within ~3% at every scale, in a fixed
+ * 10 KiB. One thread records; others may read concurrently (relaxed loads,
+ * so a snapshot can be a few samples behind).
+ */
+class HdrHistogram {
+public:
+    static constexpr unsigned kSubBits = 5;
+    static constexpr size_t kBuckets = size_t(41) << kSubBits;
+
+    static size_t index(uint64_t v) {
+        if (v < (1u << kSubBits)) return static_cast<size_t>(v);
+        const unsigned shift = 63 - __builtin_clzll(v) - kSubBits;
+        return min<size_t>((size_t(shift + 1) << kSubBits) + ((v >> shift) & ((1u << kSubBits) - 1)), kBuckets - 1);
+    }
+    static uint64_t upperBound(size_t i) {
+        if (i < (1u << kSubBits)) return i;
+        const unsigned shift = static_cast<unsigned>(i >> kSubBits) - 1;
+        return ((uint64_t((1u << kSubBits) + (i & ((1u << kSubBits) - 1))) + 1) << shift) - 1;
+    }
+
+    // Single writer.
+    void record(uint64_t v) {
+        bump(counts[index(v)], 1);
+        bump(count, 1);
+        bump(sum, v);
+        if (v > max.load(memory_order_relaxed)) max.store(v, memory_order_relaxed);
+    }
+
+    // Adds `o` into this histogram; the caller must be its only writer.
+    void absorb(const HdrHistogram& o) {
+        for (size_t i = 0; i < kBuckets; ++i) bump(counts[i], o.counts[i].load(memory_order_relaxed));
+        bump(count, o.count.load(memory_order_relaxed));
+        bump(sum, o.sum.load(memory_order_relaxed));
+        if (o.max.load(memory_order_relaxed) > max.load(memory_order_relaxed)) max.store(o.max.load(memory_order_relaxed), memory_order_relaxed);
+    }
+
+    // Merged, non-atomic copy for reporting.
+    struct Snapshot {
+        vector<uint64_t> counts = vector<uint64_t>(kBuckets);
+        uint64_t count{0}, sum{0}, max{0};
+
+        void merge(const HdrHistogram& h) {
+            for (size_t i = 0; i < kBuckets; ++i) counts[i] += h.counts[i].load(memory_order_relaxed);
+            count += h.count.load(memory_order_relaxed);
+            sum += h.sum.load(memory_order_relaxed);
+            max = std::max(max, h.max.load(memory_order_relaxed));
+        }
+        uint64_t percentile(double q) const {
+            const uint64_t rank = static_cast<uint64_t>(ceil(q * count));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < kBuckets; ++i) {
+                seen += counts[i];
+                if (seen >= rank && seen > 0) return min(upperBound(i), max);
+            }
+            return max;
+        }
+        double mean() const { return count ? double(sum) / count : 0.0; }
+    };
+
+    // Plain load + store: the owning thread is the only writer, so no locked instruction is needed.
+    static void bump(atomic<uint64_t>& c, uint64_t n) { c.store(c.load(memory_order_relaxed) + n, memory_order_relaxed); }
+
+private:
+    array<atomic<uint64_t>, kBuckets> counts{};
+    atomic<uint64_t> count{0}, sum{0}, max{0};
+};
+
+/**
+ * @brief Process-wide metrics surface for the media classes.
+ *
+ * Metrics are named `stream/name` and registered once, up front, for an Id;
+ * recording by Id is the only thing on the hot path. Counters and latency
+ * histograms are sharded per thread: each thread writes only its own shard,
+ * with no locks or atomic read-modify-writes, and a read sums the shards.
+ * A thread's shard is folded into a retired total when the thread exits and
+ * then reused. Gauges (buffer occupancy) are last-value-wins plus a
+ * high-water mark, shared by all threads.
+ *
+ * Everything is off until setEnabled(true); disabled, every record call is
+ * one relaxed load and a branch. Registering is always allowed. Stage
+ * timers started with now() sample one event in setTimingSample() (16 by
+ * default, always including a thread's first): reading the clock costs more
+ * than all the bookkeeping, and a 1-in-16 sample still gives stable
+ * percentiles at frame rates. Coarse stages use nowUnsampled().
+ *
+ * An instance release()s its stream when it dies. Its metrics stay in the
+ * snapshot until the registry runs out of room, then their slots are reset
+ * and reused, oldest first; registering a released name again resets it too.
+ */
+class MediaMetrics {
+public:
+    using Id = uint32_t;
+    static constexpr Id kNone = UINT32_MAX;  // registry full: recording is a no-op
+    static constexpr size_t kMaxCounters = 8192;
+    static constexpr size_t kMaxHistograms = 256;
+    static constexpr size_t kMaxGauges = 1024;
+
+    static MediaMetrics& global() {
+        static MediaMetrics* m = new MediaMetrics();  // never destroyed: exiting threads fold their shards into it
+        return *m;
+    }
+
+    static void setEnabled(bool on) { enabledFlag().store(on, memory_order_relaxed); }
+    static bool enabled() { return enabledFlag().load(memory_order_relaxed); }
+    static void setTimingSample(uint32_t everyN) { sampleEvery().store(max<uint32_t>(everyN, 1), memory_order_relaxed); }
+    // Steady-clock ns for a sampled event, else 0; recordSince() ignores 0, so unsampled events never read the clock.
+    static int64_t now() {
+        if (!enabled()) return 0;
+        static thread_local uint32_t tick = UINT32_MAX - 1;  // wraps to sample a thread's first event
+        if (++tick < sampleEvery().load(memory_order_relaxed)) return 0;
+        tick = 0;
+        return steadyNs();
+    }
+    // Every event, for stages (an HTTP chunk, a disk flush) that dwarf a clock read.
+    static int64_t nowUnsampled() { return enabled() ? steadyNs() : 0; }
+
+    Id counter(const string& stream, const string& name) { return lookup(counters, stream + "/" + name); }
+    Id histogram(const string& stream, const string& name) { return lookup(histograms, stream + "/" + name); }
+    Id gauge(const string& stream, const string& name) { return lookup(gaugeRegistry, stream + "/" + name); }
+
+    // "kind-N", N counting up per kind: a stream name for one instance of an instrumented class.
+    string uniqueStream(const string& kind) {
+        lock_guard<mutex> lock(registryMtx);
+        return kind + "-" + to_string(++instances[kind]);
+    }
+
+    // `stream` and everything under it (`stream/...`) may be reused; the owner must no longer record to them.
+    void release(const string& stream) {
+        lock_guard<mutex> lock(registryMtx);
+        for (Registry* r : {&counters, &histograms, &gaugeRegistry}) {
+            const string prefix = r->tag + stream + "/";
+            for (auto it = ids.lower_bound(prefix); it != ids.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+                if (r->released[it->second]) continue;
+                r->released[it->second] = true;
+                r->reusable.push_back(it->second);
+            }
+        }
+    }
+
+    void add(Id id, uint64_t n = 1) {
+        if (!enabled() || id == kNone) return;
+        HdrHistogram::bump(shard().counters[id], n);
+    }
+    void record(Id id, uint64_t ns) {
+        if (!enabled() || id == kNone) return;
+        Shard& s = shard();
+        HdrHistogram* h = s.histograms[id].load(memory_order_relaxed);
+        if (!h) {
+            h = new HdrHistogram();  // once per thread and histogram
+            s.histograms[id].store(h, memory_order_release);
+        }
+        h->record(ns);
+    }
+    // No-op when `startNs` came from a disabled now().
+    void recordSince(Id id, int64_t startNs) {
+        if (startNs) record(id, static_cast<uint64_t>(max<int64_t>(steadyNs() - startNs, 0)));
+    }
+    void set(Id id, int64_t value) {
+        if (!enabled() || id == kNone) return;
+        Gauge& g = gauges[id];
+        g.value.store(value, memory_order_relaxed);
+        if (value > g.max.load(memory_order_relaxed)) g.max.store(value, memory_order_relaxed);
+    }
+
+    uint64_t counterValue(Id id) const {
+        if (id == kNone) return 0;
+        lock_guard<mutex> lock(shardsMtx);
+        uint64_t total = 0;
+        for (const Shard* s : liveShards) total += s->counters[id].load(memory_order_relaxed);
+        return total + retired.counters[id].load(memory_order_relaxed);
+    }
+    HdrHistogram::Snapshot histogramValue(Id id) const {
+        HdrHistogram::Snapshot snap;
+        if (id == kNone) return snap;
+        lock_guard<mutex> lock(shardsMtx);
+        for (const Shard* s : liveShards) {
+            if (const HdrHistogram* h = s->histograms[id].load(memory_order_acquire)) snap.merge(*h);
+        }
+        if (const HdrHistogram* h = retired.histograms[id].load(memory_order_acquire)) snap.merge(*h);
+        return snap;
+    }
+
+    // Every registered metric, one per line:
+    //   counter <stream/name> <value>
+    //   gauge <stream/name> <value> max <high-water>
+    //   histogram <stream/name> count <n> mean_us   (n counts sampled events for now()-timed stages) .. p50_us .. p90_us .. p99_us .. p999_us .. max_us ..
+    string snapshot() const {
+        vector<string> counterList, histogramList, gaugeList;
+        {
+            lock_guard<mutex> lock(registryMtx);
+            counterList = counters.names;
+            histogramList = histograms.names;
+            gaugeList = gaugeRegistry.names;
+        }
+        ostringstream out;
+        out.setf(ios::fixed);
+        out.precision(1);
+        for (size_t i = 0; i < counterList.size(); ++i) out << "counter " << counterList[i] << " " << counterValue(static_cast<Id>(i)) << "\n";
+        for (size_t i = 0; i < gaugeList.size(); ++i) {
+            out << "gauge " << gaugeList[i] << " " << gauges[i].value.load(memory_order_relaxed) << " max "
+                << gauges[i].max.load(memory_order_relaxed) << "\n";
+        }
+        for (size_t i = 0; i < histogramList.size(); ++i) {
+            auto h = histogramValue(static_cast<Id>(i));
+            out << "histogram " << histogramList[i] << " count " << h.count << " mean_us " << h.mean() / 1e3 << " p50_us "
+                << h.percentile(0.5) / 1e3 << " p90_us " << h.percentile(0.9) / 1e3 << " p99_us " << h.percentile(0.99) / 1e3
+                << " p999_us " << h.percentile(0.999) / 1e3 << " max_us " << h.max / 1e3 << "\n";
+        }
+        return out.str();
+    }
+
+private:
+    struct Shard {
+        array<atomic<uint64_t>, kMaxCounters> counters{};
+        array<atomic<HdrHistogram*>, kMaxHistograms> histograms{};
+    };
+    struct alignas(64) Gauge {
+        atomic<int64_t> value{0}, max{0};
+    };
+    struct ShardHolder {
+        Shard* s{nullptr};
+        ~ShardHolder() {
+            if (s) MediaMetrics::global().retire(s);
+        }
+    };
+
+    // One per kind. Ids are handed out in order; released ones are recycled once `capacity` is reached.
+    struct Registry {
+        string tag;  // key prefix in `ids`
+        size_t capacity;
+        vector<string> names;
+        vector<bool> released;
+        deque<Id> reusable;  // released, oldest first
+    };
+
+    mutable mutex registryMtx;
+    Registry counters{"c:", kMaxCounters, {}, {}, {}}, histograms{"h:", kMaxHistograms, {}, {}, {}}, gaugeRegistry{"g:", kMaxGauges, {}, {}, {}};
+    map<string, Id> ids;
+    map<string, uint64_t> instances;
+    mutable mutex shardsMtx;
+    vector<Shard*> liveShards, freeShards;
+    Shard retired;  // written only under shardsMtx
+    array<Gauge, kMaxGauges> gauges;
+
+    MediaMetrics() = default;
+
+    static atomic<bool>& enabledFlag() {
+        static atomic<bool> on{false};
+        return on;
+    }
+    static atomic<uint32_t>& sampleEvery() {
+        static atomic<uint32_t> n{16};
+        return n;
+    }
+    static int64_t steadyNs() { return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count(); }
+
+    Id lookup(Registry& r, const string& key) {
+        lock_guard<mutex> lock(registryMtx);
+        const string tagged = r.tag + key;
+        auto it = ids.find(tagged);
+        if (it != ids.end()) {
+            const Id id = it->second;
+            if (r.released[id]) {  // a new owner of the same name starts from zero
+                r.released[id] = false;
+                r.reusable.erase(find(r.reusable.begin(), r.reusable.end(), id));
+                reset(r, id);
+            }
+            return id;
+        }
+        if (r.names.size() < r.capacity) {
+            r.names.push_back(key);
+            r.released.push_back(false);
+            return ids[tagged] = static_cast<Id>(r.names.size() - 1);
+        }
+        if (r.reusable.empty()) return kNone;
+        const Id id = r.reusable.front();
+        r.reusable.pop_front();
+        ids.erase(r.tag + r.names[id]);
+        r.names[id] = key;
+        r.released[id] = false;
+        reset(r, id);
+        return ids[tagged] = id;
+    }
+
+    // Caller holds registryMtx; nobody records to `id` while it is released.
+    void reset(Registry& r, Id id) {
+        if (&r == &gaugeRegistry) {
+            gauges[id].value.store(0, memory_order_relaxed);
+            gauges[id].max.store(0, memory_order_relaxed);
+            return;
+        }
+        lock_guard<mutex> lock(shardsMtx);
+        for (Shard* s : liveShards) {
+            if (&r == &counters) s->counters[id].store(0, memory_order_relaxed);
+            else delete s->histograms[id].exchange(nullptr, memory_order_acq_rel);
+        }
+        if (&r == &counters) retired.counters[id].store(0, memory_order_relaxed);
+        else delete retired.histograms[id].exchange(nullptr, memory_order_acq_rel);
+    }
+
+    Shard& shard() {
+        static thread_local ShardHolder holder;
+        if (!holder.s) {
+            lock_guard<mutex> lock(shardsMtx);
+            if (!freeShards.empty()) {
+                holder.s = freeShards.back();
+                freeShards.pop_back();
+            } else {
+                holder.s = new Shard();
+            }
+            liveShards.push_back(holder.s);
+        }
+        return *holder.s;
+    }
+
+    // Thread exit: add the shard into `retired`, zero it, and keep it for the next thread.
+    void retire(Shard* s) {
+        lock_guard<mutex> lock(shardsMtx);
+        for (size_t i = 0; i < kMaxCounters; ++i) {
+            HdrHistogram::bump(retired.counters[i], s->counters[i].exchange(0, memory_order_relaxed));
+        }
+        for (size_t i = 0; i < kMaxHistograms; ++i) {
+            HdrHistogram* h = s->histograms[i].exchange(nullptr, memory_order_acq_rel);
+            if (!h) continue;
+            HdrHistogram* into = retired.histograms[i].load(memory_order_relaxed);
+            if (!into) {
+                retired.histograms[i].store(h, memory_order_release);  // adopt it whole
+                continue;
+            }
+            into->absorb(*h);
+            delete h;
+        }
+        liveShards.erase(find(liveShards.begin(), liveShards.end(), s));
+        freeShards.push_back(s);
+    }
+};
+
+/**
+ * @brief Writes MediaMetrics::snapshot() every `interval` to a file and/or serves it on a Unix socket.
+ *
+ * The file is replaced atomically (write to `path.tmp`, then rename), so a
+ * reader never sees half a dump. Each client connecting to the socket gets
+ * the current snapshot and EOF, e.g. `socat - UNIX-CONNECT:<socket>`.
+ */
+class MetricsDumper {
+public:
+    struct Options {
+        string filePath;    // empty: no file
+        string socketPath;  // empty: no socket
+        chrono::milliseconds interval{1000};
+    };
+
+    explicit MetricsDumper(Options o) : opts(move(o)) {
+        if (!opts.socketPath.empty()) {
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            if (opts.socketPath.size() >= sizeof addr.sun_path) throw invalid_argument("socket path too long: " + opts.socketPath);
+            strcpy(addr.sun_path, opts.socketPath.c_str());
+            listener = FileDescriptor(::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0));
+            if (!listener) throwErrno("socket");
+            ::unlink(opts.socketPath.c_str());
+            if (::bind(listener.get(), reinterpret_cast<sockaddr*>(&addr), sizeof addr) != 0) throwErrno("bind " + opts.socketPath);
+            if (::listen(listener.get(), 16) != 0) throwErrno("listen");
+        }
+        worker = thread([this] { loop(); });
+    }
+    ~MetricsDumper() { stop(); }
+
+    // Writes a final dump and removes the socket.
+    void stop() {
+        if (!running.exchange(false)) return;
+        worker.join();
+        if (!opts.filePath.empty()) writeFile();
+        if (listener) ::unlink(opts.socketPath.c_str());
+    }
+
+    uint64_t getDumps() const { return dumps.load(); }
+
+private:
+    Options opts;
+    FileDescriptor listener;
+    atomic<bool> running{true};
+    atomic<uint64_t> dumps{0};
+    thread worker;
+
+    void writeFile() {
+        const string tmp = opts.filePath + ".tmp";
+        const string text = MediaMetrics::global().snapshot();
+        FileDescriptor fd(::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+        if (!fd) return;  // best effort: a metrics dump must never take the player down
+        writeAll(fd.get(), text.data(), text.size());
+        if (::rename(tmp.c_str(), opts.filePath.c_str()) == 0) dumps.fetch_add(1, memory_order_relaxed);
+    }
+
+    void loop() {
+        auto next = chrono::steady_clock::now() + opts.interval;
+        while (running.load(memory_order_acquire)) {
+            const auto wait = chrono::duration_cast<chrono::milliseconds>(next - chrono::steady_clock::now());
+            pollfd pfd{listener.get(), POLLIN, 0};
+            const int timeout = static_cast<int>(min<int64_t>(max<int64_t>(wait.count(), 0), 50));
+            if (listener && ::poll(&pfd, 1, timeout) > 0) {
+                FileDescriptor client(::accept4(listener.get(), nullptr, nullptr, SOCK_CLOEXEC));
+                if (client) {
+                    timeval limit{0, 100'000};  // a client that doesn't read can't stall the dumps
+                    setsockopt(client.get(), SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof limit);
+                    const string text = MediaMetrics::global().snapshot();
+                    for (size_t off = 0; off < text.size();) {  // MSG_NOSIGNAL: a client that hung up must not SIGPIPE us
+                        ssize_t n = ::send(client.get(), text.data() + off, text.size() - off, MSG_NOSIGNAL);
+                        if (n <= 0) break;
+                        off += static_cast<size_t>(n);
+                    }
+                }
+            } else if (!listener) {
+                this_thread::sleep_for(chrono::milliseconds(timeout));
+            }
+            if (chrono::steady_clock::now() >= next) {
+                if (!opts.filePath.empty()) writeFile();
+                next += opts.interval;
+            }
+        }
+    }
+};
+
+// =========================
+// Streaming download
+// =========================
+struct HttpUrl {
+    string host;
+    uint16_t port{80};
+    string path;
+
+    static HttpUrl parse(const string& url) {
+        const string scheme = "http://";
+        if (url.compare(0, scheme.size(), scheme) != 0) throw invalid_argument("Only http:// URLs are supported: " + url);
+        HttpUrl u;
+        size_t hostEnd = url.find('/', scheme.size());
+        string authority = url.substr(scheme.size(), hostEnd == string::npos ? string::npos : hostEnd - scheme.size());
+        u.path = hostEnd == string::npos ? "/" : url.substr(hostEnd);
+        size_t colon = authority.rfind(':');
+        u.host = authority.substr(0, colon);
+        if (colon != string::npos) u.port = static_cast<uint16_t>(stoi(authority.substr(colon + 1)));
+        return u;
+    }
+};
+
+// One HTTP exchange: status, headers, and the socket positioned at the body.
+struct HttpResponse {
+    int status{0};
+    uint64_t contentLength{0};
+    bool acceptsRanges{false};
+    string etag, lastModified;  // empty when the server sent none
+    FileDescriptor socket;
+    string bodyPrefix;  // body bytes that arrived together with the headers
+};
+
+inline HttpResponse httpRequest(const HttpUrl& url, const string& method, const string& extraHeaders = "") {
+    addrinfo hints{}, *res = nullptr;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(url.host.c_str(), to_string(url.port).c_str(), &hints, &res) != 0 || !res) {
+        throw runtime_error("Cannot resolve " + url.host);
+    }
+    HttpResponse resp;
+    resp.socket = FileDescriptor(::socket(res->ai_family, res->ai_socktype, res->ai_protocol));
+    int rc = resp.socket ? ::connect(resp.socket.get(), res->ai_addr, res->ai_addrlen) : -1;
+    freeaddrinfo(res);
+    if (rc != 0) throwErrno("connect " + url.host);
+
+    string req = method + " " + url.path + " HTTP/1.1\r\nHost: " + url.host + "\r\nConnection: close\r\n" + extraHeaders + "\r\n";
+    writeAll(resp.socket.get(), req.data(), req.size());
+
+    string buf;
+    char chunk[4096];
+    size_t end;
+    while ((end = buf.find("\r\n\r\n")) == string::npos) {
+        ssize_t n = ::recv(resp.socket.get(), chunk, sizeof chunk, 0);
+        if (n <= 0) throw runtime_error("Connection closed before HTTP headers");
+        buf.append(chunk, static_cast<size_t>(n));
+    }
+    resp.bodyPrefix = buf.substr(end + 4);
+    buf.resize(end + 2);
+    sscanf(buf.c_str(), "HTTP/%*s %d", &resp.status);
+    for (size_t pos = buf.find("\r\n"); pos != string::npos && pos + 2 < buf.size();) {
+        size_t next = buf.find("\r\n", pos + 2);
+        string line = buf.substr(pos + 2, next - pos - 2);
+        if (line.compare(0, 15, "Content-Length:") == 0) resp.contentLength = stoull(line.substr(15));
+        if (line.compare(0, 20, "Accept-Ranges: bytes") == 0) resp.acceptsRanges = true;
+        if (line.compare(0, 6, "ETag: ") == 0) resp.etag = line.substr(6);
+        if (line.compare(0, 15, "Last-Modified: ") == 0) resp.lastModified = line.substr(15);
+        pos = next;
+    }
+    return resp;
+}
+
+/**
+ * @brief Resumable, parallel, zero-copy HTTP downloader.
+ *
+ * The file is fetched in fixed-size chunks over parallel Range requests. Each
+ * body is moved socket -> pipe -> file with splice(), so the payload never
+ * enters user space, and lands at its offset in "<dest>.part". A chunk is
+ * marked done, one byte each in "<dest>.part.state", only after its data is
+ * fdatasync'd, so a crash cannot leave a done chunk that never reached disk.
+ * The flags are followed by the remote file's identity (ETag, else size and
+ * Last-Modified); a later call with the same destination and an unchanged
+ * remote file fetches only the missing chunks, then renames the part file
+ * into place. If the remote file changed,
+ * the download starts over, and range requests carry If-Range so a change
+ * mid-download fails the chunk instead of mixing versions. Servers without
+ * range support get a single sequential stream. If splice() is refused by the
+ * filesystem, bodies are copied with read()/pwrite().
+ */
+class StreamingDownloader {
+public:
+    struct Options {
+        size_t parallelChunks{4};
+        uint64_t chunkSize{8u << 20};
+        bool zeroCopy{true};  // false: read()/pwrite() through a user-space buffer, for comparison
+        // Called after each chunk with (bytes on disk, total); return false to stop early (resumable).
+        function<bool(uint64_t, uint64_t)> progress;
+    };
+
+    struct Stats {
+        uint64_t totalBytes{0};
+        uint64_t fetchedBytes{0};  // this call only; less than total when resuming
+        double seconds{0.0};
+        double cpuSeconds{0.0};
+        bool complete{false};
+
+        double megabytesPerSecond() const { return seconds > 0 ? fetchedBytes / 1e6 / seconds : 0.0; }
+        double cpuSecondsPerGigabyte() const { return fetchedBytes ? cpuSeconds / (fetchedBytes / 1e9) : 0.0; }
+    };
+
+private:
+    Options opts;
+    string metricsStream;
+    MediaMetrics::Id bytesMetric, chunkMetric;
+
+    static double cpuNow() {
+        rusage ru{};
+        getrusage(RUSAGE_SELF, &ru);
+        return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+    }
+
+    static void copyBody(int socket, int file, loff_t at, uint64_t length, vector<char>& buffer) {
+        buffer.resize(1 << 20);
+        while (length > 0) {
+            ssize_t in = ::read(socket, buffer.data(), min<uint64_t>(length, buffer.size()));
+            if (in < 0 && errno == EINTR) continue;
+            if (in <= 0) throw runtime_error("Connection closed mid-body");
+            if (::pwrite(file, buffer.data(), static_cast<size_t>(in), at) != in) throwErrno("pwrite");
+            at += in;
+            length -= static_cast<uint64_t>(in);
+        }
+    }
+
+    // Writes `length` body bytes from the response to file offset `offset`.
+    static void receiveBody(HttpResponse& resp, int file, uint64_t offset, uint64_t length, bool zeroCopy) {
+        if (resp.bodyPrefix.size() > length) throw runtime_error("Server sent more than requested");
+        if (!resp.bodyPrefix.empty()) {
+            if (::pwrite(file, resp.bodyPrefix.data(), resp.bodyPrefix.size(), static_cast<off_t>(offset)) !=
+                static_cast<ssize_t>(resp.bodyPrefix.size())) {
+                throwErrno("pwrite");
+            }
+            offset += resp.bodyPrefix.size();
+            length -= resp.bodyPrefix.size();
+        }
+        vector<char> fallback;
+        if (!zeroCopy) return copyBody(resp.socket.get(), file, static_cast<loff_t>(offset), length, fallback);
+        int pipeFds[2];
+        if (::pipe(pipeFds) != 0) throwErrno("pipe");
+        FileDescriptor pipeRead(pipeFds[0]), pipeWrite(pipeFds[1]);
+        const size_t kPipeChunk = 1 << 20;
+        fcntl(pipeWrite.get(), F_SETPIPE_SZ, kPipeChunk);
+        loff_t at = static_cast<loff_t>(offset);
+        while (length > 0) {
+            ssize_t in = ::splice(resp.socket.get(), nullptr, pipeWrite.get(), nullptr, min<uint64_t>(length, kPipeChunk), SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (in < 0 && errno == EINTR) continue;
+            if (in < 0 && errno == EINVAL) return copyBody(resp.socket.get(), file, at, length, fallback);  // no splice for this socket
+            if (in <= 0) throw runtime_error("Connection closed mid-body");
+            for (ssize_t left = in; left > 0;) {
+                ssize_t out = ::splice(pipeRead.get(), nullptr, file, &at, static_cast<size_t>(left), SPLICE_F_MOVE);
+                if (out < 0 && errno == EINTR) continue;
+                if (out < 0 && errno == EINVAL) {  // target filesystem refuses splice: drain the pipe by hand
+                    fallback.resize(static_cast<size_t>(left));
+                    ssize_t r = ::read(pipeRead.get(), fallback.data(), static_cast<size_t>(left));
+                    if (r <= 0 || ::pwrite(file, fallback.data(), static_cast<size_t>(r), at) != r) throwErrno("pwrite");
+                    out = r;
+                    at += r;
+                }
+                if (out <= 0) throwErrno("splice");
+                left -= out;
+            }
+            length -= static_cast<uint64_t>(in);
+        }
+    }
+
+public:
+    StreamingDownloader() : StreamingDownloader(Options{}) {}
+    explicit StreamingDownloader(Options o) : opts(move(o)) {
+        auto& mm = MediaMetrics::global();
+        metricsStream = mm.uniqueStream("download");
+        bytesMetric = mm.counter(metricsStream, "bytes");
+        chunkMetric = mm.histogram(metricsStream, "chunk");  // range request sent -> chunk on disk
+    }
+    StreamingDownloader(const StreamingDownloader&) = delete;
+    StreamingDownloader& operator=(const StreamingDownloader&) = delete;
+    ~StreamingDownloader() { MediaMetrics::global().release(metricsStream); }
+
+    Stats download(const string& url, const string& dest) {
+        const auto startWall = chrono::steady_clock::now();
+        const double startCpu = cpuNow();
+        const HttpUrl target = HttpUrl::parse(url);
+        HttpResponse head = httpRequest(target, "HEAD");
+        if (head.status != 200) throw runtime_error("HEAD " + url + " returned " + to_string(head.status));
+        head.socket.reset();
+
+        Stats stats;
+        stats.totalBytes = head.contentLength;
+        const uint64_t chunkSize = head.acceptsRanges ? max<uint64_t>(opts.chunkSize, 64 * 1024) : max<uint64_t>(stats.totalBytes, 1);
+        const size_t chunks = static_cast<size_t>((stats.totalBytes + chunkSize - 1) / chunkSize);
+
+        const string partPath = dest + ".part", statePath = dest + ".part.state";
+        FileDescriptor part(::open(partPath.c_str(), O_RDWR | O_CREAT, 0644));
+        FileDescriptor state(::open(statePath.c_str(), O_RDWR | O_CREAT, 0644));
+        if (!part || !state) throwErrno("open " + partPath);
+        const string identity = !head.etag.empty() ? "etag " + head.etag
+                                                   : "size " + to_string(stats.totalBytes) + " modified " + head.lastModified;
+        vector<char> done(chunks, 0);
+        string stored(identity.size(), '\0');
+        struct stat st;
+        if (fstat(state.get(), &st) == 0 && static_cast<size_t>(st.st_size) == chunks + identity.size() &&
+            ::pread(state.get(), &stored[0], stored.size(), static_cast<off_t>(chunks)) == static_cast<ssize_t>(stored.size()) &&
+            stored == identity) {
+            if (::pread(state.get(), done.data(), chunks, 0) != static_cast<ssize_t>(chunks)) fill(done.begin(), done.end(), 0);
+        } else {  // new download, or the remote file changed under a partial one: nothing on disk can be trusted
+            if (::ftruncate(state.get(), 0) != 0 || ::ftruncate(state.get(), static_cast<off_t>(chunks)) != 0) {
+                throwErrno("ftruncate " + statePath);
+            }
+            if (::pwrite(state.get(), identity.data(), identity.size(), static_cast<off_t>(chunks)) != static_cast<ssize_t>(identity.size())) {
+                throwErrno("pwrite " + statePath);
+            }
+        }
+        if (posix_fallocate(part.get(), 0, static_cast<off_t>(stats.totalBytes)) != 0 &&
+            ::ftruncate(part.get(), static_cast<off_t>(stats.totalBytes)) != 0) {
+            throwErrno("ftruncate " + partPath);
+        }
+
+        atomic<uint64_t> onDisk{0};
+        for (size_t c = 0; c < chunks; ++c) {
+            if (done[c]) onDisk += min(chunkSize, stats.totalBytes - c * chunkSize);
+        }
+        atomic<size_t> nextChunk{0};
+        atomic<bool> stop{false};
+        atomic<uint64_t> fetched{0};
+        mutex errMtx;
+        exception_ptr error;
+        auto worker = [&] {
+            try {
+                for (size_t c; !stop && (c = nextChunk++) < chunks;) {
+                    if (done[c]) continue;
+                    const uint64_t first = c * chunkSize;
+                    const uint64_t len = min(chunkSize, stats.totalBytes - first);
+                    const int64_t requested = MediaMetrics::nowUnsampled();
+                    HttpResponse resp = head.acceptsRanges
+                        ? httpRequest(target, "GET", "Range: bytes=" + to_string(first) + "-" + to_string(first + len - 1) + "\r\n" +
+                                                         (head.etag.empty() ? "" : "If-Range: " + head.etag + "\r\n"))
+                        : httpRequest(target, "GET");
+                    if (resp.status != (head.acceptsRanges ? 206 : 200) || resp.contentLength != len) {
+                        throw runtime_error("Unexpected response " + to_string(resp.status) + " for chunk " + to_string(c));
+                    }
+                    receiveBody(resp, part.get(), first, len, opts.zeroCopy);
+                    if (::fdatasync(part.get()) != 0) throwErrno("fdatasync " + partPath);
+                    const char one = 1;
+                    if (::pwrite(state.get(), &one, 1, static_cast<off_t>(c)) != 1) throwErrno("pwrite " + statePath);
+                    fetched += len;
+                    MediaMetrics::global().add(bytesMetric, len);
+                    MediaMetrics::global().recordSince(chunkMetric, requested);
+                    uint64_t total = onDisk += len;
+                    if (opts.progress && !opts.progress(total, stats.totalBytes)) stop = true;
+                }
+            } catch (...) {
+                lock_guard<mutex> lock(errMtx);
+                if (!error) error = current_exception();
+                stop = true;
+            }
+        };
+        vector<thread> pool;
+        for (size_t i = 0; i < max<size_t>(1, min(opts.parallelChunks, chunks)); ++i) pool.emplace_back(worker);
+        for (auto& t : pool) t.join();
+        if (error) rethrow_exception(error);
+
+        stats.fetchedBytes = fetched;
+        stats.complete = onDisk == stats.totalBytes;
+        if (stats.complete) {
+            if (::fsync(part.get()) != 0) throwErrno("fsync " + partPath);
+            if (::rename(partPath.c_str(), dest.c_str()) != 0) throwErrno("rename " + partPath);
+            ::unlink(statePath.c_str());
+        }
+        stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - startWall).count();
+        stats.cpuSeconds = cpuNow() - startCpu;
+        return stats;
+    }
+};
+
+// =========================
+// Frame buffer pool
+// =========================
+// Header in front of every pooled buffer. The payload starts 64 bytes in.
+struct FrameBlock {
+    static constexpr uint32_t kKeyframe = 1;
+    atomic<uint32_t> refs{0};
+    uint32_t sizeClass{0};  // FramePool::kClasses = oversize, plain aligned allocation
+    size_t size{0};
+    size_t capacity{0};
+    int64_t ptsNs{0};
+    uint32_t flags{0};
+    FrameBlock* next{nullptr};  // free-list link while not in use
+
+    uint8_t* data() { return reinterpret_cast<uint8_t*>(this) + 64; }
+};
+static_assert(sizeof(FrameBlock) <= 64, "FrameBlock header must fit its 64-byte slot");
+
+/**
+ * @brief Process-wide size-classed pool for frame and chunk buffers.
+ *
+ * Size classes are powers of two from 4 KiB to 8 MiB, header included.
+ * Each thread keeps a small free list per class, so the common allocate and
+ * release are a few pointer moves with no lock and no atomics. A thread that
+ * frees more than it allocates (a writer, a decoder sink) spills half its
+ * list to the class's central list; a thread that allocates more refills a
+ * batch from there. Central lists are grown by carving 2 MiB arenas (one
+ * arena per block above 2 MiB). Arenas come from MAP_HUGETLB when huge pages
+ * are reserved, otherwise from 2 MiB-aligned anonymous memory marked
+ * MADV_HUGEPAGE for transparent huge pages.
+ *
+ * Memory is never returned to the OS, so RSS settles at the working set's
+ * high-water mark instead of following the allocation churn. Requests above
+ * the largest class fall back to posix_memalign.
+ */
+class FramePool {
+public:
+    static constexpr size_t kMinShift = 12, kMaxShift = 23;
+    static constexpr size_t kClasses = kMaxShift - kMinShift + 1;
+    static constexpr size_t kArenaBytes = 2u << 20;
+    static constexpr size_t kCacheBytes = 2u << 20;  // per class, per thread
+
+    struct Stats {
+        uint64_t refills{0};     // batches a thread took from a central list
+        uint64_t spills{0};      // batches a thread gave back
+        uint64_t arenas{0};
+        uint64_t oversize{0};    // allocations too large for any class
+        size_t reservedBytes{0};
+        size_t hugeTlbBytes{0};  // of reservedBytes, backed by MAP_HUGETLB
+    };
+
+    static FramePool& shared() {
+        static FramePool* pool = new FramePool();  // never destroyed: thread caches flush into it at thread exit
+        return *pool;
+    }
+
+    // A block with refs == 1 and size == bytes; payload uninitialised.
+    FrameBlock* acquire(size_t bytes) {
+        const size_t cls = classFor(bytes);
+        FrameBlock* b;
+        if (cls == kClasses) {
+            void* p = nullptr;
+            if (posix_memalign(&p, 64, 64 + bytes) != 0) throw bad_alloc();
+            b = new (p) FrameBlock();
+            b->sizeClass = kClasses;
+            b->capacity = bytes;
+            oversize.fetch_add(1, memory_order_relaxed);
+        } else {
+            ThreadCache& tc = cache();
+            if (!tc.head[cls]) refill(tc, cls);
+            b = tc.head[cls];
+            tc.head[cls] = b->next;
+            --tc.count[cls];
+        }
+        b->refs.store(1, memory_order_relaxed);
+        b->size = bytes;
+        b->ptsNs = 0;
+        b->flags = 0;
+        return b;
+    }
+
+    // Called with the last reference gone. Any thread may release any block.
+    void release(FrameBlock* b) {
+        if (b->sizeClass == kClasses) {
+            b->~FrameBlock();
+            free(b);
+            return;
+        }
+        ThreadCache& tc = cache();
+        const size_t cls = b->sizeClass;
+        b->next = tc.head[cls];
+        tc.head[cls] = b;
+        if (++tc.count[cls] > cacheLimit(cls)) spill(tc, cls, tc.count[cls] / 2);
+    }
+
+    Stats getStats() const {
+        Stats st;
+        st.refills = refills.load();
+        st.spills = spills.load();
+        st.arenas = arenas.load();
+        st.oversize = oversize.load();
+        st.reservedBytes = reservedBytes.load();
+        st.hugeTlbBytes = hugeTlbBytes.load();
+        return st;
+    }
+
+    static size_t classBytes(size_t cls) { return size_t(1) << (kMinShift + cls); }
+
+private:
+    struct alignas(64) Central {
+        mutex mtx;
+        FrameBlock* head{nullptr};
+        uint8_t* carve{nullptr};  // unused tail of the newest arena
+        uint8_t* carveEnd{nullptr};
+    };
+
+    struct ThreadCache {
+        array<FrameBlock*, kClasses> head{};
+        array<size_t, kClasses> count{};
+        ~ThreadCache() {
+            for (size_t cls = 0; cls < kClasses; ++cls) {
+                if (count[cls]) FramePool::shared().spill(*this, cls, count[cls]);
+            }
+        }
+    };
+
+    array<Central, kClasses> central;
+    atomic<uint64_t> refills{0}, spills{0}, arenas{0}, oversize{0};
+    atomic<size_t> reservedBytes{0}, hugeTlbBytes{0};
+
+    FramePool() = default;
+
+    static ThreadCache& cache() {
+        static thread_local ThreadCache tc;
+        return tc;
+    }
+
+    static size_t classFor(size_t bytes) {
+        for (size_t cls = 0; cls < kClasses; ++cls) {
+            if (bytes + 64 <= classBytes(cls)) return cls;
+        }
+        return kClasses;
+    }
+
+    static size_t cacheLimit(size_t cls) { return max<size_t>(kCacheBytes / classBytes(cls), 2); }
+
+    void refill(ThreadCache& tc, size_t cls) {
+        const size_t want = max<size_t>(cacheLimit(cls) / 2, 1);
+        const size_t blockBytes = classBytes(cls);
+        Central& c = central[cls];
+        lock_guard<mutex> lock(c.mtx);
+        refills.fetch_add(1, memory_order_relaxed);
+        for (size_t n = 0; n < want; ++n) {
+            FrameBlock* b = c.head;
+            if (b) {
+                c.head = b->next;
+            } else {
+                if (c.carve == c.carveEnd) {
+                    if (n > 0) break;  // don't grow the pool just to fill a batch
+                    const size_t bytes = max(blockBytes, kArenaBytes);
+                    c.carve = mapArena(bytes);
+                    c.carveEnd = c.carve + bytes;
+                }
+                b = new (c.carve) FrameBlock();
+                b->sizeClass = static_cast<uint32_t>(cls);
+                b->capacity = blockBytes - 64;
+                c.carve += blockBytes;
+            }
+            b->next = tc.head[cls];
+            tc.head[cls] = b;
+            ++tc.count[cls];
+        }
+    }
+
+    void spill(ThreadCache& tc, size_t cls, size_t n) {
+        Central& c = central[cls];
+        lock_guard<mutex> lock(c.mtx);
+        spills.fetch_add(1, memory_order_relaxed);
+        for (; n > 0 && tc.head[cls]; --n) {
+            FrameBlock* b = tc.head[cls];
+            tc.head[cls] = b->next;
+            --tc.count[cls];
+            b->next = c.head;
+            c.head = b;
+        }
+    }
+
+    uint8_t* mapArena(size_t bytes) {
+        void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            hugeTlbBytes.fetch_add(bytes, memory_order_relaxed);
+        } else {
+            // Over-map by one huge page and trim, so the arena is 2 MiB aligned and THP can back it.
+            p = mmap(nullptr, bytes + kArenaBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) throw bad_alloc();
+            const uintptr_t base = reinterpret_cast<uintptr_t>(p);
+            const uintptr_t aligned = (base + kArenaBytes - 1) & ~(uintptr_t(kArenaBytes) - 1);
+            if (aligned > base) munmap(p, aligned - base);
+            munmap(reinterpret_cast<void*>(aligned + bytes), base + kArenaBytes - aligned);
+            p = reinterpret_cast<void*>(aligned);
+            madvise(p, bytes, MADV_HUGEPAGE);
+        }
+        arenas.fetch_add(1, memory_order_relaxed);
+        reservedBytes.fetch_add(bytes, memory_order_relaxed);
+        return static_cast<uint8_t*>(p);
+    }
+};
+
+/**
+ * @brief Reference-counted handle to a pooled frame buffer.
+ *
+ * Copying a FrameRef shares the buffer; the last handle to go returns it to
+ * the pool from whichever thread drops it. That is how one decoded frame
+ * reaches the recorder and a preview without a copy. Fill the buffer before
+ * sharing it: shared frames are read-only by convention.
+ */
+class FrameRef {
+    FrameBlock* block{nullptr};
+
+public:
+    FrameRef() = default;
+    static FrameRef allocate(size_t bytes) {
+        FrameRef f;
+        f.block = FramePool::shared().acquire(bytes);
+        return f;
+    }
+    static FrameRef copyOf(const uint8_t* data, size_t size, int64_t ptsNs = 0, bool keyframe = false) {
+        FrameRef f = allocate(size);
+        memcpy(f.data(), data, size);
+        f.block->ptsNs = ptsNs;
+        f.block->flags = keyframe ? FrameBlock::kKeyframe : 0;
+        return f;
+    }
+
+    FrameRef(const FrameRef& o) : block(o.block) {
+        if (block) block->refs.fetch_add(1, memory_order_relaxed);
+    }
+    FrameRef(FrameRef&& o) noexcept : block(exchange(o.block, nullptr)) {}
+    FrameRef& operator=(FrameRef o) noexcept {
+        swap(block, o.block);
+        return *this;
+    }
+    ~FrameRef() { reset(); }
+
+    void reset() {
+        if (block && block->refs.fetch_sub(1, memory_order_acq_rel) == 1) FramePool::shared().release(block);
+        block = nullptr;
+    }
+
+    uint8_t* data() { return block->data(); }
+    const uint8_t* data() const { return block->data(); }
+    size_t size() const { return block->size; }
+    size_t capacity() const { return block->capacity; }
+    void resize(size_t n) {
+        if (n > block->capacity) throw length_error("FrameRef::resize beyond capacity");
+        block->size = n;
+    }
+    int64_t ptsNs() const { return block->ptsNs; }
+    bool isKeyframe() const { return block->flags & FrameBlock::kKeyframe; }
+    void setTiming(int64_t pts, bool keyframe) {
+        block->ptsNs = pts;
+        block->flags = keyframe ? FrameBlock::kKeyframe : 0;
+    }
+    uint32_t useCount() const { return block ? block->refs.load(memory_order_relaxed) : 0; }
+    explicit operator bool() const { return block != nullptr; }
+};
+
+// =========================
+// Recording pipeline
+// =========================
+/**
+ * @brief Bounded single-producer single-consumer lock-free ring.
+ *
+ * Capacity is rounded up to a power of two. Each side caches the other side's
+ * index, so a push or pop only touches the shared cache line when the cached
+ * view says the ring looks full or empty.
+ */
+template <class T>
+class SpscRing {
+private:
+    vector<T> slots;
+    size_t mask;
+    alignas(64) atomic<size_t> head{0};  // next slot to pop; written by the consumer
+    alignas(64) size_t cachedTail{0};    // consumer's view of tail
+    alignas(64) atomic<size_t> tail{0};  // next slot to push; written by the producer
+    alignas(64) size_t cachedHead{0};    // producer's view of head
+
+    static size_t roundUp(size_t n) {
+        size_t p = 2;
+        while (p < n) p <<= 1;
+        return p;
+    }
+
+    template <class U>
+    bool emplace(U&& value) {
+        const size_t t = tail.load(memory_order_relaxed);
+        if (t - cachedHead == slots.size()) {
+            cachedHead = head.load(memory_order_acquire);
+            if (t - cachedHead == slots.size()) return false;
+        }
+        slots[t & mask] = forward<U>(value);
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+
+public:
+    explicit SpscRing(size_t capacity) : slots(roundUp(capacity)), mask(slots.size() - 1) {}
+
+    bool tryPush(const T& value) { return emplace(value); }
+    // Moves from `value` only on success.
+    bool tryPush(T&& value) { return emplace(move(value)); }
+
+    bool tryPop(T& out) {
+        const size_t h = head.load(memory_order_relaxed);
+        if (h == cachedTail) {
+            cachedTail = tail.load(memory_order_acquire);
+            if (h == cachedTail) return false;
+        }
+        out = move(slots[h & mask]);  // leaves nothing (e.g. a FrameRef) pinned in the slot
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+
+    // Approximate when called from a third thread.
+    size_t size() const { return tail.load(memory_order_acquire) - head.load(memory_order_acquire); }
+    size_t capacity() const { return slots.size(); }
+};
+
+// Spin, then yield, then sleep: keeps idle pipeline stages off the CPU without a futex on the hot path.
+class Backoff {
+    unsigned rounds{0};
+public:
+    void pause() {
+        if (++rounds < 64) return;
+        if (rounds < 128) this_thread::yield();
+        else this_thread::sleep_for(chrono::microseconds(50));
+    }
+    void reset() { rounds = 0; }
+};
+
+struct AlignedFree {
+    void operator()(void* p) const { free(p); }
+};
+using AlignedBuffer = unique_ptr<uint8_t[], AlignedFree>;
+
+inline AlignedBuffer allocateAligned(size_t bytes, size_t alignment) {
+    void* p = nullptr;
+    if (posix_memalign(&p, alignment, bytes) != 0) throw bad_alloc();
+    return AlignedBuffer(static_cast<uint8_t*>(p));
+}
+
+// On-disk record preceding every frame payload.
+struct FrameHeader {
+    static constexpr uint32_t kMagic = 0x314D5246;  // "FRM1"
+    static constexpr uint32_t kKeyframe = 1;
+    uint32_t magic{kMagic};
+    uint32_t size{0};
+    uint64_t sequence{0};
+    int64_t ptsNs{0};
+    uint32_t flags{0};
+    uint32_t reserved{0};
+
+    bool isKeyframe() const { return flags & kKeyframe; }
+};
+static_assert(sizeof(FrameHeader) == 32, "FrameHeader is part of the file format");
+
+/**
+ * @brief Append-only file writer that only issues large, aligned writes.
+ *
+ * Bytes are gathered in a page-aligned staging buffer and written once it is
+ * full, so every write() except the last covers exactly batchBytes at an
+ * aligned offset; records straddle batches freely. Each batch gets
+ * sync_file_range() to start writeback early, and the previous batch is waited
+ * on and dropped from the page cache, so a long recording does not build up a
+ * backlog of dirty pages that the kernel flushes all at once.
+ */
+class BatchedFileWriter {
+private:
+    FileDescriptor fd;
+    AlignedBuffer staging;
+    size_t batchBytes;
+    size_t used{0};
+    uint64_t flushedBytes{0};
+    uint64_t writeCalls{0};
+    double maxWriteSeconds{0.0};
+
+    void writeStaging() {
+        if (used == 0) return;
+        auto start = chrono::steady_clock::now();
+        for (size_t done = 0; done < used;) {
+            ssize_t n = ::pwrite(fd.get(), staging.get() + done, used - done, static_cast<off_t>(flushedBytes + done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) throwErrno("pwrite");
+            done += static_cast<size_t>(n);
+        }
+        sync_file_range(fd.get(), static_cast<off_t>(flushedBytes), static_cast<off_t>(used), SYNC_FILE_RANGE_WRITE);
+        if (flushedBytes >= batchBytes) {
+            const off_t prev = static_cast<off_t>(flushedBytes - batchBytes);
+            sync_file_range(fd.get(), prev, static_cast<off_t>(batchBytes),
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(fd.get(), prev, static_cast<off_t>(batchBytes), POSIX_FADV_DONTNEED);
+        }
+        maxWriteSeconds = max(maxWriteSeconds, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+        flushedBytes += used;
+        used = 0;
+        ++writeCalls;
+    }
+
+public:
+    static constexpr size_t kAlignment = 4096;
+
+    BatchedFileWriter(const string& path, size_t batch)
+        : fd(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)),
+          batchBytes((max(batch, kAlignment) + kAlignment - 1) / kAlignment * kAlignment) {
+        if (!fd) throwErrno("open " + path);
+        staging = allocateAligned(batchBytes, kAlignment);
+    }
+    ~BatchedFileWriter() {
+        try {
+            close();
+        } catch (const exception&) {
+        }
+    }
+
+    void append(const void* data, size_t len) {
+        const auto* p = static_cast<const uint8_t*>(data);
+        while (len > 0) {
+            size_t n = min(len, batchBytes - used);
+            memcpy(staging.get() + used, p, n);
+            used += n;
+            p += n;
+            len -= n;
+            if (used == batchBytes) writeStaging();
+        }
+    }
+
+    void close() {
+        if (!fd) return;
+        writeStaging();
+        if (::fdatasync(fd.get()) != 0) throwErrno("fdatasync");
+        fd.reset();
+    }
+
+    // Logical end of file, including bytes still staged.
+    uint64_t offset() const { return flushedBytes + used; }
+    // End of what has reached the file and is visible to readers.
+    uint64_t flushedOffset() const { return flushedBytes; }
+    uint64_t getWriteCalls() const { return writeCalls; }
+    double getMaxWriteSeconds() const { return maxWriteSeconds; }
+};
+
+// Where the writer stage puts frames. Called from the writer thread only.
+class IRecordingSink {
+public:
+    virtual ~IRecordingSink() = default;
+    virtual void append(const FrameHeader& header, const uint8_t* payload) = 0;
+    virtual void close() = 0;
+    virtual uint64_t getWriteCalls() const { return 0; }
+    virtual double getMaxWriteSeconds() const { return 0.0; }
+};
+
+// One file of back-to-back FrameHeader + payload records.
+class FileRecordingSink final : public IRecordingSink {
+    BatchedFileWriter writer;
+public:
+    explicit FileRecordingSink(const string& path, size_t batchBytes = 4u << 20) : writer(path, batchBytes) {}
+    void append(const FrameHeader& header, const uint8_t* payload) override {
+        writer.append(&header, sizeof header);
+        writer.append(payload, header.size);
+    }
+    void close() override { writer.close(); }
+    uint64_t getWriteCalls() const override { return writer.getWriteCalls(); }
+    double getMaxWriteSeconds() const override { return writer.getMaxWriteSeconds(); }
+};
+
+// What the capture stage does when every preallocated frame buffer is in flight.
+enum class DropPolicy {
+    Block,           // wait for the writer: lossless, but stalls whoever is capturing
+    DropNewest,      // discard the incoming frame
+    DropToKeyframe,  // discard it and every following delta frame until a keyframe fits, so the file stays decodable
+};
+
+struct RecordingStats {
+    uint64_t framesCaptured{0};
+    uint64_t framesWritten{0};
+    uint64_t framesDropped{0};
+    uint64_t framesOversize{0};
+    uint64_t captureStalls{0};
+    uint64_t bytesWritten{0};
+    uint64_t writeCalls{0};
+    size_t maxInFlight{0};
+    double maxWriteSeconds{0.0};
+};
+
+/**
+ * @brief Capture -> encode-passthrough -> writer pipeline over preallocated frames.
+ *
+ * All frame memory is allocated up front: `frameSlots` buffers of
+ * `maxFrameBytes`. Slot indices circulate through three SPSC rings
+ * (free -> encode -> write -> free), so no stage locks or allocates per frame.
+ * The encode stage keeps the payload as-is and stamps the on-disk header; a
+ * real encoder would slot in there. The writer hands frames to an
+ * IRecordingSink. A disk stall only backs up the rings; what happens when they
+ * are full is the DropPolicy's call, and every outcome is counted.
+ *
+ * capture(FrameRef) skips the copy: the slot holds a reference to the pooled
+ * frame until the writer has appended it. With `copyFrames` off no slot
+ * buffers are allocated and only that overload may be used.
+ *
+ * capture() must be called from a single thread.
+ */
+class RecordingPipeline {
+public:
+    struct Options {
+        size_t frameSlots{64};  // about a second of 4K60 video
+        size_t maxFrameBytes{1u << 20};
+        DropPolicy dropPolicy{DropPolicy::DropToKeyframe};
+        bool copyFrames{true};
+    };
+
+private:
+    struct Slot {
+        FrameHeader header;
+        uint8_t* payload{nullptr};
+        FrameRef frame;  // set instead of `payload` for zero-copy captures
+        int64_t capturedNs{0};  // MediaMetrics::now() at capture
+    };
+
+    struct Metrics {
+        MediaMetrics::Id captured, dropped, bytes, queueWait, write, captureToDisk, inFlight;
+    } metrics;
+    string metricsStream;
+
+    Options opts;
+    unique_ptr<IRecordingSink> sink;
+    AlignedBuffer arena;
+    vector<Slot> slots;
+    SpscRing<uint32_t> freeRing, encodeRing, writeRing;
+    atomic<bool> capturing{true};
+    atomic<bool> encoderDone{false};
+    atomic<bool> drained{false};
+    thread encoder, writer;
+    exception_ptr writerError;
+
+    // Capture-side state (capture thread only).
+    uint64_t nextSequence{0};
+    bool awaitingKeyframe{false};
+
+    alignas(64) atomic<uint64_t> captured{0}, dropped{0}, oversize{0}, stalls{0};
+    alignas(64) atomic<uint64_t> written{0}, bytesWritten{0};
+    atomic<size_t> maxInFlight{0};
+
+    void encodeLoop() {
+        Backoff idle;
+        uint32_t idx;
+        for (;;) {
+            if (!encodeRing.tryPop(idx)) {
+                if (!capturing.load(memory_order_acquire) && encodeRing.size() == 0) break;
+                idle.pause();
+                continue;
+            }
+            idle.reset();
+            Slot& s = slots[idx];
+            s.header.magic = FrameHeader::kMagic;  // passthrough: payload is already encoded
+            Backoff full;
+            while (!writeRing.tryPush(idx)) full.pause();
+        }
+        encoderDone.store(true, memory_order_release);
+    }
+
+    void writeLoop() {
+        Backoff idle;
+        uint32_t idx;
+        for (;;) {
+            if (!writeRing.tryPop(idx)) {
+                if (encoderDone.load(memory_order_acquire) && writeRing.size() == 0) break;
+                idle.pause();
+                continue;
+            }
+            idle.reset();
+            Slot& s = slots[idx];
+            auto& mm = MediaMetrics::global();
+            mm.recordSince(metrics.queueWait, s.capturedNs);
+            if (!writerError) {
+                try {
+                    const int64_t begin = MediaMetrics::now();
+                    sink->append(s.header, s.frame ? s.frame.data() : s.payload);
+                    mm.recordSince(metrics.write, begin);
+                    mm.recordSince(metrics.captureToDisk, s.capturedNs);
+                    mm.add(metrics.bytes, sizeof(FrameHeader) + s.header.size);
+                    written.fetch_add(1, memory_order_relaxed);
+                    bytesWritten.fetch_add(sizeof(FrameHeader) + s.header.size, memory_order_relaxed);
+                } catch (...) {
+                    writerError = current_exception();  // keep draining so capture never deadlocks
+                }
+            }
+            s.frame.reset();
+            freeRing.tryPush(idx);  // cannot fail: the ring holds every slot
+        }
+    }
+
+    // Drop-policy and sequencing shared by both capture() overloads; on true, `idx` is a free slot.
+    bool admit(size_t size, bool keyframe, uint64_t& sequence, uint32_t& idx) {
+        sequence = nextSequence++;
+        captured.fetch_add(1, memory_order_relaxed);
+        MediaMetrics::global().add(metrics.captured);
+        if (size > opts.maxFrameBytes) {
+            oversize.fetch_add(1, memory_order_relaxed);
+            dropped.fetch_add(1, memory_order_relaxed);
+            awaitingKeyframe = opts.dropPolicy == DropPolicy::DropToKeyframe;
+            return false;
+        }
+        if (awaitingKeyframe && !keyframe) {
+            dropped.fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+        if (!freeRing.tryPop(idx)) {
+            if (opts.dropPolicy != DropPolicy::Block) {
+                dropped.fetch_add(1, memory_order_relaxed);
+                awaitingKeyframe = opts.dropPolicy == DropPolicy::DropToKeyframe;
+                return false;
+            }
+            stalls.fetch_add(1, memory_order_relaxed);
+            Backoff wait;
+            while (!freeRing.tryPop(idx)) wait.pause();
+        }
+        awaitingKeyframe = false;
+        return true;
+    }
+
+    void submit(uint32_t idx, size_t size, uint64_t sequence, int64_t ptsNs, bool keyframe) {
+        Slot& s = slots[idx];
+        s.capturedNs = MediaMetrics::now();
+        s.header.size = static_cast<uint32_t>(size);
+        s.header.sequence = sequence;
+        s.header.ptsNs = ptsNs;
+        s.header.flags = keyframe ? FrameHeader::kKeyframe : 0;
+        encodeRing.tryPush(idx);  // cannot fail: the ring holds every slot
+
+        size_t inFlight = opts.frameSlots - freeRing.size();
+        size_t seen = maxInFlight.load(memory_order_relaxed);
+        if (inFlight > seen) maxInFlight.store(inFlight, memory_order_relaxed);  // single writer
+        MediaMetrics::global().set(metrics.inFlight, static_cast<int64_t>(inFlight));
+    }
+
+public:
+    RecordingPipeline(unique_ptr<IRecordingSink> s, Options o)
+        : opts(o), sink(move(s)), freeRing(o.frameSlots), encodeRing(o.frameSlots), writeRing(o.frameSlots) {
+        auto& mm = MediaMetrics::global();
+        const string& stream = metricsStream = mm.uniqueStream("recording");
+        metrics = {mm.counter(stream, "frames_captured"), mm.counter(stream, "frames_dropped"), mm.counter(stream, "bytes_written"),
+                   mm.histogram(stream, "queue_wait"), mm.histogram(stream, "write"), mm.histogram(stream, "capture_to_disk"),
+                   mm.gauge(stream, "slots_in_flight")};
+        const size_t stride = opts.copyFrames ? (opts.maxFrameBytes + 63) / 64 * 64 : 0;
+        if (stride) arena = allocateAligned(stride * opts.frameSlots, 4096);
+        slots.resize(opts.frameSlots);
+        for (size_t i = 0; i < opts.frameSlots; ++i) {
+            if (stride) {
+                slots[i].payload = arena.get() + i * stride;
+                memset(slots[i].payload, 0, stride);  // fault the pages in now, not on the capture path
+            }
+            freeRing.tryPush(static_cast<uint32_t>(i));
+        }
+        encoder = thread([this] { encodeLoop(); });
+        writer = thread([this] { writeLoop(); });
+    }
+    explicit RecordingPipeline(unique_ptr<IRecordingSink> s) : RecordingPipeline(move(s), Options{}) {}
+
+    ~RecordingPipeline() {
+        try {
+            stop();
+        } catch (const exception&) {
+        }
+        MediaMetrics::global().release(metricsStream);
+    }
+
+    // Returns false if the frame was dropped.
+    // Sequence numbers count every captured frame, so drops show up as gaps in the file.
+    bool capture(const uint8_t* data, size_t size, int64_t ptsNs, bool keyframe) {
+        if (!opts.copyFrames) throw logic_error("RecordingPipeline without copyFrames takes FrameRefs only");
+        uint64_t sequence;
+        uint32_t idx;
+        if (!admit(size, keyframe, sequence, idx)) {
+            MediaMetrics::global().add(metrics.dropped);
+            return false;
+        }
+        memcpy(slots[idx].payload, data, size);
+        submit(idx, size, sequence, ptsNs, keyframe);
+        return true;
+    }
+
+    // Zero-copy: keeps a reference to `frame` until it is on disk. Timing comes from the frame.
+    bool capture(FrameRef frame) {
+        uint64_t sequence;
+        uint32_t idx;
+        const size_t size = frame.size();
+        if (!admit(0, frame.isKeyframe(), sequence, idx)) {  // nothing is copied, so no size limit
+            MediaMetrics::global().add(metrics.dropped);
+            return false;
+        }
+        const int64_t pts = frame.ptsNs();
+        const bool key = frame.isKeyframe();
+        slots[idx].frame = move(frame);
+        submit(idx, size, sequence, pts, key);
+        return true;
+    }
+
+    // Drains every accepted frame to the sink and closes it. Idempotent.
+    RecordingStats stop() {
+        if (capturing.exchange(false)) {
+            encoder.join();
+            writer.join();
+            if (!writerError) sink->close();
+            drained.store(true, memory_order_release);
+            if (writerError) rethrow_exception(writerError);
+        }
+        return stats();
+    }
+
+    RecordingStats stats() const {
+        RecordingStats st;
+        st.framesCaptured = captured.load(memory_order_relaxed);
+        st.framesWritten = written.load(memory_order_relaxed);
+        st.framesDropped = dropped.load(memory_order_relaxed);
+        st.framesOversize = oversize.load(memory_order_relaxed);
+        st.captureStalls = stalls.load(memory_order_relaxed);
+        st.bytesWritten = bytesWritten.load(memory_order_relaxed);
+        st.maxInFlight = maxInFlight.load(memory_order_relaxed);
+        if (drained.load(memory_order_acquire)) {  // sink counters are only stable once the writer has exited
+            st.writeCalls = sink->getWriteCalls();
+            st.maxWriteSeconds = sink->getMaxWriteSeconds();
+        }
+        return st;
+    }
+};
+
+/**
+ * @brief Deterministic stand-in for an encoder's output at a given bitrate.
+ *
+ * One keyframe per GOP, about `keyframeRatio` times the size of a delta
+ * frame, with +-20% jitter on delta frames. Payload bytes come from one
+ * pre-filled buffer, so producing a frame costs nothing.
+ */
+class SyntheticFrameSource {
+private:
+    double fps;
+    uint32_t gop;
+    size_t deltaBytes, keyBytes;
+    vector<uint8_t> payload;
+    uint64_t frameIndex{0};
+    uint64_t gopStart{0};
+    uint64_t rng{0x2545F4914F6CDD1Dull};
+
+public:
+    struct Frame {
+        const uint8_t* data;
+        size_t size;
+        int64_t ptsNs;
+        bool keyframe;
+    };
+
+    SyntheticFrameSource(uint64_t bitsPerSecond, double framesPerSecond, uint32_t gopFrames = 60, double keyframeRatio = 6.0)
+        : fps(framesPerSecond), gop(max<uint32_t>(gopFrames, 1)) {
+        const double perGop = bitsPerSecond / 8.0 / fps * gop;
+        deltaBytes = static_cast<size_t>(perGop / (keyframeRatio + gop - 1));
+        keyBytes = static_cast<size_t>(deltaBytes * keyframeRatio);
+        payload.resize(maxFrameBytes() + 64);  // frames start at one of 64 offsets
+        for (auto& b : payload) b = static_cast<uint8_t>(rng >> 56), rng = rng * 6364136223846793005ull + 1442695040888963407ull;
+    }
+
+    Frame next() {
+        const bool key = (frameIndex - gopStart) % gop == 0;
+        size_t size = keyBytes;
+        if (!key) {
+            rng ^= rng << 13, rng ^= rng >> 7, rng ^= rng << 17;
+            size = deltaBytes * (80 + rng % 41) / 100;
+        }
+        Frame f{payload.data() + frameIndex % 64, size, static_cast<int64_t>(frameIndex * 1e9 / fps), key};
+        ++frameIndex;
+        return f;
+    }
+
+    // Like an encoder's IDR request: the next frame is a keyframe and starts a new GOP.
+    void requestKeyframe() { gopStart = frameIndex; }
+
+    double getFps() const { return fps; }
+    size_t maxFrameBytes() const { return max(keyBytes, deltaBytes * 120 / 100); }
+};
+
+// =========================
+// Segmented recording
+// =========================
+// One keyframe in a segment's .idx file: its pts and the byte offset of its FrameHeader in the .frm.
+struct SegmentIndexEntry {
+    int64_t ptsNs;
+    uint64_t offset;
+};
+static_assert(sizeof(SegmentIndexEntry) == 16, "SegmentIndexEntry is part of the file format");
+
+// Holds the pts of the recording's first frame, so positions stay absolute after old segments rotate away.
+inline string recordingStartPath(const string& dir) { return dir + "/recording.start"; }
+
+inline string segmentPath(const string& dir, uint32_t segment, const char* ext) {
+    char name[32];
+    snprintf(name, sizeof name, "/segment-%06u.%s", segment, ext);
+    return dir + name;
+}
+
+// Segment numbers present in a recording directory, ascending.
+inline vector<uint32_t> listSegments(const string& dir) {
+    vector<uint32_t> segments;
+    DIR* d = opendir(dir.c_str());
+    if (!d) return segments;
+    while (dirent* e = readdir(d)) {
+        unsigned n;
+        char ext[8];
+        if (sscanf(e->d_name, "segment-%6u.%3s", &n, ext) == 2 && strcmp(ext, "idx") == 0) segments.push_back(n);
+    }
+    closedir(d);
+    sort(segments.begin(), segments.end());
+    return segments;
+}
+
+/**
+ * @brief IRecordingSink that cuts a recording into fixed-duration segments.
+ *
+ * A directory holds one recording as segment-NNNNNN.frm files plus a
+ * segment-NNNNNN.idx next to each, listing the pts and byte offset of every
+ * keyframe in it. A new segment starts at the first keyframe once the current
+ * one spans `segmentDuration`, so every segment but possibly the first opens
+ * decodable. Index entries are appended with one small write() per keyframe
+ * from the writer thread, so the capture thread never sees index I/O. An
+ * entry is held back until the frame it points at has left the staging buffer
+ * for the file. A reader that loads the live segment's index can therefore
+ * seek to every keyframe listed in it; only the newest ~batchBytes are not
+ * yet indexed. The first frame's pts goes to recording.start, and seek
+ * positions are measured from it. With maxSegments set, the oldest segment
+ * pair is unlinked as new ones close; nothing is ever rewritten.
+ */
+class SegmentedRecordingSink final : public IRecordingSink {
+public:
+    struct Options {
+        chrono::nanoseconds segmentDuration{chrono::seconds(10)};
+        size_t maxSegments{0};  // 0 keeps everything
+        size_t batchBytes{4u << 20};
+    };
+
+private:
+    string dir;
+    Options opts;
+    unique_ptr<BatchedFileWriter> data;
+    FileDescriptor index;
+    uint32_t segment{0};
+    int64_t segmentStartPts{0};
+    deque<uint32_t> retained;
+    deque<pair<SegmentIndexEntry, uint64_t>> unpublished;  // index entry, end offset of its frame
+    bool started{false};
+    uint64_t writeCalls{0};
+    double maxWriteSeconds{0.0};
+
+    // Appends index entries whose frames are entirely in the file.
+    void publishIndex(uint64_t flushedTo) {
+        while (!unpublished.empty() && unpublished.front().second <= flushedTo) {
+            const SegmentIndexEntry& entry = unpublished.front().first;
+            if (::write(index.get(), &entry, sizeof entry) != static_cast<ssize_t>(sizeof entry)) throwErrno("write index");
+            unpublished.pop_front();
+        }
+    }
+
+    void closeSegment() {
+        if (!data) return;
+        data->close();
+        publishIndex(UINT64_MAX);
+        writeCalls += data->getWriteCalls();
+        maxWriteSeconds = max(maxWriteSeconds, data->getMaxWriteSeconds());
+        data.reset();
+        if (::fdatasync(index.get()) != 0) throwErrno("fdatasync index");
+        index.reset();
+        retained.push_back(segment++);
+        while (opts.maxSegments && retained.size() > opts.maxSegments) {
+            // Index first: readers discover segments through their .idx.
+            ::unlink(segmentPath(dir, retained.front(), "idx").c_str());
+            ::unlink(segmentPath(dir, retained.front(), "frm").c_str());
+            retained.pop_front();
+        }
+    }
+
+    void openSegment(int64_t ptsNs) {
+        data = make_unique<BatchedFileWriter>(segmentPath(dir, segment, "frm"), opts.batchBytes);
+        index = FileDescriptor(::open(segmentPath(dir, segment, "idx").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644));
+        if (!index) throwErrno("open index");
+        segmentStartPts = ptsNs;
+    }
+
+public:
+    SegmentedRecordingSink(string directory, Options o) : dir(move(directory)), opts(o) {
+        if (::mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) throwErrno("mkdir " + dir);
+        if (!listSegments(dir).empty()) throw invalid_argument(dir + " already contains a recording");
+    }
+    explicit SegmentedRecordingSink(string directory) : SegmentedRecordingSink(move(directory), Options{}) {}
+    ~SegmentedRecordingSink() override {
+        try {
+            close();
+        } catch (const exception&) {
+        }
+    }
+
+    void append(const FrameHeader& header, const uint8_t* payload) override {
+        if (data && header.isKeyframe() && header.ptsNs - segmentStartPts >= opts.segmentDuration.count()) closeSegment();
+        if (!data) openSegment(header.ptsNs);
+        if (!started) {
+            FileDescriptor startFile(::open(recordingStartPath(dir).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+            if (!startFile) throwErrno("open " + recordingStartPath(dir));
+            writeAll(startFile.get(), reinterpret_cast<const char*>(&header.ptsNs), sizeof header.ptsNs);
+            started = true;
+        }
+        if (header.isKeyframe()) {
+            uint64_t at = data->offset();
+            unpublished.push_back({SegmentIndexEntry{header.ptsNs, at}, at + sizeof header + header.size});
+        }
+        data->append(&header, sizeof header);
+        data->append(payload, header.size);
+        publishIndex(data->flushedOffset());
+    }
+
+    void close() override { closeSegment(); }
+    uint64_t getWriteCalls() const override { return writeCalls; }
+    double getMaxWriteSeconds() const override { return maxWriteSeconds; }
+};
+
+// =========================
+// Live playback
+// =========================
+inline int64_t steadyNowNs() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Datagram layout of the live feed: one frame (or slice) per packet, RTP-style.
+struct StreamPacketHeader {
+    static constexpr uint32_t kMagic = 0x31504B50;  // "PKP1"
+    uint32_t magic{kMagic};
+    uint32_t sequence{0};
+    int64_t ptsNs{0};      // media timestamp
+    int64_t captureNs{0};  // sender's steady clock at capture, for glass-to-glass latency (same host only)
+    uint32_t flags{0};     // FrameHeader::kKeyframe
+    uint32_t size{0};
+};
+static_assert(sizeof(StreamPacketHeader) == 32, "StreamPacketHeader is part of the wire format");
+
+/**
+ * @brief Fixed-range latency histogram: 0.1 ms buckets up to 1 s, O(1) record, no allocation after construction.
+ */
+class LatencyHistogram {
+    static constexpr int64_t kBucketNs = 100'000;
+    static constexpr size_t kBuckets = 10'000;
+    vector<uint64_t> buckets = vector<uint64_t>(kBuckets + 1);  // last bucket: >= 1 s
+    uint64_t count{0};
+    int64_t maxNs{0};
+
+public:
+    void record(int64_t ns) {
+        ns = max<int64_t>(ns, 0);
+        ++buckets[min<size_t>(static_cast<size_t>(ns / kBucketNs), kBuckets)];
+        ++count;
+        maxNs = max(maxNs, ns);
+    }
+
+    // Upper edge of the bucket holding quantile q, in milliseconds.
+    double percentileMs(double q) const {
+        if (count == 0) return 0.0;
+        const uint64_t rank = static_cast<uint64_t>(ceil(q * count));
+        uint64_t seen = 0;
+        for (size_t i = 0; i <= kBuckets; ++i) {
+            seen += buckets[i];
+            if (seen >= rank) return i == kBuckets ? maxNs / 1e6 : (i + 1) * kBucketNs / 1e6;
+        }
+        return maxNs / 1e6;
+    }
+    double maxMs() const { return maxNs / 1e6; }
+    uint64_t getCount() const { return count; }
+};
+
+struct JitterStats {
+    uint64_t received{0};
+    uint64_t played{0};
+    uint64_t lateDrops{0};      // arrived after their slot was already played or skipped
+    uint64_t duplicates{0};
+    uint64_t missing{0};        // skipped at playout time: lost, or still in flight (becomes a late drop)
+    uint64_t discontinuities{0};  // sequence jumped a whole slot window away; the buffer was flushed and resynced
+    double avgDepth{0.0};       // packets buffered, sampled at each playout
+    size_t maxDepth{0};
+    double delayMs{0.0};        // current playout delay above the fastest observed transit
+    double jitterMs{0.0};       // RFC 3550 interarrival jitter estimate
+};
+
+/**
+ * @brief Adaptive jitter buffer over preallocated sequence-indexed slots.
+ *
+ * Packets are slotted by sequence number, so reordering costs nothing; slot
+ * storage (headers and payload bytes) is allocated once. A packet plays at
+ * pts + fastestTransit + delay: fastestTransit is the minimum arrival - pts
+ * over a sliding window, and delay is the `quantile` of the window's transit
+ * spread plus a small margin. The delay grows at once when the network gets
+ * worse and gives back at most `shrinkStep` per update when it calms down, so
+ * latency tracks conditions without oscillating. A missing packet is skipped
+ * once the next present one is due; if it shows up after that it is a late
+ * drop. With adaptive=false the delay stays at fixedDelay, for comparison.
+ * A sequence a whole slot window ahead of or behind the playout point (a long
+ * outage, or a sender that restarted its numbering) is a discontinuity: the
+ * buffered packets are counted as missing and dropped, and playout restarts
+ * from that packet.
+ *
+ * Single-threaded: insert() and popDue() come from one event loop.
+ */
+class JitterBuffer {
+public:
+    struct Options {
+        size_t slots{1024};
+        size_t maxPayload{1400};
+        bool adaptive{true};
+        chrono::nanoseconds fixedDelay{chrono::milliseconds(40)};
+        chrono::nanoseconds minDelay{chrono::milliseconds(2)};
+        chrono::nanoseconds maxDelay{chrono::milliseconds(500)};
+        double quantile{0.99};
+        chrono::nanoseconds shrinkStep{chrono::microseconds(500)};
+    };
+
+    struct Packet {
+        StreamPacketHeader header;
+        const uint8_t* payload;
+    };
+
+private:
+    struct Slot {
+        bool present{false};
+        StreamPacketHeader header;
+    };
+    static constexpr size_t kWindow = 512;
+    static constexpr int kUpdateEvery = 16;
+
+    Options opts;
+    vector<Slot> slots;
+    vector<uint8_t> payloads;
+    bool started{false};
+    uint32_t nextSeq{0};   // next sequence to play
+    uint32_t highSeq{0};   // highest sequence stored + 1
+    size_t depth{0};
+
+    array<int64_t, kWindow> transits{};
+    array<int64_t, kWindow> scratch{};
+    size_t transitCount{0};
+    int64_t fastestTransit{0};
+    int64_t delayNs{0};
+    int sinceUpdate{0};
+    double jitterNs{0.0};
+    int64_t lastTransit{0};
+
+    JitterStats stats;
+    uint64_t depthSamples{0};
+    double depthSum{0.0};
+
+    Slot& slotOf(uint32_t seq) { return slots[seq % slots.size()]; }
+    int64_t playAt(const StreamPacketHeader& h) const { return h.ptsNs + fastestTransit + delayNs; }
+
+    // The next insert() starts over as if it were the first packet; the delay estimate is kept.
+    void resync() {
+        for (auto& s : slots) s.present = false;
+        stats.missing += depth;
+        ++stats.discontinuities;
+        depth = 0;
+        transitCount = 0;
+        sinceUpdate = 0;
+        started = false;
+    }
+
+    void updateDelay() {
+        const size_t n = min(transitCount, kWindow);
+        copy(transits.begin(), transits.begin() + n, scratch.begin());
+        auto q = scratch.begin() + min(n - 1, static_cast<size_t>(opts.quantile * n));
+        nth_element(scratch.begin(), q, scratch.begin() + n);
+        const int64_t fastest = *min_element(scratch.begin(), q + 1);
+        fastestTransit = fastest;
+        if (!opts.adaptive) return;
+        const int64_t target = clamp<int64_t>(*q - fastest + opts.minDelay.count(), opts.minDelay.count(), opts.maxDelay.count());
+        delayNs = target > delayNs ? target : max(target, delayNs - static_cast<int64_t>(opts.shrinkStep.count()));
+    }
+
+public:
+    explicit JitterBuffer(Options o) : opts(o), slots(o.slots), payloads(o.slots * o.maxPayload) {
+        delayNs = opts.adaptive ? opts.minDelay.count() : opts.fixedDelay.count();
+    }
+    JitterBuffer() : JitterBuffer(Options{}) {}
+
+    void insert(const StreamPacketHeader& h, const uint8_t* payload, int64_t arrivalNs) {
+        if (h.size > opts.maxPayload) return;
+        ++stats.received;
+        const int64_t transit = arrivalNs - h.ptsNs;
+        if (started) {
+            const int64_t gap = static_cast<int32_t>(h.sequence - nextSeq);
+            if (gap >= static_cast<int64_t>(slots.size()) || gap < -static_cast<int64_t>(slots.size())) resync();
+        }
+        if (!started) {
+            started = true;
+            nextSeq = highSeq = h.sequence;
+            fastestTransit = lastTransit = transit;
+        }
+        jitterNs += (fabs(static_cast<double>(transit - lastTransit)) - jitterNs) / 16.0;
+        lastTransit = transit;
+        transits[transitCount++ % kWindow] = transit;
+        if (++sinceUpdate >= kUpdateEvery || transitCount <= kWindow) {
+            sinceUpdate = 0;
+            updateDelay();
+        }
+
+        const int32_t ahead = static_cast<int32_t>(h.sequence - nextSeq);
+        if (ahead < 0) {
+            ++stats.lateDrops;
+            return;
+        }
+        Slot& s = slotOf(h.sequence);
+        if (s.present) {
+            ++stats.duplicates;
+            return;
+        }
+        s.present = true;
+        s.header = h;
+        memcpy(&payloads[(h.sequence % slots.size()) * opts.maxPayload], payload, h.size);
+        ++depth;
+        if (static_cast<int32_t>(h.sequence + 1 - highSeq) > 0) highSeq = h.sequence + 1;
+    }
+
+    // Steady-clock time at which popDue() next has something to do; INT64_MAX if empty.
+    int64_t nextDeadline() const {
+        if (depth == 0) return numeric_limits<int64_t>::max();
+        for (uint32_t seq = nextSeq; seq != highSeq; ++seq) {
+            const Slot& s = slots[seq % slots.size()];
+            if (s.present) return playAt(s.header);
+        }
+        return numeric_limits<int64_t>::max();
+    }
+
+    // Next packet in sequence order whose playout time has come. The payload stays valid until the next insert().
+    bool popDue(int64_t nowNs, Packet& out) {
+        if (depth == 0) return false;
+        uint32_t seq = nextSeq;
+        while (seq != highSeq && !slotOf(seq).present) ++seq;
+        if (seq == highSeq) return false;
+        Slot& s = slotOf(seq);
+        if (playAt(s.header) > nowNs) return false;
+        stats.missing += seq - nextSeq;
+        depthSum += depth;
+        ++depthSamples;
+        stats.maxDepth = max(stats.maxDepth, depth);
+        s.present = false;
+        --depth;
+        nextSeq = seq + 1;
+        ++stats.played;
+        out.header = s.header;
+        out.payload = &payloads[(seq % slots.size()) * opts.maxPayload];
+        return true;
+    }
+
+    size_t getDepth() const { return depth; }
+
+    JitterStats getStats() const {
+        JitterStats st = stats;
+        st.avgDepth = depthSamples ? depthSum / depthSamples : 0.0;
+        st.delayMs = delayNs / 1e6;
+        st.jitterMs = jitterNs / 1e6;
+        return st;
+    }
+};
+
+/**
+ * @brief UDP receive + playout event loop around a JitterBuffer.
+ *
+ * One thread does both: ppoll() sleeps until either a datagram arrives or the
+ * next packet's playout time, so playout is not delayed by a separate timer
+ * thread handing off through a lock. Glass-to-glass latency (playout time
+ * minus the sender's capture time) goes into a LatencyHistogram.
+ */
+class LiveStreamReceiver {
+private:
+    FileDescriptor sock;
+    uint16_t port{0};
+    JitterBuffer buffer;
+    LatencyHistogram latency;
+    vector<uint8_t> datagram = vector<uint8_t>(65536);
+    string metricsStream;
+    MediaMetrics::Id packetsMetric, playedMetric, networkMetric, playoutMetric, depthMetric;
+
+public:
+    using OnFrame = function<void(const StreamPacketHeader&, const uint8_t*)>;
+
+    // Binds 127.0.0.1:port; 0 picks a free port.
+    explicit LiveStreamReceiver(uint16_t listenPort, JitterBuffer::Options opts = {}) : buffer(opts) {
+        sock = FileDescriptor(::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0));
+        if (!sock) throwErrno("socket");
+        int rcvbuf = 4 << 20;
+        setsockopt(sock.get(), SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(listenPort);
+        if (::bind(sock.get(), reinterpret_cast<sockaddr*>(&addr), sizeof addr) != 0) throwErrno("bind udp");
+        socklen_t len = sizeof addr;
+        getsockname(sock.get(), reinterpret_cast<sockaddr*>(&addr), &len);
+        port = ntohs(addr.sin_port);
+        auto& mm = MediaMetrics::global();
+        const string& stream = metricsStream = mm.uniqueStream("live");
+        packetsMetric = mm.counter(stream, "packets");
+        playedMetric = mm.counter(stream, "frames_played");
+        networkMetric = mm.histogram(stream, "network");  // capture -> arrival
+        playoutMetric = mm.histogram(stream, "playout");  // capture -> handed to onFrame
+        depthMetric = mm.gauge(stream, "jitter_depth");
+    }
+    ~LiveStreamReceiver() { MediaMetrics::global().release(metricsStream); }
+
+    // Runs until `running` goes false (checked at least every 50 ms).
+    void run(const atomic<bool>& running, const OnFrame& onFrame) {
+        pollfd pfd{sock.get(), POLLIN, 0};
+        JitterBuffer::Packet pkt;
+        auto& mm = MediaMetrics::global();
+        while (running.load(memory_order_acquire)) {
+            int64_t wait = min<int64_t>(buffer.nextDeadline() - steadyNowNs(), 50'000'000);
+            timespec ts{0, 0};
+            if (wait > 0) ts = {static_cast<time_t>(wait / 1'000'000'000), static_cast<long>(wait % 1'000'000'000)};
+            if (ppoll(&pfd, 1, &ts, nullptr) > 0) {
+                for (;;) {
+                    ssize_t n = ::recv(sock.get(), datagram.data(), datagram.size(), 0);
+                    if (n < static_cast<ssize_t>(sizeof(StreamPacketHeader))) break;
+                    StreamPacketHeader h;
+                    memcpy(&h, datagram.data(), sizeof h);
+                    if (h.magic != StreamPacketHeader::kMagic || sizeof h + h.size > static_cast<size_t>(n)) continue;
+                    const int64_t arrival = steadyNowNs();
+                    buffer.insert(h, datagram.data() + sizeof h, arrival);
+                    mm.add(packetsMetric);
+                    mm.record(networkMetric, static_cast<uint64_t>(max<int64_t>(arrival - h.captureNs, 0)));
+                }
+                mm.set(depthMetric, static_cast<int64_t>(buffer.getDepth()));
+            }
+            for (int64_t now = steadyNowNs(); buffer.popDue(now, pkt); now = steadyNowNs()) {
+                latency.record(now - pkt.header.captureNs);
+                mm.add(playedMetric);
+                mm.record(playoutMetric, static_cast<uint64_t>(max<int64_t>(now - pkt.header.captureNs, 0)));
+                if (onFrame) onFrame(pkt.header, pkt.payload);
+            }
+        }
+    }
+
+    uint16_t getPort() const { return port; }
+    JitterStats getStats() const { return buffer.getStats(); }
+    const LatencyHistogram& getLatency() const { return latency; }
+};
+
+/**
+ * @brief Local stand-in for a camera across a bad network.
+ *
+ * Sends `packetsPerSecond` datagrams to 127.0.0.1:port, each delayed by
+ * baseDelay plus an exponentially distributed extra (mean `jitter`), with a
+ * `spikeDelay` burst every `spikeEvery` and random loss. Packets whose delays
+ * cross overtake each other, which is where the reordering comes from.
+ */
+class PacketReplayer {
+public:
+    struct NetworkProfile {
+        chrono::nanoseconds baseDelay{chrono::milliseconds(5)};
+        chrono::nanoseconds jitter{chrono::milliseconds(5)};
+        chrono::nanoseconds spikeEvery{0};
+        chrono::nanoseconds spikeLength{chrono::milliseconds(200)};
+        chrono::nanoseconds spikeDelay{chrono::milliseconds(80)};
+        double lossRate{0.0};
+    };
+
+private:
+    atomic<bool> running{true};
+    thread sender;
+    atomic<uint64_t> sent{0};
+
+    void sendLoop(uint16_t port, double packetsPerSecond, NetworkProfile net, size_t payloadBytes, uint32_t gop) {
+        FileDescriptor sock(::socket(AF_INET, SOCK_DGRAM, 0));
+        sockaddr_in to{};
+        to.sin_family = AF_INET;
+        to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        to.sin_port = htons(port);
+        mt19937_64 rng(7);
+        exponential_distribution<double> extra(net.jitter.count() > 0 ? 1.0 / net.jitter.count() : 1.0);
+        uniform_real_distribution<double> coin(0.0, 1.0);
+
+        struct InFlight {
+            int64_t deliverAt;
+            vector<uint8_t> bytes;
+            bool operator>(const InFlight& o) const { return deliverAt > o.deliverAt; }
+        };
+        priority_queue<InFlight, vector<InFlight>, greater<InFlight>> wire;
+        const int64_t interval = static_cast<int64_t>(1e9 / packetsPerSecond);
+        const int64_t start = steadyNowNs();
+        uint32_t seq = 0;
+        int64_t nextCapture = start;
+        while (running.load(memory_order_acquire) || !wire.empty()) {
+            const int64_t now = steadyNowNs();
+            if (running && now >= nextCapture) {
+                StreamPacketHeader h;
+                h.sequence = seq;
+                h.ptsNs = nextCapture - start;
+                h.captureNs = nextCapture;
+                h.flags = seq % gop == 0 ? FrameHeader::kKeyframe : 0;
+                h.size = static_cast<uint32_t>(payloadBytes);
+                vector<uint8_t> bytes(sizeof h + payloadBytes, static_cast<uint8_t>(seq));
+                memcpy(bytes.data(), &h, sizeof h);
+                int64_t delay = net.baseDelay.count() + (net.jitter.count() > 0 ? static_cast<int64_t>(extra(rng)) : 0);
+                if (net.spikeEvery.count() > 0 && (nextCapture - start) % net.spikeEvery.count() < net.spikeLength.count()) {
+                    delay += net.spikeDelay.count();
+                }
+                if (coin(rng) >= net.lossRate) wire.push({nextCapture + delay, move(bytes)});
+                ++seq;
+                nextCapture += interval;
+            }
+            while (!wire.empty() && wire.top().deliverAt <= steadyNowNs()) {
+                const auto& p = wire.top().bytes;
+                ::sendto(sock.get(), p.data(), p.size(), 0, reinterpret_cast<sockaddr*>(&to), sizeof to);
+                ++sent;
+                wire.pop();
+            }
+            int64_t wake = running ? nextCapture : numeric_limits<int64_t>::max();
+            if (!wire.empty()) wake = min(wake, wire.top().deliverAt);
+            if (wake != numeric_limits<int64_t>::max()) {
+                this_thread::sleep_for(chrono::nanoseconds(max<int64_t>(wake - steadyNowNs(), 0)));
+            }
+        }
+    }
+
+public:
+    PacketReplayer(uint16_t port, double packetsPerSecond, NetworkProfile net, size_t payloadBytes = 1000, uint32_t gop = 60)
+        : sender([=] { sendLoop(port, packetsPerSecond, net, payloadBytes, gop); }) {}
+    ~PacketReplayer() { stop(); }
+
+    // Stops capturing; packets already "on the wire" are still delivered.
+    void stop() {
+        running = false;
+        if (sender.joinable()) sender.join();
+    }
+    uint64_t getSent() const { return sent; }
+};
+
+// =========================
+// Audio engine
+// =========================
+// Block kernels over float PCM. Each has a scalar, SSE and AVX2+FMA build; PcmKernels::best() picks one at startup.
+struct PcmKernels {
+    const char* name;
+    // dst[i] += src[i] * (gain + i * step): mixing with a click-free linear gain ramp.
+    void (*mixRamp)(float* dst, const float* src, float gain, float step, size_t n);
+    float (*dot)(const float* a, const float* b, size_t n);
+    void (*limit)(float* buf, size_t n, float ceiling);
+    // Polyphase FIR: out[j] = dot(coefs[phase(pos) * taps ...], history[pos / L ...]) with pos += M per output.
+    void (*polyphase)(float* out, size_t frames, const float* coefs, size_t taps, const float* history, uint64_t pos, uint32_t L, uint32_t M);
+
+    static const PcmKernels& scalar();
+    static const PcmKernels& best();
+#if MEDIA_HAVE_X86_SIMD
+    static const PcmKernels& sse();
+    static const PcmKernels& avx2();
+#endif
+};
+
+// Vectorisation is switched off so the scalar build stays the baseline it is named after.
+[[gnu::optimize("no-tree-vectorize")]] static void mixRampScalar(float* dst, const float* src, float gain, float step, size_t n) {
+    for (size_t i = 0; i < n; ++i) dst[i] += src[i] * (gain + static_cast<float>(i) * step);
+}
+[[gnu::optimize("no-tree-vectorize")]] static float dotScalar(const float* a, const float* b, size_t n) {
+    float sum = 0.0f;
+    for (size_t i = 0; i < n; ++i) sum += a[i] * b[i];
+    return sum;
+}
+[[gnu::optimize("no-tree-vectorize")]] static void polyphaseScalar(float* out, size_t frames, const float* coefs, size_t taps,
+                                                                   const float* history, uint64_t pos, uint32_t L, uint32_t M) {
+    size_t idx = static_cast<size_t>(pos / L), phase = static_cast<size_t>(pos % L);  // stepped below: no division per sample
+    for (size_t j = 0; j < frames; ++j) {
+        out[j] = dotScalar(coefs + phase * taps, history + idx, taps);
+        idx += M / L;
+        phase += M % L;
+        if (phase >= L) phase -= L, ++idx;
+    }
+}
+[[gnu::optimize("no-tree-vectorize")]] static void limitScalar(float* buf, size_t n, float ceiling) {
+    for (size_t i = 0; i < n; ++i) buf[i] = min(max(buf[i], -ceiling), ceiling);
+}
+
+#if MEDIA_HAVE_X86_SIMD
+static void mixRampSse(float* dst, const float* src, float gain, float step, size_t n) {
+    __m128 g = _mm_add_ps(_mm_set1_ps(gain), _mm_mul_ps(_mm_setr_ps(0, 1, 2, 3), _mm_set1_ps(step)));
+    const __m128 gStep = _mm_set1_ps(4 * step);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_mul_ps(_mm_loadu_ps(src + i), g)));
+        g = _mm_add_ps(g, gStep);
+    }
+    for (; i < n; ++i) dst[i] += src[i] * (gain + static_cast<float>(i) * step);
+}
+static float dotSse(const float* a, const float* b, size_t n) {
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    __m128 acc = _mm_add_ps(acc0, acc1);
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    float sum = _mm_cvtss_f32(acc);
+    for (; i < n; ++i) sum += a[i] * b[i];
+    return sum;
+}
+static void polyphaseSse(float* out, size_t frames, const float* coefs, size_t taps, const float* history, uint64_t pos,
+                         uint32_t L, uint32_t M) {
+    size_t idx = static_cast<size_t>(pos / L), phase = static_cast<size_t>(pos % L);  // stepped below: no division per sample
+    for (size_t j = 0; j < frames; ++j) {
+        out[j] = dotSse(coefs + phase * taps, history + idx, taps);
+        idx += M / L;
+        phase += M % L;
+        if (phase >= L) phase -= L, ++idx;
+    }
+}
+static void limitSse(float* buf, size_t n, float ceiling) {
+    const __m128 hi = _mm_set1_ps(ceiling), lo = _mm_set1_ps(-ceiling);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) _mm_storeu_ps(buf + i, _mm_min_ps(_mm_max_ps(_mm_loadu_ps(buf + i), lo), hi));
+    for (; i < n; ++i) buf[i] = min(max(buf[i], -ceiling), ceiling);
+}
+
+[[gnu::target("avx2,fma")]] static void mixRampAvx2(float* dst, const float* src, float gain, float step, size_t n) {
+    __m256 g = _mm256_fmadd_ps(_mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_ps(step), _mm256_set1_ps(gain));
+    const __m256 gStep = _mm256_set1_ps(8 * step);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(dst + i, _mm256_fmadd_ps(_mm256_loadu_ps(src + i), g, _mm256_loadu_ps(dst + i)));
+        g = _mm256_add_ps(g, gStep);
+    }
+    for (; i < n; ++i) dst[i] += src[i] * (gain + static_cast<float>(i) * step);
+}
+[[gnu::target("avx2,fma")]] static float dotAvx2(const float* a, const float* b, size_t n) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    __m256 acc = _mm256_add_ps(acc0, acc1);
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    float sum = _mm_cvtss_f32(s);
+    for (; i < n; ++i) sum += a[i] * b[i];
+    return sum;
+}
+[[gnu::target("avx2,fma")]] static void polyphaseAvx2(float* out, size_t frames, const float* coefs, size_t taps,
+                                                       const float* history, uint64_t pos, uint32_t L, uint32_t M) {
+    size_t idx = static_cast<size_t>(pos / L), phase = static_cast<size_t>(pos % L);  // stepped below: no division per sample
+    for (size_t j = 0; j < frames; ++j) {
+        out[j] = dotAvx2(coefs + phase * taps, history + idx, taps);
+        idx += M / L;
+        phase += M % L;
+        if (phase >= L) phase -= L, ++idx;
+    }
+}
+[[gnu::target("avx2,fma")]] static void limitAvx2(float* buf, size_t n, float ceiling) {
+    const __m256 hi = _mm256_set1_ps(ceiling), lo = _mm256_set1_ps(-ceiling);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) _mm256_storeu_ps(buf + i, _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(buf + i), lo), hi));
+    for (; i < n; ++i) buf[i] = min(max(buf[i], -ceiling), ceiling);
+}
+
+const PcmKernels& PcmKernels::sse() {
+    static const PcmKernels k{"sse", mixRampSse, dotSse, limitSse, polyphaseSse};
+    return k;
+}
+const PcmKernels& PcmKernels::avx2() {
+    static const PcmKernels k{"avx2", mixRampAvx2, dotAvx2, limitAvx2, polyphaseAvx2};
+    return k;
+}
+#endif
+
+const PcmKernels& PcmKernels::scalar() {
+    static const PcmKernels k{"scalar", mixRampScalar, dotScalar, limitScalar, polyphaseScalar};
+    return k;
+}
+
+const PcmKernels& PcmKernels::best() {
+#if MEDIA_HAVE_X86_SIMD
+    static const PcmKernels& k = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ? avx2() : sse();
+    return k;
+#else
+    return scalar();
+#endif
+}
+
+/**
+ * @brief Streaming polyphase FIR resampler for rational ratios (44.1k <-> 48k is 160/147).
+ *
+ * The prototype low-pass is a Blackman-windowed sinc at L x the input rate,
+ * cut off just below the lower of the two Nyquist frequencies, split into L
+ * phases of `taps` coefficients each (stored reversed, so every output sample
+ * is one contiguous dot product over the input history). push() appends
+ * input, render() produces output; the buffers are sized for `maxOutFrames`
+ * per render at construction, so neither allocates.
+ */
+class PolyphaseResampler {
+private:
+    uint32_t L, M;
+    size_t taps;
+    vector<float> coefs;  // L phases x taps
+    vector<float> history;
+    size_t avail;
+    uint64_t pos{0};  // position of the next output, in 1/L input samples from history[0]
+    const PcmKernels* kernels;
+
+public:
+    PolyphaseResampler(uint32_t inRate, uint32_t outRate, size_t maxOutFrames, size_t tapsPerPhase = 32,
+                       const PcmKernels& k = PcmKernels::best())
+        : taps(tapsPerPhase), kernels(&k) {
+        const uint32_t g = gcd(inRate, outRate);
+        L = outRate / g;
+        M = inRate / g;
+        const double cutoff = 0.45 * min(1.0, static_cast<double>(L) / M);  // cycles per input sample
+        const size_t total = static_cast<size_t>(L) * taps;
+        coefs.resize(total);
+        const double center = (total - 1) / 2.0;
+        for (size_t i = 0; i < total; ++i) {
+            const double x = (i - center) / L;  // in input samples
+            const double sinc = x == 0.0 ? 2 * cutoff : sin(2 * M_PI * cutoff * x) / (M_PI * x);
+            const double w = 0.42 - 0.5 * cos(2 * M_PI * i / (total - 1)) + 0.08 * cos(4 * M_PI * i / (total - 1));
+            // Tap k of phase p is h[p + k*L]; stored reversed so it lines up with ascending input.
+            const size_t phase = i % L, k = i / L;
+            coefs[phase * taps + (taps - 1 - k)] = static_cast<float>(sinc * w);
+        }
+        history.assign(taps + maxOutFrames * M / L + 2, 0.0f);
+        avail = taps - 1;  // zero history: the output lags the input by taps/2 input samples
+    }
+
+    // Input samples push() must supply before render(frames) can run.
+    size_t inputNeeded(size_t frames) const {
+        const size_t last = static_cast<size_t>((pos + (frames - 1) * M) / L) + taps;
+        return last > avail ? last - avail : 0;
+    }
+
+    void push(const float* in, size_t n) {
+        memcpy(history.data() + avail, in, n * sizeof(float));
+        avail += n;
+    }
+
+    void render(float* out, size_t frames) {
+        kernels->polyphase(out, frames, coefs.data(), taps, history.data(), pos, L, M);
+        pos += static_cast<uint64_t>(frames) * M;
+        const size_t drop = static_cast<size_t>(pos / L);
+        memmove(history.data(), history.data() + drop, (avail - drop) * sizeof(float));
+        avail -= drop;
+        pos -= static_cast<uint64_t>(drop) * L;
+    }
+};
+
+// Decoded mono PCM at its native rate. Immutable once handed to the engine.
+struct AudioClip {
+    uint32_t sampleRate;
+    vector<float> samples;
+};
+
+// Pull-model PCM source for a voice. read() runs on the render thread: it must not block, lock or allocate.
+class IAudioStream {
+public:
+    virtual ~IAudioStream() = default;
+    virtual uint32_t sampleRate() const = 0;
+    // Fills up to `frames` samples and returns how many; a short read is an underrun unless exhausted().
+    virtual size_t read(float* dst, size_t frames) = 0;
+    virtual bool exhausted() const = 0;
+};
+
+/**
+ * @brief Voice mixer with a real-time-safe render path.
+ *
+ * Everything the render thread touches is allocated up front: kMaxVoices
+ * voices, each with its own resampler and scratch blocks, and kMaxClips clip
+ * slots. Control calls (addClip, play, setGain, stop) come from one control
+ * thread: clips are published through atomic pointers and freed only when
+ * the engine is destroyed, and voice changes travel over an SPSC command
+ * ring, so renderBlock() neither locks, allocates nor frees (a resampler or
+ * stream replaced by a later play goes back to the control thread on a second
+ * ring). A voice plays either a clip or an IAudioStream it takes ownership of. Gain changes are
+ * ramped over the next block. start() runs renderBlock() on its own thread at
+ * the output rate (SCHED_FIFO where permitted) and hands each block to
+ * `output`; renderBlock() can also be driven directly for offline bouncing.
+ */
+class AudioEngine {
+public:
+    static constexpr size_t kMaxVoices = 64;
+    static constexpr size_t kMaxClips = 256;
+    using Output = function<void(const float*, size_t)>;
+
+    struct Stats {
+        uint64_t blocks{0};
+        uint64_t xruns{0};  // blocks rendered after their deadline
+        double maxRenderUs{0.0};
+        float peak{0.0f};
+    };
+
+private:
+    struct Command {
+        enum Kind : uint8_t { Play, SetGain, Stop } kind;
+        uint8_t voice;
+        uint16_t clip;
+        float gain;
+        bool loop;
+        float duck;                     // Play only: level other voices drop to while this one plays
+        PolyphaseResampler* resampler;  // Play only: owned by the voice once applied
+        IAudioStream* stream;           // Play only: replaces the clip; owned by the voice once applied
+    };
+
+    struct Retired {
+        PolyphaseResampler* resampler;
+        IAudioStream* stream;
+    };
+
+    struct Voice {
+        bool active{false};
+        bool loop{false};
+        const AudioClip* clip{nullptr};
+        IAudioStream* stream{nullptr};
+        size_t position{0};
+        bool stopping{false};
+        float gain{0.0f}, targetGain{0.0f};  // gain is what the last block ended at, including ducking
+        float ducks{1.0f};
+        PolyphaseResampler* resampler{nullptr};  // built for this clip by play(); null at the output rate
+    };
+
+    uint32_t outRate;
+    size_t blockFrames;
+    const PcmKernels* kernels;
+    array<atomic<AudioClip*>, kMaxClips> clips{};
+    size_t clipCount{0};
+    array<Voice, kMaxVoices> voices;
+    SpscRing<Command> commands{256};
+    SpscRing<Retired> retired{1024};  // render -> control: what a Play replaced, freed off the render thread
+    vector<float> mixBuf, voiceIn, voiceOut;
+    atomic<bool> running{false};
+    thread renderThread;
+    Stats stats;
+    string metricsStream;
+    MediaMetrics::Id blocksMetric, xrunsMetric, renderMetric, voicesMetric;
+    float masterCeiling{1.0f};
+
+    PolyphaseResampler* resamplerFor(uint32_t rate) const {
+        return rate == outRate ? nullptr : new PolyphaseResampler(rate, outRate, blockFrames, 32, *kernels);
+    }
+
+    void push(const Command& c) {
+        Backoff full;
+        while (!commands.tryPush(c)) full.pause();
+    }
+
+    // Copies `n` samples of the voice's source (zeros past the end unless looping, and for stream underruns).
+    void pull(Voice& v, float* dst, size_t n) {
+        if (v.stream) {
+            size_t got = v.stream->read(dst, n);
+            memset(dst + got, 0, (n - got) * sizeof(float));
+            return;
+        }
+        const auto& s = v.clip->samples;
+        while (n > 0) {
+            if (v.position >= s.size()) {
+                if (!v.loop || s.empty()) {
+                    memset(dst, 0, n * sizeof(float));
+                    return;
+                }
+                v.position = 0;
+            }
+            size_t take = min(n, s.size() - v.position);
+            memcpy(dst, s.data() + v.position, take * sizeof(float));
+            v.position += take;
+            dst += take;
+            n -= take;
+        }
+    }
+
+    void applyCommands() {
+        Command c;
+        while (commands.tryPop(c)) {
+            Voice& v = voices[c.voice];
+            switch (c.kind) {
+                case Command::Play:
+                    v.clip = c.stream ? nullptr : clips[c.clip].load(memory_order_acquire);
+                    v.position = 0;
+                    v.loop = c.loop;
+                    v.gain = 0.0f;  // fade in over the first block
+                    v.targetGain = c.gain;
+                    v.active = true;
+                    // Cannot fail: play() collects before every push, and this ring outsizes the command ring.
+                    if (v.resampler || v.stream) retired.tryPush({v.resampler, v.stream});
+                    v.resampler = c.resampler;
+                    v.stream = c.stream;
+                    v.ducks = c.duck;
+                    v.stopping = false;
+                    break;
+                case Command::SetGain:
+                    v.targetGain = c.gain;
+                    break;
+                case Command::Stop:
+                    v.stopping = true;  // ramps down over one block, then goes idle
+                    break;
+            }
+        }
+    }
+
+public:
+    AudioEngine(uint32_t outputRate = 48000, size_t block = 256, const PcmKernels& k = PcmKernels::best())
+        : outRate(outputRate), blockFrames(block), kernels(&k), mixBuf(block), voiceIn(block * 2 + 64), voiceOut(block) {
+        auto& mm = MediaMetrics::global();
+        const string& stream = metricsStream = mm.uniqueStream("audio");
+        blocksMetric = mm.counter(stream, "blocks");
+        xrunsMetric = mm.counter(stream, "xruns");
+        renderMetric = mm.histogram(stream, "render_block");
+        voicesMetric = mm.gauge(stream, "active_voices");
+    }
+    ~AudioEngine() {
+        stop();
+        collectRetired();
+        Command c;
+        while (commands.tryPop(c)) delete c.resampler, delete c.stream;
+        for (auto& v : voices) delete v.resampler, delete v.stream;
+        for (auto& c : clips) delete c.load();
+        MediaMetrics::global().release(metricsStream);
+    }
+
+    AudioEngine(const AudioEngine&) = delete;
+    AudioEngine& operator=(const AudioEngine&) = delete;
+
+    // Control thread. Returns the clip id for play().
+    uint16_t addClip(AudioClip clip) {
+        if (clipCount == kMaxClips) throw length_error("AudioEngine clip table is full");
+        clips[clipCount].store(new AudioClip(move(clip)), memory_order_release);
+        return static_cast<uint16_t>(clipCount++);
+    }
+
+    // Control thread. The voice starts (and fades in) at the next block. Clips may be at most twice the output rate.
+    // With duck < 1, every other voice is ramped down to that level while this one is playing (announcements over music).
+    void play(size_t voice, uint16_t clip, float gain, bool loop = false, float duck = 1.0f) {
+        collectRetired();
+        const AudioClip* c = clips.at(clip).load(memory_order_acquire);
+        if (voice >= kMaxVoices || !c) throw out_of_range("No such voice or clip");
+        if (c->sampleRate > 2 * outRate) throw invalid_argument("Clip rate more than twice the output rate");
+        push({Command::Play, static_cast<uint8_t>(voice), clip, gain, loop, duck, resamplerFor(c->sampleRate), nullptr});
+    }
+
+    // Control thread. Like play(), for a stream the engine now owns; it is freed on this thread once replaced.
+    void playStream(size_t voice, unique_ptr<IAudioStream> stream, float gain, float duck = 1.0f) {
+        collectRetired();
+        if (voice >= kMaxVoices || !stream) throw out_of_range("No such voice or stream");
+        if (stream->sampleRate() > 2 * outRate) throw invalid_argument("Stream rate more than twice the output rate");
+        auto* resampler = resamplerFor(stream->sampleRate());
+        push({Command::Play, static_cast<uint8_t>(voice), 0, gain, false, duck, resampler, stream.release()});
+    }
+
+    void setGain(size_t voice, float gain) { push({Command::SetGain, static_cast<uint8_t>(voice), 0, gain, false, 1.0f, nullptr, nullptr}); }
+    void stopVoice(size_t voice) { push({Command::Stop, static_cast<uint8_t>(voice), 0, 0.0f, false, 1.0f, nullptr, nullptr}); }
+
+    void collectRetired() {
+        Retired r;
+        while (retired.tryPop(r)) delete r.resampler, delete r.stream;
+    }
+
+    // Render thread (or offline): mixes every active voice into `out` (blockFrames samples).
+    void renderBlock(float* out) {
+        applyCommands();
+        memset(mixBuf.data(), 0, blockFrames * sizeof(float));
+        float duckLevel = 1.0f;
+        int64_t activeVoices = 0;
+        for (const auto& v : voices) {
+            if (v.active && !v.stopping) duckLevel = min(duckLevel, v.ducks);
+            activeVoices += v.active;
+        }
+        for (auto& v : voices) {
+            if (!v.active) continue;
+            const float* src = voiceOut.data();
+            if (!v.resampler) {
+                pull(v, voiceOut.data(), blockFrames);
+            } else {
+                const size_t need = v.resampler->inputNeeded(blockFrames);
+                pull(v, voiceIn.data(), need);
+                v.resampler->push(voiceIn.data(), need);
+                v.resampler->render(voiceOut.data(), blockFrames);
+            }
+            const float target = v.stopping ? 0.0f : v.targetGain * (v.ducks < 1.0f ? 1.0f : duckLevel);
+            kernels->mixRamp(mixBuf.data(), src, v.gain, (target - v.gain) / blockFrames, blockFrames);
+            v.gain = target;
+            const bool ended = v.stream ? v.stream->exhausted() : !v.loop && v.position >= v.clip->samples.size();
+            if (v.stopping || ended) v.active = false;
+        }
+        kernels->limit(mixBuf.data(), blockFrames, masterCeiling);
+        for (size_t i = 0; i < blockFrames; ++i) stats.peak = max(stats.peak, fabs(mixBuf[i]));
+        memcpy(out, mixBuf.data(), blockFrames * sizeof(float));
+        ++stats.blocks;
+        MediaMetrics::global().add(blocksMetric);
+        MediaMetrics::global().set(voicesMetric, activeVoices);
+    }
+
+    void start(Output output) {
+        if (running.exchange(true)) return;
+        renderThread = thread([this, output = move(output)] {
+            sched_param sp{};
+            sp.sched_priority = sched_get_priority_min(SCHED_FIFO);
+            pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);  // best effort: needs CAP_SYS_NICE
+            vector<float> block(blockFrames);
+            const auto period = chrono::nanoseconds(static_cast<int64_t>(1e9 * blockFrames / outRate));
+            auto deadline = chrono::steady_clock::now() + period;
+            while (running.load(memory_order_acquire)) {
+                auto begin = chrono::steady_clock::now();
+                renderBlock(block.data());
+                if (output) output(block.data(), blockFrames);
+                auto end = chrono::steady_clock::now();
+                stats.maxRenderUs = max(stats.maxRenderUs, chrono::duration<double, micro>(end - begin).count());
+                MediaMetrics::global().record(renderMetric, chrono::duration_cast<chrono::nanoseconds>(end - begin).count());
+                if (end > deadline) ++stats.xruns, MediaMetrics::global().add(xrunsMetric);
+                this_thread::sleep_until(deadline);
+                deadline += period;
+            }
+        });
+    }
+
+    void stop() {
+        if (running.exchange(false)) renderThread.join();
+    }
+
+    // Read after stop(), or accept a torn snapshot.
+    Stats getStats() const { return stats; }
+    uint32_t getOutputRate() const { return outRate; }
+    const char* getKernelName() const { return kernels->name; }
+    size_t getBlockFrames() const { return blockFrames; }
+};
+
+// Stand-in for decoding `seconds` of a source: a decaying two-partial tone at `rate`.
+inline AudioClip synthesizeClip(uint32_t rate, double seconds, double frequency) {
+    AudioClip clip{rate, vector<float>(static_cast<size_t>(rate * seconds))};
+    for (size_t i = 0; i < clip.samples.size(); ++i) {
+        const double t = static_cast<double>(i) / rate;
+        clip.samples[i] = static_cast<float>(0.4 * sin(2 * M_PI * frequency * t) + 0.1 * sin(2 * M_PI * 3 * frequency * t));
+    }
+    return clip;
+}
+
+// =========================
+// Playlist prefetch
+// =========================
+/**
+ * @brief IAudioStream over a playlist, decoded ahead on a background I/O thread.
+ *
+ * Tracks are raw 16-bit mono PCM files (the codec stand-in). The I/O thread
+ * decodes into a fixed pool of chunks and hands them over on an SPSC ring;
+ * the render thread hands spent chunks back on another, so the pool bounds
+ * memory and read() never blocks or allocates. Decoding runs up to
+ * `prefetchTracks` tracks ahead of the one playing (0 decodes each track only
+ * once the previous has finished), with POSIX_FADV_SEQUENTIAL on the open
+ * track and POSIX_FADV_WILLNEED on the upcoming ones so their reads come from
+ * the page cache. Track changes are sample-contiguous when the next track's
+ * first chunk is ready in time (a prefetch hit); otherwise the silence
+ * inserted is counted.
+ */
+class GaplessPlaylist final : public IAudioStream {
+public:
+    struct Options {
+        size_t prefetchTracks{2};
+        size_t chunkFrames{8192};
+        size_t poolChunks{64};
+        uint32_t sampleRate{44100};
+    };
+
+    struct Stats {
+        uint64_t transitions{0};
+        uint64_t prefetchHits{0};
+        uint64_t underrunFrames{0};  // silence inserted after the first sample
+        uint64_t bytesRead{0};
+        double firstSampleMs{-1.0};  // construction -> first sample handed to the engine
+        double maxGapMs{0.0};        // longest silence at a track change
+
+        double hitRate() const { return transitions ? static_cast<double>(prefetchHits) / transitions : 1.0; }
+    };
+
+private:
+    struct Chunk {
+        vector<float> samples;
+        size_t frames{0};
+        uint32_t track{0};
+        bool first{false}, last{false};
+    };
+
+    vector<string> tracks;
+    Options opts;
+    vector<Chunk> pool;
+    SpscRing<uint32_t> freeChunks, readyChunks;
+    atomic<uint32_t> wantedTrack{0};  // render -> I/O: the track playback needs next
+    atomic<bool> stopping{false};
+    const int64_t startNs;
+    thread io;
+
+    // Render-thread state.
+    int64_t current{-1};
+    size_t offset{0};
+    bool done{false};
+    bool atBoundary{false};
+    uint64_t gapFrames{0};
+
+    // Written by the render thread, read by anyone.
+    atomic<uint64_t> transitions{0}, hits{0}, underruns{0}, maxGapFrames{0};
+    atomic<int64_t> firstSampleNs{0};
+    atomic<uint64_t> bytesRead{0};
+
+    static void hint(const string& path, int advice) {
+        FileDescriptor fd(::open(path.c_str(), O_RDONLY));
+        if (fd) posix_fadvise(fd.get(), 0, 0, advice);
+    }
+
+    bool waitFor(const function<bool()>& ready) {
+        Backoff wait;
+        while (!ready()) {
+            if (stopping.load(memory_order_acquire)) return false;
+            wait.pause();
+        }
+        return true;
+    }
+
+    void decodeLoop() {
+        vector<int16_t> raw(opts.chunkFrames);
+        for (uint32_t t = 0; t < tracks.size(); ++t) {
+            if (!waitFor([&] { return t <= wantedTrack.load(memory_order_acquire) + opts.prefetchTracks; })) return;
+            for (size_t k = 1; k <= opts.prefetchTracks && t + k < tracks.size(); ++k) hint(tracks[t + k], POSIX_FADV_WILLNEED);
+            FileDescriptor fd(::open(tracks[t].c_str(), O_RDONLY));
+            struct stat st{};
+            uint64_t remaining = 0;
+            if (fd && fstat(fd.get(), &st) == 0) {
+                posix_fadvise(fd.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+                remaining = static_cast<uint64_t>(st.st_size) / sizeof(int16_t);
+            }
+            bool first = true;
+            do {  // an unreadable or empty track still yields one empty chunk, so the boundary is seen
+                uint32_t idx;
+                if (!waitFor([&] { return freeChunks.tryPop(idx); })) return;
+                Chunk& c = pool[idx];
+                size_t frames = static_cast<size_t>(min<uint64_t>(opts.chunkFrames, remaining));
+                ssize_t got = frames ? ::read(fd.get(), raw.data(), frames * sizeof(int16_t)) : 0;
+                if (got < static_cast<ssize_t>(frames * sizeof(int16_t))) {  // truncated underneath us: end the track here
+                    frames = got > 0 ? static_cast<size_t>(got) / sizeof(int16_t) : 0;
+                    remaining = frames;
+                }
+                bytesRead.fetch_add(frames * sizeof(int16_t), memory_order_relaxed);
+                for (size_t i = 0; i < frames; ++i) c.samples[i] = raw[i] * (1.0f / 32768.0f);
+                c.frames = frames;
+                c.track = t;
+                c.first = first;
+                c.last = remaining == frames;
+                remaining -= frames;
+                first = false;
+                readyChunks.tryPush(idx);  // cannot fail: the ring holds every chunk
+            } while (remaining > 0);
+        }
+    }
+
+public:
+    GaplessPlaylist(vector<string> paths, Options o)
+        : tracks(move(paths)), opts(o), pool(o.poolChunks), freeChunks(o.poolChunks), readyChunks(o.poolChunks), startNs(steadyNowNs()) {
+        if (tracks.empty()) throw invalid_argument("Empty playlist");
+        for (uint32_t i = 0; i < pool.size(); ++i) {
+            pool[i].samples.resize(opts.chunkFrames);
+            freeChunks.tryPush(i);
+        }
+        io = thread([this] { decodeLoop(); });
+    }
+    explicit GaplessPlaylist(vector<string> paths) : GaplessPlaylist(move(paths), Options{}) {}
+    ~GaplessPlaylist() override {
+        stopping = true;
+        io.join();
+    }
+
+    uint32_t sampleRate() const override { return opts.sampleRate; }
+    bool exhausted() const override { return done && current < 0; }
+
+    size_t read(float* dst, size_t frames) override {
+        size_t got = 0;
+        while (got < frames) {
+            if (current < 0) {
+                uint32_t idx;
+                if (done) break;
+                if (!readyChunks.tryPop(idx)) {
+                    if (firstSampleNs.load(memory_order_relaxed)) underruns.fetch_add(frames - got, memory_order_relaxed);  // startup is firstSampleMs
+                    if (atBoundary) gapFrames += frames - got;
+                    break;
+                }
+                current = idx;
+                offset = 0;
+                if (firstSampleNs.load(memory_order_relaxed) == 0) firstSampleNs.store(steadyNowNs(), memory_order_relaxed);
+                if (pool[idx].first && pool[idx].track > 0) {
+                    transitions.fetch_add(1, memory_order_relaxed);
+                    if (gapFrames == 0) hits.fetch_add(1, memory_order_relaxed);
+                    if (gapFrames > maxGapFrames.load(memory_order_relaxed)) maxGapFrames.store(gapFrames, memory_order_relaxed);
+                    gapFrames = 0;
+                    atBoundary = false;
+                }
+            }
+            Chunk& c = pool[static_cast<size_t>(current)];
+            const size_t take = min(frames - got, c.frames - offset);
+            memcpy(dst + got, c.samples.data() + offset, take * sizeof(float));
+            offset += take;
+            got += take;
+            if (offset == c.frames) {
+                if (c.last) {
+                    atBoundary = true;
+                    wantedTrack.store(c.track + 1, memory_order_release);
+                    done = c.track + 1 == tracks.size();
+                }
+                freeChunks.tryPush(static_cast<uint32_t>(current));
+                current = -1;
+            }
+        }
+        return got;
+    }
+
+    Stats getStats() const {
+        Stats st;
+        st.transitions = transitions.load(memory_order_relaxed);
+        st.prefetchHits = hits.load(memory_order_relaxed);
+        st.underrunFrames = underruns.load(memory_order_relaxed);
+        st.bytesRead = bytesRead.load(memory_order_relaxed);
+        const int64_t first = firstSampleNs.load(memory_order_relaxed);
+        st.firstSampleMs = first ? (first - startNs) / 1e6 : -1.0;
+        st.maxGapMs = maxGapFrames.load(memory_order_relaxed) * 1e3 / opts.sampleRate;
+        return st;
+    }
+};
+
+// =========================
+// Multi-camera stream manager
+// =========================
+/**
+ * @brief Fixed set of workers, each with its own task deque; idle workers steal.
+ *
+ * A worker pops its own deque newest-first (cache-warm) and steals from the
+ * others oldest-first. Deques are short-critical-section mutex + deque pairs
+ * on separate cache lines; sleeping workers wait on one condition variable
+ * and are only signalled when someone is actually asleep.
+ */
+class WorkStealingPool {
+private:
+    struct alignas(64) Queue {
+        mutex mtx;
+        deque<uint32_t> tasks;
+    };
+
+    function<void(uint32_t)> run;
+    vector<Queue> queues;
+    vector<thread> workers;
+    atomic<size_t> pending{0};
+    atomic<size_t> sleeping{0};
+    atomic<uint64_t> steals{0};
+    atomic<bool> stopping{false};
+    mutex sleepMtx;
+    condition_variable wake;
+    vector<double> cpuSeconds;
+
+    bool take(size_t self, uint32_t& task) {
+        {
+            Queue& own = queues[self];
+            lock_guard<mutex> lock(own.mtx);
+            if (!own.tasks.empty()) {
+                task = own.tasks.back();
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); ++i) {
+            Queue& victim = queues[(self + i) % queues.size()];
+            lock_guard<mutex> lock(victim.mtx);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                steals.fetch_add(1, memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(size_t self) {
+        uint32_t task;
+        while (true) {
+            if (take(self, task)) {
+                pending.fetch_sub(1, memory_order_relaxed);
+                run(task);
+                continue;
+            }
+            unique_lock<mutex> lock(sleepMtx);
+            sleeping.fetch_add(1);
+            wake.wait_for(lock, chrono::milliseconds(50), [&] { return pending.load() > 0 || stopping.load(); });
+            sleeping.fetch_sub(1);
+            if (stopping && pending.load() == 0) break;
+        }
+        timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        cpuSeconds[self] = ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+public:
+    WorkStealingPool(size_t threads, function<void(uint32_t)> task)
+        : run(move(task)), queues(max<size_t>(threads, 1)), cpuSeconds(queues.size()) {
+        for (size_t i = 0; i < queues.size(); ++i) workers.emplace_back([this, i] { workerLoop(i); });
+    }
+    ~WorkStealingPool() { stop(); }
+
+    // Queues `task` on worker `hint % size()`; safe from any thread.
+    void submit(uint32_t task, size_t hint) {
+        {
+            Queue& q = queues[hint % queues.size()];
+            lock_guard<mutex> lock(q.mtx);
+            q.tasks.push_back(task);
+        }
+        pending.fetch_add(1);
+        if (sleeping.load() > 0) {
+            lock_guard<mutex> lock(sleepMtx);
+            wake.notify_one();
+        }
+    }
+
+    // Runs everything already queued, then joins the workers.
+    void stop() {
+        if (stopping.exchange(true)) return;
+        {
+            lock_guard<mutex> lock(sleepMtx);
+            wake.notify_all();
+        }
+        for (auto& t : workers) t.join();
+    }
+
+    size_t size() const { return queues.size(); }
+    uint64_t getSteals() const { return steals.load(); }
+    // Per-worker CPU time; filled in as workers exit.
+    double getCpuSeconds() const { return accumulate(cpuSeconds.begin(), cpuSeconds.end(), 0.0); }
+};
+
+/**
+ * @brief Many live UDP camera feeds on a few threads.
+ *
+ * Sockets are spread over `ioThreads` epoll loops. An I/O thread receives
+ * each datagram straight into a slot of that stream's bounded queue (slots
+ * live in one slab allocated up front). A stream with queued frames is
+ * scheduled on the WorkStealingPool as a single task; the worker that runs
+ * it drains the queue in order, so one stream is never processed by two
+ * workers at once and per-stream ordering holds without locks. A worker
+ * yields after `batch` frames to keep a busy camera from starving others.
+ *
+ * Backpressure is per stream: when a stream's queue is full its socket is
+ * disarmed in epoll, so only that camera's kernel buffer fills and overflows
+ * (seen as sequence gaps, counted as lost); it is re-armed once its worker
+ * has drained half the queue. Every other stream keeps flowing.
+ *
+ * Per-stream state is a few cache lines: the hot control block plus a
+ * compact latency histogram. Handlers are stored apart from the hot state.
+ */
+class StreamManager {
+public:
+    struct Options {
+        size_t ioThreads{1};
+        size_t workers{max<size_t>(2, thread::hardware_concurrency())};
+        size_t maxStreams{1024};
+        size_t queueDepth{8};
+        size_t maxPacket{1472};
+        size_t batch{16};
+    };
+
+    using FrameHandler = function<void(const StreamPacketHeader&, const uint8_t*)>;
+
+    struct StreamStats {
+        uint64_t frames{0};
+        uint64_t lost{0};
+        uint64_t pauses{0};
+        double p50Ms{0.0}, p99Ms{0.0}, maxMs{0.0};  // capture -> processed
+    };
+
+    struct Totals {
+        uint64_t frames{0}, lost{0}, pauses{0}, steals{0};
+        double ioCpuSeconds{0.0}, workerCpuSeconds{0.0};
+    };
+
+private:
+    // Half-octave latency buckets from 16 us: bucket b covers [16us * 2^(b/2), 16us * 2^((b+1)/2)).
+    static constexpr size_t kLatencyBuckets = 32;
+
+    struct alignas(64) Stream {
+        FileDescriptor fd;
+        uint32_t io{0};
+        atomic<bool> open{false};
+        atomic<bool> scheduled{false};
+        atomic<bool> paused{false};
+        atomic<uint32_t> head{0};  // consumer (the scheduled worker)
+        atomic<uint32_t> tail{0};  // producer (the I/O thread)
+        // Written only while scheduled, so one worker at a time.
+        uint32_t expectedSeq{0};
+        bool seenFirst{false};
+        uint64_t frames{0}, lost{0};
+        atomic<uint32_t> pauses{0};
+        uint32_t maxLatencyUs{0};
+        array<uint32_t, kLatencyBuckets> latency{};
+    };
+
+    struct IoLoop {
+        FileDescriptor epfd;
+        thread thr;
+        atomic<uint64_t> epoch{0};
+        double cpuSeconds{0.0};
+    };
+
+    Options opts;
+    size_t slotBytes;
+    vector<Stream> streams;
+    vector<FrameHandler> handlers;
+    vector<array<MediaMetrics::Id, 3>> streamMetrics;  // frames, lost, queue_depth; cold like the handlers
+    string metricsStream;
+    MediaMetrics::Id latencyMetric;
+    vector<uint8_t> slab;
+    vector<unique_ptr<IoLoop>> ios;
+    unique_ptr<WorkStealingPool> pool;
+    atomic<bool> running{true};
+    mutex controlMtx;  // addStream / removeStream only
+    vector<uint32_t> freeIds;
+    size_t nextIo{0};
+
+    uint8_t* slot(uint32_t id, uint32_t index) { return &slab[(static_cast<size_t>(id) * opts.queueDepth + index % opts.queueDepth) * slotBytes]; }
+
+    static size_t latencyBucket(uint64_t us) {
+        if (us < 16) return 0;
+        const double b = 2.0 * log2(us / 16.0);
+        return min<size_t>(static_cast<size_t>(b), kLatencyBuckets - 1);
+    }
+
+    void arm(Stream& s, uint32_t id, bool readable) {
+        epoll_event ev{};
+        ev.events = readable ? static_cast<uint32_t>(EPOLLIN) : 0u;
+        ev.data.u32 = id;
+        epoll_ctl(ios[s.io]->epfd.get(), EPOLL_CTL_MOD, s.fd.get(), &ev);
+    }
+
+    void schedule(Stream& s, uint32_t id) {
+        if (!s.scheduled.exchange(true, memory_order_acq_rel)) pool->submit(id, id);
+    }
+
+    // I/O thread: move datagrams into the stream's queue until the socket is empty or the queue is full.
+    void drain(uint32_t id) {
+        Stream& s = streams[id];
+        if (!s.open.load(memory_order_acquire)) return;
+        bool pushed = false;
+        for (;;) {
+            const uint32_t t = s.tail.load(memory_order_relaxed);
+            if (t - s.head.load(memory_order_acquire) == opts.queueDepth) {
+                arm(s, id, false);  // disarm before publishing `paused`, so a worker's re-arm always lands last
+                s.paused.store(true, memory_order_release);
+                s.pauses.fetch_add(1, memory_order_relaxed);
+                // The worker may have made room between the check and the pause; don't strand the stream.
+                // Store->load on both sides: without the fences each load may pass the other thread's store.
+                atomic_thread_fence(memory_order_seq_cst);
+                if (t - s.head.load(memory_order_acquire) < opts.queueDepth && s.paused.exchange(false)) arm(s, id, true);
+                break;
+            }
+            uint8_t* dst = slot(id, t);
+            ssize_t n = ::recv(s.fd.get(), dst + sizeof(uint32_t), opts.maxPacket, MSG_DONTWAIT);
+            if (n < 0) break;
+            const uint32_t len = static_cast<uint32_t>(n);
+            memcpy(dst, &len, sizeof len);
+            s.tail.store(t + 1, memory_order_release);
+            MediaMetrics::global().set(streamMetrics[id][2], static_cast<int64_t>(t + 1 - s.head.load(memory_order_relaxed)));
+            pushed = true;
+        }
+        if (!pushed) return;
+        atomic_thread_fence(memory_order_seq_cst);  // pairs with the fence at the end of process()
+        schedule(s, id);
+    }
+
+    void ioLoop(IoLoop& loop) {
+        array<epoll_event, 256> events;
+        while (running.load(memory_order_acquire)) {
+            int n = epoll_wait(loop.epfd.get(), events.data(), static_cast<int>(events.size()), 50);
+            for (int i = 0; i < n; ++i) drain(events[i].data.u32);
+            loop.epoch.fetch_add(1, memory_order_release);
+        }
+        timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        loop.cpuSeconds = ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    // Worker: one scheduled run of a stream.
+    void process(uint32_t id) {
+        Stream& s = streams[id];
+        size_t done = 0;
+        for (;;) {
+            const uint32_t h = s.head.load(memory_order_relaxed);
+            if (h == s.tail.load(memory_order_acquire)) break;
+            if (done == opts.batch) {  // fairness: requeue behind the others, still scheduled
+                pool->submit(id, id);
+                return;
+            }
+            const uint8_t* src = slot(id, h);
+            uint32_t len;
+            memcpy(&len, src, sizeof len);
+            StreamPacketHeader hdr;
+            if (len >= sizeof hdr) {
+                memcpy(&hdr, src + sizeof len, sizeof hdr);
+                if (hdr.magic == StreamPacketHeader::kMagic && sizeof hdr + hdr.size <= len) {
+                    auto& mm = MediaMetrics::global();
+                    if (s.seenFirst && hdr.sequence > s.expectedSeq) {
+                        s.lost += hdr.sequence - s.expectedSeq;
+                        mm.add(streamMetrics[id][1], hdr.sequence - s.expectedSeq);
+                    }
+                    s.seenFirst = true;
+                    s.expectedSeq = hdr.sequence + 1;
+                    if (handlers[id]) handlers[id](hdr, src + sizeof len + sizeof hdr);
+                    const uint64_t ns = static_cast<uint64_t>(max<int64_t>(steadyNowNs() - hdr.captureNs, 0));
+                    mm.add(streamMetrics[id][0]);
+                    mm.record(latencyMetric, ns);
+                    const uint64_t us = ns / 1000;
+                    ++s.latency[latencyBucket(us)];
+                    s.maxLatencyUs = max<uint32_t>(s.maxLatencyUs, static_cast<uint32_t>(min<uint64_t>(us, UINT32_MAX)));
+                    ++s.frames;
+                }
+            }
+            s.head.store(h + 1, memory_order_release);
+            ++done;
+            atomic_thread_fence(memory_order_seq_cst);  // pairs with the fence after drain() publishes `paused`
+            if (s.paused.load(memory_order_acquire) && s.tail.load(memory_order_acquire) - (h + 1) <= opts.queueDepth / 2 &&
+                s.paused.exchange(false)) {
+                arm(s, id, true);
+            }
+        }
+        s.scheduled.store(false, memory_order_release);
+        // With the fence in drain(), either this load sees the I/O thread's new tail or its schedule() sees `scheduled` clear.
+        atomic_thread_fence(memory_order_seq_cst);
+        if (s.head.load(memory_order_relaxed) != s.tail.load(memory_order_acquire)) schedule(s, id);  // raced with the I/O thread
+    }
+
+public:
+    explicit StreamManager(Options o) : opts(o), slotBytes(slotBytesFor(o.maxPacket)), streams(o.maxStreams),
+                                        handlers(o.maxStreams), streamMetrics(o.maxStreams), slab(o.maxStreams * o.queueDepth * slotBytes) {
+        auto& mm = MediaMetrics::global();
+        metricsStream = mm.uniqueStream("streams");
+        latencyMetric = mm.histogram(metricsStream, "capture_to_processed");
+        for (uint32_t id = static_cast<uint32_t>(opts.maxStreams); id-- > 0;) freeIds.push_back(id);
+        pool = make_unique<WorkStealingPool>(opts.workers, [this](uint32_t id) { process(id); });
+        for (size_t i = 0; i < max<size_t>(opts.ioThreads, 1); ++i) {
+            auto loop = make_unique<IoLoop>();
+            loop->epfd = FileDescriptor(epoll_create1(0));
+            if (!loop->epfd) throwErrno("epoll_create1");
+            ios.push_back(move(loop));
+        }
+        for (auto& loop : ios) loop->thr = thread([this, l = loop.get()] { ioLoop(*l); });
+    }
+    StreamManager() : StreamManager(Options{}) {}
+    ~StreamManager() {
+        stop();
+        MediaMetrics::global().release(metricsStream);
+    }
+
+    // Binds a UDP socket on 127.0.0.1:port (0 = any free port) and starts delivering its frames to `handler`.
+    uint32_t addStream(FrameHandler handler, uint16_t port = 0) {
+        lock_guard<mutex> lock(controlMtx);
+        if (freeIds.empty()) throw length_error("StreamManager is full");
+        FileDescriptor fd(::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0));
+        if (!fd) throwErrno("socket");
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if (::bind(fd.get(), reinterpret_cast<sockaddr*>(&addr), sizeof addr) != 0) throwErrno("bind udp");
+
+        const uint32_t id = freeIds.back();
+        freeIds.pop_back();
+        Stream& s = streams[id];
+        handlers[id] = move(handler);
+        auto& mm = MediaMetrics::global();
+        const string stream = metricsStream + "/cam" + to_string(id);  // released by removeStream, so zero again here
+        streamMetrics[id] = {mm.counter(stream, "frames"), mm.counter(stream, "lost"), mm.gauge(stream, "queue_depth")};
+        s.io = static_cast<uint32_t>(nextIo++ % ios.size());
+        s.head = s.tail = 0;
+        s.seenFirst = false;
+        s.frames = s.lost = 0;
+        s.pauses = 0;
+        s.maxLatencyUs = 0;
+        s.latency.fill(0);
+        s.paused = false;
+        s.fd = move(fd);
+        s.open.store(true, memory_order_release);
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u32 = id;
+        if (epoll_ctl(ios[s.io]->epfd.get(), EPOLL_CTL_ADD, s.fd.get(), &ev) != 0) {
+            s.open = false;
+            s.fd.reset();
+            freeIds.push_back(id);
+            throwErrno("epoll_ctl");
+        }
+        return id;
+    }
+
+    uint16_t portOf(uint32_t id) const {
+        sockaddr_in addr{};
+        socklen_t len = sizeof addr;
+        getsockname(streams.at(id).fd.get(), reinterpret_cast<sockaddr*>(&addr), &len);
+        return ntohs(addr.sin_port);
+    }
+
+    // Stops delivery; returns once no thread can still touch the stream.
+    void removeStream(uint32_t id) {
+        lock_guard<mutex> lock(controlMtx);
+        Stream& s = streams.at(id);
+        if (!s.open.exchange(false)) return;
+        IoLoop& loop = *ios[s.io];
+        epoll_ctl(loop.epfd.get(), EPOLL_CTL_DEL, s.fd.get(), nullptr);
+        const uint64_t epoch = loop.epoch.load(memory_order_acquire);
+        Backoff wait;
+        while (running && loop.epoch.load(memory_order_acquire) < epoch + 2) wait.pause();  // I/O thread has left any batch naming it
+        while (s.scheduled.load(memory_order_acquire)) wait.pause();
+        s.fd.reset();
+        handlers[id] = nullptr;
+        MediaMetrics::global().release(metricsStream + "/cam" + to_string(id));
+        freeIds.push_back(id);
+    }
+
+    StreamStats streamStats(uint32_t id) const {
+        const Stream& s = streams.at(id);
+        StreamStats st;
+        st.frames = s.frames;
+        st.lost = s.lost;
+        st.pauses = s.pauses.load();
+        st.maxMs = s.maxLatencyUs / 1e3;
+        auto quantile = [&](double q) {
+            const uint64_t rank = static_cast<uint64_t>(ceil(q * s.frames));
+            uint64_t seen = 0;
+            for (size_t b = 0; b < kLatencyBuckets; ++b) {
+                seen += s.latency[b];
+                if (seen >= rank && rank > 0) return min(16e-3 * pow(2.0, (b + 1) / 2.0), st.maxMs);  // bucket upper edge
+            }
+            return st.maxMs;
+        };
+        st.p50Ms = quantile(0.5);
+        st.p99Ms = quantile(0.99);
+        return st;
+    }
+
+    // Joins every thread; counters are final afterwards.
+    void stop() {
+        if (!running.exchange(false)) return;
+        for (auto& loop : ios) loop->thr.join();
+        pool->stop();
+        for (auto& s : streams) {
+            s.open = false;
+            s.fd.reset();
+        }
+    }
+
+    Totals totals() const {
+        Totals t;
+        for (size_t id = 0; id < streams.size(); ++id) {
+            t.frames += streams[id].frames;
+            t.lost += streams[id].lost;
+            t.pauses += streams[id].pauses.load();
+        }
+        t.steals = pool->getSteals();
+        for (const auto& loop : ios) t.ioCpuSeconds += loop->cpuSeconds;
+        t.workerCpuSeconds = pool->getCpuSeconds();
+        return t;
+    }
+
+    static constexpr size_t streamStateBytes() { return sizeof(Stream) + sizeof(FrameHandler); }
+    // Length prefix plus payload, rounded up to a cache line.
+    static constexpr size_t slotBytesFor(size_t maxPacket) { return (sizeof(uint32_t) + maxPacket + 63) / 64 * 64; }
+    size_t getSlotBytes() const { return slotBytes; }
+};
+
+/**
+ * @brief Local stand-in for a fleet of cameras: one thread sending every camera's frames.
+ *
+ * Cameras are phase-staggered evenly across the frame interval, so the load
+ * is smooth rather than N packets at once. Each packet is a StreamPacketHeader
+ * with the capture time plus `payloadBytes` of payload.
+ */
+class CameraFleetSimulator {
+    atomic<bool> running{true};
+    atomic<uint64_t> sent{0};
+    thread sender;
+
+public:
+    CameraFleetSimulator(vector<uint16_t> ports, double fps, size_t payloadBytes = 1000) {
+        sender = thread([this, ports = move(ports), fps, payloadBytes] {
+            FileDescriptor sock(::socket(AF_INET, SOCK_DGRAM, 0));
+            int sndbuf = 4 << 20;
+            setsockopt(sock.get(), SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof sndbuf);
+            vector<uint8_t> packet(sizeof(StreamPacketHeader) + payloadBytes, 0xA5);
+            vector<uint32_t> seq(ports.size(), 0);
+            const double slotNs = 1e9 / fps / ports.size();
+            const int64_t start = steadyNowNs();
+            for (uint64_t j = 0; running.load(memory_order_relaxed); ++j) {
+                const int64_t due = start + static_cast<int64_t>(j * slotNs);
+                const int64_t ahead = due - steadyNowNs();
+                if (ahead > 200'000) this_thread::sleep_for(chrono::nanoseconds(ahead));
+                const size_t cam = j % ports.size();
+                StreamPacketHeader h;
+                h.sequence = seq[cam]++;
+                h.ptsNs = due - start;
+                h.captureNs = due;
+                h.size = static_cast<uint32_t>(payloadBytes);
+                memcpy(packet.data(), &h, sizeof h);
+                sockaddr_in to{};
+                to.sin_family = AF_INET;
+                to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                to.sin_port = htons(ports[cam]);
+                ::sendto(sock.get(), packet.data(), packet.size(), 0, reinterpret_cast<sockaddr*>(&to), sizeof to);
+                sent.fetch_add(1, memory_order_relaxed);
+            }
+        });
+    }
+    ~CameraFleetSimulator() { stop(); }
+    void stop() {
+        running = false;
+        if (sender.joinable()) sender.join();
+    }
+    uint64_t getSent() const { return sent; }
+};
+
+// =========================
+// Adaptive bitrate
+// =========================
+// One title in several renditions, all cut at the same keyframe-aligned segment boundaries, so a segment of any
+// rendition can follow any other: switching never refetches or waits for a keyframe.
+struct AbrManifest {
+    struct Rendition {
+        uint32_t kbps;
+        string dir;
+    };
+    double segmentSeconds{2.0};
+    size_t segmentCount{0};
+    vector<Rendition> renditions;  // ascending bitrate
+
+    // One directive per line: "segment_seconds 2", "segments 30", "rendition <kbps> <dir>".
+    static AbrManifest parse(const string& text) {
+        AbrManifest m;
+        istringstream in(text);
+        for (string key; in >> key;) {
+            if (key == "segment_seconds") in >> m.segmentSeconds;
+            else if (key == "segments") in >> m.segmentCount;
+            else if (key == "rendition") {
+                Rendition r;
+                in >> r.kbps >> r.dir;
+                m.renditions.push_back(r);
+            } else {
+                throw runtime_error("Bad manifest directive: " + key);
+            }
+        }
+        if (m.renditions.empty() || m.segmentCount == 0 || m.segmentSeconds <= 0) throw runtime_error("Incomplete manifest");
+        sort(m.renditions.begin(), m.renditions.end(), [](const Rendition& a, const Rendition& b) { return a.kbps < b.kbps; });
+        return m;
+    }
+
+    string toText() const {
+        ostringstream out;
+        out << "segment_seconds " << segmentSeconds << "\nsegments " << segmentCount << "\n";
+        for (const auto& r : renditions) out << "rendition " << r.kbps << " " << r.dir << "\n";
+        return out.str();
+    }
+
+    string segmentPath(size_t rendition, size_t index) const { return "/" + renditions[rendition].dir + "/seg" + to_string(index) + ".bin"; }
+    // Constant-bitrate stand-in: a real encoder's segments vary around this.
+    uint64_t segmentBytes(size_t rendition) const { return static_cast<uint64_t>(renditions[rendition].kbps * 125.0 * segmentSeconds); }
+    vector<uint32_t> ladder() const {
+        vector<uint32_t> kbps;
+        for (const auto& r : renditions) kbps.push_back(r.kbps);
+        return kbps;
+    }
+};
+
+/**
+ * @brief Bandwidth estimate from segment download timings.
+ *
+ * Two EWMAs over per-download throughput, each sample weighted by how long
+ * the download took: a fast one (2 s half-life) that notices a drop within a
+ * segment, and a slow one (8 s) that ignores a single lucky burst. The
+ * estimate is the lower of the two. Downloads under 16 KiB are skipped:
+ * they measure round trips, not bandwidth.
+ */
+class ThroughputEstimator {
+    struct Ewma {
+        double halfLife;
+        double value{0.0};
+        double weight{0.0};
+
+        void add(double seconds, double bps) {
+            const double alpha = pow(0.5, seconds / halfLife);
+            value = alpha * value + (1 - alpha) * bps;
+            weight += seconds;
+        }
+        // Divides out the bias toward the zero the average started from.
+        double get() const { return weight > 0 ? value / (1 - pow(0.5, weight / halfLife)) : 0.0; }
+    };
+    Ewma fast{2.0}, slow{8.0};
+
+public:
+    void addSample(uint64_t bytes, double seconds) {
+        if (bytes < 16 * 1024 || seconds <= 0) return;
+        const double bps = bytes * 8.0 / seconds;
+        fast.add(seconds, bps);
+        slow.add(seconds, bps);
+    }
+    bool hasEstimate() const { return fast.weight > 0; }
+    double estimateBps() const { return min(fast.get(), slow.get()); }
+};
+
+/**
+ * @brief Picks the rendition for the next segment: throughput rule, buffer rule, or a hybrid of the two.
+ *
+ * Throughput rule: the highest bitrate under `safety` x the estimate. Buffer
+ * rule (BBA): the lowest rendition while the buffer is inside the reservoir,
+ * the highest above reservoir + cushion, and a linear map over the ladder in
+ * between. The hybrid takes the higher of the two once the buffer is past the
+ * reservoir, so a full buffer rides out a dip at high quality and a fast link
+ * is used before the buffer has grown; the buffer rule may not pick more than
+ * `maxOvershoot` x the estimate. Inside the reservoir only the throughput rule
+ * counts. Up-switches go one rendition at a time and need `upSwitchBuffer`
+ * seconds buffered. A rendition the link can nearly sustain is held until
+ * the buffer falls below the middle of the cushion; that hysteresis stops
+ * BBA's segment-by-segment flapping around the top of its map. Otherwise
+ * down-switches go as far as needed at once.
+ *
+ * shouldAbandon() is the stall guard: a segment that will not arrive before
+ * the buffer runs dry is dropped in favour of the lowest rendition, if that
+ * would arrive sooner. All times are media seconds.
+ */
+class AbrController {
+public:
+    enum class Mode { Hybrid, ThroughputOnly, BufferOnly };
+
+    struct Options {
+        Mode mode{Mode::Hybrid};
+        double safety{0.85};
+        double reservoirSeconds{6.0};
+        double cushionSeconds{14.0};
+        double bufferTargetSeconds{24.0};  // stop fetching above this
+        double upSwitchBuffer{10.0};
+        double maxOvershoot{1.3};
+        double startupKbps{1000.0};  // assumed before the first measurement
+        bool abandon{true};
+    };
+
+    AbrController(vector<uint32_t> ladderKbps, Options o) : ladder(move(ladderKbps)), opts(o) {
+        if (ladder.empty()) throw invalid_argument("AbrController needs at least one rendition");
+    }
+
+    size_t choose(double bufferSeconds) {
+        const double kbps = estimator.hasEstimate() ? estimator.estimateBps() / 1000 : opts.startupKbps;
+        const size_t byThroughput = highestUnder(opts.safety * kbps);
+        size_t byBuffer = 0;
+        if (bufferSeconds >= opts.reservoirSeconds + opts.cushionSeconds) {
+            byBuffer = ladder.size() - 1;
+        } else if (bufferSeconds > opts.reservoirSeconds) {
+            const double f = (bufferSeconds - opts.reservoirSeconds) / opts.cushionSeconds;
+            byBuffer = highestUnder(ladder.front() + f * (ladder.back() - ladder.front()));
+        }
+        size_t next;
+        switch (opts.mode) {
+        case Mode::ThroughputOnly:
+            next = byThroughput;
+            break;
+        case Mode::BufferOnly:
+            next = byBuffer;
+            break;
+        default: {
+            const size_t cap = highestUnder(opts.maxOvershoot * kbps);
+            next = bufferSeconds < opts.reservoirSeconds ? byThroughput : max(byThroughput, min(byBuffer, cap));
+            if (!started) break;
+            if (next > current) {
+                next = bufferSeconds >= opts.upSwitchBuffer ? current + 1 : current;
+            } else if (next < current && current <= cap && bufferSeconds >= opts.reservoirSeconds + opts.cushionSeconds / 2) {
+                next = current;
+            }
+            break;
+        }
+        }
+        switches += started && next != current;
+        started = true;
+        current = next;
+        return current;
+    }
+
+    void onDownload(uint64_t bytes, double seconds) { estimator.addSample(bytes, seconds); }
+
+    bool shouldAbandon(size_t rendition, uint64_t bytesDone, uint64_t bytesTotal, double elapsed, double bufferSeconds) const {
+        if (!opts.abandon || rendition == 0 || elapsed < 0.25 || bytesDone >= bytesTotal) return false;
+        const double bytesPerSecond = max(bytesDone, uint64_t(1)) / elapsed;
+        const double remaining = (bytesTotal - bytesDone) / bytesPerSecond;
+        if (remaining < bufferSeconds) return false;
+        const double lowest = ladder.front() * 125.0 * (bytesTotal / (ladder[rendition] * 125.0)) / bytesPerSecond;
+        return lowest < remaining;
+    }
+
+    // After an abandon: the next choice starts from the bottom.
+    void onAbandon() { current = 0; }
+
+    size_t getSwitches() const { return switches; }
+    double getEstimateKbps() const { return estimator.estimateBps() / 1000; }
+
+private:
+    vector<uint32_t> ladder;
+    Options opts;
+    ThroughputEstimator estimator;
+    size_t current{0};
+    size_t switches{0};
+    bool started{false};
+
+    size_t highestUnder(double kbps) const {
+        size_t r = 0;
+        while (r + 1 < ladder.size() && ladder[r + 1] <= kbps) ++r;
+        return r;
+    }
+};
+
+// What a streamed session looked like: the numbers ABR is judged on.
+struct AbrStats {
+    double mediaSeconds{0.0};     // played
+    double rebufferSeconds{0.0};  // stalled after playback started
+    double startupSeconds{0.0};
+    double kbpsSum{0.0};  // over segments played
+    size_t segments{0};
+    size_t switches{0};
+    size_t abandons{0};
+    uint64_t wastedBytes{0};  // abandoned partial downloads
+
+    double rebufferRatio() const { return mediaSeconds + rebufferSeconds > 0 ? rebufferSeconds / (mediaSeconds + rebufferSeconds) : 0.0; }
+    double averageKbps() const { return segments ? kbpsSum / segments : 0.0; }
+};
+
+// Piecewise-constant link capacity, looping: (seconds, kbps) steps.
+struct BandwidthTrace {
+    string name;
+    vector<pair<double, double>> steps;
+
+    double period() const {
+        double p = 0;
+        for (const auto& s : steps) p += s.first;
+        return p;
+    }
+    double kbpsAt(double t) const {
+        t = fmod(t, period());
+        for (const auto& s : steps) {
+            if (t < s.first) return s.second;
+            t -= s.first;
+        }
+        return steps.back().second;
+    }
+};
+
+/**
+ * @brief Streams a title from an HTTP server through an AbrController, playing it against the wall clock.
+ *
+ * One thread fetches segments in order, each from the rendition the
+ * controller picks, into FramePool buffers, and keeps up to
+ * `bufferTargetSeconds` of media queued. Playback starts once one segment is
+ * buffered and consumes `speed` media seconds per second; when the queue runs
+ * dry it stalls and the stall is counted. Bodies are read in 64 KiB steps so
+ * a segment that would stall playback can be abandoned mid-download.
+ */
+class AdaptiveStreamPlayer : public IPlayable {
+public:
+    struct Options {
+        AbrController::Options abr;
+        double speed{1.0};  // media seconds per wall second; >1 compresses a long session
+    };
+
+    AdaptiveStreamPlayer() : AdaptiveStreamPlayer(Options{}) {}
+    explicit AdaptiveStreamPlayer(Options o) : opts(o) {}
+    ~AdaptiveStreamPlayer() { pause(); }
+
+    // `source` is the manifest URL; segments are fetched relative to its host.
+    void play(const string& source) override {
+        pause();
+        stopping = false;
+        playing = true;
+        session = thread([this, source] {
+            try {
+                run(source);
+            } catch (const exception& e) {
+                cout << "Adaptive stream failed: " << e.what() << "\n";
+            }
+            playing = false;
+        });
+    }
+
+    void pause() override {
+        stopping = true;
+        if (session.joinable()) session.join();
+    }
+
+    bool isPlaying() const { return playing; }
+    // Stable once isPlaying() is false.
+    AbrStats getStats() const { return stats; }
+
+private:
+    Options opts;
+    thread session;
+    atomic<bool> stopping{false}, playing{false};
+    AbrStats stats;
+
+    // Media clock: advances with the wall clock while buffered media lasts, and counts the stall when it doesn't.
+    struct Playback {
+        double speed{1.0};
+        bool started{false};
+        double buffered{0.0};  // media seconds queued
+        chrono::steady_clock::time_point last{chrono::steady_clock::now()};
+        deque<FrameRef> segments;
+        double headPlayed{0.0};  // of segments.front()
+        double segmentSeconds{0.0};
+
+        void advance(AbrStats& st) {
+            const auto now = chrono::steady_clock::now();
+            double media = chrono::duration<double>(now - last).count() * speed;
+            last = now;
+            if (!started) return;
+            const double played = min(media, buffered);
+            buffered -= played;
+            st.mediaSeconds += played;
+            st.rebufferSeconds += media - played;
+            for (headPlayed += played; !segments.empty() && headPlayed >= segmentSeconds - 1e-9; headPlayed -= segmentSeconds) {
+                segments.pop_front();  // "decoded and shown": its pooled buffer goes back
+            }
+        }
+    };
+
+    static string fetchText(const HttpUrl& url) {
+        HttpResponse resp = httpRequest(url, "GET");
+        if (resp.status != 200) throw runtime_error("GET " + url.path + " returned " + to_string(resp.status));
+        string body = resp.bodyPrefix;
+        char buf[4096];
+        for (ssize_t n; body.size() < resp.contentLength && (n = ::recv(resp.socket.get(), buf, sizeof buf, 0)) > 0;) {
+            body.append(buf, static_cast<size_t>(n));
+        }
+        return body;
+    }
+
+    void run(const string& manifestUrl) {
+        const HttpUrl base = HttpUrl::parse(manifestUrl);
+        const AbrManifest manifest = AbrManifest::parse(fetchText(base));
+        AbrController abr(manifest.ladder(), opts.abr);
+        Playback pb;
+        pb.speed = opts.speed;
+        pb.segmentSeconds = manifest.segmentSeconds;
+        stats = AbrStats{};
+        const auto start = chrono::steady_clock::now();
+
+        for (size_t i = 0; i < manifest.segmentCount && !stopping; ++i) {
+            pb.advance(stats);
+            while (pb.buffered > opts.abr.bufferTargetSeconds && !stopping) {
+                this_thread::sleep_for(chrono::duration<double>((pb.buffered - opts.abr.bufferTargetSeconds) / opts.speed));
+                pb.advance(stats);
+            }
+            size_t r = abr.choose(pb.buffered);
+            FrameRef segment;
+            while (!segment && !stopping) {
+                HttpUrl url = base;
+                url.path = manifest.segmentPath(r, i);
+                const auto begin = chrono::steady_clock::now();
+                HttpResponse resp = httpRequest(url, "GET");
+                if (resp.status != 200) throw runtime_error("GET " + url.path + " returned " + to_string(resp.status));
+                FrameRef body = FrameRef::allocate(resp.contentLength);
+                size_t got = min<size_t>(resp.bodyPrefix.size(), resp.contentLength);
+                memcpy(body.data(), resp.bodyPrefix.data(), got);
+                bool abandoned = false;
+                while (got < resp.contentLength && !stopping) {
+                    ssize_t n = ::recv(resp.socket.get(), body.data() + got, min<size_t>(resp.contentLength - got, 64 * 1024), 0);
+                    if (n <= 0) throw runtime_error("Connection closed mid-segment");
+                    got += static_cast<size_t>(n);
+                    pb.advance(stats);
+                    const double elapsed = chrono::duration<double>(chrono::steady_clock::now() - begin).count() * opts.speed;
+                    if (pb.started && abr.shouldAbandon(r, got, resp.contentLength, elapsed, pb.buffered)) {
+                        abandoned = true;
+                        break;
+                    }
+                }
+                const double elapsed = chrono::duration<double>(chrono::steady_clock::now() - begin).count() * opts.speed;
+                abr.onDownload(got, elapsed);
+                if (abandoned) {
+                    ++stats.abandons;
+                    stats.wastedBytes += got;
+                    abr.onAbandon();
+                    r = 0;
+                    continue;
+                }
+                if (got == resp.contentLength) segment = move(body);
+            }
+            if (!segment) break;
+            pb.advance(stats);
+            pb.segments.push_back(move(segment));
+            pb.buffered += manifest.segmentSeconds;
+            stats.kbpsSum += manifest.renditions[r].kbps;
+            ++stats.segments;
+            if (!pb.started) {
+                pb.started = true;
+                stats.startupSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count() * opts.speed;
+            }
+        }
+        while (pb.buffered > 0 && !stopping) {  // play out what is left
+            this_thread::sleep_for(chrono::duration<double>(pb.buffered / opts.speed));
+            pb.advance(stats);
+        }
+        stats.switches = abr.getSwitches();
+    }
 };
 
+// The same session as AdaptiveStreamPlayer in virtual time: `trace` is the link, `rttSeconds` is paid per request.
+AbrStats simulateAbr(const AbrManifest& manifest, const BandwidthTrace& trace, AbrController::Options opts, double rttSeconds = 0.05) {
+    AbrController abr(manifest.ladder(), opts);
+    AbrStats st;
+    const double dt = 0.01;
+    double t = 0.0, buffered = 0.0;
+    bool started = false;
+    auto tick = [&](double seconds) {
+        t += seconds;
+        if (!started) return;
+        const double played = min(seconds, buffered);
+        buffered -= played;
+        st.mediaSeconds += played;
+        st.rebufferSeconds += seconds - played;
+    };
+    for (size_t i = 0; i < manifest.segmentCount; ++i) {
+        if (buffered > opts.bufferTargetSeconds) tick(buffered - opts.bufferTargetSeconds);
+        size_t r = abr.choose(buffered);
+        for (;;) {
+            const uint64_t total = manifest.segmentBytes(r);
+            const double begin = t;
+            tick(rttSeconds);
+            double got = 0.0;
+            bool abandoned = false;
+            while (got < total) {
+                got += trace.kbpsAt(t) * 125.0 * dt;
+                tick(dt);
+                if (started && abr.shouldAbandon(r, static_cast<uint64_t>(min<double>(got, total)), total, t - begin, buffered)) {
+                    abandoned = true;
+                    break;
+                }
+            }
+            abr.onDownload(static_cast<uint64_t>(min<double>(got, total)), t - begin);
+            if (!abandoned) break;
+            ++st.abandons;
+            st.wastedBytes += static_cast<uint64_t>(got);
+            abr.onAbandon();
+            r = 0;
+        }
+        buffered += manifest.segmentSeconds;
+        st.kbpsSum += manifest.renditions[r].kbps;
+        ++st.segments;
+        if (!started) started = true, st.startupSeconds = t;
+    }
+    st.mediaSeconds += buffered;
+    st.switches = abr.getSwitches();
+    return st;
+}
+
 // Classes now implement only the interfaces they support.
+// play() and announce() schedule voices on an AudioEngine rendering 48 kHz output; there
+// are no codecs here, so a source "decodes" to a synthesized 44.1 kHz stand-in clip.
 class AudioPlayer : public IPlayable, public IDownloadable {
+    static constexpr size_t kMusicVoice = 0;
+    static constexpr size_t kAnnouncementVoice = 1;
+
     bool playing{false};
+    string downloadDir;
+    StreamingDownloader downloader;
+    AudioEngine engine;
+    map<string, uint16_t> decoded;
+    GaplessPlaylist* playlist{nullptr};  // owned by the engine; valid until the music voice is replaced
+    bool engineStarted{false};
+
+    uint16_t clipFor(const string& source, uint32_t rate, double seconds, double frequency) {
+        auto it = decoded.find(source);
+        if (it != decoded.end()) return it->second;
+        return decoded[source] = engine.addClip(synthesizeClip(rate, seconds, frequency));
+    }
+
+    void ensureEngine() {
+        if (engineStarted) return;
+        engine.start(nullptr);  // no audio device in this exercise: blocks are rendered on time and discarded
+        engineStarted = true;
+    }
+
 public:
+    explicit AudioPlayer(string dir = ".", StreamingDownloader::Options opts = {})
+        : downloadDir(move(dir)), downloader(move(opts)) {}
+
     void play(const string& source) override {
         cout << "Playing audio from " << source << "\n";
+        engine.play(kMusicVoice, clipFor(source, 44100, 30.0, 220.0), 0.8f, true);
+        playlist = nullptr;
+        ensureEngine();
+        playing = true;
+    }
+    // Plays raw 16-bit mono 44.1 kHz tracks back to back with no gap, decoding ahead in the background.
+    void playPlaylist(vector<string> tracks, GaplessPlaylist::Options opts = {}) {
+        cout << "Playing playlist of " << tracks.size() << " tracks\n";
+        auto stream = make_unique<GaplessPlaylist>(move(tracks), opts);
+        playlist = stream.get();
+        engine.playStream(kMusicVoice, move(stream), 0.8f);
+        ensureEngine();
         playing = true;
     }
+    GaplessPlaylist::Stats getPlaylistStats() const { return playlist ? playlist->getStats() : GaplessPlaylist::Stats{}; }
     void pause() override {
         cout << "Pausing audio.\n";
+        engine.setGain(kMusicVoice, 0.0f);
         playing = false;
     }
+    // Plays `source` once over the music, which is ducked to 25% until it ends.
+    void announce(const string& source) {
+        cout << "Announcing " << source << " over the music\n";
+        engine.play(kAnnouncementVoice, clipFor(source, 48000, 0.2, 660.0), 1.0f, false, 0.25f);
+        ensureEngine();
+    }
+    // Stops rendering (play() restarts it) and returns the render thread's counters.
+    AudioEngine::Stats stopEngine() {
+        engine.stop();
+        engineStarted = false;
+        return engine.getStats();
+    }
+    const char* getKernelName() const { return engine.getKernelName(); }
+    // Fetches into <downloadDir>/<last path segment>; an interrupted download resumes on the next call.
     void download(const string& url) override {
         cout << "Downloading audio from " << url << "\n";
-        /* pretend */
-        (void)url;
+        string name = url.substr(url.find_last_of('/') + 1);
+        if (name.empty()) name = "download.bin";
+        const string dest = downloadDir + "/" + name;
+        auto stats = downloader.download(url, dest);
+        cout << (stats.complete ? "Downloaded " : "Partially downloaded ") << stats.totalBytes << " bytes to " << dest << "\n";
     }
     bool isPlaying() const { return playing; }
 };
 
 // LSP: This class now has a clear and unsurprising contract.
 // It only handles live streaming and recording, not generic "playing".
+// While streaming, a capture thread feeds frames at the camera's rate; record()
+// attaches a RecordingPipeline to it, so disk stalls never hold up capture. Recordings are
+// segmented directories that RecordingPlayer can seek in. A "udp://127.0.0.1:port" URL
+// receives a live feed instead of the local camera, played out through a JitterBuffer.
+// Fleets of IP cameras should share a StreamManager (useStreamManager) instead: no thread
+// per camera, and frames are delivered on its workers in arrival order, without jitter buffering.
 class CameraStreamPlayer : public ILiveStreamable, public IRecordable {
-    bool is_streaming{false};
+    atomic<bool> is_streaming{false};
+    uint64_t bitrate;
+    double fps;
+    RecordingPipeline::Options recordingOpts;
+    SegmentedRecordingSink::Options segmentOpts;
+    JitterBuffer::Options jitterOpts;
+    unique_ptr<LiveStreamReceiver> live;
+    StreamManager* manager{nullptr};
+    static constexpr uint32_t kNoStream = UINT32_MAX;
+    uint32_t managedId{kNoStream};
+    uint16_t managedPort{0};
+    thread captureThread;
+    mutex recorderMtx;  // taken once per frame by the capture thread; never contended on the hot path
+    unique_ptr<RecordingPipeline> recorder;
+    function<void(const FrameRef&)> preview;  // guarded by recorderMtx
+    atomic<bool> keyframeRequested{false};
+    bool awaitingKeyframe{false};  // guarded by recorderMtx
+    string recordingPath;
+
+    void captureLoop() {
+        SyntheticFrameSource source(bitrate, fps);
+        const auto start = chrono::steady_clock::now();
+        while (is_streaming.load(memory_order_acquire)) {
+            if (keyframeRequested.exchange(false)) source.requestKeyframe();
+            auto frame = source.next();
+            this_thread::sleep_until(start + chrono::nanoseconds(frame.ptsNs));
+            deliver(FrameRef::copyOf(frame.data, frame.size, frame.ptsNs, frame.keyframe));
+        }
+    }
+
+    // One pooled frame per capture, shared by the recorder and the preview.
+    void deliver(const FrameRef& frame) {
+        lock_guard<mutex> lock(recorderMtx);
+        awaitingKeyframe = awaitingKeyframe && !frame.isKeyframe();
+        if (recorder && !awaitingKeyframe) recorder->capture(frame);
+        if (preview) preview(frame);
+    }
+
+    void finishRecording() {
+        unique_ptr<RecordingPipeline> done;
+        {
+            lock_guard<mutex> lock(recorderMtx);
+            done = move(recorder);
+        }
+        if (!done) return;
+        auto st = done->stop();
+        cout << "Recorded " << st.framesWritten << " frames (" << st.framesDropped << " dropped) to " << recordingPath << "\n";
+    }
+
 public:
+    explicit CameraStreamPlayer(uint64_t bitsPerSecond = 50'000'000, double framesPerSecond = 60.0,
+                                RecordingPipeline::Options opts = {}, SegmentedRecordingSink::Options segments = {},
+                                JitterBuffer::Options jitter = {})
+        : bitrate(bitsPerSecond), fps(framesPerSecond), recordingOpts(opts), segmentOpts(segments), jitterOpts(jitter) {}
+    ~CameraStreamPlayer() {
+        if (is_streaming) stopStreaming();
+    }
+
     // LSP Fix: No more surprising 'play'. The action is 'startStreaming'.
     void startStreaming(const string& url) override {
+        if (is_streaming) return;
         cout << "Starting live stream from " << url << "\n";
+        live.reset();
+        const bool udp = url.compare(0, 6, "udp://") == 0;
+        const uint16_t port = udp ? static_cast<uint16_t>(stoi(url.substr(url.rfind(':') + 1))) : 0;
+        if (udp && manager) {
+            managedId = manager->addStream([this](const StreamPacketHeader& h, const uint8_t* payload) {
+                deliver(FrameRef::copyOf(payload, h.size, h.ptsNs, h.flags & FrameHeader::kKeyframe));
+            }, port);
+            managedPort = manager->portOf(managedId);
+            is_streaming = true;
+            return;
+        }
+        if (udp) live = make_unique<LiveStreamReceiver>(port, jitterOpts);
         is_streaming = true;
-        (void)url;
+        if (live) {
+            captureThread = thread([this] {
+                live->run(is_streaming, [this](const StreamPacketHeader& h, const uint8_t* payload) {
+                    deliver(FrameRef::copyOf(payload, h.size, h.ptsNs, h.flags & FrameHeader::kKeyframe));
+                });
+            });
+        } else {
+            captureThread = thread([this] { captureLoop(); });
+        }
     }
 
     void stopStreaming() override {
         cout << "Stopping live stream.\n";
         is_streaming = false;
+        if (captureThread.joinable()) captureThread.join();
+        if (managedId != kNoStream) {
+            manager->removeStream(managedId);  // no delivery after this returns
+            managedId = kNoStream;
+        }
+        finishRecording();
     }
 
     void record(const string& dest) override {
@@ -77,28 +4159,1183 @@ public:
             // Fail predictably if a precondition is not met.
             throw runtime_error("Cannot record: stream is not active.");
         }
+        finishRecording();
         cout << "Recording stream to " << dest << "\n";
-        (void)dest;
+        RecordingPipeline::Options opts = recordingOpts;
+        opts.copyFrames = false;  // slots hold the captured FrameRefs
+        auto pipeline = make_unique<RecordingPipeline>(make_unique<SegmentedRecordingSink>(dest, segmentOpts), opts);
+        lock_guard<mutex> lock(recorderMtx);
+        recorder = move(pipeline);
+        recordingPath = dest;
+        awaitingKeyframe = true;  // new recordings open on a keyframe
+        keyframeRequested = true;
+    }
+
+    // Sees every captured frame, on the capture thread; keep a copy of the FrameRef to hold on to it.
+    void setPreview(function<void(const FrameRef&)> onFrame) {
+        lock_guard<mutex> lock(recorderMtx);
+        preview = move(onFrame);
+    }
+
+    // Later udp:// streams are received by `mgr`, which must outlive this player's streaming.
+    void useStreamManager(StreamManager& mgr) {
+        if (is_streaming) throw logic_error("useStreamManager while streaming");
+        manager = &mgr;
     }
 
     bool isStreaming() const { return is_streaming; }
+    // Live-feed instrumentation; only meaningful after a udp:// startStreaming. Read once streaming has stopped.
+    uint16_t getLivePort() const { return live ? live->getPort() : managedPort; }
+    JitterStats getLiveStats() const { return live ? live->getStats() : JitterStats{}; }
+    const LiveStreamReceiver* getLiveReceiver() const { return live.get(); }
+};
+
+// Plays back a segmented recording directory. Seeking binary-searches the keyframe index: O(log n) in keyframes.
+// Positions are measured from the recording's first frame, also after its oldest segments have rotated away.
+class RecordingPlayer : public IPlayable, public ISeekable {
+    struct Keyframe {
+        int64_t ptsNs;
+        uint32_t segment;
+        uint64_t offset;
+    };
+
+    string dir;
+    vector<Keyframe> keyframes;  // pts-ordered: segments are numbered in recording order
+    vector<uint32_t> segments;
+    int64_t originPts{0};
+    size_t segmentPos{0};
+    FileDescriptor current;
+    uint64_t offset{0};
+    bool playing{false};
+
+    bool openSegment(size_t pos, uint64_t at) {
+        for (; pos < segments.size(); ++pos, at = 0) {
+            FileDescriptor fd(::open(segmentPath(dir, segments[pos], "frm").c_str(), O_RDONLY));
+            if (!fd) continue;  // rotated away since the index was loaded
+            current = move(fd);
+            segmentPos = pos;
+            offset = at;
+            return true;
+        }
+        current.reset();
+        return false;
+    }
+
+public:
+    // Loads (or reloads, to pick up a live recording's tail) every segment index.
+    void play(const string& source) override {
+        dir = source;
+        segments = listSegments(dir);
+        keyframes.clear();
+        for (uint32_t seg : segments) {
+            FileDescriptor idx(::open(segmentPath(dir, seg, "idx").c_str(), O_RDONLY));
+            struct stat st;
+            if (!idx || fstat(idx.get(), &st) != 0) continue;
+            vector<SegmentIndexEntry> entries(static_cast<size_t>(st.st_size) / sizeof(SegmentIndexEntry));
+            ssize_t want = static_cast<ssize_t>(entries.size() * sizeof(SegmentIndexEntry));
+            if (::pread(idx.get(), entries.data(), static_cast<size_t>(want), 0) != want) continue;
+            for (const auto& e : entries) keyframes.push_back({e.ptsNs, seg, e.offset});
+        }
+        if (segments.empty()) throw runtime_error("No recording in " + dir);
+        FileDescriptor startFile(::open(recordingStartPath(dir).c_str(), O_RDONLY));
+        if (!startFile || ::pread(startFile.get(), &originPts, sizeof originPts, 0) != static_cast<ssize_t>(sizeof originPts)) {
+            originPts = keyframes.empty() ? 0 : keyframes.front().ptsNs;  // older recordings without recording.start
+        }
+        cout << "Playing recording from " << dir << " (" << segments.size() << " segments, " << keyframes.size() << " keyframes)\n";
+        openSegment(0, 0);
+        playing = true;
+    }
+
+    void pause() override {
+        cout << "Pausing playback.\n";
+        playing = false;
+    }
+
+    // Positions at the last keyframe at or before `position` and returns where it landed. Positions before
+    // retainedFrom() land on the oldest keyframe still on disk.
+    chrono::nanoseconds seek(chrono::nanoseconds position) override {
+        if (keyframes.empty()) throw runtime_error("Recording has no keyframes to seek to");
+        const int64_t target = originPts + position.count();
+        auto it = upper_bound(keyframes.begin(), keyframes.end(), target, [](int64_t t, const Keyframe& k) { return t < k.ptsNs; });
+        if (it != keyframes.begin()) --it;
+        size_t pos = static_cast<size_t>(lower_bound(segments.begin(), segments.end(), it->segment) - segments.begin());
+        if (!openSegment(pos, it->offset) || segmentPos != pos) throw runtime_error("Segment " + to_string(it->segment) + " is gone");
+        return chrono::nanoseconds(it->ptsNs - originPts);
+    }
+
+    // Next frame in recording order, crossing segment boundaries; false at the end.
+    bool readFrame(FrameHeader& header, vector<uint8_t>& payload) {
+        while (current) {
+            if (::pread(current.get(), &header, sizeof header, static_cast<off_t>(offset)) == static_cast<ssize_t>(sizeof header) &&
+                header.magic == FrameHeader::kMagic) {
+                payload.resize(header.size);
+                ssize_t got = ::pread(current.get(), payload.data(), header.size, static_cast<off_t>(offset + sizeof header));
+                if (got == static_cast<ssize_t>(header.size)) {
+                    offset += sizeof header + header.size;
+                    return true;
+                }
+            }
+            if (!openSegment(segmentPos + 1, 0)) return false;
+        }
+        return false;
+    }
+
+    // Position of the last indexed keyframe.
+    chrono::nanoseconds duration() const {
+        return keyframes.empty() ? chrono::nanoseconds(0) : chrono::nanoseconds(keyframes.back().ptsNs - originPts);
+    }
+    // Position of the oldest keyframe still on disk; zero unless segments have rotated away.
+    chrono::nanoseconds retainedFrom() const {
+        return keyframes.empty() ? chrono::nanoseconds(0) : chrono::nanoseconds(keyframes.front().ptsNs - originPts);
+    }
+    bool isPlaying() const { return playing; }
+};
+
+// =========================
+// Benchmarks
+// =========================
+static double secondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static string makeTempDir(const char* prefix) {
+    string tmpl = string("/tmp/") + prefix + "-XXXXXX";
+    if (!mkdtemp(tmpl.data())) throwErrno("mkdtemp");
+    return tmpl;
+}
+
+static void writePatternFile(const string& path, uint64_t bytes) {
+    FileDescriptor fd(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    if (!fd) throwErrno("open " + path);
+    vector<char> block(1 << 20);
+    for (uint64_t off = 0; off < bytes; off += block.size()) {
+        for (size_t i = 0; i < block.size(); i += 8) {
+            uint64_t v = (off + i) * 0x9E3779B97F4A7C15ull;
+            memcpy(&block[i], &v, 8);
+        }
+        writeAll(fd.get(), block.data(), min<uint64_t>(block.size(), bytes - off));
+    }
+}
+
+// Raw 16-bit mono PCM: the track format GaplessPlaylist decodes.
+static void writeToneTrack(const string& path, uint32_t rate, double seconds, double frequency) {
+    vector<int16_t> pcm(static_cast<size_t>(rate * seconds));
+    for (size_t i = 0; i < pcm.size(); ++i) pcm[i] = static_cast<int16_t>(12000 * sin(2 * M_PI * frequency * i / rate));
+    FileDescriptor fd(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    if (!fd) throwErrno("open " + path);
+    writeAll(fd.get(), reinterpret_cast<const char*>(pcm.data()), pcm.size() * sizeof(int16_t));
+}
+
+static void removeRecording(const string& dir) {
+    for (uint32_t seg : listSegments(dir)) {
+        ::unlink(segmentPath(dir, seg, "idx").c_str());
+        ::unlink(segmentPath(dir, seg, "frm").c_str());
+    }
+    ::unlink(recordingStartPath(dir).c_str());
+    ::rmdir(dir.c_str());
+}
+
+static bool sameContents(const string& a, const string& b) {
+    FileDescriptor fa(::open(a.c_str(), O_RDONLY)), fb(::open(b.c_str(), O_RDONLY));
+    if (!fa || !fb) return false;
+    vector<char> ba(1 << 20), bb(1 << 20);
+    for (;;) {
+        ssize_t na = ::read(fa.get(), ba.data(), ba.size());
+        ssize_t nb = ::read(fb.get(), bb.data(), bb.size());
+        if (na != nb || na < 0) return false;
+        if (na == 0) return true;
+        if (memcmp(ba.data(), bb.data(), static_cast<size_t>(na)) != 0) return false;
+    }
+}
+
+// Download throughput and CPU cost per GB (server runs in-process, so its sendfile() time is included): copy vs zero-copy, 1 vs N range streams, plus an interrupted-then-resumed run.
+int benchDownload(uint64_t megabytes, size_t parallel) {
+    const string dir = makeTempDir("bench-download");
+    const string source = dir + "/media.bin";
+    writePatternFile(source, megabytes << 20);
+    LocalHttpServer server(dir);
+    const string url = server.url("media.bin");
+    cout << "Downloading " << megabytes << " MiB from " << url << "\n";
+
+    auto report = [&](const char* label, const StreamingDownloader::Stats& st, const string& dest) {
+        printf("%-28s %8.1f MB/s  %6.3f CPU s/GB  %s\n", label, st.megabytesPerSecond(), st.cpuSecondsPerGigabyte(),
+               st.complete && sameContents(source, dest) ? "verified" : "MISMATCH");
+        ::unlink(dest.c_str());
+    };
+    struct Run { const char* label; size_t streams; bool zeroCopy; };
+    const Run runs[] = { {"copy, 1 stream", 1, false}, {"splice, 1 stream", 1, true},
+                         {"copy, N streams", parallel, false}, {"splice, N streams", parallel, true} };
+    for (const auto& run : runs) {
+        StreamingDownloader::Options opts;
+        opts.parallelChunks = run.streams;
+        opts.zeroCopy = run.zeroCopy;
+        const string dest = dir + "/out.bin";
+        report(run.label, StreamingDownloader(opts).download(url, dest), dest);
+    }
+
+    StreamingDownloader::Options opts;
+    opts.parallelChunks = parallel;
+    opts.progress = [](uint64_t done, uint64_t total) { return done * 2 < total; };
+    const string dest = dir + "/resumed.bin";
+    auto first = StreamingDownloader(opts).download(url, dest);
+    opts.progress = nullptr;
+    auto rest = StreamingDownloader(opts).download(url, dest);
+    printf("resume: first pass %llu MiB (complete=%d), second pass %llu MiB\n",
+           static_cast<unsigned long long>(first.fetchedBytes >> 20), first.complete,
+           static_cast<unsigned long long>(rest.fetchedBytes >> 20));
+    report("splice, resumed", rest, dest);
+
+    // Same partial download, but the source changes in the part already fetched: the resume must start over.
+    opts.progress = [](uint64_t done, uint64_t total) { return done * 2 < total; };
+    StreamingDownloader(opts).download(url, dest);
+    {
+        FileDescriptor fd(::open(source.c_str(), O_WRONLY));
+        const vector<char> changed(4096, '\xFF');
+        if (!fd || ::pwrite(fd.get(), changed.data(), changed.size(), 0) != static_cast<ssize_t>(changed.size())) throwErrno("pwrite " + source);
+    }
+    opts.progress = nullptr;
+    auto restarted = StreamingDownloader(opts).download(url, dest);
+    printf("source changed mid-resume: second pass %llu MiB\n", static_cast<unsigned long long>(restarted.fetchedBytes >> 20));
+    report("splice, restarted", restarted, dest);
+
+    // Shutdown with a throttled response in flight and a client that never sent a request.
+    double shutdownMs;
+    {
+        auto slow = make_unique<LocalHttpServer>(dir);
+        slow->setThrottle(64 << 10);
+        HttpResponse stalled = httpRequest(HttpUrl::parse(slow->url("media.bin")), "GET");
+        FileDescriptor idle(::socket(AF_INET, SOCK_STREAM, 0));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(slow->getPort());
+        if (!idle || ::connect(idle.get(), reinterpret_cast<sockaddr*>(&addr), sizeof addr) != 0) throwErrno("connect");
+        this_thread::sleep_for(chrono::milliseconds(50));  // let the server accept the idle connection
+        auto start = chrono::steady_clock::now();
+        slow.reset();
+        shutdownMs = secondsSince(start) * 1e3;
+    }
+    printf("server shutdown with a throttled download and an idle client open: %.1f ms\n", shutdownMs);
+
+    ::unlink(source.c_str());
+    ::rmdir(dir.c_str());
+    return 0;
+}
+
+// Test double: forwards to a real sink but blocks for `stall` every `period`, like a disk hitting a flush storm.
+class StallingRecordingSink final : public IRecordingSink {
+    unique_ptr<IRecordingSink> inner;
+    chrono::milliseconds stall, period;
+    chrono::steady_clock::time_point nextStall;
+public:
+    StallingRecordingSink(unique_ptr<IRecordingSink> s, chrono::milliseconds stallFor, chrono::milliseconds every)
+        : inner(move(s)), stall(stallFor), period(every), nextStall(chrono::steady_clock::now() + every) {}
+    void append(const FrameHeader& header, const uint8_t* payload) override {
+        if (chrono::steady_clock::now() >= nextStall) {
+            this_thread::sleep_for(stall);
+            nextStall = chrono::steady_clock::now() + period;
+        }
+        inner->append(header, payload);
+    }
+    void close() override { inner->close(); }
+    uint64_t getWriteCalls() const override { return inner->getWriteCalls(); }
+    double getMaxWriteSeconds() const override { return inner->getMaxWriteSeconds(); }
 };
 
-int main() {
-    AudioPlayer ap;
+struct RecordingCheck {
+    long long frames{0};
+    long long gaps{0};          // runs of dropped frames
+    long long brokenGaps{0};    // gaps that resume on a delta frame (undecodable until the next keyframe)
+    bool corrupt{false};
+};
+
+static RecordingCheck verifyRecording(const string& path) {
+    RecordingCheck check;
+    FILE* f = fopen(path.c_str(), "rb");
+    if (!f) return {0, 0, 0, true};
+    vector<uint8_t> payload;
+    FrameHeader h;
+    uint64_t expected = 0;
+    while (fread(&h, sizeof h, 1, f) == 1) {
+        payload.resize(h.size);
+        if (h.magic != FrameHeader::kMagic || fread(payload.data(), 1, h.size, f) != h.size || h.sequence < expected) {
+            check.corrupt = true;
+            break;
+        }
+        if (h.sequence != expected) {
+            ++check.gaps;
+            if (!h.isKeyframe()) ++check.brokenGaps;
+        }
+        expected = h.sequence + 1;
+        ++check.frames;
+    }
+    fclose(f);
+    return check;
+}
+
+// 4K60 recording: unpaced pipeline throughput, then real-time capture through periodic disk stalls under each drop policy.
+int benchRecord(double seconds, uint64_t megabitsPerSecond, int stallMs) {
+    const string dir = makeTempDir("bench-record");
+    const string path = dir + "/capture.frm";
+    const double fps = 60.0;
+    const size_t frames = static_cast<size_t>(seconds * fps);
+    RecordingPipeline::Options opts;
+    opts.maxFrameBytes = max(opts.maxFrameBytes, SyntheticFrameSource(megabitsPerSecond * 1000000, fps).maxFrameBytes());
+    printf("4K60 at %llu Mbit/s, %zu frame slots of %zu KiB\n", static_cast<unsigned long long>(megabitsPerSecond),
+           opts.frameSlots, opts.maxFrameBytes >> 10);
+
+    auto print = [&](const char* label, const RecordingStats& st, double secs) {
+        auto check = verifyRecording(path);
+        bool ok = !check.corrupt && check.frames == static_cast<long long>(st.framesWritten);
+        printf("%-28s %5llu captured %4llu dropped %3llu stalls %7.1f MB/s %4llu writes, max %5.1f ms  %s, %lld gaps (%lld undecodable)\n", label,
+               static_cast<unsigned long long>(st.framesCaptured), static_cast<unsigned long long>(st.framesDropped),
+               static_cast<unsigned long long>(st.captureStalls), st.bytesWritten / 1e6 / secs,
+               static_cast<unsigned long long>(st.writeCalls), st.maxWriteSeconds * 1e3,
+               ok ? "verified" : "CORRUPT", check.gaps, check.brokenGaps);
+    };
+
+    {
+        opts.dropPolicy = DropPolicy::Block;
+        SyntheticFrameSource source(megabitsPerSecond * 1000000, fps);
+        RecordingPipeline pipeline(make_unique<FileRecordingSink>(path), opts);
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < frames * 4; ++i) {
+            auto f = source.next();
+            pipeline.capture(f.data, f.size, f.ptsNs, f.keyframe);
+        }
+        auto st = pipeline.stop();
+        double secs = secondsSince(start);
+        print("unpaced, block", st, secs);
+        printf("  -> %.0f fps, %.1fx real time\n", st.framesWritten / secs, st.framesWritten / secs / fps);
+    }
+
+    const pair<DropPolicy, const char*> policies[] = { {DropPolicy::Block, "paced + stalls, block"},
+                                                       {DropPolicy::DropNewest, "paced + stalls, drop-newest"},
+                                                       {DropPolicy::DropToKeyframe, "paced + stalls, to-keyframe"} };
+    for (const auto& [policy, label] : policies) {
+        opts.dropPolicy = policy;
+        SyntheticFrameSource source(megabitsPerSecond * 1000000, fps);
+        RecordingPipeline pipeline(make_unique<StallingRecordingSink>(make_unique<FileRecordingSink>(path),
+                                                                      chrono::milliseconds(stallMs), chrono::milliseconds(2000)),
+                                   opts);
+        auto start = chrono::steady_clock::now();
+        double maxLateMs = 0.0;
+        for (size_t i = 0; i < frames; ++i) {
+            auto f = source.next();
+            auto due = start + chrono::nanoseconds(f.ptsNs);
+            this_thread::sleep_until(due);
+            pipeline.capture(f.data, f.size, f.ptsNs, f.keyframe);
+            maxLateMs = max(maxLateMs, chrono::duration<double, milli>(chrono::steady_clock::now() - due).count());
+        }
+        auto st = pipeline.stop();
+        print(label, st, secondsSince(start));
+        printf("  -> peak %zu/%zu slots in flight, capture up to %.1f ms late\n", st.maxInFlight, opts.frameSlots, maxLateMs);
+    }
+
+    ::unlink(path.c_str());
+    ::rmdir(dir.c_str());
+    return 0;
+}
+
+// Seek cost in a long segmented recording: index lookup vs scanning frame headers from the start, plus rotation.
+int benchSeek(double minutes, uint64_t kilobitsPerSecond) {
+    const string dir = makeTempDir("bench-seek");
+    const double fps = 60.0;
+    const size_t frames = static_cast<size_t>(minutes * 60 * fps);
+    auto recordInto = [&](const string& path, SegmentedRecordingSink::Options segOpts) {
+        SyntheticFrameSource source(kilobitsPerSecond * 1000, fps);
+        RecordingPipeline::Options opts;
+        opts.dropPolicy = DropPolicy::Block;
+        RecordingPipeline pipeline(make_unique<SegmentedRecordingSink>(path, segOpts), opts);
+        for (size_t i = 0; i < frames; ++i) {
+            auto f = source.next();
+            pipeline.capture(f.data, f.size, f.ptsNs, f.keyframe);
+        }
+        return pipeline.stop();
+    };
+
+    auto start = chrono::steady_clock::now();
+    auto st = recordInto(dir + "/full", {});
+    printf("Recorded %.0f min of 60 fps at %llu kbit/s in %.2f s: %zu segments, %.1f MB, unpaced capture stalls %llu, max write %.1f ms\n",
+           minutes, static_cast<unsigned long long>(kilobitsPerSecond), secondsSince(start), listSegments(dir + "/full").size(),
+           st.bytesWritten / 1e6, static_cast<unsigned long long>(st.captureStalls), st.maxWriteSeconds * 1e3);
+
+    RecordingPlayer player;
+    start = chrono::steady_clock::now();
+    player.play(dir + "/full");
+    printf("Index load: %.2f ms\n", secondsSince(start) * 1e3);
+
+    mt19937_64 rng(42);
+    const int64_t span = player.duration().count();
+    FrameHeader header;
+    vector<uint8_t> payload;
+    const int seeks = 10000;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < seeks; ++i) {
+        player.seek(chrono::nanoseconds(static_cast<int64_t>(rng() % static_cast<uint64_t>(span + 1))));
+        if (!player.readFrame(header, payload) || !header.isKeyframe()) return printf("seek landed off a keyframe\n"), 1;
+    }
+    printf("Indexed seek + first frame read: %.1f us avg over %d seeks\n", secondsSince(start) * 1e6 / seeks, seeks);
+
+    // Baseline: what seeking costs without an index, walking frame headers from the first segment.
+    const int scans = 20;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < scans; ++i) {
+        const int64_t target = static_cast<int64_t>(rng() % static_cast<uint64_t>(span + 1));
+        for (uint32_t seg : listSegments(dir + "/full")) {
+            FileDescriptor fd(::open(segmentPath(dir + "/full", seg, "frm").c_str(), O_RDONLY));
+            uint64_t off = 0;
+            bool found = false;
+            while (::pread(fd.get(), &header, sizeof header, static_cast<off_t>(off)) == static_cast<ssize_t>(sizeof header)) {
+                if (header.ptsNs >= target) {
+                    found = true;
+                    break;
+                }
+                off += sizeof header + header.size;
+            }
+            if (found) break;
+        }
+    }
+    printf("Header-scan seek (no index): %.2f ms avg over %d seeks\n", secondsSince(start) * 1e3 / scans, scans);
+
+    // Live segment: every keyframe the index lists must be readable while the sink is still writing.
+    {
+        SegmentedRecordingSink live(dir + "/live");
+        SyntheticFrameSource source(kilobitsPerSecond * 1000, fps);
+        for (int i = 0; i < 30 * 60; ++i) {
+            auto f = source.next();
+            FrameHeader h;
+            h.size = static_cast<uint32_t>(f.size);
+            h.ptsNs = f.ptsNs;
+            h.flags = f.keyframe ? FrameHeader::kKeyframe : 0;
+            live.append(h, f.data);
+        }
+        RecordingPlayer reader;
+        reader.play(dir + "/live");
+        int listed = 0, readable = 0;
+        for (int64_t pos = 0; pos <= reader.duration().count(); pos += 1'000'000'000) {
+            ++listed;
+            reader.seek(chrono::nanoseconds(pos));
+            readable += reader.readFrame(header, payload) && header.isKeyframe();
+        }
+        printf("Live segment: %d/%d seeks up to the last indexed keyframe (%.1f s of 30 s written) read a keyframe\n", readable,
+               listed, chrono::duration<double>(reader.duration()).count());
+    }
+    removeRecording(dir + "/live");
+
+    SegmentedRecordingSink::Options rotating;
+    rotating.maxSegments = 6;
+    recordInto(dir + "/rotating", rotating);
+    RecordingPlayer tail;
+    tail.play(dir + "/rotating");
+    auto landed = tail.seek(chrono::nanoseconds(0));
+    printf("Rotation keeps %zu segments: positions %.0f-%.0f s retained of %.0f s recorded; seek(0) lands at %.0f s\n",
+           listSegments(dir + "/rotating").size(), chrono::duration<double>(tail.retainedFrom()).count(),
+           chrono::duration<double>(tail.duration()).count(), minutes * 60, chrono::duration<double>(landed).count());
+
+    removeRecording(dir + "/full");
+    removeRecording(dir + "/rotating");
+    ::rmdir(dir.c_str());
+    return 0;
+}
+
+// Jitter buffer under simulated network conditions: fixed 40 ms playout delay vs adaptive.
+int benchJitter(double seconds, double packetsPerSecond) {
+    using ms = chrono::milliseconds;
+    struct Scenario { const char* name; PacketReplayer::NetworkProfile net; };
+    PacketReplayer::NetworkProfile lan, wan, bursty;
+    lan.baseDelay = ms(1), lan.jitter = chrono::microseconds(500);
+    wan.baseDelay = ms(20), wan.jitter = ms(10), wan.lossRate = 0.005;
+    bursty.baseDelay = ms(10), bursty.jitter = ms(3), bursty.spikeEvery = ms(3000), bursty.spikeDelay = ms(80);
+    const Scenario scenarios[] = { {"lan", lan}, {"wan", wan}, {"bursty", bursty} };
+
+    printf("%-7s %-9s %6s %6s %5s %6s %5s %8s %7s %7s %7s %7s\n", "net", "buffer", "played", "missing", "late",
+           "depth", "max", "delay ms", "p50", "p95", "p99", "max");
+    for (const auto& sc : scenarios) {
+        for (bool adaptive : {false, true}) {
+            JitterBuffer::Options opts;
+            opts.adaptive = adaptive;
+            LiveStreamReceiver receiver(0, opts);
+            atomic<bool> running{true};
+            thread loop([&] { receiver.run(running, nullptr); });
+            {
+                PacketReplayer feed(receiver.getPort(), packetsPerSecond, sc.net);
+                this_thread::sleep_for(chrono::duration<double>(seconds));
+            }
+            this_thread::sleep_for(ms(300));  // let the tail play out
+            running = false;
+            loop.join();
+            auto st = receiver.getStats();
+            const auto& lat = receiver.getLatency();
+            printf("%-7s %-9s %6llu %7llu %5llu %6.1f %5zu %8.1f %7.1f %7.1f %7.1f %7.1f\n", sc.name, adaptive ? "adaptive" : "fixed 40",
+                   static_cast<unsigned long long>(st.played), static_cast<unsigned long long>(st.missing),
+                   static_cast<unsigned long long>(st.lateDrops), st.avgDepth, st.maxDepth, st.delayMs, lat.percentileMs(0.5),
+                   lat.percentileMs(0.95), lat.percentileMs(0.99), lat.maxMs());
+        }
+    }
+    printf("(latency = glass-to-glass ms; missing includes network loss; late = arrived after being skipped)\n");
+
+    // Discontinuities, fed directly: 100 packets, a 2000-packet outage, 500 packets, then the sender
+    // restarts its numbering and timestamps at 0 for 300 more. All 900 must play.
+    JitterBuffer jb;
+    const vector<uint8_t> payload(200, 0x5A);
+    const int64_t frameNs = 1'000'000'000 / 60;
+    int64_t clockNs = 0;
+    uint64_t played = 0;
+    auto feed = [&](uint32_t firstSeq, int64_t firstPts, int count) {
+        for (int i = 0; i < count; ++i, clockNs += frameNs) {
+            StreamPacketHeader h;
+            h.sequence = firstSeq + static_cast<uint32_t>(i);
+            h.ptsNs = firstPts + i * frameNs;
+            h.size = static_cast<uint32_t>(payload.size());
+            jb.insert(h, payload.data(), clockNs + 1'000'000);
+            JitterBuffer::Packet pkt;
+            while (jb.popDue(clockNs + 1'000'000'000, pkt)) ++played;
+        }
+    };
+    feed(0, 0, 100);
+    clockNs += 2000 * frameNs;
+    feed(2100, 2100 * frameNs, 500);
+    feed(0, 0, 300);
+    const auto js = jb.getStats();
+    printf("Discontinuities: %llu/900 played across a 2000-packet gap and a sender restart, %llu resyncs, %llu late%s\n",
+           static_cast<unsigned long long>(played), static_cast<unsigned long long>(js.discontinuities),
+           static_cast<unsigned long long>(js.lateDrops), played == 900 && js.discontinuities == 2 ? "" : "  MISMATCH");
+    return played == 900 && js.discontinuities == 2 ? 0 : 1;
+}
+
+// PCM kernels, resampler quality/speed and mixer capacity per kernel build: channels one core can mix at a fixed block size.
+int benchMix(size_t blockFrames, double seconds) {
+    vector<const PcmKernels*> builds = { &PcmKernels::scalar() };
+#if MEDIA_HAVE_X86_SIMD
+    builds.push_back(&PcmKernels::sse());
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) builds.push_back(&PcmKernels::avx2());
+#endif
+    volatile float sink = 0.0f;
+
+    printf("Kernels (ns per sample):\n");
+    for (const auto* k : builds) {
+        vector<float> dst(blockFrames, 0.0f), src(blockFrames, 0.5f);
+        const int reps = 200000;
+        auto start = chrono::steady_clock::now();
+        for (int r = 0; r < reps; ++r) k->mixRamp(dst.data(), src.data(), 0.5f, 1e-6f, blockFrames);
+        double mixNs = secondsSince(start) * 1e9 / (double(reps) * blockFrames);
+        start = chrono::steady_clock::now();
+        for (int r = 0; r < reps; ++r) sink = sink + k->dot(dst.data() + (r & 7), src.data(), 32);
+        double dotNs = secondsSince(start) * 1e9 / (double(reps) * 32);
+        printf("  %-7s mix+ramp %.3f  dot(32) %.3f\n", k->name, mixNs, dotNs);
+    }
+
+    // Quality: a 1 kHz tone through 44.1k -> 48k, compared with the ideal tone at the resampler's group delay.
+    {
+        PolyphaseResampler r(44100, 48000, blockFrames);
+        const size_t taps = 32;
+        const double delay = taps / 2.0 - 1.0 / (2 * 160);  // input samples
+        vector<float> in(blockFrames * 2), out(blockFrames);
+        size_t consumed = 0, produced = 0;
+        double signal = 0.0, noise = 0.0;
+        for (int b = 0; b < 400; ++b) {
+            size_t need = r.inputNeeded(blockFrames);
+            for (size_t i = 0; i < need; ++i) in[i] = static_cast<float>(0.5 * sin(2 * M_PI * 1000.0 * (consumed + i) / 44100));
+            consumed += need;
+            r.push(in.data(), need);
+            r.render(out.data(), blockFrames);
+            for (size_t j = 0; j < blockFrames; ++j, ++produced) {
+                if (b < 4) continue;  // filter warm-up
+                const double t = (produced * 147.0 / 160.0 - delay) / 44100;
+                const double ideal = 0.5 * sin(2 * M_PI * 1000.0 * t);
+                signal += ideal * ideal;
+                noise += (out[j] - ideal) * (out[j] - ideal);
+            }
+        }
+        printf("Resampler 44.1k->48k, 32 taps x 160 phases: 1 kHz SNR %.1f dB\n", 10 * log10(signal / noise));
+    }
+
+    const double period = static_cast<double>(blockFrames) / 48000;
+    printf("Mixer, %zu-frame blocks at 48 kHz (%.2f ms budget), %zu voices:\n", blockFrames, period * 1e3, AudioEngine::kMaxVoices);
+    for (const auto* k : builds) {
+        for (uint32_t rate : {48000u, 44100u}) {
+            AudioEngine engine(48000, blockFrames, *k);
+            uint16_t clip = engine.addClip(synthesizeClip(rate, 2.0, 220.0));
+            for (size_t v = 0; v < AudioEngine::kMaxVoices; ++v) engine.play(v, clip, 1.0f / AudioEngine::kMaxVoices, true);
+            vector<float> out(blockFrames);
+            engine.renderBlock(out.data());
+            const size_t blocks = static_cast<size_t>(seconds / period);
+            auto start = chrono::steady_clock::now();
+            for (size_t b = 0; b < blocks; ++b) engine.renderBlock(out.data());
+            const double perBlock = secondsSince(start) / blocks;
+            const double perVoice = perBlock / AudioEngine::kMaxVoices;
+            printf("  %-7s %s sources: %6.2f us/voice-block -> %6.0f channels per core in real time\n", k->name,
+                   rate == 48000 ? "48k (mix only)   " : "44.1k (resample)", perVoice * 1e6, period / perVoice);
+        }
+    }
+    return sink == 12345.0f;
+}
+
+// Playlist playback at `speed` x real time from a cold page cache: on-demand decoding vs prefetching ahead.
+int benchPlaylist(size_t trackCount, double secondsPerTrack, double speed) {
+    const string dir = makeTempDir("bench-playlist");
+    vector<string> tracks;
+    for (size_t i = 0; i < trackCount; ++i) {
+        tracks.push_back(dir + "/track" + to_string(i) + ".pcm");
+        writeToneTrack(tracks.back(), 44100, secondsPerTrack, 110.0 * (i + 1));
+    }
+    printf("%zu tracks x %.1f s, played at %.0fx real time, cold cache\n", trackCount, secondsPerTrack, speed);
+    printf("%-10s %9s %9s %12s %12s %14s\n", "prefetch", "hit rate", "max gap", "underrun ms", "first sample", "wall s");
+    for (size_t prefetch : {size_t(0), size_t(1), size_t(2)}) {
+        for (const auto& t : tracks) {  // evict from the page cache so every run starts cold
+            FileDescriptor fd(::open(t.c_str(), O_RDONLY));
+            fdatasync(fd.get());
+            posix_fadvise(fd.get(), 0, 0, POSIX_FADV_DONTNEED);
+        }
+        GaplessPlaylist::Options opts;
+        opts.prefetchTracks = prefetch;
+        AudioEngine engine(48000, 256);
+        auto stream = make_unique<GaplessPlaylist>(tracks, opts);
+        auto* playlist = stream.get();
+        engine.playStream(0, move(stream), 1.0f);
+        vector<float> out(256);
+        const auto period = chrono::duration<double>(256.0 / 48000 / speed);
+        auto start = chrono::steady_clock::now();
+        auto next = start;
+        const size_t maxBlocks = static_cast<size_t>(trackCount * secondsPerTrack * 48000 / 256 * 4);
+        for (size_t b = 0; b < maxBlocks && !playlist->exhausted(); ++b) {
+            engine.renderBlock(out.data());
+            next += chrono::duration_cast<chrono::steady_clock::duration>(period);
+            this_thread::sleep_until(next);
+        }
+        auto st = playlist->getStats();
+        printf("%-10zu %8.0f%% %7.1f ms %12.1f %9.2f ms %14.2f\n", prefetch, st.hitRate() * 100, st.maxGapMs,
+               st.underrunFrames * 1e3 / 44100, st.firstSampleMs, secondsSince(start));
+    }
+    for (const auto& t : tracks) ::unlink(t.c_str());
+    ::rmdir(dir.c_str());
+    return 0;
+}
+
+// Test double: accepts frames and drops them, so a benchmark sees only pipeline cost.
+class DiscardingRecordingSink final : public IRecordingSink {
+public:
+    void append(const FrameHeader&, const uint8_t*) override {}
+    void close() override {}
+    uint64_t getWriteCalls() const override { return 0; }
+    double getMaxWriteSeconds() const override { return 0.0; }
+};
+
+// Cost of MediaMetrics: per-call price, then throughput of two instrumented hot paths with metrics off vs on.
+int benchMetrics(size_t rounds) {
+    auto& mm = MediaMetrics::global();
+    MediaMetrics::setEnabled(true);
+    const auto c = mm.counter("bench", "counter");
+    const auto h = mm.histogram("bench", "histogram");
+    const auto g = mm.gauge("bench", "gauge");
+    const size_t calls = 20'000'000;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < calls; ++i) mm.add(c);
+    const double addNs = secondsSince(start) * 1e9 / calls;
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < calls; ++i) mm.record(h, i & 0xFFFFF);
+    const double recordNs = secondsSince(start) * 1e9 / calls;
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < calls; ++i) mm.recordSince(h, MediaMetrics::now());
+    const double timedNs = secondsSince(start) * 1e9 / calls;
+    MediaMetrics::setEnabled(false);
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < calls; ++i) mm.record(h, i);
+    const double offNs = secondsSince(start) * 1e9 / calls;
+    printf("Per call: counter add %.1f ns, histogram record %.1f ns, timed stage (1-in-16 sampled) %.1f ns, disabled %.2f ns\n", addNs,
+           recordNs, timedNs, offNs);
+    if (mm.counterValue(c) != calls) printf("  counter mismatch: %llu\n", (unsigned long long)mm.counterValue(c));
+
+    // Each workload alternates off/on (swapping which goes first) for `rounds` and keeps the best of each, to shed scheduler noise.
+    // A/B throughput on a shared VM wobbles by a few percent either way, so the instrumentation one event executes
+    // (`replay`, the same calls on the same kind of ids) is also timed on its own and set against the event's cost.
+    auto compare = [&](const char* name, const char* unit, const function<double()>& run, const function<void()>& replay) {
+        double best[2] = {0.0, 0.0};
+        for (size_t r = 0; r < 2 * rounds; ++r) {
+            const int on = static_cast<int>((r + r / 2) % 2);
+            MediaMetrics::setEnabled(on);
+            best[on] = max(best[on], run());
+        }
+        MediaMetrics::setEnabled(true);
+        const size_t events = 2'000'000;
+        auto begin = chrono::steady_clock::now();
+        for (size_t i = 0; i < events; ++i) replay();
+        const double replayNs = secondsSince(begin) * 1e9 / events;
+        MediaMetrics::setEnabled(false);
+        printf("%-34s off %8.0f %s  on %8.0f %s (A/B %+.1f%%)  instrumentation %.1f ns of %.0f ns per event = %.2f%%\n", name, best[0],
+               unit, best[1], unit, (best[0] / best[1] - 1) * 100, replayNs, 1e9 / best[0], replayNs * best[0] / 1e7);
+    };
+    // 64 KiB is a delta frame of a 30 Mbit/s 60 fps stream.
+    compare("recording pipeline, 64 KiB frames", "frames/s", [] {
+        RecordingPipeline::Options opts;
+        opts.dropPolicy = DropPolicy::Block;
+        opts.maxFrameBytes = 64 << 10;
+        RecordingPipeline pipeline(make_unique<DiscardingRecordingSink>(), opts);
+        vector<uint8_t> frame(64 << 10, 7);
+        const size_t frames = 30'000;
+        auto begin = chrono::steady_clock::now();
+        for (size_t i = 0; i < frames; ++i) pipeline.capture(frame.data(), frame.size(), static_cast<int64_t>(i), i % 60 == 0);
+        pipeline.stop();
+        return frames / secondsSince(begin);
+    }, [&] {
+        const int64_t captured = MediaMetrics::now();
+        mm.add(c);
+        mm.set(g, 3);
+        mm.recordSince(h, captured);
+        const int64_t write = MediaMetrics::now();
+        mm.recordSince(h, write);
+        mm.recordSince(h, captured);
+        mm.add(c, 65536);
+    });
+    compare("audio engine, 64 voices", "blocks/s", [] {
+        AudioEngine engine(48000, 256);
+        uint16_t clip = engine.addClip(synthesizeClip(48000, 1.0, 220.0));
+        for (size_t v = 0; v < AudioEngine::kMaxVoices; ++v) engine.play(v, clip, 1.0f / AudioEngine::kMaxVoices, true);
+        vector<float> out(256);
+        const size_t blocks = 30'000;
+        auto begin = chrono::steady_clock::now();
+        for (size_t b = 0; b < blocks; ++b) engine.renderBlock(out.data());
+        return blocks / secondsSince(begin);
+    }, [&] {
+        mm.add(c);
+        mm.set(g, 64);
+    });
+
+    // Instances come and go for the life of the process; their released slots must keep registration working.
+    const size_t churn = 2 * MediaMetrics::kMaxHistograms;
+    for (size_t i = 0; i < churn; ++i) LiveStreamReceiver(0).getPort();
+    printf("After %zu short-lived receivers (2 histograms each, %zu slots): a new histogram %s\n", churn, MediaMetrics::kMaxHistograms,
+           mm.histogram("bench", "after_churn") == MediaMetrics::kNone ? "is refused (registry full)" : "registers");
+    return 0;
+}
+
+// Resident and transparent-huge-page bytes of this process.
+static pair<size_t, size_t> residentBytes() {
+    size_t rss = 0, thp = 0;
+    if (FILE* f = fopen("/proc/self/statm", "r")) {
+        unsigned long pages = 0, resident = 0;
+        if (fscanf(f, "%lu %lu", &pages, &resident) == 2) rss = resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        fclose(f);
+    }
+    if (FILE* f = fopen("/proc/self/smaps_rollup", "r")) {
+        char line[256];
+        unsigned long kb;
+        while (fgets(line, sizeof line, f)) {
+            if (sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) thp = kb << 10;
+        }
+        fclose(f);
+    }
+    return {rss, thp};
+}
+
+// Frame buffer churn: the producer allocates every video frame and an audio chunk, fans each frame out to a
+// recorder (whose backlog changes every simulated hour, like a disk that sometimes falls behind) and a preview.
+template <class Handle, class Make, class Bytes>
+static void churnBuffers(const char* name, double hours, double fps, Make make, Bytes bytes) {
+    const uint64_t perHour = static_cast<uint64_t>(fps * 3600);
+    const uint64_t frames = static_cast<uint64_t>(perHour * hours);
+    SpscRing<Handle> toRecorder(256), toPreview(256);
+    atomic<size_t> recorderBacklog{8};
+    atomic<bool> producing{true};
+    auto consumer = [&](SpscRing<Handle>& ring, const atomic<size_t>* backlog) {
+        deque<Handle> held;
+        Handle h;
+        Backoff idle;
+        while (producing.load(memory_order_acquire) || ring.size() > 0) {
+            if (!ring.tryPop(h)) {
+                idle.pause();
+                continue;
+            }
+            idle.reset();
+            held.push_back(move(h));
+            while (held.size() > (backlog ? backlog->load(memory_order_relaxed) : 2)) held.pop_front();
+        }
+    };
+    thread recorder(consumer, ref(toRecorder), &recorderBacklog);
+    thread preview(consumer, ref(toPreview), nullptr);
+
+    SyntheticFrameSource source(50'000'000, fps);
+    array<uint64_t, 48> histogram{};  // log2 of ns per allocation
+    uint64_t allocs = 0, slow = 0, totalNs = 0, maxNs = 0;
+    auto timed = [&](size_t size) {
+        // Timed through the first write of every page: fresh memory costs its page faults, not just the call.
+        auto t0 = chrono::steady_clock::now();
+        Handle h = make(size);
+        uint8_t* p = bytes(h);
+        for (size_t off = 0; off < size; off += 4096) p[off] = static_cast<uint8_t>(off);
+        const uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - t0).count();
+        ++allocs;
+        totalNs += ns;
+        maxNs = max(maxNs, ns);
+        slow += ns > 10'000;
+        ++histogram[min<size_t>(63 - __builtin_clzll(ns | 1), histogram.size() - 1)];
+        return h;
+    };
+
+    uint64_t rng = 0x9E3779B97F4A7C15ull;
+    vector<Handle> audio(32);
+    size_t rssFirstHour = 0, rssMin = SIZE_MAX, rssMax = 0, thpPeak = 0;
+    uint64_t peakHour = 0;
+    const auto start = chrono::steady_clock::now();
+    for (uint64_t i = 0; i < frames; ++i) {
+        auto f = source.next();
+        Handle frame = timed(f.size);
+        Backoff full;
+        while (!toRecorder.tryPush(frame)) full.pause();
+        while (!toPreview.tryPush(move(frame))) full.pause();
+        rng ^= rng << 13, rng ^= rng >> 7, rng ^= rng << 17;
+        audio[i % audio.size()] = timed(2048 + rng % 14336);
+        if ((i + 1) % perHour == 0) {
+            recorderBacklog = 8 + rng % 200;
+            auto [rss, thp] = residentBytes();
+            if (!rssFirstHour) rssFirstHour = rss;
+            rssMin = min(rssMin, rss);
+            if (rss > rssMax) rssMax = rss, peakHour = (i + 1) / perHour;
+            thpPeak = max(thpPeak, thp);
+        }
+    }
+    producing = false;
+    recorder.join();
+    preview.join();
+    const double wall = secondsSince(start);
+    auto [rssEnd, thpEnd] = residentBytes();
+    (void)thpEnd;
+
+    uint64_t seen = 0, p999 = 0;
+    for (size_t b = 0; b < histogram.size(); ++b) {
+        seen += histogram[b];
+        if (seen * 1000 >= allocs * 999) {
+            p999 = uint64_t(2) << b;
+            break;
+        }
+    }
+    printf("%-11s %8.0f %9llu %9.0f %9llu %8.0f %8.0f %8.0f %7llu %8.0f %7.0f %7.1f\n", name, double(totalNs) / allocs,
+           (unsigned long long)p999, maxNs / 1e3, (unsigned long long)slow, rssFirstHour / 1048576.0, rssMin / 1048576.0,
+           rssMax / 1048576.0, (unsigned long long)peakHour, rssEnd / 1048576.0, thpPeak / 1048576.0, wall);
+}
+
+// Allocation cost and RSS over `hours` of simulated recording (compressed in time): per-frame new/delete vs FramePool.
+int benchPool(double hours, double fps) {
+    printf("%.0f h of %.0f fps 50 Mbit/s video plus an audio chunk per frame, each frame shared by a recorder and a preview\n", hours, fps);
+    printf("%-11s %8s %9s %9s %9s %8s %8s %8s %7s %8s %7s %7s\n", "allocator", "ns/alloc", "p99.9 ns", "max us", ">10us", "RSS h1",
+           "RSS min", "RSS max", "peak h", "RSS end", "THP MB", "wall s");
+    fflush(stdout);
+    // Each allocator runs in its own process so neither inherits the other's heap.
+    for (int mode = 0; mode < 2; ++mode) {
+        pid_t pid = fork();
+        if (pid < 0) throwErrno("fork");
+        if (pid == 0) {
+            if (mode == 0) {
+                churnBuffers<shared_ptr<uint8_t[]>>("new/delete", hours, fps, [](size_t n) { return shared_ptr<uint8_t[]>(new uint8_t[n]); },
+                                                    [](shared_ptr<uint8_t[]>& h) { return h.get(); });
+            } else {
+                churnBuffers<FrameRef>("FramePool", hours, fps, [](size_t n) { return FrameRef::allocate(n); },
+                                       [](FrameRef& h) { return h.data(); });
+                auto st = FramePool::shared().getStats();
+                printf("FramePool: %.0f MiB in %llu arenas (%.0f MiB hugetlbfs), %llu refills / %llu spills of thread caches\n",
+                       st.reservedBytes / 1048576.0, (unsigned long long)st.arenas, st.hugeTlbBytes / 1048576.0,
+                       (unsigned long long)st.refills, (unsigned long long)st.spills);
+            }
+            fflush(stdout);
+            _exit(0);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+    }
+    return 0;
+}
+
+// Many simulated cameras on one StreamManager: CPU per stream and per-stream latency, then one stalled consumer.
+int benchStreams(double seconds, double fps) {
+    auto runFleet = [&](size_t cameras, bool stallFirst) {
+        StreamManager::Options opts;
+        opts.maxStreams = cameras;
+        StreamManager mgr(opts);
+        vector<uint16_t> ports;
+        volatile uint64_t checksum = 0;
+        for (size_t i = 0; i < cameras; ++i) {
+            const bool stall = stallFirst && i == 0;
+            uint32_t id = mgr.addStream([&checksum, stall](const StreamPacketHeader& h, const uint8_t* payload) {
+                checksum = checksum + payload[0] + h.size;
+                if (stall) this_thread::sleep_for(chrono::milliseconds(100));
+            });
+            ports.push_back(mgr.portOf(id));
+        }
+        auto start = chrono::steady_clock::now();
+        CameraFleetSimulator fleet(ports, fps);
+        this_thread::sleep_for(chrono::duration<double>(seconds));
+        fleet.stop();
+        const uint64_t sentPerCamera = fleet.getSent() / cameras;
+        this_thread::sleep_for(chrono::milliseconds(100));  // let queues drain
+        mgr.stop();
+        const double wall = secondsSince(start);
+        const auto t = mgr.totals();
+
+        vector<double> p50s, p99s;
+        for (uint32_t id = stallFirst ? 1 : 0; id < cameras; ++id) {
+            auto st = mgr.streamStats(id);
+            p50s.push_back(st.p50Ms);
+            p99s.push_back(st.p99Ms);
+        }
+        sort(p50s.begin(), p50s.end());
+        sort(p99s.begin(), p99s.end());
+        const double cpu = t.ioCpuSeconds + t.workerCpuSeconds;
+        if (!stallFirst) {
+            printf("%7zu %10llu %8llu %7llu %8.2f %12.0f %11.2f ms %11.2f ms %8llu\n", cameras, (unsigned long long)t.frames,
+                   (unsigned long long)t.lost, (unsigned long long)t.pauses, cpu / wall, cameras / (cpu / wall), p50s[p50s.size() / 2],
+                   p99s.back(), (unsigned long long)t.steals);
+        } else {
+            auto slow = mgr.streamStats(0);
+            printf("Stalled stream 0 (100 ms handler): %llu of ~%llu frames processed, %llu lost, %llu pauses; the rest backed up in its own socket\n",
+                   (unsigned long long)slow.frames, (unsigned long long)sentPerCamera, (unsigned long long)slow.lost,
+                   (unsigned long long)slow.pauses);
+            uint64_t otherLost = t.lost - slow.lost;
+            printf("Other %zu streams: %llu lost, median p50 %.2f ms, worst p99 %.2f ms\n", cameras - 1, (unsigned long long)otherLost,
+                   p50s[p50s.size() / 2], p99s.back());
+        }
+    };
+
+    printf("%.0f fps per camera, %.1f s per run, %zu worker(s) on %u core(s), %zu B state + %zu B queue per stream\n", fps, seconds,
+           StreamManager::Options{}.workers, thread::hardware_concurrency(), StreamManager::streamStateBytes(),
+           StreamManager::Options{}.queueDepth * StreamManager::slotBytesFor(StreamManager::Options{}.maxPacket));
+    printf("%7s %10s %8s %7s %8s %12s %14s %14s %8s\n", "cameras", "frames", "lost", "pauses", "cores", "streams/core",
+           "median p50", "worst p99", "steals");
+    for (size_t n : {size_t(100), size_t(500), size_t(1000)}) runFleet(n, false);
+    runFleet(100, true);
+    return 0;
+}
+
+// ABR on replayed bandwidth traces: throughput rule vs buffer rule vs hybrid, simulated; then the hybrid live over HTTP.
+int benchAbr(double sessionMinutes, double speed) {
+    AbrManifest manifest;
+    manifest.segmentSeconds = 2.0;
+    manifest.segmentCount = static_cast<size_t>(sessionMinutes * 60 / manifest.segmentSeconds);
+    for (uint32_t kbps : {300u, 750u, 1200u, 2400u, 4000u, 6000u}) manifest.renditions.push_back({kbps, "r" + to_string(kbps)});
+
+    vector<BandwidthTrace> traces = {
+        {"steady 5 Mbit/s", {{60, 5000}}},
+        {"step 6M/1.5M/4M", {{60, 6000}, {60, 1500}, {60, 4000}}},
+        {"oscillating 4M/0.8M", {{8, 4000}, {8, 800}}},
+        {"outage 5M, 15 s at 0.3M", {{40, 5000}, {15, 300}}},
+    };
+    BandwidthTrace walk{"cellular random walk", {}};
+    double kbps = 1500;
+    uint64_t rng = 0x853C49E6748FEA9Bull;
+    for (int s = 0; s < 600; ++s) {
+        rng ^= rng << 13, rng ^= rng >> 7, rng ^= rng << 17;
+        kbps = min(8000.0, max(200.0, kbps * (0.75 + (rng % 1000) / 2000.0)));
+        walk.steps.push_back({1.0, kbps});
+    }
+    traces.push_back(walk);
+
+    struct Variant {
+        const char* name;
+        AbrController::Options opts;
+    };
+    vector<Variant> variants(4);
+    variants[0].name = "throughput (EWMA)";
+    variants[0].opts.mode = AbrController::Mode::ThroughputOnly;
+    variants[1].name = "buffer (BBA)";
+    variants[1].opts.mode = AbrController::Mode::BufferOnly;
+    variants[2].name = "hybrid, no abandon";
+    variants[2].opts.abandon = false;
+    variants[3].name = "hybrid";
+
+    printf("%.0f min session, %zu x %.0f s segments, ladder 300..6000 kbps, 50 ms RTT (simulated)\n", sessionMinutes,
+           manifest.segmentCount, manifest.segmentSeconds);
+    printf("%-24s %-20s %9s %9s %9s %9s %9s\n", "trace", "controller", "rebuffer", "avg kbps", "switches", "abandons", "startup");
+    for (const auto& trace : traces) {
+        for (const auto& v : variants) {
+            auto st = simulateAbr(manifest, trace, v.opts);
+            printf("%-24s %-20s %8.2f%% %9.0f %9zu %9zu %8.2fs\n", trace.name.c_str(), v.name, st.rebufferRatio() * 100,
+                   st.averageKbps(), st.switches, st.abandons, st.startupSeconds);
+        }
+    }
+
+    // Live: the same hybrid against LocalHttpServer, its throttle following the step trace, `speed` x faster than real time.
+    AbrManifest live = manifest;
+    live.segmentCount = 45;
+    live.renditions = {{400, "r400"}, {1200, "r1200"}, {2400, "r2400"}, {5000, "r5000"}};
+    const string dir = makeTempDir("bench-abr");
+    for (size_t r = 0; r < live.renditions.size(); ++r) {
+        const string sub = dir + "/" + live.renditions[r].dir;
+        if (::mkdir(sub.c_str(), 0755) != 0) throwErrno("mkdir " + sub);
+        for (size_t i = 0; i < live.segmentCount; ++i) writePatternFile(dir + live.segmentPath(r, i), live.segmentBytes(r));
+    }
+    {
+        const string text = live.toText();
+        FileDescriptor fd(::open((dir + "/manifest.txt").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+        writeAll(fd.get(), text.data(), text.size());
+    }
+    const BandwidthTrace& trace = traces[1];
+    LocalHttpServer server(dir);
+    atomic<bool> replaying{true};
+    thread shaper([&] {
+        const auto start = chrono::steady_clock::now();
+        while (replaying) {
+            const double mediaNow = chrono::duration<double>(chrono::steady_clock::now() - start).count() * speed;
+            server.setThrottle(static_cast<uint64_t>(trace.kbpsAt(mediaNow) * 125.0 * speed));
+            this_thread::sleep_for(chrono::milliseconds(5));
+        }
+    });
+    AdaptiveStreamPlayer::Options opts;
+    opts.speed = speed;
+    AdaptiveStreamPlayer player(opts);
+    auto start = chrono::steady_clock::now();
+    player.play(server.url("manifest.txt"));
+    while (player.isPlaying()) this_thread::sleep_for(chrono::milliseconds(20));
+    replaying = false;
+    shaper.join();
+    auto st = player.getStats();
+    auto sim = simulateAbr(live, trace, opts.abr);
+    printf("\nLive over HTTP, %s, %zu segments at %.0fx real time (%.1f s wall):\n", trace.name.c_str(), live.segmentCount, speed,
+           secondsSince(start));
+    printf("%-24s %-20s %8.2f%% %9.0f %9zu %9zu %8.2fs\n", "  measured", "hybrid", st.rebufferRatio() * 100, st.averageKbps(),
+           st.switches, st.abandons, st.startupSeconds);
+    printf("%-24s %-20s %8.2f%% %9.0f %9zu %9zu %8.2fs\n", "  simulated", "hybrid", sim.rebufferRatio() * 100, sim.averageKbps(),
+           sim.switches, sim.abandons, sim.startupSeconds);
+
+    for (size_t r = 0; r < live.renditions.size(); ++r) {
+        for (size_t i = 0; i < live.segmentCount; ++i) ::unlink((dir + live.segmentPath(r, i)).c_str());
+        ::rmdir((dir + "/" + live.renditions[r].dir).c_str());
+    }
+    ::unlink((dir + "/manifest.txt").c_str());
+    ::rmdir(dir.c_str());
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && string(argv[1]) == "bench-abr") return benchAbr(argc > 2 ? stod(argv[2]) : 10.0, argc > 3 ? stod(argv[3]) : 10.0);
+    if (argc > 1 && string(argv[1]) == "bench-metrics") return benchMetrics(argc > 2 ? stoul(argv[2]) : 15);
+    if (argc > 1 && string(argv[1]) == "bench-pool") return benchPool(argc > 2 ? stod(argv[2]) : 24.0, argc > 3 ? stod(argv[3]) : 60.0);
+    if (argc > 1 && string(argv[1]) == "bench-streams") return benchStreams(argc > 2 ? stod(argv[2]) : 5.0, argc > 3 ? stod(argv[3]) : 30.0);
+    if (argc > 1 && string(argv[1]) == "bench-record") return benchRecord(argc > 2 ? stod(argv[2]) : 5.0, argc > 3 ? stoull(argv[3]) : 80, argc > 4 ? stoi(argv[4]) : 500);
+    if (argc > 1 && string(argv[1]) == "bench-seek") return benchSeek(argc > 2 ? stod(argv[2]) : 60.0, argc > 3 ? stoull(argv[3]) : 400);
+    if (argc > 1 && string(argv[1]) == "bench-jitter") return benchJitter(argc > 2 ? stod(argv[2]) : 6.0, argc > 3 ? stod(argv[3]) : 200.0);
+    if (argc > 1 && string(argv[1]) == "bench-mix") return benchMix(argc > 2 ? stoul(argv[2]) : 256, argc > 3 ? stod(argv[3]) : 2.0);
+    if (argc > 1 && string(argv[1]) == "bench-playlist") return benchPlaylist(argc > 2 ? stoul(argv[2]) : 8, argc > 3 ? stod(argv[3]) : 3.0, argc > 4 ? stod(argv[4]) : 50.0);
+    if (argc > 1 && string(argv[1]) == "bench-download") return benchDownload(argc > 2 ? stoull(argv[2]) : 256, argc > 3 ? stoul(argv[3]) : 4);
+
+    // Stand-in CDN so the download below is real.
+    const string demoDir = makeTempDir("media-demo");
+    writePatternFile(demoDir + "/song.mp3", 3u << 20);
+    LocalHttpServer cdn(demoDir);
+
+    // Metrics for everything below: rewritten to metrics.txt every 250 ms and served on metrics.sock.
+    MediaMetrics::setEnabled(true);
+    MetricsDumper dumper({demoDir + "/metrics.txt", demoDir + "/metrics.sock", chrono::milliseconds(250)});
+
+    const string downloads = demoDir + "/downloads";
+    if (::mkdir(downloads.c_str(), 0755) != 0) throwErrno("mkdir " + downloads);
+
+    AudioPlayer ap(downloads);
     ap.play("song.mp3");
     cout << "Audio playing: " << boolalpha << ap.isPlaying() << "\n";
-    ap.download("http://example.com/song.mp3");
+    ap.download(cdn.url("song.mp3"));
+    vector<string> tracks;
+    for (int i = 1; i <= 3; ++i) {
+        tracks.push_back(downloads + "/track" + to_string(i) + ".pcm");
+        writeToneTrack(tracks.back(), 44100, 0.3, 220.0 * i);
+    }
+    ap.playPlaylist(tracks);
+    this_thread::sleep_for(chrono::milliseconds(1000));
+    auto pl = ap.getPlaylistStats();
+    cout << "Playlist: " << pl.prefetchHits << "/" << pl.transitions << " track changes gapless, first sample after "
+         << pl.firstSampleMs << " ms\n";
+    ap.announce("gate-change.wav");
+    this_thread::sleep_for(chrono::milliseconds(300));
     ap.pause();
-    cout << "Audio playing: " << boolalpha << ap.isPlaying() << "\n\n";
+    cout << "Audio playing: " << boolalpha << ap.isPlaying() << "\n";
+    auto mix = ap.stopEngine();
+    cout << "Audio engine (" << ap.getKernelName() << "): " << mix.blocks << " blocks rendered, " << mix.xruns << " xruns\n\n";
 
     CameraStreamPlayer cam;
     // No more surprising behavior or required ordering for a generic 'play' method.
     cam.startStreaming("rtsp://camera");
     cout << "Camera streaming: " << boolalpha << cam.isStreaming() << "\n";
-    cam.record("recording.mkv");
+    atomic<int> previewed{0}, shared{0};
+    cam.setPreview([&](const FrameRef& f) {
+        ++previewed;
+        if (f.useCount() > 1) ++shared;  // the recorder holds the same buffer
+    });
+    cam.record(demoDir + "/recording");
+    this_thread::sleep_for(chrono::milliseconds(250));
     cam.stopStreaming();
-    cout << "Camera streaming: " << boolalpha << cam.isStreaming() << "\n";
+    cout << "Preview saw " << previewed << " frames, " << shared << " of them the recorder's own buffer\n";
+    cout << "Camera streaming: " << boolalpha << cam.isStreaming() << "\n\n";
+
+    RecordingPlayer playback;
+    playback.play(demoDir + "/recording");
+    auto landed = playback.seek(chrono::milliseconds(100));
+    FrameHeader frame;
+    vector<uint8_t> payload;
+    int frames = 0;
+    while (playback.readFrame(frame, payload)) ++frames;
+    cout << "Seek to 0.1 s landed on keyframe at " << chrono::duration<double>(landed).count() << " s; " << frames << " frames from there\n";
+    playback.pause();
+    cout << "\n";
+
+    CameraStreamPlayer ipCam;
+    ipCam.startStreaming("udp://127.0.0.1:0");
+    {
+        PacketReplayer feed(ipCam.getLivePort(), 60.0, PacketReplayer::NetworkProfile{});
+        this_thread::sleep_for(chrono::seconds(1));
+    }
+    this_thread::sleep_for(chrono::milliseconds(100));
+    ipCam.stopStreaming();
+    auto jitter = ipCam.getLiveStats();
+    const auto& latency = ipCam.getLiveReceiver()->getLatency();
+    cout << "Live feed: " << jitter.played << " frames played, " << jitter.lateDrops << " late, playout delay "
+         << jitter.delayMs << " ms, latency p50 " << latency.percentileMs(0.5) << " ms / p99 " << latency.percentileMs(0.99) << " ms\n";
+
+    {
+        StreamManager::Options fleetOpts;
+        fleetOpts.maxStreams = 3;
+        StreamManager fleet(fleetOpts);
+        vector<unique_ptr<CameraStreamPlayer>> cams;
+        vector<atomic<uint64_t>> seen(fleetOpts.maxStreams);
+        for (size_t i = 0; i < fleetOpts.maxStreams; ++i) {
+            cams.push_back(make_unique<CameraStreamPlayer>());
+            cams.back()->useStreamManager(fleet);
+            cams.back()->setPreview([&seen, i](const FrameRef&) { seen[i].fetch_add(1, memory_order_relaxed); });
+            cams.back()->startStreaming("udp://127.0.0.1:0");
+        }
+        {
+            vector<unique_ptr<PacketReplayer>> feeds;
+            for (auto& cam : cams) feeds.push_back(make_unique<PacketReplayer>(cam->getLivePort(), 60.0, PacketReplayer::NetworkProfile{}));
+            this_thread::sleep_for(chrono::milliseconds(500));
+        }
+        this_thread::sleep_for(chrono::milliseconds(100));
+        for (auto& cam : cams) cam->stopStreaming();
+        cout << "Shared StreamManager:";
+        for (auto& n : seen) cout << " " << n.load() << " frames";
+        cout << " from " << cams.size() << " cameras, no per-camera threads\n";
+    }
+
+    {
+        FileDescriptor client(::socket(AF_UNIX, SOCK_STREAM, 0));
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, (demoDir + "/metrics.sock").c_str());
+        if (::connect(client.get(), reinterpret_cast<sockaddr*>(&addr), sizeof addr) != 0) throwErrno("connect metrics.sock");
+        string text;
+        char buf[4096];
+        for (ssize_t n; (n = ::read(client.get(), buf, sizeof buf)) > 0;) text.append(buf, static_cast<size_t>(n));
+        cout << "\nStage latencies from metrics.sock:\n";
+        istringstream lines(text);
+        for (string line; getline(lines, line);) {
+            if (line.compare(0, 10, "histogram ") == 0) cout << "  " << line.substr(10) << "\n";
+        }
+    }
+    dumper.stop();
+    ::unlink((demoDir + "/metrics.txt").c_str());
 
+    ::unlink((downloads + "/song.mp3").c_str());
+    for (const auto& t : tracks) ::unlink(t.c_str());
+    ::rmdir(downloads.c_str());
+    ::unlink((demoDir + "/song.mp3").c_str());
+    removeRecording(demoDir + "/recording");
+    ::rmdir(demoDir.c_str());
     return 0;
 }
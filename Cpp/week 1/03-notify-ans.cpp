@@ -1,6 +1,34 @@
 // 03-notify-ans.cpp
 #include <iostream>
 #include <string>
+#include <stdexcept>
+#include <vector>
+#include <map>
+#include <set>
+#include <array>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+#include <numeric>
+#include <memory>
+#include <fstream>
+#include <iterator>
+#include <cmath>
+#include <utility>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/random.h>
 
 using namespace std;
 class ISmtpMailer {
@@ -11,7 +39,7 @@ class ISmtpMailer {
 class ITwilioClient {
     public:
     virtual ~ITwilioClient() = default;
-    virtual void sendOTP(const string& phone, const string& code) = 0; 
+    virtual void sendOTP(const string& phone, const string& code) = 0;
 };
 class SmtpMailer: public ISmtpMailer {
 public:
@@ -26,30 +54,1656 @@ public:
     }
 };
 
+// =========================
+// Local provider stand-ins
+// =========================
+inline bool injectFailure(double rate) {
+    thread_local mt19937 rng(random_device{}());
+    return rate > 0.0 && uniform_real_distribution<double>(0.0, 1.0)(rng) < rate;
+}
+
+// Mail provider with injected latency and failures; a failed send throws.
+class StubSmtpMailer : public ISmtpMailer {
+    chrono::milliseconds latency;
+    atomic<double> failureRate;
+    atomic<uint64_t> calls{0};
+    atomic<uint64_t> delivered{0};
+public:
+    explicit StubSmtpMailer(chrono::milliseconds l, double failRate = 0.0) : latency(l), failureRate(failRate) {}
+    void send(const string&, const string&, const string&) override {
+        calls++;
+        this_thread::sleep_for(latency);
+        if (injectFailure(failureRate.load(memory_order_relaxed))) throw runtime_error("SMTP 451 temporary failure");
+        delivered++;
+    }
+    void setFailureRate(double rate) { failureRate = rate; }
+    uint64_t getCalls() const { return calls; }
+    uint64_t getDelivered() const { return delivered; }
+};
+
+// SMS provider with injected latency and failures; a failed send throws.
+class StubTwilioClient : public ITwilioClient {
+    chrono::milliseconds latency;
+    atomic<double> failureRate;
+    atomic<uint64_t> calls{0};
+    atomic<uint64_t> delivered{0};
+public:
+    explicit StubTwilioClient(chrono::milliseconds l, double failRate = 0.0) : latency(l), failureRate(failRate) {}
+    void sendOTP(const string&, const string&) override {
+        calls++;
+        this_thread::sleep_for(latency);
+        if (injectFailure(failureRate.load(memory_order_relaxed))) throw runtime_error("Twilio 503 service unavailable");
+        delivered++;
+    }
+    void setFailureRate(double rate) { failureRate = rate; }
+    uint64_t getCalls() const { return calls; }
+    uint64_t getDelivered() const { return delivered; }
+};
+
+// =========================
+// Provider rate limiting and failover
+// =========================
+// Monotonic nanoseconds from the vDSO coarse clock (a few ns per read, ~4 ms resolution).
+inline int64_t coarseNowNs() {
+    timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Step of coarseNowNs(), read once.
+inline int64_t coarseResolutionNs() {
+    static const int64_t step = [] {
+        timespec ts;
+        ::clock_getres(CLOCK_MONOTONIC_COARSE, &ts);
+        return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }();
+    return step;
+}
+
+// Monotonic nanoseconds at full resolution (several times the cost of the coarse read).
+inline int64_t fineNowNs() {
+    timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Lock-free token bucket in its GCRA form: a single atomic timestamp.
+ *
+ * tat is the time at which the bucket would be full again. A send is allowed
+ * when pushing tat forward by one interval keeps it within burst intervals of
+ * now, and it is committed with one CAS. A refusal re-reads the clock once
+ * before it stands, so a caller holding a stale timestamp is not throttled
+ * just for being late. A rate of zero or less disables the limit.
+ *
+ * The caller's coarse timestamp is used when burst intervals span at least one
+ * step of the coarse clock. A tighter bucket reads the fine clock instead:
+ * on the coarse clock it could refill at most burst tokens per step, so
+ * 1000/s with burst 1 would run at about 250/s.
+ */
+class TokenBucket {
+    atomic<int64_t> tat{0};
+    int64_t intervalNs;
+    int64_t burstNs;
+    bool fineClock;
+
+public:
+    TokenBucket(double perSecond, double burst)
+        : intervalNs(perSecond > 0 ? static_cast<int64_t>(1e9 / perSecond) : 0),
+          burstNs(static_cast<int64_t>(max(1.0, burst) * static_cast<double>(intervalNs))),
+          fineClock(intervalNs > 0 && burstNs < coarseResolutionNs()) {}
+
+    bool tryTake(int64_t coarseNow) {
+        if (intervalNs == 0) return true;
+        int64_t now = fineClock ? fineNowNs() : coarseNow;
+        bool refreshed = false;
+        int64_t t = tat.load(memory_order_relaxed);
+        for (;;) {
+            int64_t next = max(t, now) + intervalNs;
+            if (next - now > burstNs) {
+                // now may be stale if this thread was descheduled while others moved tat on.
+                if (refreshed) return false;
+                int64_t fresh = fineClock ? fineNowNs() : coarseNowNs();
+                if (fresh <= now) return false;
+                now = fresh;
+                refreshed = true;
+                continue;
+            }
+            if (tat.compare_exchange_weak(t, next, memory_order_relaxed)) return true;
+        }
+    }
+};
+
+/**
+ * @brief Lock-free circuit breaker: closed, open, then half-open with a single probe.
+ *
+ * failureThreshold consecutive failures open the breaker, and sends are
+ * refused without calling the provider. Once the cooldown has passed, exactly
+ * one caller wins the CAS to half-open and carries the probe. If the probe
+ * succeeds the breaker closes; if it fails the breaker reopens for another
+ * cooldown. On the closed path a send costs one load, plus one more on success.
+ */
+class CircuitBreaker {
+public:
+    enum class State : uint8_t { Closed, Open, HalfOpen };
+    enum class Permit : uint8_t { Denied, Allowed, Probe };
+
+private:
+    atomic<State> state{State::Closed};
+    atomic<uint32_t> failures{0};
+    atomic<int64_t> retryAtNs{0};
+    atomic<uint64_t> trips{0};
+    uint32_t threshold;
+    int64_t cooldownNs;
+
+    void open(int64_t now) {
+        retryAtNs.store(now + cooldownNs, memory_order_relaxed);
+        state.store(State::Open, memory_order_release);
+        trips.fetch_add(1, memory_order_relaxed);
+    }
+
+public:
+    CircuitBreaker(uint32_t failureThreshold, chrono::milliseconds cooldown)
+        : threshold(max<uint32_t>(1, failureThreshold)), cooldownNs(chrono::nanoseconds(cooldown).count()) {}
+
+    Permit acquire(int64_t now) {
+        State s = state.load(memory_order_acquire);
+        if (s == State::Closed) return Permit::Allowed;
+        if (s == State::HalfOpen || now < retryAtNs.load(memory_order_relaxed)) return Permit::Denied;
+        return state.compare_exchange_strong(s, State::HalfOpen, memory_order_acq_rel) ? Permit::Probe : Permit::Denied;
+    }
+
+    void onSuccess(Permit p) {
+        if (failures.load(memory_order_relaxed) != 0) failures.store(0, memory_order_relaxed);
+        if (p == Permit::Probe) state.store(State::Closed, memory_order_release);
+    }
+
+    void onFailure(Permit p, int64_t now) {
+        if (p == Permit::Probe) open(now);
+        // Only the caller that reaches the threshold trips it; later failures in flight do not extend the cooldown.
+        else if (failures.fetch_add(1, memory_order_relaxed) + 1 == threshold) open(now);
+    }
+
+    // The probe holder did not call the provider after all; let the next caller probe instead.
+    void cancelProbe() { state.store(State::Open, memory_order_release); }
+
+    State getState() const { return state.load(memory_order_relaxed); }
+    uint64_t getTrips() const { return trips.load(memory_order_relaxed); }
+};
+
+// what() of the exception being handled, for catch (...) blocks.
+inline string currentExceptionText() {
+    try {
+        throw;
+    } catch (const exception& e) {
+        return e.what();
+    } catch (...) {
+        return "unknown exception";
+    }
+}
+
+struct ProviderLimits {
+    double ratePerSecond{100};
+    double burst{20};
+    uint32_t failureThreshold{5};
+    chrono::milliseconds cooldown{2000};
+};
+
+/**
+ * @brief Ordered list of providers, each behind its own rate limit and breaker.
+ *
+ * dispatch() tries the providers in order of registration. It skips a
+ * provider whose breaker is open or whose bucket is empty. When a provider
+ * throws, the failure is recorded and the next provider is tried. If no
+ * provider accepts the send, dispatch() throws, so a caller such as the
+ * outbox retries later with backoff. Each route sits on its own cache line,
+ * and no locks are taken on any path.
+ */
+template <class Provider>
+class ProviderFailover {
+public:
+    struct RouteStats {
+        string name;
+        uint64_t sent, throttled, shortCircuited, failed, trips;
+        CircuitBreaker::State state;
+    };
+
+private:
+    struct alignas(64) Route {
+        Provider& provider;
+        string name;
+        TokenBucket bucket;
+        CircuitBreaker breaker;
+        atomic<uint64_t> sent{0}, throttled{0}, shortCircuited{0}, failed{0};
+
+        Route(Provider& p, string n, const ProviderLimits& l)
+            : provider(p), name(move(n)), bucket(l.ratePerSecond, l.burst), breaker(l.failureThreshold, l.cooldown) {}
+    };
+
+    vector<unique_ptr<Route>> routes;
+
+public:
+    // Not thread-safe; register every provider before the first dispatch.
+    void add(Provider& provider, string name, ProviderLimits limits) {
+        routes.push_back(make_unique<Route>(provider, move(name), limits));
+    }
+
+    template <class Call>
+    void dispatch(const char* what, Call&& call) {
+        const int64_t now = coarseNowNs();
+        string errors;
+        for (auto& r : routes) {
+            CircuitBreaker::Permit permit = r->breaker.acquire(now);
+            if (permit == CircuitBreaker::Permit::Denied) {
+                r->shortCircuited.fetch_add(1, memory_order_relaxed);
+                continue;
+            }
+            if (!r->bucket.tryTake(now)) {
+                if (permit == CircuitBreaker::Permit::Probe) r->breaker.cancelProbe();
+                r->throttled.fetch_add(1, memory_order_relaxed);
+                continue;
+            }
+            try {
+                call(r->provider);
+            } catch (...) {
+                // Anything a provider throws is a failure; a probe that escaped here would leave the breaker half-open for good.
+                r->breaker.onFailure(permit, coarseNowNs());
+                r->failed.fetch_add(1, memory_order_relaxed);
+                errors += "; " + r->name + ": " + currentExceptionText();
+                continue;
+            }
+            r->breaker.onSuccess(permit);
+            r->sent.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        throw runtime_error(string("no ") + what + " provider accepted the send" + errors);
+    }
+
+    vector<RouteStats> stats() const {
+        vector<RouteStats> out;
+        for (const auto& r : routes) {
+            out.push_back({r->name, r->sent.load(), r->throttled.load(), r->shortCircuited.load(), r->failed.load(),
+                           r->breaker.getTrips(), r->breaker.getState()});
+        }
+        return out;
+    }
+};
+
+// Rate-limited, circuit-broken mailer that fails over across the registered providers.
+class ResilientSmtpMailer : public ISmtpMailer {
+    ProviderFailover<ISmtpMailer> routes;
+public:
+    ResilientSmtpMailer& add(ISmtpMailer& provider, string name, ProviderLimits limits = {}) {
+        routes.add(provider, move(name), limits);
+        return *this;
+    }
+    void send(const string& templ, const string& to, const string& body) override {
+        routes.dispatch("mail", [&](ISmtpMailer& m) { m.send(templ, to, body); });
+    }
+    vector<ProviderFailover<ISmtpMailer>::RouteStats> stats() const { return routes.stats(); }
+};
+
+// Rate-limited, circuit-broken SMS client that fails over across the registered providers.
+class ResilientTwilioClient : public ITwilioClient {
+    ProviderFailover<ITwilioClient> routes;
+public:
+    ResilientTwilioClient& add(ITwilioClient& provider, string name, ProviderLimits limits = {}) {
+        routes.add(provider, move(name), limits);
+        return *this;
+    }
+    void sendOTP(const string& phone, const string& code) override {
+        routes.dispatch("SMS", [&](ITwilioClient& c) { c.sendOTP(phone, code); });
+    }
+    vector<ProviderFailover<ITwilioClient>::RouteStats> stats() const { return routes.stats(); }
+};
+
 struct User { string email; string phone; };
 
-class SignUpService {
+// =========================
+// Notification outbox
+// =========================
+// Throws with errno text, the way every POSIX failure below is reported.
+[[noreturn]] inline void throwErrno(const string& what) {
+    throw runtime_error(what + ": " + strerror(errno));
+}
+
+inline void writeAll(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = ::write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) throwErrno("write");
+        data += n;
+        len -= static_cast<size_t>(n);
+    }
+}
+
+inline uint32_t crc32(const char* data, size_t len) {
+    static const array<uint32_t, 256> table = [] {
+        array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t c = ~0u;
+    for (size_t i = 0; i < len; ++i) c = table[(c ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (c >> 8);
+    return ~c;
+}
+
+struct NotificationJob {
+    enum class Channel : uint8_t { Email = 'E', Sms = 'S' };
+    uint64_t id{0};
+    Channel channel{Channel::Email};
+    string to;      // email address or phone number
+    string templ;   // email template; empty for SMS
+    string body;    // email body or OTP code
+    int attempts{0};
+    bool secret{false};  // body stays in memory only; the log records the job without it
+};
+
+// Little-endian entry encoding shared by the log writer and its replay.
+namespace outboxcodec {
+    inline void putU32(string& out, uint32_t v) { for (int i = 0; i < 4; ++i) out.push_back(static_cast<char>(v >> (8 * i))); }
+    inline void putU64(string& out, uint64_t v) { for (int i = 0; i < 8; ++i) out.push_back(static_cast<char>(v >> (8 * i))); }
+    inline void putStr(string& out, const string& s) {
+        putU32(out, static_cast<uint32_t>(s.size()));
+        out += s;
+    }
+    inline void putUser(string& out, const User& u) {
+        out.push_back('U');
+        putStr(out, u.email);
+        putStr(out, u.phone);
+    }
+    inline void putJob(string& out, const NotificationJob& job) {
+        out.push_back(job.secret ? 'S' : 'J');
+        putU64(out, job.id);
+        out.push_back(static_cast<char>(job.channel));
+        putStr(out, job.to);
+        putStr(out, job.templ);
+        if (!job.secret) putStr(out, job.body);
+    }
+    inline void putDone(string& out, uint64_t id) {
+        out.push_back('D');
+        putU64(out, id);
+    }
+
+    // Bounds-checked cursor; every get fails once the input runs out.
+    struct Reader {
+        const char* p;
+        const char* end;
+        bool getU8(uint8_t& v) {
+            if (p == end) return false;
+            v = static_cast<uint8_t>(*p++);
+            return true;
+        }
+        bool getU32(uint32_t& v) {
+            if (end - p < 4) return false;
+            v = 0;
+            for (int i = 0; i < 4; ++i) v |= uint32_t(static_cast<uint8_t>(p[i])) << (8 * i);
+            p += 4;
+            return true;
+        }
+        bool getU64(uint64_t& v) {
+            if (end - p < 8) return false;
+            v = 0;
+            for (int i = 0; i < 8; ++i) v |= uint64_t(static_cast<uint8_t>(p[i])) << (8 * i);
+            p += 8;
+            return true;
+        }
+        bool getStr(string& s) {
+            uint32_t n;
+            if (!getU32(n) || static_cast<size_t>(end - p) < n) return false;
+            s.assign(p, n);
+            p += n;
+            return true;
+        }
+    };
+}
+
+/**
+ * @brief Durable append-only log of signed-up users and their notification jobs.
+ *
+ * Each record is [u32 length][u32 crc32][payload], and a payload is a list of
+ * entries: 'U' user, 'J' notification job, 'S' secret job logged without its
+ * body, and 'D' job delivered. A signup is one record holding the user and its
+ * jobs, so it is either wholly in the log or not at all. Appends are
+ * group-committed: one flusher thread writes whatever has accumulated since its
+ * last pass and covers all of it with a single fdatasync. open() replays the
+ * file, drops a torn or corrupt tail, and compacts it to the users plus the
+ * jobs that were never marked delivered. Undelivered secret jobs cannot be
+ * resent without their body, so open() drops them and counts them. While
+ * running, the flusher compacts the same way once compactBytes have been
+ * appended since the last compaction (and at least as much as that compaction
+ * kept), but keeps 'S' entries since their bodies are still in memory.
+ */
+class OutboxLog {
+public:
+    struct Recovered {
+        size_t users{0};
+        vector<NotificationJob> pending;
+        size_t droppedSecrets{0};
+        uint64_t nextJobId{1};
+    };
+
+private:
+    struct State {
+        vector<User> users;
+        map<uint64_t, NotificationJob> pending;  // 'J' and 'S' entries without a 'D'
+        uint64_t nextJobId{1};
+    };
+
+    string path;
+    uint64_t compactBytes;
+    int fd{-1};  // written only by open() and then the flusher
+    mutex mtx;
+    condition_variable wake, durable;
+    string buffer;
+    uint64_t appendedSeq{0};
+    uint64_t durableSeq{0};
+    string error;
+    bool stopping{false};
+    thread flusher;
+    uint64_t sinceCompaction{0};
+    uint64_t compactedSize{0};
+    atomic<uint64_t> syncs{0};
+    atomic<uint64_t> records{0};
+    atomic<uint64_t> compactions{0};
+
+    static void frame(string& out, const string& payload) {
+        outboxcodec::putU32(out, static_cast<uint32_t>(payload.size()));
+        outboxcodec::putU32(out, crc32(payload.data(), payload.size()));
+        out += payload;
+    }
+
+    static void syncDirectoryOf(const string& file) {
+        size_t slash = file.find_last_of('/');
+        string dir = slash == string::npos ? "." : file.substr(0, slash + 1);
+        int dfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dfd < 0) throwErrno("open " + dir);
+        ::fsync(dfd);
+        ::close(dfd);
+    }
+
+    State replay() const {
+        string data;
+        {
+            ifstream in(path, ios::binary);
+            data.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        }
+        State st;
+        outboxcodec::Reader file{data.data(), data.data() + data.size()};
+        uint32_t len, crc;
+        while (file.getU32(len) && file.getU32(crc)) {
+            if (static_cast<size_t>(file.end - file.p) < len || crc32(file.p, len) != crc) break;  // torn tail
+            outboxcodec::Reader r{file.p, file.p + len};
+            file.p += len;
+            uint8_t kind;
+            bool ok = true;
+            while (ok && r.getU8(kind)) {
+                if (kind == 'U') {
+                    User u;
+                    ok = r.getStr(u.email) && r.getStr(u.phone);
+                    if (ok) st.users.push_back(move(u));
+                } else if (kind == 'J' || kind == 'S') {
+                    NotificationJob job;
+                    uint8_t channel = 0;
+                    job.secret = kind == 'S';
+                    ok = r.getU64(job.id) && r.getU8(channel) && r.getStr(job.to) && r.getStr(job.templ) &&
+                         (job.secret || r.getStr(job.body));
+                    if (!ok) break;
+                    job.channel = static_cast<NotificationJob::Channel>(channel);
+                    st.nextJobId = max(st.nextJobId, job.id + 1);
+                    st.pending[job.id] = move(job);
+                } else if (kind == 'D') {
+                    uint64_t id = 0;
+                    ok = r.getU64(id);
+                    st.pending.erase(id);
+                } else {
+                    ok = false;
+                }
+            }
+        }
+        return st;
+    }
+
+    // Writes the live state next to the log, swaps it in atomically, and returns its size.
+    uint64_t rewrite(const State& st) const {
+        const string tmp = path + ".compact";
+        int out = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out < 0) throwErrno("open " + tmp);
+        uint64_t written = 0;
+        string chunk, framed;
+        auto emit = [&](bool force) {
+            if (chunk.empty() || (!force && chunk.size() < (1u << 20))) return;
+            frame(framed, chunk);
+            try {
+                writeAll(out, framed.data(), framed.size());
+            } catch (...) {
+                ::close(out);
+                throw;
+            }
+            written += framed.size();
+            chunk.clear();
+            framed.clear();
+        };
+        for (const auto& u : st.users) {
+            outboxcodec::putUser(chunk, u);
+            emit(false);
+        }
+        for (const auto& kv : st.pending) {
+            outboxcodec::putJob(chunk, kv.second);
+            emit(false);
+        }
+        emit(true);
+        bool synced = ::fdatasync(out) == 0;
+        ::close(out);
+        if (!synced) throwErrno("fdatasync " + tmp);
+        if (::rename(tmp.c_str(), path.c_str()) != 0) throwErrno("rename " + tmp);
+        syncDirectoryOf(path);
+        return written;
+    }
+
+    // Runs on the flusher, so nothing else touches fd; new appends wait in the buffer.
+    void compact() {
+        compactedSize = rewrite(replay());
+        sinceCompaction = 0;
+        int next = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (next < 0) throwErrno("open " + path);
+        ::close(fd);
+        fd = next;
+        compactions++;
+    }
+
+    void flushLoop() {
+        string batch;
+        unique_lock<mutex> lock(mtx);
+        for (;;) {
+            wake.wait(lock, [&] { return stopping || !buffer.empty(); });
+            if (buffer.empty()) return;
+            batch.swap(buffer);
+            uint64_t seq = appendedSeq;
+            lock.unlock();
+            string failure;
+            try {
+                writeAll(fd, batch.data(), batch.size());
+                if (::fdatasync(fd) != 0) throwErrno("fdatasync " + path);
+            } catch (const exception& e) {
+                failure = e.what();
+            }
+            size_t written = batch.size();
+            batch.clear();
+            syncs++;
+            lock.lock();
+            if (!failure.empty()) error = failure;
+            else durableSeq = seq;
+            durable.notify_all();
+            if (!failure.empty()) continue;
+
+            sinceCompaction += written;
+            if (sinceCompaction < compactBytes || sinceCompaction < compactedSize) continue;
+            lock.unlock();
+            try {
+                compact();
+            } catch (const exception& e) {
+                failure = e.what();
+            }
+            lock.lock();
+            if (!failure.empty()) error = "compact " + path + ": " + failure;
+        }
+    }
+
+    uint64_t enqueue(const string& payload) {
+        if (!error.empty()) throw runtime_error(error);
+        frame(buffer, payload);
+        records++;
+        wake.notify_one();
+        return ++appendedSeq;
+    }
+
+public:
+    explicit OutboxLog(string p, uint64_t compactAfterBytes = 64u << 20)
+        : path(move(p)), compactBytes(compactAfterBytes) {}
+
+    ~OutboxLog() {
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (flusher.joinable()) flusher.join();
+        if (fd >= 0) ::close(fd);
+    }
+
+    OutboxLog(const OutboxLog&) = delete;
+    OutboxLog& operator=(const OutboxLog&) = delete;
+
+    Recovered open() {
+        State st = replay();
+        Recovered rec;
+        rec.nextJobId = st.nextJobId;
+        for (auto it = st.pending.begin(); it != st.pending.end();) {
+            if (!it->second.secret) {
+                ++it;
+                continue;
+            }
+            rec.droppedSecrets++;
+            it = st.pending.erase(it);
+        }
+        compactedSize = rewrite(st);
+
+        fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd < 0) throwErrno("open " + path);
+        flusher = thread([this] { flushLoop(); });
+
+        rec.users = st.users.size();
+        for (auto& kv : st.pending) rec.pending.push_back(move(kv.second));
+        return rec;
+    }
+
+    // Appends one record and returns once it is on disk.
+    void appendDurable(const string& payload) {
+        unique_lock<mutex> lock(mtx);
+        uint64_t seq = enqueue(payload);
+        durable.wait(lock, [&] { return durableSeq >= seq || !error.empty(); });
+        if (durableSeq < seq) throw runtime_error(error);
+    }
+
+    // Appends one record; it reaches disk with the next group commit.
+    void append(const string& payload) {
+        lock_guard<mutex> lock(mtx);
+        enqueue(payload);
+    }
+
+    uint64_t getSyncs() const { return syncs; }
+    uint64_t getRecords() const { return records; }
+    uint64_t getCompactions() const { return compactions; }
+};
+
+/**
+ * @brief Transactional outbox: signups append to the log, a worker pool delivers.
+ *
+ * commit() writes the user and its notification jobs as one durable record and
+ * returns, so provider latency never reaches the signup path. Workers take due
+ * jobs from a time-ordered queue, call the mailer or SMS client, and log a 'D'
+ * entry on success. A failed send is rescheduled with exponential backoff plus
+ * jitter rather than sleeping the worker; after maxAttempts the job is parked
+ * (left undelivered in the log) and retried on the next start. Delivery is
+ * at-least-once: a crash between a send and its 'D' entry reaching disk sends
+ * that notification again, and so does a restart after the 'D' append itself
+ * failed. Such failures are counted, never treated as a failed send.
+ */
+class NotificationOutbox {
+public:
+    struct Options {
+        size_t workers{32};
+        int maxAttempts{6};
+        chrono::milliseconds baseBackoff{200};
+        chrono::milliseconds maxBackoff{30000};
+        uint64_t logCompactBytes{64u << 20};
+    };
+
+private:
+    struct Scheduled {
+        chrono::steady_clock::time_point due;
+        NotificationJob job;
+        bool operator<(const Scheduled& o) const { return due > o.due; }  // min-heap on due time
+    };
+
     ISmtpMailer& mailer;
     ITwilioClient& smsClient;
+    Options opts;
+    OutboxLog log;
+    mutex mtx;
+    condition_variable ready, idle;
+    vector<Scheduled> queue;
+    size_t inFlight{0};
+    bool stopping{false};
+    atomic<uint64_t> nextJobId{1};
+    atomic<uint64_t> delivered{0};
+    atomic<uint64_t> retries{0};
+    atomic<uint64_t> parked{0};
+    atomic<uint64_t> unloggedDeliveries{0};
+    size_t recoveredUsers{0};
+    size_t recoveredJobs{0};
+    size_t droppedSecrets{0};
+    vector<thread> workers;
+
+    void schedule(NotificationJob job, chrono::steady_clock::time_point due) {
+        queue.push_back(Scheduled{due, move(job)});
+        push_heap(queue.begin(), queue.end());
+    }
+
+    void workerLoop() {
+        thread_local mt19937 rng(random_device{}());
+        unique_lock<mutex> lock(mtx);
+        for (;;) {
+            if (stopping) return;
+            if (queue.empty()) {
+                ready.wait(lock);
+                continue;
+            }
+            auto due = queue.front().due;
+            if (due > chrono::steady_clock::now()) {
+                ready.wait_until(lock, due);
+                continue;
+            }
+            pop_heap(queue.begin(), queue.end());
+            NotificationJob job = move(queue.back().job);
+            queue.pop_back();
+            lock.unlock();
+
+            bool ok = true;
+            try {
+                if (job.channel == NotificationJob::Channel::Email) mailer.send(job.templ, job.to, job.body);
+                else smsClient.sendOTP(job.to, job.body);
+            } catch (const exception&) {
+                ok = false;
+            }
+            if (ok) {
+                delivered++;
+                // The send went out; a missing 'D' only means it goes out again after a restart.
+                string done;
+                outboxcodec::putDone(done, job.id);
+                try {
+                    log.append(done);
+                } catch (const exception&) {
+                    unloggedDeliveries++;
+                }
+            }
+
+            lock.lock();
+            if (!ok && ++job.attempts < opts.maxAttempts) {
+                // Exponential backoff; half of it is randomised so failed jobs do not retry in lockstep.
+                auto cap = min<chrono::milliseconds>(opts.baseBackoff * (1 << min(job.attempts - 1, 20)), opts.maxBackoff);
+                auto delay = cap / 2 + chrono::milliseconds(uniform_int_distribution<long>(0, cap.count() / 2)(rng));
+                retries++;
+                schedule(move(job), chrono::steady_clock::now() + delay);
+                ready.notify_one();
+                continue;
+            }
+            if (!ok) parked++;
+            if (--inFlight == 0) idle.notify_all();
+        }
+    }
+
+public:
+    NotificationOutbox(ISmtpMailer& m, ITwilioClient& s, string logPath, Options o)
+        : mailer(m), smsClient(s), opts(o), log(move(logPath), o.logCompactBytes) {
+        OutboxLog::Recovered rec = log.open();
+        nextJobId = rec.nextJobId;
+        recoveredUsers = rec.users;
+        recoveredJobs = rec.pending.size();
+        droppedSecrets = rec.droppedSecrets;
+        auto now = chrono::steady_clock::now();
+        for (auto& job : rec.pending) schedule(move(job), now);
+        inFlight = recoveredJobs;
+        for (size_t i = 0; i < opts.workers; ++i) workers.emplace_back([this] { workerLoop(); });
+    }
 
+    NotificationOutbox(ISmtpMailer& m, ITwilioClient& s, string logPath)
+        : NotificationOutbox(m, s, move(logPath), Options{}) {}
+
+    // Sends already in progress finish; everything still queued stays in the log.
+    ~NotificationOutbox() {
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto& w : workers) w.join();
+    }
+
+    NotificationJob email(const string& templ, const string& to, const string& body) {
+        return NotificationJob{nextJobId++, NotificationJob::Channel::Email, to, templ, body, 0};
+    }
+    // The code is never written to the log; an OTP still queued at a crash is dropped on restart.
+    NotificationJob otp(const string& phone, const string& code) {
+        return NotificationJob{nextJobId++, NotificationJob::Channel::Sms, phone, "", code, 0, true};
+    }
+
+    // Persists the user together with its jobs, then hands the jobs to the workers.
+    void commit(const User& u, vector<NotificationJob> jobs) {
+        string payload;
+        outboxcodec::putUser(payload, u);
+        for (const auto& job : jobs) outboxcodec::putJob(payload, job);
+        log.appendDurable(payload);
+
+        lock_guard<mutex> lock(mtx);
+        auto now = chrono::steady_clock::now();
+        inFlight += jobs.size();
+        for (auto& job : jobs) schedule(move(job), now);
+        if (jobs.size() == 1) ready.notify_one();
+        else ready.notify_all();
+    }
+
+    // Blocks until every job so far has been delivered or parked.
+    void flush() {
+        unique_lock<mutex> lock(mtx);
+        idle.wait(lock, [&] { return inFlight == 0; });
+    }
+
+    uint64_t getDelivered() const { return delivered; }
+    uint64_t getRetries() const { return retries; }
+    uint64_t getParked() const { return parked; }
+    uint64_t getUnloggedDeliveries() const { return unloggedDeliveries; }
+    size_t getRecoveredUsers() const { return recoveredUsers; }
+    size_t getRecoveredJobs() const { return recoveredJobs; }
+    size_t getDroppedSecrets() const { return droppedSecrets; }
+    const OutboxLog& getLog() const { return log; }
+};
+
+// =========================
+// One-time passwords
+// =========================
+/**
+ * @brief Uniform 6-digit codes from the kernel CSPRNG, buffered per thread.
+ *
+ * Each thread refills a 4 KiB pool with one getrandom() call and then takes
+ * 32-bit words from it, so a code costs a syscall only once every ~1000 codes.
+ * Words at or above the largest multiple of 10^6 are rejected, so every code
+ * is equally likely. A fork bumps a generation counter, and the child then
+ * discards its inherited pools instead of handing out codes its parent
+ * already used. Used words are zeroed.
+ */
+class OtpGenerator {
 public:
-    SignUpService(ISmtpMailer& mailer, ITwilioClient& smsClient)
-        : mailer(mailer), smsClient(smsClient) {}
+    static constexpr int kDigits = 6;
+
+    static string next() {
+        string code(kDigits, '0');
+        next(&code[0]);
+        return code;
+    }
+
+    // Writes kDigits ASCII digits to out.
+    static void next(char* out) {
+        constexpr uint32_t kModulus = 1000000;
+        constexpr uint32_t kLimit = UINT32_MAX - UINT32_MAX % kModulus;  // reject above to stay uniform
+        uint32_t w;
+        do w = word(); while (w >= kLimit);
+        w %= kModulus;
+        for (int i = kDigits - 1; i >= 0; --i, w /= 10) out[i] = static_cast<char>('0' + w % 10);
+    }
+
+    static void fillRandom(void* buf, size_t len) {
+        auto* p = static_cast<char*>(buf);
+        while (len > 0) {
+            ssize_t n = ::getrandom(p, len, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) throwErrno("getrandom");
+            p += n;
+            len -= static_cast<size_t>(n);
+        }
+    }
+
+private:
+    static constexpr size_t kPoolWords = 1024;
+
+    struct Pool {
+        array<uint32_t, kPoolWords> words;
+        size_t pos{kPoolWords};
+        uint32_t generation{0};
+    };
+
+    static atomic<uint32_t>& forkGeneration() {
+        static atomic<uint32_t> generation{[] {
+            ::pthread_atfork(nullptr, nullptr, [] { forkGeneration()++; });
+            return 1u;
+        }()};
+        return generation;
+    }
+
+    static uint32_t word() {
+        thread_local Pool pool;
+        uint32_t generation = forkGeneration().load(memory_order_relaxed);
+        if (pool.pos == kPoolWords || pool.generation != generation) {
+            fillRandom(pool.words.data(), sizeof pool.words);
+            pool.pos = 0;
+            pool.generation = generation;
+        }
+        uint32_t w = pool.words[pool.pos];
+        pool.words[pool.pos++] = 0;
+        return w;
+    }
+};
+
+enum class OtpResult { Verified, WrongCode, LockedOut, Consumed, NoCode };
+
+inline const char* toString(OtpResult r) {
+    switch (r) {
+        case OtpResult::Verified: return "verified";
+        case OtpResult::WrongCode: return "wrong code";
+        case OtpResult::LockedOut: return "locked out";
+        case OtpResult::Consumed: return "already used";
+        case OtpResult::NoCode: return "no code";
+    }
+    return "?";
+}
+
+/**
+ * @brief Sharded in-memory OTP store with timing-wheel expiry and a hard memory cap.
+ *
+ * Keys (phone numbers, at most kMaxKey bytes) hash with a per-process random
+ * seed to one of the shards. Each shard has its own mutex, a fixed-capacity
+ * slab of entries, an open-addressing index into that slab, and a timing
+ * wheel with one slot per tick of the TTL. Every entry sits on the intrusive
+ * list of the slot in which it expires. Any operation on a shard first
+ * advances that shard's wheel to the current tick and frees whole slots, so
+ * expiry costs O(1) per entry and needs no sweeper thread. A code is
+ * therefore valid for between ttl and ttl + tick.
+ *
+ * Memory is allocated up front: capacity entries plus the index, about
+ * 64 bytes per entry. By default capacity is derived from the peak issue rate
+ * times the TTL, with headroom for uneven shards. At 100k issues/s and a
+ * 60 s TTL that is ~7.6M entries (~490 MiB). An explicit capacity below
+ * rate x TTL is rejected. A live code is never evicted to make room: if a
+ * shard is full, issue() throws OtpStoreFull and counts the rejection.
+ *
+ * A successful verify consumes the code. The entry then answers Consumed
+ * until it expires, and NoCode after that. After maxAttempts wrong guesses
+ * the code is wiped, and the key answers LockedOut until it expires or a new
+ * code is issued. Codes are compared in constant time. Codes live only in
+ * this store: the outbox logs OTP jobs without the code and drops any still
+ * queued at a restart, and the user asks for a new one.
+ */
+class OtpStoreFull : public runtime_error {
+public:
+    using runtime_error::runtime_error;
+};
 
+class OtpStore {
+public:
+    static constexpr size_t kMaxKey = 24;
+
+    struct Options {
+        chrono::milliseconds ttl{60 * 1000};
+        chrono::milliseconds tick{1000};
+        int maxAttempts{5};
+        double peakIssuesPerSecond{100000};
+        size_t capacity{0};     // 0: peakIssuesPerSecond x (ttl + tick), plus 25% shard headroom
+        size_t shards{64};
+    };
+
+private:
+    static constexpr uint32_t kNone = UINT32_MAX;
+    static constexpr uint8_t kActive = 0, kConsumed = 1, kLockedOut = 2;
+
+    struct Entry {
+        uint64_t hash;
+        uint32_t prev, next;    // wheel slot list while live, free list otherwise
+        uint32_t expiresTick;
+        uint8_t attempts;
+        uint8_t keyLen;
+        uint8_t status;         // kActive, kConsumed or kLockedOut
+        char code[OtpGenerator::kDigits];
+        char key[kMaxKey];
+    };
+
+    struct alignas(64) Shard {
+        mutex mtx;
+        vector<Entry> entries;
+        vector<uint32_t> index;     // entry number per bucket, kNone when empty
+        vector<uint32_t> wheel;     // head entry per slot
+        vector<uint32_t> wheelTail;
+        uint32_t freeHead{kNone};
+        uint32_t sweptTick{0};
+        size_t live{0};
+    };
+
+    Options opts;
+    chrono::steady_clock::time_point epoch;
+    uint32_t ttlTicks;
+    uint64_t seed;
+    vector<Shard> shards;
+    size_t indexMask;
+    atomic<uint64_t> issued{0}, expired{0}, rejected{0};
+
+    uint64_t hashKey(const char* key, size_t len) const {
+        uint64_t h = seed ^ (len * 0x9E3779B97F4A7C15ull);
+        for (size_t i = 0; i < len; ++i) h = (h ^ static_cast<uint8_t>(key[i])) * 0x100000001B3ull;
+        h ^= h >> 33;                  // murmur3 finaliser so both ends of the hash are usable
+        h *= 0xFF51AFD7ED558CCDull;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ull;
+        return h ^ (h >> 33);
+    }
+
+    Shard& shardOf(uint64_t hash) { return shards[(hash >> 40) % shards.size()]; }
+
+    uint32_t nowTick() const {
+        return static_cast<uint32_t>((chrono::steady_clock::now() - epoch) / opts.tick);
+    }
+
+    static bool sameKey(const Entry& e, uint64_t hash, const char* key, size_t len) {
+        return e.hash == hash && e.keyLen == len && memcmp(e.key, key, len) == 0;
+    }
+
+    // Bucket holding the entry for key, or the empty bucket that ends its probe run.
+    size_t findBucket(const Shard& s, uint64_t hash, const char* key, size_t len) const {
+        for (size_t b = hash & indexMask;; b = (b + 1) & indexMask) {
+            uint32_t i = s.index[b];
+            if (i == kNone || sameKey(s.entries[i], hash, key, len)) return b;
+        }
+    }
+
+    // Backward-shift deletion keeps linear probing tombstone-free.
+    void eraseBucket(Shard& s, size_t hole) {
+        for (size_t b = (hole + 1) & indexMask;; b = (b + 1) & indexMask) {
+            uint32_t i = s.index[b];
+            if (i == kNone) break;
+            size_t home = s.entries[i].hash & indexMask;
+            if (((b - home) & indexMask) >= ((b - hole) & indexMask)) {
+                s.index[hole] = i;
+                hole = b;
+            }
+        }
+        s.index[hole] = kNone;
+    }
+
+    void unlinkFromWheel(Shard& s, uint32_t i) {
+        Entry& e = s.entries[i];
+        size_t slot = e.expiresTick % s.wheel.size();
+        (e.prev == kNone ? s.wheel[slot] : s.entries[e.prev].next) = e.next;
+        (e.next == kNone ? s.wheelTail[slot] : s.entries[e.next].prev) = e.prev;
+    }
+
+    void linkToWheel(Shard& s, uint32_t i) {
+        Entry& e = s.entries[i];
+        size_t slot = e.expiresTick % s.wheel.size();
+        e.prev = s.wheelTail[slot];
+        e.next = kNone;
+        (e.prev == kNone ? s.wheel[slot] : s.entries[e.prev].next) = i;
+        s.wheelTail[slot] = i;
+    }
+
+    void release(Shard& s, uint32_t i) {
+        Entry& e = s.entries[i];
+        eraseBucket(s, findBucket(s, e.hash, e.key, e.keyLen));
+        unlinkFromWheel(s, i);
+        memset(e.code, 0, sizeof e.code);
+        e.next = s.freeHead;
+        s.freeHead = i;
+        s.live--;
+    }
+
+    // Callers read the tick under s.mtx, so it never trails sweptTick; the signed check is a backstop
+    // against a tick that does, which would otherwise look like a 4e9-tick jump and empty the wheel.
+    void advance(Shard& s, uint32_t now) {
+        if (static_cast<int32_t>(now - s.sweptTick) <= 0) return;
+        if (now - s.sweptTick > s.wheel.size()) s.sweptTick = now - static_cast<uint32_t>(s.wheel.size());
+        while (s.sweptTick != now) {
+            ++s.sweptTick;
+            size_t slot = s.sweptTick % s.wheel.size();
+            while (s.wheel[slot] != kNone) {
+                release(s, s.wheel[slot]);
+                expired++;
+            }
+        }
+    }
+
+    static bool constantTimeEqual(const char* a, const char* b, size_t n) {
+        volatile uint8_t diff = 0;
+        for (size_t i = 0; i < n; ++i) diff = diff | (static_cast<uint8_t>(a[i]) ^ static_cast<uint8_t>(b[i]));
+        return diff == 0;
+    }
+
+    static void checkKey(const string& key) {
+        if (key.empty() || key.size() > kMaxKey) throw invalid_argument("OTP key must be 1-" + to_string(kMaxKey) + " bytes");
+    }
+
+public:
+    explicit OtpStore(Options o)
+        : opts(o), epoch(chrono::steady_clock::now()),
+          ttlTicks(static_cast<uint32_t>((o.ttl + o.tick - chrono::milliseconds(1)) / o.tick)),
+          shards(max<size_t>(1, o.shards)) {
+        if (opts.tick.count() <= 0 || opts.ttl < opts.tick) throw invalid_argument("OTP ttl must be at least one tick");
+        OtpGenerator::fillRandom(&seed, sizeof seed);
+        const double liveTicks = static_cast<double>(ttlTicks + 1) * static_cast<double>(opts.tick.count()) / 1000.0;
+        const auto required = static_cast<size_t>(ceil(opts.peakIssuesPerSecond * liveTicks));
+        if (opts.capacity == 0) opts.capacity = max<size_t>(1, required + required / 4);
+        else if (opts.capacity < required) {
+            throw invalid_argument("OTP capacity " + to_string(opts.capacity) + " is below peak rate x ttl (" +
+                                   to_string(required) + "); live codes would have nowhere to go");
+        }
+        size_t perShard = max<size_t>(1, (opts.capacity + shards.size() - 1) / shards.size());
+        if (perShard >= kNone) throw invalid_argument("OTP shard capacity too large");
+        size_t buckets = 1;
+        while (buckets < perShard * 2) buckets <<= 1;
+        indexMask = buckets - 1;
+        for (auto& s : shards) {
+            s.entries.resize(perShard);
+            for (uint32_t i = 0; i < perShard; ++i) s.entries[i].next = i + 1 < perShard ? i + 1 : kNone;
+            s.freeHead = 0;
+            s.index.assign(buckets, kNone);
+            s.wheel.assign(ttlTicks + 2, kNone);
+            s.wheelTail.assign(ttlTicks + 2, kNone);
+        }
+    }
+
+    OtpStore() : OtpStore(Options{}) {}
+
+    // Generates a fresh code for key, replacing any previous one and resetting its attempts.
+    string issue(const string& key) {
+        checkKey(key);
+        string code(OtpGenerator::kDigits, '0');
+        OtpGenerator::next(&code[0]);
+        uint64_t h = hashKey(key.data(), key.size());
+        Shard& s = shardOf(h);
+        lock_guard<mutex> lock(s.mtx);
+        uint32_t now = nowTick();
+        advance(s, now);
+        size_t b = findBucket(s, h, key.data(), key.size());
+        uint32_t i = s.index[b];
+        if (i != kNone) {
+            unlinkFromWheel(s, i);
+        } else {
+            if (s.freeHead == kNone) {
+                rejected++;
+                throw OtpStoreFull("OTP store shard full: issue rate exceeds the configured peak");
+            }
+            i = s.freeHead;
+            s.freeHead = s.entries[i].next;
+            s.index[b] = i;
+            s.live++;
+            Entry& e = s.entries[i];
+            e.hash = h;
+            e.keyLen = static_cast<uint8_t>(key.size());
+            memcpy(e.key, key.data(), key.size());
+        }
+        Entry& e = s.entries[i];
+        e.attempts = 0;
+        e.status = kActive;
+        memcpy(e.code, code.data(), sizeof e.code);
+        e.expiresTick = now + ttlTicks + 1;
+        linkToWheel(s, i);
+        issued++;
+        return code;
+    }
+
+    OtpResult verify(const string& key, const string& code) {
+        checkKey(key);
+        uint64_t h = hashKey(key.data(), key.size());
+        Shard& s = shardOf(h);
+        lock_guard<mutex> lock(s.mtx);
+        advance(s, nowTick());
+        uint32_t i = s.index[findBucket(s, h, key.data(), key.size())];
+        if (i == kNone) return OtpResult::NoCode;
+        Entry& e = s.entries[i];
+        if (e.status == kLockedOut) return OtpResult::LockedOut;
+        if (e.status == kConsumed) return OtpResult::Consumed;
+        bool match = code.size() == sizeof e.code && constantTimeEqual(e.code, code.data(), sizeof e.code);
+        // Either way the entry stays until it expires, so later calls see Consumed or LockedOut.
+        if (match) {
+            e.status = kConsumed;
+            memset(e.code, 0, sizeof e.code);
+            return OtpResult::Verified;
+        }
+        if (++e.attempts >= opts.maxAttempts) {
+            e.status = kLockedOut;
+            memset(e.code, 0, sizeof e.code);
+            return OtpResult::LockedOut;
+        }
+        return OtpResult::WrongCode;
+    }
+
+    size_t size() {
+        size_t n = 0;
+        for (auto& s : shards) {
+            lock_guard<mutex> lock(s.mtx);
+            n += s.live;
+        }
+        return n;
+    }
+
+    size_t memoryBytes() const {
+        size_t n = sizeof *this;
+        for (const auto& s : shards) {
+            n += sizeof s + s.entries.capacity() * sizeof(Entry) + s.index.capacity() * sizeof(uint32_t) +
+                 (s.wheel.capacity() + s.wheelTail.capacity()) * sizeof(uint32_t);
+        }
+        return n;
+    }
+
+    uint64_t getIssued() const { return issued; }
+    uint64_t getExpired() const { return expired; }
+    uint64_t getRejected() const { return rejected; }
+    size_t getCapacity() const { return opts.capacity; }
+};
+
+class SignUpService {
+    NotificationOutbox& outbox;
+    OtpStore& otps;
+
+public:
+    SignUpService(NotificationOutbox& outbox, OtpStore& otps) : outbox(outbox), otps(otps) {}
+
+    // Returns once the user and its notifications are durable; delivery happens later.
     bool signUp(const User& u){
         if (u.email.empty()) return false;
-        // pretend DB save here…
 
-        mailer.send("welcome", u.email, "Welcome!");
-        smsClient.sendOTP(u.phone, "123456");
+        vector<NotificationJob> jobs;
+        jobs.push_back(outbox.email("welcome", u.email, "Welcome!"));
+        if (!u.phone.empty()) jobs.push_back(outbox.otp(u.phone, otps.issue(u.phone)));
+        outbox.commit(u, move(jobs));
         return true;
     }
+
+    OtpResult verifyOtp(const string& phone, const string& code) {
+        return otps.verify(phone, code);
+    }
 };
 
-int main() {
-    SmtpMailer mailer;
-    TwilioClient smsClient;
-    SignUpService svc(mailer, smsClient);
-    svc.signUp({"user@example.com", "+15550001111"});
+// =========================
+// Benchmarks
+// =========================
+inline double percentileMs(vector<double>& samples, double q) {
+    if (samples.empty()) return 0.0;
+    size_t i = min(samples.size() - 1, static_cast<size_t>(q * static_cast<double>(samples.size())));
+    nth_element(samples.begin(), samples.begin() + static_cast<long>(i), samples.end());
+    return samples[i];
+}
+
+inline double msSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// Signup latency calling the providers inline versus appending to the outbox.
+int benchOutbox(int signups, int latencyMs) {
+    const auto latency = chrono::milliseconds(latencyMs);
+    const int clients = 8;
+    auto userAt = [](int i) { return User{"user" + to_string(i) + "@example.com", "+1555" + to_string(1000000 + i)}; };
+
+    // Baseline: the old signUp, provider calls on the caller's thread.
+    vector<double> inlineMs;
+    {
+        StubSmtpMailer mailer(latency);
+        StubTwilioClient sms(latency);
+        for (int i = 0; i < 5; ++i) {
+            User u = userAt(i);
+            auto start = chrono::steady_clock::now();
+            mailer.send("welcome", u.email, "Welcome!");
+            sms.sendOTP(u.phone, "123456");
+            inlineMs.push_back(msSince(start));
+        }
+    }
+
+    const string logPath = "bench-notify.outbox";
+    remove(logPath.c_str());
+    OtpStore::Options otpOptions;
+    otpOptions.peakIssuesPerSecond = 10000;
+    OtpStore otps(otpOptions);
+    vector<double> outboxMs;
+    double commitSecs, drainSecs;
+    uint64_t delivered, retries, parked, unlogged, syncs, records, compactions;
+    {
+        StubSmtpMailer mailer(latency, 0.1);
+        StubTwilioClient sms(latency, 0.1);
+        // A small compaction threshold so the run also exercises compaction under load.
+        NotificationOutbox::Options options;
+        options.logCompactBytes = 16u << 10;
+        NotificationOutbox outbox(mailer, sms, logPath, options);
+        SignUpService svc(outbox, otps);
+        vector<vector<double>> perClient(clients);
+        vector<thread> threads;
+        auto start = chrono::steady_clock::now();
+        for (int c = 0; c < clients; ++c) {
+            threads.emplace_back([&, c] {
+                for (int i = c; i < signups; i += clients) {
+                    auto t0 = chrono::steady_clock::now();
+                    svc.signUp(userAt(i));
+                    perClient[c].push_back(msSince(t0));
+                }
+            });
+        }
+        for (auto& t : threads) t.join();
+        commitSecs = msSince(start) / 1000.0;
+        outbox.flush();
+        drainSecs = msSince(start) / 1000.0;
+        for (auto& v : perClient) outboxMs.insert(outboxMs.end(), v.begin(), v.end());
+        delivered = outbox.getDelivered();
+        retries = outbox.getRetries();
+        parked = outbox.getParked();
+        unlogged = outbox.getUnloggedDeliveries();
+        syncs = outbox.getLog().getSyncs();
+        records = outbox.getLog().getRecords();
+        compactions = outbox.getLog().getCompactions();
+    }
+
+    // Restart: stop the dispatcher with work still queued, then reopen the log.
+    size_t pendingAtStop, recoveredJobs, recoveredUsers, droppedOtps;
+    double redeliverSecs;
+    {
+        StubSmtpMailer mailer(latency);
+        StubTwilioClient sms(latency);
+        {
+            NotificationOutbox outbox(mailer, sms, logPath, NotificationOutbox::Options{2, 6, chrono::milliseconds(200), chrono::milliseconds(30000)});
+            SignUpService svc(outbox, otps);
+            for (int i = 0; i < 100; ++i) svc.signUp(userAt(signups + i));
+        }
+        pendingAtStop = 200 - mailer.getDelivered() - sms.getDelivered();
+        StubSmtpMailer mailer2(chrono::milliseconds(1));
+        StubTwilioClient sms2(chrono::milliseconds(1));
+        auto start = chrono::steady_clock::now();
+        NotificationOutbox outbox(mailer2, sms2, logPath);
+        recoveredJobs = outbox.getRecoveredJobs();
+        recoveredUsers = outbox.getRecoveredUsers();
+        droppedOtps = outbox.getDroppedSecrets();
+        outbox.flush();
+        redeliverSecs = msSince(start) / 1000.0;
+    }
+    remove(logPath.c_str());
+
+    cout << "signups=" << signups << " clients=" << clients << " provider latency=" << latencyMs << "ms\n"
+         << "inline:  signUp p50 " << percentileMs(inlineMs, 0.5) << " ms, max " << percentileMs(inlineMs, 1.0) << " ms\n"
+         << "outbox:  signUp p50 " << percentileMs(outboxMs, 0.5) << " ms, p99 " << percentileMs(outboxMs, 0.99)
+         << " ms, p99.9 " << percentileMs(outboxMs, 0.999) << " ms, max " << percentileMs(outboxMs, 1.0) << " ms, "
+         << signups / commitSecs << " signups/s\n"
+         << "         " << records << " records in " << syncs << " fdatasyncs, " << compactions << " live compactions; "
+         << delivered << " notifications delivered in " << drainSecs << " s with 10% provider failures (" << retries
+         << " retries, " << parked << " parked, " << unlogged << " deliveries not logged)\n"
+         << "restart: " << pendingAtStop << " undelivered at shutdown, reopened with " << recoveredUsers << " users and "
+         << recoveredJobs << " pending jobs (" << droppedOtps << " OTP SMS dropped, codes are not logged), redelivered in "
+         << redeliverSecs << " s\n";
+    return 0;
+}
+
+inline size_t residentBytes() {
+    ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+}
+
+// OTP generation cost, store throughput, and memory under sustained signup load.
+int benchOtp(int seconds, int threads) {
+    auto nsPer = [](auto start, size_t n) {
+        return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / static_cast<double>(n);
+    };
+    char sink[OtpGenerator::kDigits];
+    uint64_t checksum = 0;
+
+    // Generator: one getrandom() per code versus the per-thread pool.
+    const size_t perCallCodes = 200000, pooledCodes = 2000000;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < perCallCodes; ++i) {
+        uint32_t w;
+        do OtpGenerator::fillRandom(&w, sizeof w); while (w >= UINT32_MAX - UINT32_MAX % 1000000);
+        checksum += w % 1000000;
+    }
+    double perCallNs = nsPer(start, perCallCodes);
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < pooledCodes; ++i) {
+        OtpGenerator::next(sink);
+        checksum += static_cast<uint8_t>(sink[0]);
+    }
+    double pooledNs = nsPer(start, pooledCodes);
+
+    // Production options: 100k issues/s for longer than the TTL, so the wheel reaches steady state
+    // and every code lives its full TTL. Then flat out from several threads past the configured peak.
+    OtpStore::Options o;
+    size_t rssBefore = residentBytes();
+    OtpStore store(o);
+    auto keyOf = [](uint64_t i) { return "+1" + to_string(2000000000ull + i); };
+    size_t pacedPeak = 0;
+    uint64_t next = 0;
+    double pacedCpu;
+    {
+        const int batch = 1000;  // per 10 ms
+        timespec cpu0{}, cpu1{};
+        ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
+        auto due = chrono::steady_clock::now();
+        for (int step = 0; step < seconds * 100; ++step) {
+            for (int i = 0; i < batch; ++i) store.issue(keyOf(next++));
+            if (step % 500 == 499) {
+                size_t live = store.size();
+                pacedPeak = max(pacedPeak, live);
+                cout << "  t=" << (step + 1) / 100 << "s live=" << live << "\n";
+            }
+            due += chrono::milliseconds(10);
+            this_thread::sleep_until(due);
+        }
+        ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+        pacedCpu = (cpu1.tv_sec - cpu0.tv_sec) + (cpu1.tv_nsec - cpu0.tv_nsec) / 1e9;
+    }
+    uint64_t pacedRejected = store.getRejected();
+
+    atomic<bool> running{true};
+    atomic<uint64_t> accepted{0}, nextKey{next};
+    vector<thread> workers;
+    start = chrono::steady_clock::now();
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&] {
+            uint64_t n = 0;
+            while (running.load(memory_order_relaxed)) {
+                try {
+                    store.issue(keyOf(nextKey.fetch_add(1, memory_order_relaxed)));
+                    ++n;
+                } catch (const OtpStoreFull&) {
+                }
+            }
+            accepted += n;
+        });
+    }
+    this_thread::sleep_for(chrono::seconds(3));
+    size_t floodLive = store.size(), peakRss = residentBytes();
+    running = false;
+    for (auto& w : workers) w.join();
+    double floodSecs = msSince(start) / 1000.0;
+
+    // Verify: one wrong guess then the right code, per key.
+    OtpStore::Options vo;
+    vo.peakIssuesPerSecond = 10000;
+    OtpStore verifier(vo);
+    const size_t verifyKeys = 200000;
+    vector<string> keys(verifyKeys);
+    for (size_t i = 0; i < verifyKeys; ++i) keys[i] = keyOf(i);
+    vector<string> codes(verifyKeys);
+    for (size_t i = 0; i < verifyKeys; ++i) codes[i] = verifier.issue(keys[i]);
+    size_t verified = 0, lockedOut = 0;
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < verifyKeys; ++i) {
+        string wrong = codes[i];
+        wrong[0] = wrong[0] == '9' ? '0' : static_cast<char>(wrong[0] + 1);
+        verifier.verify(keys[i], wrong);
+        verified += verifier.verify(keys[i], codes[i]) == OtpResult::Verified;
+    }
+    double verifyNs = nsPer(start, verifyKeys * 2);
+    size_t consumed = 0;
+    for (size_t i = 0; i < 1000; ++i) consumed += verifier.verify(keys[i], codes[i]) == OtpResult::Consumed;
+    string victim = keys[0];
+    verifier.issue(victim);
+    for (int i = 0; i < 6; ++i) lockedOut += verifier.verify(victim, "------") == OtpResult::LockedOut;
+
+    // Race: one shard and a 1 ms tick, so threads often read a tick another thread has already swept
+    // past. Nothing is old enough to expire, and every code must verify right after it is issued.
+    OtpStore::Options ro;
+    ro.tick = chrono::milliseconds(1);
+    ro.shards = 1;
+    ro.peakIssuesPerSecond = 1000;
+    OtpStore racer(ro);
+    const int raceThreads = 8;
+    atomic<uint64_t> raceOps{0}, raceLost{0};
+    running = true;
+    workers.clear();
+    for (int t = 0; t < raceThreads; ++t) {
+        workers.emplace_back([&, t] {
+            uint64_t n = 0, lost = 0;
+            for (uint64_t i = 0; running.load(memory_order_relaxed); ++i, ++n) {
+                string key = keyOf(static_cast<uint64_t>(t) * 1000 + i % 1000);
+                lost += racer.verify(key, racer.issue(key)) != OtpResult::Verified;
+            }
+            raceOps += n;
+            raceLost += lost;
+        });
+    }
+    this_thread::sleep_for(chrono::seconds(2));
+    running = false;
+    for (auto& w : workers) w.join();
+
+    cout << "generator: getrandom per code " << perCallNs << " ns, pooled " << pooledNs << " ns (checksum " << checksum % 10 << ")\n"
+         << "paced:  100000 issues/s for " << seconds << " s, ttl " << o.ttl.count() << " ms: peak live " << pacedPeak
+         << " of capacity " << store.getCapacity() << ", " << store.getExpired() << " expired, " << pacedRejected
+         << " rejected, " << pacedCpu / seconds * 100.0 << "% of a core\n"
+         << "flood:  " << threads << " threads accepted " << accepted / floodSecs << " codes/s until full; live " << floodLive
+         << ", " << store.getRejected() - pacedRejected << " issues rejected with OtpStoreFull, no live code evicted\n"
+         << "memory: store " << store.memoryBytes() / (1 << 20) << " MiB preallocated, rss growth "
+         << (peakRss - rssBefore) / (1 << 20) << " MiB\n"
+         << "verify: " << verifyNs << " ns per call, " << verified << "/" << verifyKeys << " verified after a wrong guess; "
+         << consumed << "/1000 reuses answered Consumed; " << lockedOut << "/2 calls locked out after 5 wrong guesses\n"
+         << "race:   " << raceThreads << " threads, 1 shard, 1 ms tick: " << raceOps << " issue+verify, " << raceLost
+         << " not verified, " << racer.getExpired() << " expired" << (raceLost || racer.getExpired() ? "  MISMATCH" : "") << "\n";
+    return raceLost || racer.getExpired() ? 1 : 0;
+}
+
+// Wrapper overhead per send, then failover, breaker recovery and throttling against stub providers.
+int benchResilience(int sends, int latencyMs) {
+    auto nsPer = [](chrono::steady_clock::time_point start, size_t n) {
+        return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / static_cast<double>(n);
+    };
+
+    // Overhead: zero-latency provider called directly and through the wrapper.
+    double directNs, wrappedNs, wrappedMtNs;
+    {
+        const size_t calls = 5000000;
+        const int threads = 4;
+        StubSmtpMailer raw(chrono::milliseconds(0));
+        ResilientSmtpMailer wrapped;
+        wrapped.add(raw, "primary", ProviderLimits{1e9, 1e8, 5, chrono::milliseconds(2000)});
+        const string templ = "welcome", to = "user@example.com", body = "Welcome!";
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < calls; ++i) raw.send(templ, to, body);
+        directNs = nsPer(start, calls);
+        start = chrono::steady_clock::now();
+        for (size_t i = 0; i < calls; ++i) wrapped.send(templ, to, body);
+        wrappedNs = nsPer(start, calls);
+        vector<thread> workers;
+        start = chrono::steady_clock::now();
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&] {
+                for (size_t i = 0; i < calls / threads; ++i) wrapped.send(templ, to, body);
+            });
+        }
+        for (auto& w : workers) w.join();
+        wrappedMtNs = nsPer(start, calls);
+    }
+
+    // Outage: the primary hangs for latencyMs and then fails; compare with and without a breaker.
+    auto outage = [&](uint32_t threshold, vector<double>& ms, vector<ProviderFailover<ISmtpMailer>::RouteStats>& stats) {
+        StubSmtpMailer primary(chrono::milliseconds(latencyMs), 1.0);
+        StubSmtpMailer secondary(chrono::milliseconds(5));
+        ResilientSmtpMailer mailer;
+        mailer.add(primary, "primary", ProviderLimits{0, 1, threshold, chrono::milliseconds(1000)})
+              .add(secondary, "secondary", ProviderLimits{0, 1, threshold, chrono::milliseconds(1000)});
+        for (int i = 0; i < sends; ++i) {
+            auto start = chrono::steady_clock::now();
+            mailer.send("welcome", "user" + to_string(i) + "@example.com", "Welcome!");
+            ms.push_back(msSince(start));
+        }
+        stats = mailer.stats();
+    };
+    vector<double> noBreakerMs, breakerMs;
+    vector<ProviderFailover<ISmtpMailer>::RouteStats> noBreakerStats, breakerStats;
+    outage(UINT32_MAX, noBreakerMs, noBreakerStats);
+    outage(5, breakerMs, breakerStats);
+    double noBreakerMean = accumulate(noBreakerMs.begin(), noBreakerMs.end(), 0.0) / noBreakerMs.size();
+    double breakerMean = accumulate(breakerMs.begin(), breakerMs.end(), 0.0) / breakerMs.size();
+
+    // Recovery: the primary heals during the cooldown; one half-open probe brings traffic back.
+    uint64_t beforeHeal, afterHeal;
+    int recoveredAfterMs = -1;
+    {
+        StubSmtpMailer primary(chrono::milliseconds(1), 1.0);
+        StubSmtpMailer secondary(chrono::milliseconds(1));
+        ResilientSmtpMailer mailer;
+        mailer.add(primary, "primary", ProviderLimits{0, 1, 5, chrono::milliseconds(200)}).add(secondary, "secondary", ProviderLimits{0, 1, 5, chrono::milliseconds(200)});
+        for (int i = 0; i < 20; ++i) mailer.send("welcome", "a@example.com", "Welcome!");
+        beforeHeal = mailer.stats()[0].sent;
+        primary.setFailureRate(0.0);
+        auto healed = chrono::steady_clock::now();
+        while (msSince(healed) < 1000) {
+            mailer.send("welcome", "a@example.com", "Welcome!");
+            if (recoveredAfterMs < 0 && mailer.stats()[0].sent > beforeHeal) recoveredAfterMs = static_cast<int>(msSince(healed));
+            this_thread::sleep_for(chrono::milliseconds(5));
+        }
+        afterHeal = mailer.stats()[0].sent;
+    }
+
+    // Throttling: flat out for one second against a primary capped at 1000/s, with a loose and a tight burst.
+    auto throttle = [](double burst) {
+        StubTwilioClient primary(chrono::milliseconds(0));
+        StubTwilioClient secondary(chrono::milliseconds(0));
+        ResilientTwilioClient sms;
+        sms.add(primary, "primary", ProviderLimits{1000, burst, 5, chrono::milliseconds(2000)})
+           .add(secondary, "secondary", ProviderLimits{0, 1, 5, chrono::milliseconds(2000)});
+        auto start = chrono::steady_clock::now();
+        while (msSince(start) < 1000) sms.sendOTP("+15550001111", "123456");
+        return sms.stats();
+    };
+    auto throttleStats = throttle(50);
+    auto tightStats = throttle(1);
+
+    cout << "overhead: direct " << directNs << " ns/send, wrapped " << wrappedNs << " ns/send (+" << wrappedNs - directNs
+         << " ns), 4 threads " << wrappedMtNs << " ns/send\n"
+         << "outage (" << sends << " sends, primary hangs " << latencyMs << " ms then fails):\n"
+         << "  no breaker: mean " << noBreakerMean << " ms, p50 " << percentileMs(noBreakerMs, 0.5) << " ms, p99 " << percentileMs(noBreakerMs, 0.99) << " ms, primary tried "
+         << noBreakerStats[0].failed << " times\n"
+         << "  breaker:    mean " << breakerMean << " ms, p50 " << percentileMs(breakerMs, 0.5) << " ms, p99 " << percentileMs(breakerMs, 0.99) << " ms, primary tried "
+         << breakerStats[0].failed << " times, short-circuited " << breakerStats[0].shortCircuited << ", tripped "
+         << breakerStats[0].trips << "x\n"
+         << "recovery: primary back " << recoveredAfterMs << " ms after healing (200 ms cooldown), then took "
+         << afterHeal - beforeHeal << " sends\n"
+         << "throttle: burst 50: primary sent " << throttleStats[0].sent << " (throttled " << throttleStats[0].throttled
+         << "), secondary absorbed " << throttleStats[1].sent << "\n"
+         << "          burst 1:  primary sent " << tightStats[0].sent << " (throttled " << tightStats[0].throttled
+         << "), secondary absorbed " << tightStats[1].sent << "\n";
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && string(argv[1]) == "bench-outbox") {
+        return benchOutbox(argc > 2 ? stoi(argv[2]) : 500, argc > 3 ? stoi(argv[3]) : 500);
+    }
+
+    if (argc > 1 && string(argv[1]) == "bench-resilience") {
+        return benchResilience(argc > 2 ? stoi(argv[2]) : 20, argc > 3 ? stoi(argv[3]) : 500);
+    }
+    if (argc > 1 && string(argv[1]) == "bench-otp") {
+        return benchOtp(argc > 2 ? stoi(argv[2]) : 75, argc > 3 ? stoi(argv[3]) : 4);
+    }
+
+    // Remembers the last code so the demo can answer its own OTP.
+    struct DemoTwilioClient : TwilioClient {
+        string lastCode;
+        void sendOTP(const string& phone, const string& code) override {
+            TwilioClient::sendOTP(phone, code);
+            lastCode = code;
+        }
+    };
+    SmtpMailer smtp;
+    DemoTwilioClient twilio;
+    ResilientSmtpMailer mailer;
+    mailer.add(smtp, "smtp");
+    ResilientTwilioClient smsClient;
+    smsClient.add(twilio, "twilio", ProviderLimits{10, 5, 3, chrono::milliseconds(5000)});
+    OtpStore::Options otpOptions;
+    otpOptions.peakIssuesPerSecond = 100;
+    OtpStore otps(otpOptions);
+    // A fresh log per run, so nothing left over from an earlier run is replayed and sent again
+    char outboxDir[] = "/tmp/notify-demo-XXXXXX";
+    if (!mkdtemp(outboxDir)) throw runtime_error("Cannot create a directory for the outbox log");
+    const string outboxPath = string(outboxDir) + "/notify.outbox";
+    {
+        NotificationOutbox outbox(mailer, smsClient, outboxPath);
+        SignUpService svc(outbox, otps);
+        svc.signUp({"user@example.com", "+15550001111"});
+        outbox.flush();
+        cout << "verifyOtp(000000): " << toString(svc.verifyOtp("+15550001111", twilio.lastCode == "000000" ? "111111" : "000000")) << "\n";
+        cout << "verifyOtp(" << twilio.lastCode << "): " << toString(svc.verifyOtp("+15550001111", twilio.lastCode)) << "\n";
+        cout << "verifyOtp again: " << toString(svc.verifyOtp("+15550001111", twilio.lastCode)) << "\n";
+    }
+    remove(outboxPath.c_str());
+    rmdir(outboxDir);
     return 0;
 }